@@ -0,0 +1,197 @@
+/*
+ *  Benchmark BackendBase
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <string>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include "mocks/XenCtrlMock.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+#include "BackendBase.hpp"
+#include "FrontendHandlerBase.hpp"
+
+using std::string;
+using std::to_string;
+
+using XenBackend::BackendBase;
+using XenBackend::FrontendHandlerBase;
+using XenBackend::FrontendHandlerPtr;
+using XenBackend::XenStorePtr;
+
+static domid_t gDomId = 3;
+static domid_t gFrontDomId = 7;
+static const char* gDevName = "bench_device";
+
+/*******************************************************************************
+ * Helpers
+ ******************************************************************************/
+
+class BenchFrontendHandler : public FrontendHandlerBase
+{
+public:
+
+	BenchFrontendHandler(domid_t beDomId, domid_t feDomId, uint16_t devId,
+						 XenStorePtr xenStore) :
+		FrontendHandlerBase("BenchFrontend", gDevName, beDomId, feDomId, devId,
+							xenStore) {}
+
+private:
+
+	// frontends stay in unknown state, nothing is bound
+	void onBind() override {}
+	void onClosing() override {}
+};
+
+class BenchBackend : public BackendBase
+{
+public:
+
+	BenchBackend() : BackendBase("BenchBackend", gDevName, gDomId) {}
+
+private:
+
+	void onNewFrontend(domid_t domId, uint16_t devId) override
+	{
+		addFrontendHandler(FrontendHandlerPtr(
+				new BenchFrontendHandler(getDomId(), domId, devId,
+										 getXenStore())));
+	}
+};
+
+static void waitForFrontends(BackendBase& backend, size_t numFrontends)
+{
+	while (backend.getNumFrontendHandlers() != numFrontends)
+	{
+		std::this_thread::yield();
+	}
+}
+
+static void waitForState(XenStoreMock& mock, const string& path,
+						 xenbus_state state)
+{
+	auto value = to_string(state);
+
+	while (true)
+	{
+		auto current = mock.readValue(path);
+
+		if (current && value == current)
+		{
+			return;
+		}
+
+		std::this_thread::yield();
+	}
+}
+
+/*******************************************************************************
+ * Benchmarks
+ ******************************************************************************/
+
+/*
+ * Adds and removes number of frontends given by the argument. The backend
+ * entries are written to Xen store one by one as toolstack does.
+ */
+static void BM_BackendAddRemoveFrontends(benchmark::State& state)
+{
+	XenCtrlMock::setErrorMode(false);
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+
+	XenStoreMock storeMock;
+
+	string feDomPath = "/local/domain/" + to_string(gFrontDomId);
+	string beDomPath = "/local/domain/" + to_string(gDomId);
+	string feDevPath = feDomPath + "/device/" + gDevName + "/";
+	string beDevPath = beDomPath + "/backend/" + gDevName + "/" +
+					   to_string(gFrontDomId) + "/";
+
+	storeMock.setDomainPath(gFrontDomId, feDomPath);
+	storeMock.setDomainPath(gDomId, beDomPath);
+
+	storeMock.writeValue(feDomPath + "/name", "DomU");
+
+	auto numFrontends = state.range(0);
+
+	for (int devId = 0; devId < numFrontends; devId++)
+	{
+		storeMock.writeValue(feDevPath + to_string(devId) + "/state",
+							 to_string(XenbusStateUnknown));
+	}
+
+	BenchBackend backend;
+
+	backend.start();
+
+	auto mock = XenStoreMock::getLastInstance();
+
+	for (auto _ : state)
+	{
+		for (int devId = 0; devId < numFrontends; devId++)
+		{
+			// the mock keeps directory nodes as entries
+			mock->writeValue(beDevPath + to_string(devId), "");
+			mock->writeValue(beDevPath + to_string(devId) + "/state",
+							 to_string(XenbusStateUnknown));
+		}
+
+		waitForFrontends(backend, numFrontends);
+
+		// detach as toolstack does: request closing, wait for closed state,
+		// then remove the backend entries
+		for (int devId = 0; devId < numFrontends; devId++)
+		{
+			mock->writeValue(beDevPath + to_string(devId) + "/state",
+							 to_string(XenbusStateClosing));
+		}
+
+		for (int devId = 0; devId < numFrontends; devId++)
+		{
+			waitForState(*mock, beDevPath + to_string(devId) + "/state",
+						 XenbusStateClosed);
+		}
+
+		for (int devId = 0; devId < numFrontends; devId++)
+		{
+			mock->deleteEntry(beDevPath + to_string(devId) + "/state");
+			mock->deleteEntry(beDevPath + to_string(devId));
+		}
+
+		waitForFrontends(backend, 0);
+	}
+
+	backend.stop();
+
+	for (int devId = 0; devId < numFrontends; devId++)
+	{
+		mock->deleteEntry(feDevPath + to_string(devId) + "/state");
+	}
+
+	mock->deleteEntry(feDomPath + "/name");
+
+	state.SetItemsProcessed(state.iterations() * numFrontends);
+}
+
+BENCHMARK(BM_BackendAddRemoveFrontends)->Arg(16)->Arg(64)->Arg(256)
+	->Unit(benchmark::kMillisecond)->UseRealTime();
@@ -0,0 +1,208 @@
+/*
+ *  Benchmark ring buffers
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <algorithm>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "testRingBuffer.hpp"
+
+using XenBackend::RingBufferInBase;
+using XenBackend::StaticRingBufferInBase;
+
+static domid_t gDomId = 3;
+static evtchn_port_t gPort = 65;
+static grant_ref_t gRef = 23;
+
+/*******************************************************************************
+ * Helpers
+ ******************************************************************************/
+
+class BenchRingBufferIn : public RingBufferInBase<xen_test_back_ring,
+												  xen_test_sring,
+												  xentest_req, xentest_rsp>
+{
+public:
+
+	BenchRingBufferIn(domid_t domId, evtchn_port_t port, grant_ref_t ref) :
+		RingBufferInBase<xen_test_back_ring, xen_test_sring,
+						 xentest_req, xentest_rsp>(domId, port, ref) {}
+
+private:
+
+	void processRequest(const xentest_req& req) override
+	{
+		xentest_rsp rsp {};
+
+		rsp.seq = req.seq;
+		rsp.u32data = req.op.command1.u32data1 + req.op.command1.u32data2;
+
+		sendResponse(rsp);
+	}
+};
+
+class BenchStaticRingBufferIn : public StaticRingBufferInBase<
+										BenchStaticRingBufferIn,
+										xen_test_back_ring, xen_test_sring,
+										xentest_req, xentest_rsp>
+{
+public:
+
+	BenchStaticRingBufferIn(domid_t domId, evtchn_port_t port,
+							grant_ref_t ref) :
+		StaticRingBufferInBase<BenchStaticRingBufferIn,
+							   xen_test_back_ring, xen_test_sring,
+							   xentest_req, xentest_rsp>(domId, port, ref) {}
+
+	void processRequest(const xentest_req& req)
+	{
+		xentest_rsp rsp {};
+
+		rsp.seq = req.seq;
+		rsp.u32data = req.op.command1.u32data1 + req.op.command1.u32data2;
+
+		sendResponse(rsp);
+	}
+};
+
+static void waitForResponses(xen_test_front_ring& ring)
+{
+	// the frontend polls the ring, only the backend path is measured
+	while (ring.sring->rsp_prod != ring.req_prod_pvt)
+	{
+		std::this_thread::yield();
+	}
+
+	xen_rmb();
+
+	ring.rsp_cons = ring.sring->rsp_prod;
+}
+
+template<typename RingBuffer>
+static void runRingBufferIn(benchmark::State& state)
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	RingBuffer ringBuffer(gDomId, gPort, gRef);
+
+	ringBuffer.start();
+
+	auto gnttabMock = XenGnttabMock::getLastInstance();
+	auto evtchnMock = XenEvtchnMock::getLastInstance();
+
+	xen_test_front_ring ring;
+	auto sring = static_cast<xen_test_sring*>(gnttabMock->getLastBuffer());
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&ring, sring, XC_PAGE_SIZE);
+
+	size_t batchSize = std::min<size_t>(state.range(0), RING_SIZE(&ring));
+	xentest_req req {XENTEST_CMD1};
+	uint32_t seq = 0;
+
+	for (auto _ : state)
+	{
+		for (size_t i = 0; i < batchSize; i++)
+		{
+			req.seq = seq++;
+			req.op.command1.u32data1 = seq;
+
+			*RING_GET_REQUEST(&ring, ring.req_prod_pvt) = req;
+
+			ring.req_prod_pvt++;
+		}
+
+		RING_PUSH_REQUESTS(&ring);
+
+		evtchnMock->signalLastBoundPort();
+
+		waitForResponses(ring);
+	}
+
+	ringBuffer.stop();
+
+	state.SetItemsProcessed(state.iterations() * batchSize);
+}
+
+/*******************************************************************************
+ * Benchmarks
+ ******************************************************************************/
+
+/*
+ * Requests per second through RingBufferInBase. The argument is number of
+ * requests sent with one notification.
+ */
+static void BM_RingBufferInRequests(benchmark::State& state)
+{
+	runRingBufferIn<BenchRingBufferIn>(state);
+}
+
+BENCHMARK(BM_RingBufferInRequests)->Arg(1)->Arg(8)->Arg(32)->UseRealTime();
+
+/*
+ * Same as BM_RingBufferInRequests for statically dispatched handler
+ */
+static void BM_StaticRingBufferInRequests(benchmark::State& state)
+{
+	runRingBufferIn<BenchStaticRingBufferIn>(state);
+}
+
+BENCHMARK(BM_StaticRingBufferInRequests)->Arg(1)->Arg(8)->Arg(32)
+	->UseRealTime();
+
+/*
+ * Events per second through RingBufferOutBase::sendEvent(). The frontend
+ * consumes all events after each send.
+ */
+static void BM_RingBufferOutSendEvent(benchmark::State& state)
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	TestRingBufferOut ringBuffer(gDomId, gPort, gRef);
+
+	ringBuffer.start();
+
+	auto gnttabMock = XenGnttabMock::getLastInstance();
+	auto eventPage = static_cast<xentest_event_page*>(
+			gnttabMock->getLastBuffer());
+
+	xentest_evt evt {XENTEST_EVT1};
+	uint32_t seq = 0;
+
+	for (auto _ : state)
+	{
+		evt.seq = seq++;
+
+		ringBuffer.sendEvent(evt);
+
+		eventPage->in_cons = eventPage->in_prod;
+	}
+
+	ringBuffer.stop();
+
+	state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_RingBufferOutSendEvent);
@@ -0,0 +1,54 @@
+/*
+ *  Benchmark tools helpers
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "benchUtils.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+uint64_t now()
+{
+	return duration_cast<nanoseconds>(
+			steady_clock::now().time_since_epoch()).count();
+}
+
+void printPercentile(const char* name, const vector<uint64_t>& latencies,
+					 double percentile)
+{
+	size_t index = latencies.size() * percentile;
+
+	if (index >= latencies.size())
+	{
+		index = latencies.size() - 1;
+	}
+
+	cout << "latency " << name << " (us):" << string(10 - strlen(name), ' ')
+		 << latencies[index] / 1000.0 << endl;
+}
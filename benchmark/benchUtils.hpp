@@ -0,0 +1,41 @@
+/*
+ *  Benchmark tools helpers
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef BENCHMARK_BENCHUTILS_HPP_
+#define BENCHMARK_BENCHUTILS_HPP_
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Returns monotonic time in nanoseconds
+ */
+uint64_t now();
+
+/**
+ * Prints the latency percentile in microseconds
+ * @param[in] name       percentile name
+ * @param[in] latencies  latencies in nanoseconds sorted in ascending order
+ * @param[in] percentile percentile in range 0..1
+ */
+void printPercentile(const char* name, const std::vector<uint64_t>& latencies,
+					 double percentile);
+
+#endif /* BENCHMARK_BENCHUTILS_HPP_ */
@@ -0,0 +1,124 @@
+/*
+ *  Benchmark XenStore
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include "mocks/XenStoreMock.hpp"
+#include "XenStore.hpp"
+
+using std::atomic_bool;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::string;
+
+using XenBackend::XenStore;
+
+static const char* gPath = "/local/domain/3/bench/value";
+
+/*******************************************************************************
+ * Benchmarks
+ ******************************************************************************/
+
+static void BM_XenStoreRead(benchmark::State& state)
+{
+	XenStoreMock::setErrorMode(false);
+
+	XenStore xenStore;
+
+	xenStore.writeString(gPath, "benchmark value");
+
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(xenStore.readString(gPath));
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_XenStoreRead);
+
+static void BM_XenStoreWrite(benchmark::State& state)
+{
+	XenStoreMock::setErrorMode(false);
+
+	XenStore xenStore;
+	int value = 0;
+
+	for (auto _ : state)
+	{
+		xenStore.writeInt(gPath, value++);
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_XenStoreWrite);
+
+/*
+ * Latency from the Xen store change to the watch callback call
+ */
+static void BM_XenStoreWatchDispatch(benchmark::State& state)
+{
+	XenStoreMock::setErrorMode(false);
+
+	XenStore xenStore;
+	atomic_bool triggered(false);
+
+	xenStore.start();
+
+	auto mock = XenStoreMock::getLastInstance();
+
+	xenStore.setWatch(gPath, [&triggered] (const string&)
+					  { triggered = true; });
+
+	// skip the initial watch event
+	while (!triggered)
+	{
+		std::this_thread::yield();
+	}
+
+	for (auto _ : state)
+	{
+		triggered = false;
+
+		auto start = steady_clock::now();
+
+		mock->writeValue(gPath, "changed");
+
+		while (!triggered)
+		{
+			std::this_thread::yield();
+		}
+
+		state.SetIterationTime(duration<double>(
+				steady_clock::now() - start).count());
+	}
+
+	xenStore.clearWatches();
+	xenStore.stop();
+
+	state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_XenStoreWatchDispatch)->UseManualTime();
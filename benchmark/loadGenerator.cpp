@@ -0,0 +1,677 @@
+/*
+ *  Synthetic many-frontend load generator
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+/*
+ * Simulates N frontend domains on top of the mocks and drives the real
+ * BackendBase, FrontendHandlerBase and RingBufferInBase code:
+ *
+ * - populates /local/domain/<id>/device/... entries of the frontends;
+ * - creates backend entries as toolstack does;
+ * - performs xenbus handshake (Initialising, Initialised) for each frontend;
+ * - pushes requests into the rings at the given rate and batch size;
+ * - reports thread count, memory footprint, bring-up time and request
+ *   latency percentiles;
+ * - optionally captures the ring traffic for ringreplay (-w).
+ *
+ * The grant table mock doesn't share memory between domains, thus the
+ * frontend side accesses the shared ring through the backend ring object.
+ * Responses are polled by the client threads.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <getopt.h>
+
+#include "mocks/XenCtrlMock.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+#include "testRingBuffer.hpp"
+#include "benchUtils.hpp"
+#include "BackendBase.hpp"
+#include "FrontendHandlerBase.hpp"
+#include "Log.hpp"
+
+using std::atomic_bool;
+using std::cout;
+using std::endl;
+using std::exception;
+using std::ifstream;
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::sort;
+using std::stoul;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::unordered_map;
+using std::vector;
+
+using XenBackend::BackendBase;
+using XenBackend::EventLoop;
+using XenBackend::EventLoopPtr;
+using XenBackend::FrontendHandlerBase;
+using XenBackend::FrontendHandlerPtr;
+using XenBackend::Log;
+using XenBackend::RingBufferInBase;
+using XenBackend::RingCapture;
+using XenBackend::RingCapturePtr;
+using XenBackend::ThreadPool;
+using XenBackend::ThreadPoolPtr;
+using XenBackend::XenStorePtr;
+
+static const domid_t cBackendDomId = 0;
+static const char* cDevName = "loadgen";
+static const grant_ref_t cRingRef = 100;
+static const evtchn_port_t cRemotePort = 10;
+
+/*******************************************************************************
+ * Options
+ ******************************************************************************/
+
+struct Options
+{
+	size_t numFrontends = 1000;
+	size_t numRequests = 1000;
+	size_t batchSize = 1;
+	size_t rate = 0;
+	size_t numClients = 1;
+	size_t numLoopThreads = 0;
+	size_t numBringUpThreads = 0;
+	string captureFile;
+};
+
+static void printUsage(const char* name)
+{
+	cout << "Usage: " << name << " [options]" << endl
+		 << "  -n <num>  number of frontends (default 1000)" << endl
+		 << "  -c <num>  requests per frontend (default 1000)" << endl
+		 << "  -b <num>  requests per notification (default 1)" << endl
+		 << "  -r <num>  requests per second per frontend, "
+		 << "0 is unlimited (default 0)" << endl
+		 << "  -t <num>  client threads (default 1)" << endl
+		 << "  -e <num>  event loop threads, "
+		 << "0 is thread per event channel (default 0)" << endl
+		 << "  -p <num>  bring-up pool threads, "
+		 << "0 is synchronous (default 0)" << endl
+		 << "  -w <file> capture ring traffic to the file" << endl;
+}
+
+static bool parseOptions(int argc, char* argv[], Options& options)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:c:b:r:t:e:p:w:h")) != -1)
+	{
+		if (opt == 'h' || opt == '?' || !optarg)
+		{
+			return false;
+		}
+
+		if (opt == 'w')
+		{
+			options.captureFile = optarg;
+
+			continue;
+		}
+
+		size_t value = stoul(optarg);
+
+		switch (opt)
+		{
+		case 'n': options.numFrontends = value; break;
+		case 'c': options.numRequests = value; break;
+		case 'b': options.batchSize = value; break;
+		case 'r': options.rate = value; break;
+		case 't': options.numClients = value; break;
+		case 'e': options.numLoopThreads = value; break;
+		case 'p': options.numBringUpThreads = value; break;
+		}
+	}
+
+	return options.numFrontends > 0 && options.numFrontends < 0x7FF0 &&
+		   options.batchSize > 0 && options.numClients > 0;
+}
+
+/*******************************************************************************
+ * Helpers
+ ******************************************************************************/
+
+static string readProcStatus(const string& key)
+{
+	ifstream status("/proc/self/status");
+	string line;
+
+	while (getline(status, line))
+	{
+		if (line.compare(0, key.length(), key) == 0 &&
+			line[key.length()] == ':')
+		{
+			auto pos = line.find_first_not_of(" \t", key.length() + 1);
+
+			return pos == string::npos ? "" : line.substr(pos);
+		}
+	}
+
+	return "unknown";
+}
+
+static string frontendPath(domid_t domId)
+{
+	return "/local/domain/" + to_string(domId) + "/device/" + cDevName + "/0";
+}
+
+static string backendPath(domid_t domId)
+{
+	return "/local/domain/" + to_string(cBackendDomId) + "/backend/" +
+		   cDevName + "/" + to_string(domId) + "/0";
+}
+
+static bool checkState(XenStoreMock& mock, const string& path,
+					   xenbus_state state)
+{
+	auto value = mock.readValue(path);
+
+	return value && to_string(state) == value;
+}
+
+static void waitForStates(XenStoreMock& mock, const vector<string>& paths,
+						  xenbus_state state)
+{
+	for (auto& path : paths)
+	{
+		while (!checkState(mock, path, state))
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+/*******************************************************************************
+ * Backend side
+ ******************************************************************************/
+
+class LoadRingBuffer : public RingBufferInBase<xen_test_back_ring,
+											   xen_test_sring,
+											   xentest_req, xentest_rsp>
+{
+public:
+
+	LoadRingBuffer(domid_t domId, evtchn_port_t port,
+				   const vector<grant_ref_t>& refs) :
+		RingBufferInBase<xen_test_back_ring, xen_test_sring,
+						 xentest_req, xentest_rsp>(domId, port, refs) {}
+
+	xen_test_sring* getSharedRing()
+	{
+		return static_cast<xen_test_sring*>(mBuffer.get());
+	}
+
+private:
+
+	void processRequest(const xentest_req& req) override
+	{
+		xentest_rsp rsp {};
+
+		rsp.seq = req.seq;
+		rsp.u32data = req.op.command1.u32data1 + req.op.command1.u32data2;
+
+		sendResponse(rsp);
+	}
+};
+
+/*
+ * Frontend side view of the bound ring
+ */
+struct BoundRing
+{
+	shared_ptr<LoadRingBuffer> ringBuffer;
+	XenEvtchnMock* evtchnMock;
+};
+
+static mutex gRingsMutex;
+static unordered_map<domid_t, BoundRing> gRings;
+static RingCapturePtr gCapture;
+
+class LoadFrontendHandler : public FrontendHandlerBase
+{
+public:
+
+	LoadFrontendHandler(domid_t beDomId, domid_t feDomId, uint16_t devId,
+						XenStorePtr xenStore) :
+		FrontendHandlerBase("LoadFrontend", cDevName, beDomId, feDomId, devId,
+							xenStore) {}
+
+private:
+
+	void onBind() override
+	{
+		auto refs = readRingRefs();
+		auto port = getXenStore().readUint(getXsFrontendPath() +
+										   "/event-channel");
+
+		shared_ptr<LoadRingBuffer> ringBuffer;
+
+		{
+			// the event channel mock of the ring is the last created one
+			lock_guard<mutex> lock(gRingsMutex);
+
+			ringBuffer.reset(new LoadRingBuffer(getDomId(), port, refs));
+
+			ringBuffer->setCapture(gCapture);
+
+			gRings[getDomId()] = { ringBuffer,
+								   XenEvtchnMock::getLastInstance() };
+		}
+
+		addRingBuffer(ringBuffer);
+	}
+
+	void onClosing() override
+	{
+		lock_guard<mutex> lock(gRingsMutex);
+
+		gRings.erase(getDomId());
+	}
+};
+
+class LoadBackend : public BackendBase
+{
+public:
+
+	LoadBackend() : BackendBase("LoadBackend", cDevName, cBackendDomId) {}
+
+private:
+
+	void onNewFrontend(domid_t domId, uint16_t devId) override
+	{
+		addFrontendHandler(FrontendHandlerPtr(
+				new LoadFrontendHandler(getDomId(), domId, devId,
+										getXenStore())));
+	}
+};
+
+/*******************************************************************************
+ * Frontend side
+ ******************************************************************************/
+
+struct Frontend
+{
+	domid_t domId;
+	BoundRing bound;
+	xen_test_front_ring ring;
+	vector<uint64_t> sendTimes;
+	size_t numSent;
+	size_t numCompleted;
+	uint64_t nextSendTime;
+};
+
+static void initFrontend(Frontend& frontend)
+{
+	auto sring = frontend.bound.ringBuffer->getSharedRing();
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&frontend.ring, sring, XC_PAGE_SIZE);
+
+	frontend.sendTimes.resize(RING_SIZE(&frontend.ring));
+	frontend.numSent = 0;
+	frontend.numCompleted = 0;
+	frontend.nextSendTime = 0;
+}
+
+static bool receiveResponses(Frontend& frontend, vector<uint64_t>& latencies)
+{
+	auto& ring = frontend.ring;
+	auto rp = ring.sring->rsp_prod;
+
+	if (rp == ring.rsp_cons)
+	{
+		return false;
+	}
+
+	xen_rmb();
+
+	auto time = now();
+
+	for (auto i = ring.rsp_cons; i != rp; i++)
+	{
+		auto rsp = RING_GET_RESPONSE(&ring, i);
+
+		latencies.push_back(time - frontend.sendTimes[
+				rsp->seq % frontend.sendTimes.size()]);
+	}
+
+	frontend.numCompleted += rp - ring.rsp_cons;
+
+	ring.rsp_cons = rp;
+
+	return true;
+}
+
+static bool sendRequests(Frontend& frontend, const Options& options)
+{
+	auto& ring = frontend.ring;
+
+	if (frontend.numSent != frontend.numCompleted ||
+		frontend.numSent >= options.numRequests)
+	{
+		return false;
+	}
+
+	auto time = now();
+
+	if (time < frontend.nextSendTime)
+	{
+		return false;
+	}
+
+	auto count = std::min({options.batchSize,
+						   options.numRequests - frontend.numSent,
+						   static_cast<size_t>(RING_SIZE(&ring))});
+
+	xentest_req req {XENTEST_CMD1};
+
+	for (size_t i = 0; i < count; i++)
+	{
+		req.seq = frontend.numSent++;
+		req.op.command1.u32data1 = req.seq;
+
+		frontend.sendTimes[req.seq % frontend.sendTimes.size()] = time;
+
+		*RING_GET_REQUEST(&ring, ring.req_prod_pvt) = req;
+
+		ring.req_prod_pvt++;
+	}
+
+	int notify;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&ring, notify);
+
+	if (notify)
+	{
+		frontend.bound.evtchnMock->signalLastBoundPort();
+	}
+
+	if (options.rate)
+	{
+		auto interval = 1000000000ull * count / options.rate;
+
+		frontend.nextSendTime = (frontend.nextSendTime ?
+								 frontend.nextSendTime : time) + interval;
+	}
+
+	return true;
+}
+
+static void clientThread(vector<Frontend*> frontends, const Options& options,
+						 vector<uint64_t>& latencies)
+{
+	latencies.reserve(frontends.size() * options.numRequests);
+
+	size_t numDone = 0;
+
+	while (numDone < frontends.size())
+	{
+		bool progress = false;
+
+		numDone = 0;
+
+		for (auto frontend : frontends)
+		{
+			progress |= receiveResponses(*frontend, latencies);
+			progress |= sendRequests(*frontend, options);
+
+			if (frontend->numCompleted >= options.numRequests)
+			{
+				numDone++;
+			}
+		}
+
+		if (!progress)
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+/*******************************************************************************
+ * Main
+ ******************************************************************************/
+
+static void prepareXenStore(const Options& options)
+{
+	XenStoreMock storeMock;
+
+	storeMock.setDomainPath(cBackendDomId,
+							"/local/domain/" + to_string(cBackendDomId));
+
+	XenCtrlMock::clearDomInfos();
+
+	for (size_t i = 0; i < options.numFrontends; i++)
+	{
+		domid_t domId = i + 1;
+		auto domPath = "/local/domain/" + to_string(domId);
+
+		xc_domaininfo_t info = {};
+
+		info.domain = domId;
+		info.flags = XEN_DOMINF_running;
+
+		XenCtrlMock::addDomInfo(info);
+
+		storeMock.setDomainPath(domId, domPath);
+		storeMock.writeValue(domPath + "/name", "DomU" + to_string(domId));
+		storeMock.writeValue(frontendPath(domId) + "/state",
+							 to_string(XenbusStateUnknown));
+	}
+}
+
+static void run(const Options& options)
+{
+	prepareXenStore(options);
+
+	if (!options.captureFile.empty())
+	{
+		gCapture.reset(new RingCapture(options.captureFile));
+	}
+
+	LoadBackend backend;
+
+	auto mock = XenStoreMock::getLastInstance();
+
+	if (options.numLoopThreads)
+	{
+		backend.setEventLoop(EventLoopPtr(
+				new EventLoop(options.numLoopThreads)));
+	}
+
+	if (options.numBringUpThreads)
+	{
+		backend.setBringUpPool(ThreadPoolPtr(
+				new ThreadPool(options.numBringUpThreads)));
+	}
+
+	backend.start();
+
+	vector<string> feStatePaths, beStatePaths;
+
+	for (size_t i = 0; i < options.numFrontends; i++)
+	{
+		feStatePaths.push_back(frontendPath(i + 1) + "/state");
+		beStatePaths.push_back(backendPath(i + 1) + "/state");
+	}
+
+	// toolstack creates backend entries
+
+	auto startTime = now();
+
+	for (size_t i = 0; i < options.numFrontends; i++)
+	{
+		mock->writeValue(backendPath(i + 1), "");
+	}
+
+	waitForStates(*mock, beStatePaths, XenbusStateInitialising);
+
+	auto createdTime = now();
+
+	// xenbus handshake
+
+	for (auto& path : feStatePaths)
+	{
+		mock->writeValue(path, to_string(XenbusStateInitialising));
+	}
+
+	waitForStates(*mock, beStatePaths, XenbusStateInitWait);
+
+	for (size_t i = 0; i < options.numFrontends; i++)
+	{
+		mock->writeValue(frontendPath(i + 1) + "/ring-ref",
+						 to_string(cRingRef));
+		mock->writeValue(frontendPath(i + 1) + "/event-channel",
+						 to_string(cRemotePort));
+		mock->writeValue(feStatePaths[i], to_string(XenbusStateInitialised));
+	}
+
+	waitForStates(*mock, beStatePaths, XenbusStateConnected);
+
+	auto connectedTime = now();
+
+	auto numThreads = readProcStatus("Threads");
+	auto memory = readProcStatus("VmRSS");
+
+	// load
+
+	vector<Frontend> frontends(options.numFrontends);
+
+	{
+		lock_guard<mutex> lock(gRingsMutex);
+
+		for (size_t i = 0; i < options.numFrontends; i++)
+		{
+			frontends[i].domId = i + 1;
+			frontends[i].bound = gRings.at(i + 1);
+
+			initFrontend(frontends[i]);
+		}
+	}
+
+	vector<vector<Frontend*>> clientFrontends(options.numClients);
+	vector<vector<uint64_t>> clientLatencies(options.numClients);
+	vector<thread> clients;
+
+	for (size_t i = 0; i < frontends.size(); i++)
+	{
+		clientFrontends[i % options.numClients].push_back(&frontends[i]);
+	}
+
+	auto loadStartTime = now();
+
+	for (size_t i = 0; i < options.numClients; i++)
+	{
+		clients.emplace_back(clientThread, clientFrontends[i],
+							 std::cref(options),
+							 std::ref(clientLatencies[i]));
+	}
+
+	for (auto& client : clients)
+	{
+		client.join();
+	}
+
+	auto loadTime = now() - loadStartTime;
+
+	vector<uint64_t> latencies;
+
+	for (auto& clientLatency : clientLatencies)
+	{
+		latencies.insert(latencies.end(), clientLatency.begin(),
+						 clientLatency.end());
+	}
+
+	sort(latencies.begin(), latencies.end());
+
+	cout << "frontends:              " << options.numFrontends << endl
+		 << "threads:                " << numThreads << endl
+		 << "memory:                 " << memory << endl
+		 << "peak memory:            " << readProcStatus("VmHWM") << endl
+		 << "create time (ms):       " << (createdTime - startTime) / 1e6
+		 << endl
+		 << "bring-up time (ms):     " << (connectedTime - startTime) / 1e6
+		 << endl
+		 << "requests:               " << latencies.size() << endl
+		 << "requests per second:    "
+		 << latencies.size() * 1e9 / (loadTime ? loadTime : 1) << endl;
+
+	if (!latencies.empty())
+	{
+		printPercentile("p50", latencies, 0.5);
+		printPercentile("p90", latencies, 0.9);
+		printPercentile("p99", latencies, 0.99);
+		printPercentile("p99.9", latencies, 0.999);
+		printPercentile("max", latencies, 1.0);
+	}
+
+	backend.stop();
+
+	if (gCapture)
+	{
+		gCapture->flush();
+
+		cout << "captured records:       " << gCapture->getNumRecords()
+			 << endl;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+
+	try
+	{
+		if (!parseOptions(argc, argv, options))
+		{
+			printUsage(argv[0]);
+
+			return 1;
+		}
+
+		Log::setLogMask("*:Disable");
+
+		run(options);
+	}
+	catch(const exception& e)
+	{
+		std::cerr << "Error: " << e.what() << endl;
+
+		return 1;
+	}
+
+	return 0;
+}
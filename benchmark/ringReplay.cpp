@@ -0,0 +1,435 @@
+/*
+ *  Ring buffer capture replay
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+/*
+ * Replays requests of the capture written by RingCapture (for example by
+ * loadgen -w) into the real RingBufferInBase code on top of the mocks:
+ *
+ * - creates the ring buffer for each frontend domain and event channel port
+ *   of the capture;
+ * - pushes captured batches of requests into the rings with original timing
+ *   or at the maximal speed (-m);
+ * - compares responses with the captured ones in order;
+ * - reports replay time, request rate and latency percentiles.
+ *
+ * The tool replays the test protocol handled by ReplayRingBuffer. To replay
+ * the traffic of other backend, ReplayRingBuffer should be replaced with the
+ * ring buffer of this backend.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "testRingBuffer.hpp"
+#include "benchUtils.hpp"
+#include "Log.hpp"
+#include "RingCapture.hpp"
+
+using std::cout;
+using std::deque;
+using std::endl;
+using std::exception;
+using std::make_pair;
+using std::map;
+using std::pair;
+using std::shared_ptr;
+using std::sort;
+using std::string;
+using std::vector;
+
+using XenBackend::Log;
+using XenBackend::RingBufferInBase;
+using XenBackend::RingCaptureException;
+using XenBackend::RingCaptureReader;
+using XenBackend::RingCaptureRecord;
+
+static const grant_ref_t cRingRef = 100;
+
+/*******************************************************************************
+ * Options
+ ******************************************************************************/
+
+struct Options
+{
+	bool maxSpeed = false;
+	string fileName;
+};
+
+static void printUsage(const char* name)
+{
+	cout << "Usage: " << name << " [options] <capture file>" << endl
+		 << "  -m  replay at the maximal speed "
+		 << "(default original timing)" << endl;
+}
+
+static bool parseOptions(int argc, char* argv[], Options& options)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "mh")) != -1)
+	{
+		if (opt != 'm')
+		{
+			return false;
+		}
+
+		options.maxSpeed = true;
+	}
+
+	if (optind != argc - 1)
+	{
+		return false;
+	}
+
+	options.fileName = argv[optind];
+
+	return true;
+}
+
+/*******************************************************************************
+ * Backend side
+ ******************************************************************************/
+
+class ReplayRingBuffer : public RingBufferInBase<xen_test_back_ring,
+												 xen_test_sring,
+												 xentest_req, xentest_rsp>
+{
+public:
+
+	ReplayRingBuffer(domid_t domId, evtchn_port_t port, grant_ref_t ref) :
+		RingBufferInBase<xen_test_back_ring, xen_test_sring,
+						 xentest_req, xentest_rsp>(domId, port, ref) {}
+
+	xen_test_sring* getSharedRing()
+	{
+		return static_cast<xen_test_sring*>(mBuffer.get());
+	}
+
+private:
+
+	void processRequest(const xentest_req& req) override
+	{
+		xentest_rsp rsp {};
+
+		rsp.seq = req.seq;
+		rsp.u32data = req.op.command1.u32data1 + req.op.command1.u32data2;
+
+		sendResponse(rsp);
+	}
+};
+
+/*******************************************************************************
+ * Frontend side
+ ******************************************************************************/
+
+struct Ring
+{
+	shared_ptr<ReplayRingBuffer> ringBuffer;
+	XenEvtchnMock* evtchnMock;
+	xen_test_front_ring ring;
+	deque<uint64_t> sendTimes;
+	deque<xentest_rsp> expected;
+	size_t numMismatches;
+};
+
+class Replay
+{
+public:
+
+	explicit Replay(const Options& options) :
+		mOptions(options),
+		mNumRequests(0),
+		mNumBatches(0)
+	{
+		readCapture();
+	}
+
+	~Replay()
+	{
+		for (auto& ring : mRings)
+		{
+			ring.second.ringBuffer->stop();
+		}
+	}
+
+	void run()
+	{
+		auto startTime = now();
+		auto firstTime = mRecords.empty() ? 0 : mRecords.front().time;
+
+		for (auto& record : mRecords)
+		{
+			// keep original intervals between batches
+			while (!mOptions.maxSpeed &&
+				   now() - startTime < record.time - firstTime)
+			{
+				if (!receiveResponses())
+				{
+					std::this_thread::yield();
+				}
+			}
+
+			sendRequests(getRing(record), record);
+
+			receiveResponses();
+		}
+
+		while (mLatencies.size() < mNumRequests)
+		{
+			if (!receiveResponses())
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		report(now() - startTime);
+	}
+
+private:
+
+	const Options& mOptions;
+	vector<RingCaptureRecord> mRecords;
+	map<pair<domid_t, evtchn_port_t>, Ring> mRings;
+	vector<uint64_t> mLatencies;
+	size_t mNumRequests;
+	size_t mNumBatches;
+
+	void readCapture()
+	{
+		RingCaptureReader reader(mOptions.fileName);
+		RingCaptureRecord record;
+
+		while (reader.read(record))
+		{
+			if (record.type == RingCaptureRecord::Type::REQUEST)
+			{
+				if (record.itemSize != sizeof(xentest_req))
+				{
+					throw RingCaptureException(
+							"Request size doesn't match the protocol");
+				}
+
+				getRing(record);
+
+				mNumRequests += record.getCount();
+				mNumBatches++;
+
+				mRecords.push_back(record);
+			}
+			else if (record.type == RingCaptureRecord::Type::RESPONSE &&
+					 record.itemSize == sizeof(xentest_rsp))
+			{
+				auto rsps = reinterpret_cast<const xentest_rsp*>(
+						record.data.data());
+				auto& expected = getRing(record).expected;
+
+				expected.insert(expected.end(), rsps,
+								rsps + record.getCount());
+			}
+		}
+
+		mLatencies.reserve(mNumRequests);
+	}
+
+	Ring& getRing(const RingCaptureRecord& record)
+	{
+		auto key = make_pair(record.domId, record.port);
+		auto it = mRings.find(key);
+
+		if (it != mRings.end())
+		{
+			return it->second;
+		}
+
+		auto& ring = mRings[key];
+
+		// the event channel mock of the ring is the last created one
+		ring.ringBuffer.reset(new ReplayRingBuffer(record.domId, record.port,
+												   cRingRef));
+		ring.evtchnMock = XenEvtchnMock::getLastInstance();
+		ring.numMismatches = 0;
+
+		auto sring = ring.ringBuffer->getSharedRing();
+
+		SHARED_RING_INIT(sring);
+		FRONT_RING_INIT(&ring.ring, sring, XC_PAGE_SIZE);
+
+		ring.ringBuffer->start();
+
+		return ring;
+	}
+
+	void pushRequests(Ring& ring)
+	{
+		int notify;
+
+		RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&ring.ring, notify);
+
+		if (notify)
+		{
+			ring.evtchnMock->signalLastBoundPort();
+		}
+	}
+
+	void sendRequests(Ring& ring, const RingCaptureRecord& record)
+	{
+		for (size_t i = 0; i < record.getCount(); i++)
+		{
+			while (RING_FULL(&ring.ring))
+			{
+				pushRequests(ring);
+
+				if (!receiveResponses())
+				{
+					std::this_thread::yield();
+				}
+			}
+
+			memcpy(RING_GET_REQUEST(&ring.ring, ring.ring.req_prod_pvt),
+				   &record.data[i * record.itemSize], record.itemSize);
+
+			ring.ring.req_prod_pvt++;
+
+			ring.sendTimes.push_back(now());
+		}
+
+		pushRequests(ring);
+	}
+
+	bool receiveResponses()
+	{
+		bool received = false;
+
+		for (auto& item : mRings)
+		{
+			auto& ring = item.second;
+			auto rp = ring.ring.sring->rsp_prod;
+
+			if (rp == ring.ring.rsp_cons)
+			{
+				continue;
+			}
+
+			xen_rmb();
+
+			auto time = now();
+
+			for (auto i = ring.ring.rsp_cons; i != rp; i++)
+			{
+				auto rsp = RING_GET_RESPONSE(&ring.ring, i);
+
+				if (!ring.expected.empty())
+				{
+					if (memcmp(rsp, &ring.expected.front(), sizeof(*rsp)) != 0)
+					{
+						ring.numMismatches++;
+					}
+
+					ring.expected.pop_front();
+				}
+
+				mLatencies.push_back(time - ring.sendTimes.front());
+
+				ring.sendTimes.pop_front();
+			}
+
+			ring.ring.rsp_cons = rp;
+
+			received = true;
+		}
+
+		return received;
+	}
+
+	void report(uint64_t replayTime)
+	{
+		size_t numMismatches = 0;
+
+		for (auto& ring : mRings)
+		{
+			numMismatches += ring.second.numMismatches;
+		}
+
+		sort(mLatencies.begin(), mLatencies.end());
+
+		cout << "rings:                  " << mRings.size() << endl
+			 << "batches:                " << mNumBatches << endl
+			 << "requests:               " << mNumRequests << endl
+			 << "replay time (ms):       " << replayTime / 1e6 << endl
+			 << "requests per second:    "
+			 << mNumRequests * 1e9 / (replayTime ? replayTime : 1) << endl
+			 << "mismatched responses:   " << numMismatches << endl;
+
+		if (!mLatencies.empty())
+		{
+			printPercentile("p50", mLatencies, 0.5);
+			printPercentile("p90", mLatencies, 0.9);
+			printPercentile("p99", mLatencies, 0.99);
+			printPercentile("max", mLatencies, 1.0);
+		}
+	}
+};
+
+/*******************************************************************************
+ * Main
+ ******************************************************************************/
+
+int main(int argc, char* argv[])
+{
+	Options options;
+
+	try
+	{
+		if (!parseOptions(argc, argv, options))
+		{
+			printUsage(argv[0]);
+
+			return 1;
+		}
+
+		Log::setLogMask("*:Disable");
+
+		XenEvtchnMock::setErrorMode(false);
+		XenGnttabMock::setErrorMode(false);
+
+		Replay replay(options);
+
+		replay.run();
+	}
+	catch(const exception& e)
+	{
+		std::cerr << "Error: " << e.what() << endl;
+
+		return 1;
+	}
+
+	return 0;
+}
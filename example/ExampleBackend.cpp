@@ -128,9 +128,11 @@ void ExampleBackend::onNewFrontend(domid_t domId, uint16_t devId)
 {
 	LOG(mLog, DEBUG) << "New frontend, dom id: " << domId;
 
-	// create new example frontend handler
+	// create new example frontend handler, it shares the backend XenStore
+	// connection
 	addFrontendHandler(FrontendHandlerPtr(
-			new ExampleFrontendHandler(getDeviceName(), domId)));
+			new ExampleFrontendHandler(getDeviceName(), domId,
+									   getXenStore())));
 }
 //! [onNewFrontend]
 
@@ -74,8 +74,10 @@ class ExampleFrontendHandler : public XenBackend::FrontendHandlerBase
 {
 public:
 
-	ExampleFrontendHandler(const std::string& devName, domid_t feDomId) :
-		FrontendHandlerBase("FrontendHandler", "example_dev", 0, feDomId),
+	ExampleFrontendHandler(const std::string& devName, domid_t feDomId,
+						   XenBackend::XenStorePtr xenStore = nullptr) :
+		FrontendHandlerBase("FrontendHandler", "example_dev", 0, feDomId, 0,
+							xenStore),
 		mLog("FrontendHandler")
 	{
 		LOG(mLog, DEBUG) << "Create example frontend handler, dom id: "
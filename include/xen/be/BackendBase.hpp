@@ -24,11 +24,17 @@
 #define INCLUDE_BACKENDBASE_HPP_
 
 #include <atomic>
+#include <condition_variable>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
+#include "EventLoop.hpp"
 #include "FrontendHandlerBase.hpp"
 #include "XenException.hpp"
 #include "XenStore.hpp"
@@ -83,8 +89,37 @@ class BackendException : public XenException
  * When the backend instance is created, it should be started by calling start()
  * method. The backend will process frontends till stop() method is called.
  *
+ * On start the backend discovers already existing frontends eagerly: the
+ * frontend list is read once, entries of domains which don't exist anymore
+ * (according to XenStat) are skipped and handlers for the rest are created
+ * before the watch is set. If the bring-up pool is set (see setBringUpPool()),
+ * the handlers are created in parallel and start() doesn't wait for them.
+ *
  * @snippet ExampleBackend.cpp main
  *
+ * The backend may be restarted (upgraded) without renegotiation with
+ * connected frontends. The old instance writes the state of connected
+ * frontends (domain and device ids, ring grant references, event channel
+ * ports and private ring indexes) to a file descriptor (a file or a memfd
+ * passed to the new process) by saveHandoff() and exits. Xen store entries
+ * stay in XenbusStateConnected. The new instance reads the state by
+ * loadHandoff() before start(): the frontend handlers created for the saved
+ * frontends map the same rings, bind the same event channels and continue
+ * from the saved indexes without touching the backend state:
+ *
+ * @code
+ * // old instance
+ * backend.saveHandoff(fd);
+ *
+ * // new instance
+ * backend.loadHandoff(fd);
+ * backend.start();
+ * @endcode
+ *
+ * Requests consumed from the rings should be completed before
+ * saveHandoff(): responses of requests which are in flight are lost. The
+ * backlog of output ring buffers is dropped.
+ *
  * @ingroup backend
  ******************************************************************************/
 class BackendBase
@@ -105,10 +140,28 @@ public:
 	void start();
 
 	/**
-	 * Stops backend.
+	 * Stops detecting frontends and waits till queued bring-ups are finished.
+	 * Frontend handlers keep running: the XenStore connection shared with
+	 * them is stopped on the backend deletion.
 	 */
 	void stop();
 
+	/**
+	 * Stops the backend and writes the state of all frontends to the file
+	 * descriptor for the live restart (see FrontendHandlerBase::detach()).
+	 * After the call the backend doesn't have frontend handlers.
+	 * @param[in] fd file descriptor
+	 */
+	void saveHandoff(int fd);
+
+	/**
+	 * Reads the state written by saveHandoff() of the previous backend
+	 * instance. The state is passed to the frontend handlers added for the
+	 * saved frontends. Should be called before start().
+	 * @param[in] fd file descriptor
+	 */
+	void loadHandoff(int fd);
+
 	/**
 	 * Waits for backend is finished.
 	 */
@@ -124,6 +177,79 @@ public:
 	 */
 	domid_t getDomId() const { return mDomId; }
 
+	/**
+	 * Sets the shared event loop. The event loop is passed to all frontend
+	 * handlers added after this call, which don't have own event loop set.
+	 * @param[in] eventLoop event loop
+	 */
+	void setEventLoop(EventLoopPtr eventLoop) { mEventLoop = eventLoop; }
+
+	/**
+	 * Returns the shared event loop or <i>nullptr</i> if it is not set
+	 */
+	EventLoopPtr getEventLoop() const { return mEventLoop; }
+
+	/**
+	 * Sets thread configuration of the backend: it is used by the backend
+	 * XenStore connection and by the frontend handlers which don't have own
+	 * configuration. Should be called before start().
+	 * @param[in] config thread configuration
+	 */
+	void setThreadConfig(const ThreadConfig& config) { mThreadConfig = config; }
+
+	/**
+	 * Returns XenStore connection of the backend. It may be passed to the
+	 * frontend handlers in order to share one connection and one watches
+	 * thread between all of them.
+	 */
+	XenStorePtr getXenStore() const { return mXenStore; }
+
+	/**
+	 * Sets thread pool for parallel frontend bring-up.
+	 *
+	 * By default onNewFrontend() is called for each new device one by one
+	 * in the XenStore watch callback. When the pool is set, onNewFrontend()
+	 * calls for new devices are queued to the pool and run concurrently,
+	 * thus onNewFrontend() and the frontend handler constructor should be
+	 * thread safe. stop() waits till queued calls are finished. If the
+	 * device is removed before its queued bring-up runs, onNewFrontend() is
+	 * not called; if it is removed while onNewFrontend() is running, the
+	 * added frontend handler is stopped and removed afterwards.
+	 *
+	 * The bring-up blocks on Xen store requests and the pool size is the
+	 * maximal number of concurrent bring-ups. A dedicated pool should be
+	 * used: ThreadPool::getShared() also runs the frontend handlers closing
+	 * which shall not wait behind the bring-up of many devices.
+	 * @param[in] pool thread pool or <i>nullptr</i> to create frontends
+	 *                 sequentially
+	 */
+	void setBringUpPool(ThreadPoolPtr pool);
+
+	/**
+	 * Returns the frontend handler. This method is thread safe.
+	 * @param[in] domId domain id
+	 * @param[in] devId device id
+	 * @return frontend handler or <i>nullptr</i> if it doesn't exist
+	 */
+	FrontendHandlerPtr getFrontendHandler(domid_t domId, uint16_t devId);
+
+	/**
+	 * Returns snapshot of all frontend handlers. This method is thread safe.
+	 * The handlers may be stopped and removed from the backend after the
+	 * call, but they remain valid as long as the snapshot holds them.
+	 */
+	std::vector<FrontendHandlerPtr> getFrontendHandlers();
+
+	/**
+	 * Returns number of frontend handlers
+	 */
+	size_t getNumFrontendHandlers();
+
+	/**
+	 * Returns snapshot of counters of all ring buffers of all frontends
+	 */
+	std::vector<RingBufferStats> getRingBufferStats();
+
 protected:
 
 	/**
@@ -146,15 +272,46 @@ private:
 
 	domid_t mDomId;
 	std::string mDeviceName;
-	XenStore mXenStore;
-	std::list<FrontendHandlerPtr> mFrontendHandlers;
-	std::list<domid_t> mFrontendDomIds;
+	XenStorePtr mXenStore;
+	// backend watches are handled in order even if XenStore executor is set
+	XenStore::WatchGroup mWatchGroup;
+	// frontend handlers indexed by domain id and device id
+	typedef std::unordered_map<uint16_t, FrontendHandlerPtr> DeviceHandlers;
+
+	std::unordered_map<domid_t, DeviceHandlers> mFrontendHandlers;
+	size_t mNumFrontendHandlers;
+	std::string mFrontendListPath;
+	EventLoopPtr mEventLoop;
+	ThreadConfig mThreadConfig;
+	ThreadPoolPtr mBringUpPool;
+	// frontends queued to the bring-up pool
+	std::unordered_set<uint32_t> mPendingFrontends;
+	// queued frontends which devices are removed before the bring-up is done
+	std::unordered_set<uint32_t> mCancelledFrontends;
+	// frontend states loaded by loadHandoff()
+	std::unordered_map<uint32_t, FrontendHandlerBase::HandoffState>
+		mHandoffStates;
+	std::condition_variable mCondVar;
+	std::mutex mMutex;
 
 	Log mLog;
 
+	void discoverFrontends();
 	void frontendListChanged(const std::string& path);
+	void rescanFrontends();
 	void deviceListChanged(const std::string& path, domid_t domId);
-	FrontendHandlerPtr getFrontendHandler(domid_t domId, uint16_t devId);
+	bool isFrontendKnown(domid_t domId, uint16_t devId);
+	static bool parseId(const std::string& str, unsigned long max,
+						unsigned long& id);
+	void createFrontend(domid_t domId, uint16_t devId);
+	void bringUpFrontend(domid_t domId, uint16_t devId);
+	bool isBringUpCancelled(uint32_t key);
+	// should be called with mMutex locked
+	FrontendHandlerPtr takeFrontendHandler(domid_t domId, uint16_t devId);
+	static uint32_t getFrontendKey(domid_t domId, uint16_t devId)
+	{
+		return (static_cast<uint32_t>(domId) << 16) | devId;
+	}
 };
 
 }
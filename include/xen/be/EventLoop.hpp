@@ -0,0 +1,220 @@
+/*
+ *  Shared event loop
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef INCLUDE_EVENTLOOP_HPP_
+#define INCLUDE_EVENTLOOP_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Utils.hpp"
+#include "XenException.hpp"
+#include "Log.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by EventLoop.
+ * @ingroup backend
+ ******************************************************************************/
+class EventLoopException : public XenException
+{
+	using XenException::XenException;
+};
+
+/***************************************************************************//**
+ * Shared event loop.
+ *
+ * The event loop runs a fixed number of worker threads. Each worker has its
+ * own epoll instance and waits for the file descriptors assigned to it. When
+ * a file descriptor becomes ready the associated callback is called in the
+ * worker thread. It allows many objects (for example XenEvtchn instances) to
+ * share a small number of threads instead of owning a thread each.
+ *
+ * A file descriptor is always handled by one worker thread, thus its callback
+ * is never called concurrently.
+ *
+ * If the callback throws an exception, the file descriptor is removed from
+ * the loop and the error callback is called.
+ *
+ * The event loop also provides timers (based on timerfd). A timer is created
+ * disarmed by addTimer() and armed by setTimer(). The timer callback is
+ * called in the worker thread the same way as the file descriptor callback.
+ * It allows to handle deadlines (flushing batched data, retrying the backlog
+ * etc.) in the thread which handles the events.
+ *
+ * @code
+ * EventLoopPtr eventLoop(new EventLoop());
+ *
+ * eventLoop->addFd(fd, POLLIN, readCbk, errorCbk);
+ *
+ * auto timer = eventLoop->addTimer(flushCbk);
+ *
+ * eventLoop->setTimer(timer, std::chrono::microseconds(100));
+ *
+ * ...
+ *
+ * eventLoop->removeTimer(timer);
+ * eventLoop->removeFd(fd);
+ * @endcode
+ * @ingroup backend
+ ******************************************************************************/
+class EventLoop
+{
+public:
+
+	/**
+	 * Callback which is called when the file descriptor is ready
+	 */
+	typedef std::function<void()> Callback;
+
+	/**
+	 * Timer identifier
+	 */
+	typedef uint64_t TimerId;
+
+	/**
+	 * @param[in] numThreads number of worker threads. If 0 is passed, the
+	 * number of available CPU cores is used.
+	 * @param[in] configs    thread configurations: worker i uses configs[i %
+	 *                       configs.size()]. It allows for example to pin
+	 *                       each worker to own CPU.
+	 */
+	explicit EventLoop(size_t numThreads = 0,
+					   const std::vector<ThreadConfig>& configs = {});
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(EventLoop const&) = delete;
+	~EventLoop();
+
+	/**
+	 * Returns number of worker threads
+	 */
+	size_t getNumThreads() const { return mWorkers.size(); }
+
+	/**
+	 * Adds file descriptor to the event loop
+	 * @param[in] fd            file descriptor
+	 * @param[in] events        events to poll (same as in system poll
+	 *                          function)
+	 * @param[in] callback      callback which is called when the file
+	 *                          descriptor is ready
+	 * @param[in] errorCallback callback which is called when an error occurs
+	 * @param[in] thread        index of the worker thread which handles the
+	 *                          file descriptor. If -1 is passed, the least
+	 *                          loaded worker is selected.
+	 */
+	void addFd(int fd, short int events, Callback callback,
+			   ErrorCallback errorCallback = nullptr, int thread = -1);
+
+	/**
+	 * Removes file descriptor from the event loop.
+	 * When this method returns, it is guaranteed that the callback of the
+	 * file descriptor is not running (except the case when it is called from
+	 * the callback itself).
+	 * @param[in] fd file descriptor
+	 */
+	void removeFd(int fd);
+
+	/**
+	 * Adds disarmed timer to the event loop
+	 * @param[in] callback      callback which is called when the timer
+	 *                          expires
+	 * @param[in] errorCallback callback which is called when an error occurs
+	 * @param[in] thread        index of the worker thread which handles the
+	 *                          timer. If -1 is passed, the least loaded
+	 *                          worker is selected.
+	 * @return timer id
+	 */
+	TimerId addTimer(Callback callback, ErrorCallback errorCallback = nullptr,
+					 int thread = -1);
+
+	/**
+	 * Arms or disarms the timer. May be called from the timer callback.
+	 * @param[in] id      timer id
+	 * @param[in] timeout time till the first expiration, 0 disarms the timer
+	 * @param[in] period  period of the following expirations, 0 means
+	 *                    one-shot timer
+	 */
+	void setTimer(TimerId id, std::chrono::microseconds timeout,
+				  std::chrono::microseconds period =
+						  std::chrono::microseconds(0));
+
+	/**
+	 * Removes the timer from the event loop. Same as for removeFd(), the
+	 * callback is not running when this method returns.
+	 * @param[in] id timer id
+	 */
+	void removeTimer(TimerId id);
+
+private:
+
+	struct Entry
+	{
+		int fd;
+		Callback callback;
+		ErrorCallback errorCallback;
+	};
+
+	typedef std::shared_ptr<Entry> EntryPtr;
+
+	// each fd is handled by one worker: the entries and the running entry
+	// are protected by the worker mutex, the fds map by mMutex
+	struct Worker
+	{
+		int epollFd;
+		int wakeupFd;
+		std::thread thread;
+		std::unordered_map<uint64_t, EntryPtr> entries;
+		size_t numEntries;
+		uint64_t runningId;
+		std::mutex mutex;
+		std::condition_variable condVar;
+	};
+
+	std::vector<std::unique_ptr<Worker>> mWorkers;
+	std::unordered_map<int, std::pair<size_t, uint64_t>> mFds;
+	std::unordered_map<TimerId, int> mTimers;
+	uint64_t mNextId;
+	std::atomic_bool mTerminate;
+	std::mutex mMutex;
+
+	Log mLog;
+
+	void init(size_t numThreads, const std::vector<ThreadConfig>& configs);
+	void release();
+	size_t selectWorker(int thread);
+	void removeEntry(Worker& worker, uint64_t id);
+	void removeFailedEntry(Worker& worker, uint64_t id, int fd);
+	void workerThread(Worker& worker);
+	void handleEvent(Worker& worker, uint64_t id, uint32_t events);
+};
+
+typedef std::shared_ptr<EventLoop> EventLoopPtr;
+
+}
+
+#endif /* INCLUDE_EVENTLOOP_HPP_ */
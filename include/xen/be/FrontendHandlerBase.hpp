@@ -32,6 +32,7 @@ extern "C" {
 #include <xen/io/xenbus.h>
 }
 
+#include "EventLoop.hpp"
 #include "RingBufferBase.hpp"
 #include "XenEvtchn.hpp"
 #include "XenException.hpp"
@@ -114,11 +115,157 @@ class XenStore;
  *
  * @snippet ExampleBackend.cpp onBind
  *
+ * Multi-page rings are negotiated with setMaxRingPageOrder() and
+ * readRingRefs(). The backend advertises the maximal supported ring page order
+ * and the frontend publishes ring-page-order and ring-ref%u entries:
+ *
+ * @code
+ * // in the frontend handler constructor
+ * setMaxRingPageOrder(4);
+ *
+ * // in onBind()
+ * auto refs = readRingRefs();
+ *
+ * addRingBuffer(RingBufferPtr(new MyRingBuffer(getDomId(), port, refs)));
+ * @endcode
+ *
+ * When the frontend restarts, the ring buffers are destroyed and created
+ * again in onBind(). If the frontend is known to republish the same rings
+ * (driver reload, suspend/resume), the fast reconnect may be enabled by
+ * setFastReconnect(). In this case on the frontend restart the ring buffers
+ * are stopped and parked instead of being destroyed. In onBind() the client
+ * takes the parked ring buffer with takeParkedRingBuffer(): the ring buffer is
+ * returned only if its port and grant references match the published ones,
+ * and it keeps its grant mapping. The event channel is bound again as the
+ * same port number doesn't prove the old binding is alive. Parked ring
+ * buffers which are not taken in onBind() are destroyed:
+ *
+ * @code
+ * auto refs = readRingRefs();
+ * auto ringBuffer = takeParkedRingBuffer(port, refs);
+ *
+ * if (!ringBuffer)
+ * {
+ *     ringBuffer.reset(new MyRingBuffer(getDomId(), port, refs));
+ * }
+ *
+ * addRingBuffer(ringBuffer);
+ * @endcode
+ *
+ * Multi-queue devices are negotiated with setMaxQueues() and readQueues().
+ * The backend advertises the maximal number of queues
+ * (multi-queue-max-queues entry) and the frontend publishes
+ * multi-queue-num-queues and the ring entries of each queue in queue-%u
+ * directories (or in the frontend path if there is one queue). readQueues()
+ * reads grant references and event channel ports of all queues. If the shared
+ * event loop is set, each queue of the frontend gets own event loop worker,
+ * so queues are processed in parallel:
+ *
+ * @code
+ * // in the frontend handler constructor
+ * setMaxQueues(4);
+ *
+ * // in onBind()
+ * for (auto& queue : readQueues())
+ * {
+ *     addRingBuffer(RingBufferPtr(new MyRingBuffer(getDomId(), queue.port,
+ *                                                  queue.refs)),
+ *                   true, queue.thread);
+ * }
+ * @endcode
+ *
+ * Protocols with several rings per queue (for example separate tx and rx
+ * rings) call readRingRefs() for getQueuePath() and use getQueueThread()
+ * directly.
+ *
+ * On the live restart of the backend (see BackendBase::saveHandoff()) the
+ * connected frontend is detached by detach(): the ring buffers are stopped
+ * and their states are saved while Xen store entries remain untouched. The
+ * handler of the new backend instance gets the saved state by
+ * setHandoffState() before start(). If both backend and frontend are still
+ * connected, start() calls onBind() without changing the backend state and
+ * addRingBuffer() restores the saved indexes of the matching ring buffers.
+ * Output ring buffers publish their producer index in the shared page, so
+ * they should get the saved state from takeHandoffState() in the constructor
+ * instead. Requests published by the frontend while no backend was running
+ * are handled when the restored ring buffer is started. If the handler
+ * can't be resumed (or a ring buffer doesn't match the saved one), it goes
+ * through the usual state machine:
+ *
+ * @code
+ * // in onBind()
+ * RingBufferBase::HandoffState state;
+ *
+ * if (takeHandoffState(port, refs, state))
+ * {
+ *     ringBuffer.reset(new MyOutRingBuffer(getDomId(), port, refs, &state));
+ * }
+ * else
+ * {
+ *     ringBuffer.reset(new MyOutRingBuffer(getDomId(), port, refs));
+ * }
+ *
+ * addRingBuffer(ringBuffer);
+ * @endcode
+ *
  * @ingroup backend
  ******************************************************************************/
 class FrontendHandlerBase
 {
 public:
+
+	/**
+	 * Ring configuration of one queue published by the frontend
+	 */
+	struct QueueInfo
+	{
+		/**
+		 * Queue index
+		 */
+		unsigned int index;
+
+		/**
+		 * Xen store path of the queue entries
+		 */
+		std::string path;
+
+		/**
+		 * Event channel port
+		 */
+		evtchn_port_t port;
+
+		/**
+		 * Grant references of the ring
+		 */
+		std::vector<grant_ref_t> refs;
+
+		/**
+		 * Event loop worker for the queue or -1 (see getQueueThread())
+		 */
+		int thread;
+	};
+
+	/**
+	 * Frontend state passed to the new backend instance on the live restart
+	 */
+	struct HandoffState
+	{
+		/**
+		 * Frontend domain id
+		 */
+		domid_t domId;
+
+		/**
+		 * Frontend device id
+		 */
+		uint16_t devId;
+
+		/**
+		 * States of the ring buffers
+		 */
+		std::vector<RingBufferBase::HandoffState> rings;
+	};
+
 	/**
 	 * @param[in] name                optional frontend name
 	 * @param[in] devName             device name
@@ -126,9 +273,17 @@ public:
 	 * @param[in] feDomId             frontend domain id
 	 * @param[in] beDevId             backend device id
 	 * @param[in] feDevId             frontend device id
+	 * @param[in] xenStore            XenStore connection shared with other
+	 *                                handlers (see BackendBase::getXenStore()).
+	 *                                If <i>nullptr</i> is passed, the handler
+	 *                                opens own connection. The handler
+	 *                                doesn't change the read cache of the
+	 *                                connection: the owner may enable it by
+	 *                                XenStore::setCacheEnabled().
 	 */
 	FrontendHandlerBase(const std::string& name, const std::string& devName,
-						domid_t beDomId, domid_t feDomId, uint16_t devId = 0);
+						domid_t beDomId, domid_t feDomId, uint16_t devId = 0,
+						XenStorePtr xenStore = nullptr);
 
 	virtual ~FrontendHandlerBase();
 
@@ -160,13 +315,52 @@ public:
 	/**
 	 * Returns reference to the xen store instance accociated with the frontend
 	 */
-	XenStore& getXenStore() {  return mXenStore; }
+	XenStore& getXenStore() {  return *mXenStore; }
 
 	/**
 	 * Returns current backend state.
 	 */
 	xenbus_state getBackendState() const { return mBackendState; }
 
+	/**
+	 * Sets the shared event loop. Ring buffers added by addRingBuffer() are
+	 * handled by this event loop instead of dedicated threads.
+	 * @param[in] eventLoop event loop
+	 */
+	void setEventLoop(EventLoopPtr eventLoop) { mEventLoop = eventLoop; }
+
+	/**
+	 * Returns the shared event loop or <i>nullptr</i> if it is not set
+	 */
+	EventLoopPtr getEventLoop() const { return mEventLoop; }
+
+	/**
+	 * Sets thread configuration of the frontend: it is used by the own
+	 * XenStore connection and by the ring buffers which are handled by
+	 * dedicated threads and don't have own configuration. Should be called
+	 * before start().
+	 * @param[in] config thread configuration
+	 */
+	void setThreadConfig(const ThreadConfig& config) { mThreadConfig = config; }
+
+	/**
+	 * Returns thread configuration of the frontend
+	 */
+	const ThreadConfig& getThreadConfig() const { return mThreadConfig; }
+
+	/**
+	 * Enables or disables fast reconnect. If enabled, the ring buffers are
+	 * parked on the frontend restart and may be reused in onBind() by
+	 * takeParkedRingBuffer().
+	 * @param[in] enable <i>true</i> to enable fast reconnect
+	 */
+	void setFastReconnect(bool enable) { mFastReconnect = enable; }
+
+	/**
+	 * Returns snapshot of counters of all ring buffers of the frontend
+	 */
+	std::vector<RingBufferStats> getRingBufferStats();
+
 	/**
 	 * Starts frontend handling
 	 */
@@ -177,6 +371,22 @@ public:
 	 */
 	void stop();
 
+	/**
+	 * Detaches the connected frontend for the live restart. The handler
+	 * stops watching Xen store, stops and releases the ring buffers without
+	 * changing the backend state and without calling onClosing(). After the
+	 * call the handler doesn't handle the frontend anymore.
+	 * @return state of the frontend to be passed to the new backend instance
+	 */
+	HandoffState detach();
+
+	/**
+	 * Sets the state saved by detach() of the previous backend instance.
+	 * Should be called before start().
+	 * @param[in] state frontend state
+	 */
+	void setHandoffState(const HandoffState& state);
+
 protected:
 
 	/**
@@ -196,9 +406,116 @@ protected:
 
 	/**
 	 * Adds new ring buffer to the frontend handler.
-	 * @param[in] ringBuffer the ring buffer instance
+	 * If the shared event loop is set, the ring buffer is handled by it.
+	 * Ring buffers which require a dedicated thread should be added with
+	 * <i>useEventLoop</i> set to <i>false</i>.
+	 * @param[in] ringBuffer   the ring buffer instance
+	 * @param[in] useEventLoop use the shared event loop if it is set
+	 * @param[in] thread       index of the event loop worker which handles
+	 *                         the ring buffer. If -1 is passed, the least
+	 *                         loaded worker is selected.
+	 */
+	void addRingBuffer(RingBufferPtr ringBuffer, bool useEventLoop = true,
+					   int thread = -1);
+
+	/**
+	 * Takes the ring buffer parked on the frontend restart.
+	 * The ring buffer is returned only if its port and grant references are
+	 * the same as passed. The event channel of the returned ring buffer is
+	 * bound again, the ring buffer is reset and should be added with
+	 * addRingBuffer().
+	 * @param[in] port event channel port number
+	 * @param[in] refs grant references of the ring
+	 * @return parked ring buffer or <i>nullptr</i> if there is no matching one
+	 * or its event channel can't be bound
+	 */
+	RingBufferPtr takeParkedRingBuffer(evtchn_port_t port,
+									   const std::vector<grant_ref_t>& refs);
+
+	/**
+	 * Takes the saved state of the ring buffer on the live restart. It is
+	 * used in onBind() to create the output ring buffer with the saved
+	 * producer index (see RingBufferOutBase): the state should be passed to
+	 * the constructor, which doesn't clear the index in the shared page
+	 * then. Ring buffers restored by the constructor are added with
+	 * addRingBuffer() as usual.
+	 * @param[in]  port  event channel port number
+	 * @param[in]  refs  grant references of the ring
+	 * @param[out] state saved ring buffer state
+	 * @return <i>false</i> if the handler is not resuming or there is no
+	 * matching state
+	 */
+	bool takeHandoffState(evtchn_port_t port,
+						  const std::vector<grant_ref_t>& refs,
+						  RingBufferBase::HandoffState& state);
+
+	/**
+	 * Advertises the maximal ring page order supported by the backend
+	 * (max-ring-page-order entry). Should be called before the frontend is
+	 * initialized, for example in the constructor.
+	 * @param[in] order maximal ring page order
+	 */
+	void setMaxRingPageOrder(unsigned int order);
+
+	/**
+	 * Reads grant references of the ring published by the frontend.
+	 * If ring-page-order entry exists (in the ring path or in the frontend
+	 * path), 2^order ring-ref%u entries are read. Otherwise single ring-ref
+	 * entry is read.
+	 * @param[in] path    path where the ring entries are located. If empty,
+	 *                    the frontend path is used.
+	 * @param[in] refName name of the ring reference entry
+	 * @return grant references of the ring
 	 */
-	void addRingBuffer(RingBufferPtr ringBuffer);
+	std::vector<grant_ref_t> readRingRefs(const std::string& path = "",
+										  const std::string& refName =
+										  "ring-ref");
+
+	/**
+	 * Advertises the maximal number of queues supported by the backend
+	 * (multi-queue-max-queues entry). Should be called before the frontend is
+	 * initialized, for example in the constructor.
+	 * @param[in] numQueues maximal number of queues
+	 */
+	void setMaxQueues(unsigned int numQueues);
+
+	/**
+	 * Reads number of queues requested by the frontend
+	 * (multi-queue-num-queues entry). If the entry doesn't exist, one queue
+	 * is used.
+	 * @return number of queues
+	 */
+	unsigned int readNumQueues();
+
+	/**
+	 * Returns path of the queue entries: queue-%u directory in the frontend
+	 * path or the frontend path itself if there is one queue
+	 * @param[in] queue     queue index
+	 * @param[in] numQueues number of queues
+	 */
+	std::string getQueuePath(unsigned int queue,
+							 unsigned int numQueues) const;
+
+	/**
+	 * Returns the event loop worker for the queue. Queues of one frontend are
+	 * assigned to consecutive workers, the first worker is shifted by the
+	 * frontend domain and device ids. If the event loop is not set or there is
+	 * one queue, -1 (the least loaded worker) is returned.
+	 * @param[in] queue     queue index
+	 * @param[in] numQueues number of queues
+	 */
+	int getQueueThread(unsigned int queue, unsigned int numQueues) const;
+
+	/**
+	 * Reads ring configuration of all queues (see readNumQueues(),
+	 * getQueuePath() and readRingRefs())
+	 * @param[in] refName  name of the ring reference entry
+	 * @param[in] portName name of the event channel entry
+	 * @return queues
+	 */
+	std::vector<QueueInfo> readQueues(const std::string& refName = "ring-ref",
+									  const std::string& portName =
+									  "event-channel");
 
 	/**
 	 * Sets backend state.
@@ -206,6 +523,17 @@ protected:
 	 */
 	void setBackendState(xenbus_state state);
 
+	/**
+	 * Sets backend state and publishes additional entries in the same XS
+	 * transaction. It allows to publish backend entries (features, ring
+	 * references etc.) together with the new state atomically.
+	 * @param[in] state   new state to set
+	 * @param[in] publish callback which writes additional entries. It may be
+	 *                    called several times if the transaction is retried.
+	 */
+	void setBackendState(xenbus_state state,
+						 XenStore::TransactionCallback publish);
+
 	/**
 	 * Called when the frontend state changed to XenbusStateUnknown
 	 */
@@ -266,12 +594,26 @@ private:
 	xenbus_state mBackendState;
 	xenbus_state mFrontendState;
 
-	XenStore mXenStore;
+	unsigned int mMaxRingPageOrder;
+	unsigned int mMaxQueues;
+	bool mFastReconnect;
+	bool mDetached;
+	bool mHasHandoffState;
+	bool mResuming;
+
+	XenStorePtr mXenStore;
+	bool mOwnXenStore;
+	XenStore::WatchGroup mWatchGroup;
 
 	std::string mXsBackendPath;
 	std::string mXsFrontendPath;
 
 	std::vector<RingBufferPtr> mRingBuffers;
+	std::vector<RingBufferPtr> mParkedRingBuffers;
+	std::vector<RingBufferBase::HandoffState> mHandoffRings;
+
+	EventLoopPtr mEventLoop;
+	ThreadConfig mThreadConfig;
 
 	XenBackend::AsyncContext mAsyncContext;
 
@@ -279,14 +621,16 @@ private:
 
 	Log mLog;
 
-	void release();
+	bool resume();
+	void release(bool park);
+	void releaseParkedRingBuffers();
 	void initXenStorePathes();
 	void frontendStateChanged();
 	void backendStateChanged();
 	void onFrontendStateChanged(xenbus_state state);
 	void onBackendStateChanged(xenbus_state state);
 	void onError(const std::exception& e);
-	void close(xenbus_state stateAfterClose);
+	void close(xenbus_state stateAfterClose, bool park = false);
 };
 
 typedef std::shared_ptr<FrontendHandlerBase> FrontendHandlerPtr;
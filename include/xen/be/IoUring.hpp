@@ -0,0 +1,301 @@
+/*
+ *  io_uring I/O helper
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef INCLUDE_IOURING_HPP_
+#define INCLUDE_IOURING_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "EventLoop.hpp"
+#include "Log.hpp"
+#include "XenException.hpp"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by IoUring.
+ * @ingroup backend
+ ******************************************************************************/
+class IoUringException : public XenException
+{
+	using XenException::XenException;
+};
+
+/***************************************************************************//**
+ * Asynchronous I/O on top of Linux io_uring.
+ *
+ * Read and write requests are queued into the submission queue by read(),
+ * write(), readv(), writev(), readFixed(), writeFixed() and fsync() and
+ * passed to the kernel at once by submit(). So the ring buffer may queue I/O
+ * for the whole batch of requests in processRequests() and submit it with
+ * one system call.
+ *
+ * Data buffers are used directly: the buffer of a grant mapping
+ * (XenGnttabBuffer::get()) or the iovec array of a scatter-gather list
+ * (XenGnttabSgList::getIoVec()) may be passed as is, without copying. The
+ * buffers (and the iovec array) shall be valid till the request is completed.
+ * Long living buffers (pages of XenGnttabCache, preallocated bounce buffers
+ * etc.) may be registered by registerBuffers() and used by readFixed() and
+ * writeFixed(): it saves pinning of the pages on each request.
+ *
+ * Completions are signaled through the eventfd handled by the shared event
+ * loop. When the eventfd is ready, all available completions are reaped, the
+ * request callbacks are called with the request result (number of bytes
+ * transferred or negative errno) and then the batch callback is called. The
+ * request callbacks usually store responses and the batch callback sends
+ * them with one RingBufferInBase::sendResponses() call.
+ *
+ * The callbacks are called in the event loop worker selected by the thread
+ * argument of the constructor. If it is the same worker as the one set for
+ * the ring buffer by RingBufferBase::setEventLoop(), responses are sent in
+ * the same thread as requests are processed and no locking is required.
+ * Otherwise the ring buffer shall use the thread pool mode where
+ * sendResponses() may be called from any thread.
+ *
+ * @code{.cpp}
+ * IoUring ioUring(eventLoop, 256, [this] { flushResponses(); }, errorCbk,
+ *                 thread);
+ *
+ * void MyRingBuffer::processRequests(const Req* reqs, size_t count)
+ * {
+ *     for (size_t i = 0; i < count; i++)
+ *     {
+ *         auto id = reqs[i].id;
+ *
+ *         mIoUring.readv(fd, sgList.getIoVec(), sgList.getIoVecCount(), offset,
+ *                        [this, id] (int result) { storeResponse(id, result); });
+ *     }
+ *
+ *     mIoUring.submit();
+ * }
+ * @endcode
+ *
+ * The number of requests in flight is limited by the completion queue size
+ * (twice the submission queue size): the submission beyond the limit throws
+ * the exception. All requests should be completed before the object is
+ * destroyed.
+ *
+ * IoUring is compiled in only if the WITH_IO_URING CMake option is set. It
+ * uses io_uring system calls directly and doesn't require liburing.
+ * @ingroup backend
+ ******************************************************************************/
+class IoUring
+{
+public:
+
+	/**
+	 * Callback which is called when the request is completed. The argument is
+	 * the request result: number of bytes transferred or negative errno.
+	 */
+	typedef std::function<void(int result)> Callback;
+
+	/**
+	 * Callback which is called after the batch of completions is handled
+	 */
+	typedef std::function<void()> BatchCallback;
+
+	/**
+	 * Default submission queue size
+	 */
+	static const unsigned cDefaultEntries = 256;
+
+	/**
+	 * @param[in] eventLoop     event loop which handles completions
+	 * @param[in] entries       submission queue size, rounded up to the power
+	 *                          of 2 by the kernel
+	 * @param[in] batchCallback callback which is called after the batch of
+	 *                          completions is handled
+	 * @param[in] errorCallback callback which is called when an error occurs
+	 * @param[in] thread        index of the event loop worker which handles
+	 *                          completions. If -1 is passed, the least loaded
+	 *                          worker is selected.
+	 */
+	explicit IoUring(EventLoopPtr eventLoop,
+					 unsigned entries = cDefaultEntries,
+					 BatchCallback batchCallback = nullptr,
+					 ErrorCallback errorCallback = nullptr, int thread = -1);
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(IoUring const&) = delete;
+	~IoUring();
+
+	/**
+	 * Returns <i>true</i> if io_uring is supported by the running kernel
+	 */
+	static bool isSupported();
+
+	/**
+	 * Queues read request
+	 * @param[in] fd       file descriptor
+	 * @param[in] buf      data buffer
+	 * @param[in] len      data length
+	 * @param[in] offset   file offset
+	 * @param[in] callback completion callback
+	 */
+	void read(int fd, void* buf, size_t len, off_t offset, Callback callback);
+
+	/**
+	 * Queues write request
+	 * @param[in] fd       file descriptor
+	 * @param[in] buf      data buffer
+	 * @param[in] len      data length
+	 * @param[in] offset   file offset
+	 * @param[in] callback completion callback
+	 */
+	void write(int fd, const void* buf, size_t len, off_t offset,
+			   Callback callback);
+
+	/**
+	 * Queues vectored read request
+	 * @param[in] fd       file descriptor
+	 * @param[in] iov      iovec array
+	 * @param[in] count    number of iovec entries
+	 * @param[in] offset   file offset
+	 * @param[in] callback completion callback
+	 */
+	void readv(int fd, const iovec* iov, size_t count, off_t offset,
+			   Callback callback);
+
+	/**
+	 * Queues vectored write request
+	 * @param[in] fd       file descriptor
+	 * @param[in] iov      iovec array
+	 * @param[in] count    number of iovec entries
+	 * @param[in] offset   file offset
+	 * @param[in] callback completion callback
+	 */
+	void writev(int fd, const iovec* iov, size_t count, off_t offset,
+				Callback callback);
+
+	/**
+	 * Queues read request into the registered buffer
+	 * @param[in] fd       file descriptor
+	 * @param[in] buf      data buffer inside the registered buffer
+	 * @param[in] len      data length
+	 * @param[in] offset   file offset
+	 * @param[in] index    index of the registered buffer
+	 * @param[in] callback completion callback
+	 */
+	void readFixed(int fd, void* buf, size_t len, off_t offset,
+				   unsigned index, Callback callback);
+
+	/**
+	 * Queues write request from the registered buffer
+	 * @param[in] fd       file descriptor
+	 * @param[in] buf      data buffer inside the registered buffer
+	 * @param[in] len      data length
+	 * @param[in] offset   file offset
+	 * @param[in] index    index of the registered buffer
+	 * @param[in] callback completion callback
+	 */
+	void writeFixed(int fd, const void* buf, size_t len, off_t offset,
+					unsigned index, Callback callback);
+
+	/**
+	 * Queues fsync request
+	 * @param[in] fd       file descriptor
+	 * @param[in] callback completion callback
+	 */
+	void fsync(int fd, Callback callback);
+
+	/**
+	 * Passes all queued requests to the kernel
+	 */
+	void submit();
+
+	/**
+	 * Registers buffers for readFixed() and writeFixed(). Previously
+	 * registered buffers are unregistered.
+	 * @param[in] buffers buffers to register
+	 */
+	void registerBuffers(const std::vector<iovec>& buffers);
+
+	/**
+	 * Unregisters buffers
+	 */
+	void unregisterBuffers();
+
+	/**
+	 * Returns number of requests which are queued or in flight
+	 */
+	size_t getNumPending() const;
+
+private:
+
+	static const unsigned cMaxBatchSize = 64;
+
+	EventLoopPtr mEventLoop;
+	BatchCallback mBatchCallback;
+
+	int mFd;
+	int mEventFd;
+
+	void* mSqRing;
+	size_t mSqRingSize;
+	void* mCqRing;
+	size_t mCqRingSize;
+	io_uring_sqe* mSqes;
+	size_t mSqesSize;
+
+	unsigned* mSqHead;
+	unsigned* mSqTail;
+	unsigned* mSqArray;
+	unsigned mSqMask;
+	unsigned mSqEntries;
+
+	unsigned* mCqHead;
+	unsigned* mCqTail;
+	io_uring_cqe* mCqes;
+	unsigned mCqMask;
+	unsigned mCqEntries;
+
+	unsigned mNumQueued;
+	bool mBuffersRegistered;
+
+	uint64_t mNextId;
+	std::unordered_map<uint64_t, Callback> mCallbacks;
+	std::vector<std::pair<Callback, int>> mCompleted;
+	mutable std::mutex mMutex;
+
+	Log mLog;
+
+	void init(unsigned entries);
+	void release();
+
+	io_uring_sqe* getSqe(Callback&& callback);
+	void queueRw(uint8_t opcode, int fd, const void* addr, size_t len,
+				 off_t offset, Callback&& callback, unsigned index = 0);
+	void enter(unsigned toSubmit);
+	void handleCompletions();
+};
+
+}
+
+#endif /* INCLUDE_IOURING_HPP_ */
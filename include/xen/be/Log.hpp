@@ -21,9 +21,13 @@
 #ifndef SRC_XEN_LOG_HPP_
 #define SRC_XEN_LOG_HPP_
 
+#include <atomic>
+#include <cstdint>
 #include <cstring>
+#include <memory>
 #include <mutex>
 #include <sstream>
+#include <string>
 #include <vector>
 
 /***************************************************************************//**
@@ -33,6 +37,17 @@
  * DLOG is compiled to void in release build (NDEBUG is defined) and can be used
  * in time critical path. These macros returns a string stream object thus basic
  * c++ iostream operators can be used.
+ *
+ * The log level is checked before the log line is created: if the level is
+ * filtered out, neither the stream is created nor the operands of <<
+ * operators are evaluated. Log sites with level lower than LOG_MIN_LEVEL
+ * (defined at compile time, for example -DLOG_MIN_LEVEL=WARNING) are compiled
+ * to void.
+ *
+ * By default log lines are written to the standard output synchronously. The
+ * asynchronous sink (see XenBackend::LogSink) may be installed with
+ * XenBackend::Log::setSink() to move formatting output off the logging
+ * threads.
  * The macros take two parameters: first one could be
  * either instance of XenBackend::Log or string, second one is
  * XenBackend::LogLevel (for macro use DISABLE, ERROR, WARNING, INFO, DEBUG).
@@ -75,6 +90,29 @@
 #define __FILENAME__ (strrchr(__FILE__, '/') ? \
 					  strrchr(__FILE__, '/') + 1 : __FILE__)
 
+/**
+ * @def LOG_MIN_LEVEL
+ * Minimal log level compiled in. Log sites with lower level (more verbose)
+ * are compiled to void. DEBUG by default.
+ * @ingroup log
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL DEBUG
+#endif
+
+/// @cond HIDDEN_SYMBOLS
+#define LOG_CONCAT(a, b) LOG_CONCAT_(a, b)
+#define LOG_CONCAT_(a, b) a ## b
+
+#define LOG_COMPILED(level) \
+	(XenBackend::LogLevel::log ## level <= \
+	 XenBackend::LogLevel::LOG_CONCAT(log, LOG_MIN_LEVEL))
+
+#define LOG_LINE(instance, level) \
+	XenBackend::LogLine().get(instance, __FILENAME__, __LINE__, \
+							  XenBackend::LogLevel::log ## level)
+/// @endcond
+
 /**
  * @def LOG(instance, level)
  * Displays log with defined level.
@@ -84,8 +122,9 @@
  * @ingroup log
  */
 #define LOG(instance, level) \
-	XenBackend::LogLine().get(instance, __FILENAME__, __LINE__, \
-							  XenBackend::LogLevel::log ## level)
+	(!LOG_COMPILED(level) || !XenBackend::LogLine::isEnabled(instance, \
+								XenBackend::LogLevel::log ## level)) ? \
+	(void) 0 : XenBackend::LogVoid() & LOG_LINE(instance, level)
 
 /**
  * @def DLOG(instance, level)
@@ -103,7 +142,7 @@
 #else
 
 #define DLOG(instance, level) \
-	true ? (void) 0 : XenBackend::LogVoid() & LOG(instance, level)
+	true ? (void) 0 : XenBackend::LogVoid() & LOG_LINE(instance, level)
 
 #endif
 
@@ -118,6 +157,8 @@ enum class LogLevel
 	logDISABLE, logERROR, logWARNING, logINFO, logDEBUG
 };
 
+class LogSink;
+
 /// @cond HIDDEN_SYMBOLS
 class LogVoid
 {
@@ -129,25 +170,90 @@ public:
 /// @endcond
 
 
+/// @cond HIDDEN_SYMBOLS
+struct LogCategory
+{
+	static const int8_t cNotSet = -1;
+
+	std::string name;
+	std::atomic<int> maskLevel;
+};
+/// @endcond
+
 /***************************************************************************//**
  * Log instance.
+ *
+ * Log instances with the same module name share one interned category, which
+ * is created on the first use of the name and lives till the program exit.
+ * The instance holds the pointer to the category only, so it is cheap to
+ * create and to copy. The log level set by setLogLevel() and the log mask set
+ * by setLogMask() are applied to all existing instances: the mask level is
+ * stored in the category, the current level is checked on each log site.
+ *
+ * Objects created on the data path may copy the prepared instance instead of
+ * constructing a new one from the name, it avoids the category lookup:
+ * @code{.cpp}
+ * static const Log& getBufferLog()
+ * {
+ *     static Log log("MyBuffer");
+ *
+ *     return log;
+ * }
+ *
+ * MyBuffer::MyBuffer() : mLog(getBufferLog()) {}
+ * @endcode
  * @ingroup log
  ******************************************************************************/
 class Log
 {
 public:
 
+	/**
+	 * @param[in] name module name which will be displayed in the log
+	 */
+	Log(const std::string& name) :
+		mCategory(getCategory(name)), mLevel(LogCategory::cNotSet),
+		mFileAndLine(LogCategory::cNotSet) {}
+
+	/**
+	 * @param[in] name        module name which will be displayed in the log
+	 * @param[in] level       log level for this module
+	 */
+	Log(const std::string& name, LogLevel level) :
+		mCategory(getCategory(name)), mLevel(static_cast<int8_t>(level)),
+		mFileAndLine(LogCategory::cNotSet) {}
+
 	/**
 	 * @param[in] name        module name which will be displayed in the log
 	 * @param[in] level       log level for this module
 	 * @param[in] fileAndLine displays source file name and line number instead
 	 *                        of module name
 	 */
-	Log(const std::string& name, LogLevel level = sCurrentLevel,
-		bool fileAndLine = sShowFileAndLine) :
-		mName(name),  mLevel(level), mFileAndLine(fileAndLine)
+	Log(const std::string& name, LogLevel level, bool fileAndLine) :
+		mCategory(getCategory(name)), mLevel(static_cast<int8_t>(level)),
+		mFileAndLine(fileAndLine) {}
+
+	/**
+	 * Returns module name
+	 */
+	const std::string& getName() const { return mCategory->name; }
+
+	/**
+	 * Returns effective log level of the instance: the level of the matched
+	 * log mask item, the level passed to the constructor or the current log
+	 * level.
+	 */
+	LogLevel getLevel() const
 	{
-		setLogLevelByMask();
+		auto maskLevel = mCategory->maskLevel.load(std::memory_order_relaxed);
+
+		if (maskLevel != LogCategory::cNotSet)
+		{
+			return static_cast<LogLevel>(maskLevel);
+		}
+
+		return mLevel != LogCategory::cNotSet ?
+			   static_cast<LogLevel>(mLevel) : sCurrentLevel;
 	}
 
 	/**
@@ -188,7 +294,7 @@ public:
 	static bool getShowFileAndLine() { return sShowFileAndLine; }
 
 	/**
-	 * Sets log mask
+	 * Sets log mask. The mask is applied to all existing and new instances.
 	 * @param[in] mask log mask
 	 * @return <i>true</i> if log mask is set successfully
 	 */
@@ -198,7 +304,15 @@ public:
 	 * Gets current log mask
 	 * @return current log mask
 	 */
-	static std::string getLogMask() { return sLogMask; }
+	static std::string getLogMask();
+
+	/**
+	 * Sets the asynchronous log sink. If <i>nullptr</i> is passed, log lines
+	 * are written to the standard output synchronously. When this method
+	 * returns, the previous sink is not used by the logging threads anymore.
+	 * @param[in] sink log sink
+	 */
+	static void setSink(std::shared_ptr<LogSink> sink);
 
 private:
 
@@ -206,15 +320,22 @@ private:
 
 	static LogLevel sCurrentLevel;
 	static bool sShowFileAndLine;
-	static std::string sLogMask;
-	static std::vector<std::pair<std::string, LogLevel>> sLogMaskItems;
+	static std::atomic<LogSink*> sSink;
+	static std::atomic<int> sSinkUsers;
+	static std::shared_ptr<LogSink> sSinkHolder;
+	static std::mutex sSinkMutex;
 
-	std::string mName;
-	LogLevel mLevel;
-	bool mFileAndLine;
+	const LogCategory* mCategory;
+	int8_t mLevel;
+	int8_t mFileAndLine;
+
+	bool getFileAndLine() const
+	{
+		return mFileAndLine != LogCategory::cNotSet ? mFileAndLine :
+													  sShowFileAndLine;
+	}
 
-	void setLogLevelByMask();
-	static void splitMask(std::vector<std::string>& splitVector, char delim);
+	static const LogCategory* getCategory(const std::string& name);
 	static bool getLogLevelByString(const std::string& strLevel,
 									LogLevel& level);
 };
@@ -226,6 +347,19 @@ public:
 
 	virtual ~LogLine();
 
+	static bool isEnabled(const Log& log, LogLevel level)
+	{
+		auto logLevel = log.getLevel();
+
+		return level <= logLevel && logLevel > LogLevel::logDISABLE;
+	}
+
+	static bool isEnabled(const char* /* name */, LogLevel level)
+	{
+		return level <= Log::sCurrentLevel &&
+			   Log::sCurrentLevel > LogLevel::logDISABLE;
+	}
+
 	std::ostringstream& get(const Log& log, const char* file, int line,
 							LogLevel level = LogLevel::logDEBUG);
 	std::ostringstream& get(const char* name, const char* file, int line,
@@ -233,7 +367,7 @@ public:
 
 private:
 
-	static size_t sAlignmentLength;
+	static std::atomic<size_t> sAlignmentLength;
 
 	std::ostringstream mStream;
 	LogLevel mCurrentLevel;
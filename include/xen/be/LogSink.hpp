@@ -0,0 +1,263 @@
+/*
+ *  Asynchronous log sink
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef INCLUDE_LOGSINK_HPP_
+#define INCLUDE_LOGSINK_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.hpp"
+#include "XenException.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by LogSink and log outputs.
+ * @ingroup log
+ ******************************************************************************/
+class LogSinkException : public XenException
+{
+	using XenException::XenException;
+};
+
+/***************************************************************************//**
+ * Formatted log line passed to the log output.
+ * @ingroup log
+ ******************************************************************************/
+struct LogRecord
+{
+	/**
+	 * Level of the log line
+	 */
+	LogLevel level;
+
+	/**
+	 * Formatted log line without trailing new line
+	 */
+	std::string text;
+};
+
+/***************************************************************************//**
+ * Interface of the log output.
+ *
+ * The output is called from the writer thread of LogSink only, thus it
+ * doesn't need to be thread safe.
+ * @ingroup log
+ ******************************************************************************/
+class LogOutput
+{
+public:
+
+	virtual ~LogOutput() {}
+
+	/**
+	 * Writes batch of log records
+	 * @param[in] records log records
+	 */
+	virtual void write(const std::vector<LogRecord>& records) = 0;
+};
+
+typedef std::unique_ptr<LogOutput> LogOutputPtr;
+
+/***************************************************************************//**
+ * Writes log records to the file descriptor.
+ *
+ * Each batch of records is written with one write() call.
+ * @ingroup log
+ ******************************************************************************/
+class LogFdOutput : public LogOutput
+{
+public:
+
+	/**
+	 * @param[in] fd file descriptor (standard output by default)
+	 */
+	explicit LogFdOutput(int fd = 1) : mFd(fd) {}
+
+	void write(const std::vector<LogRecord>& records) override;
+
+protected:
+
+	/**
+	 * File descriptor
+	 */
+	int mFd;
+
+private:
+
+	std::string mBuffer;
+};
+
+/***************************************************************************//**
+ * Appends log records to the file.
+ * @ingroup log
+ ******************************************************************************/
+class LogFileOutput : public LogFdOutput
+{
+public:
+
+	/**
+	 * @param[in] path file path
+	 */
+	explicit LogFileOutput(const std::string& path);
+	~LogFileOutput();
+};
+
+/***************************************************************************//**
+ * Sends log records to the system logger.
+ * @ingroup log
+ ******************************************************************************/
+class LogSyslogOutput : public LogOutput
+{
+public:
+
+	/**
+	 * @param[in] ident identifier prepended to every message
+	 */
+	explicit LogSyslogOutput(const std::string& ident);
+	~LogSyslogOutput();
+
+	void write(const std::vector<LogRecord>& records) override;
+
+private:
+
+	std::string mIdent;
+};
+
+/***************************************************************************//**
+ * Asynchronous log sink.
+ *
+ * By default each log line is written to the standard output synchronously
+ * under the global lock. When the sink is installed by Log::setSink(), log
+ * lines are pushed to the bounded lock-free queue instead and written to the
+ * output in batches by the background writer thread.
+ *
+ * If the queue is full, the log line is dropped (OverflowPolicy::DROP, see
+ * getNumDropped()) or the logging thread waits till the writer frees a slot
+ * (OverflowPolicy::BLOCK).
+ *
+ * @code
+ * Log::setSink(LogSinkPtr(new LogSink(LogOutputPtr(
+ *         new LogFileOutput("/var/log/backend.log")))));
+ *
+ * ...
+ *
+ * Log::setSink(nullptr);
+ * @endcode
+ * @ingroup log
+ ******************************************************************************/
+class LogSink
+{
+public:
+
+	/**
+	 * Defines what to do when the queue is full
+	 */
+	enum class OverflowPolicy
+	{
+		DROP,  ///< drop the log line
+		BLOCK  ///< wait for the free slot
+	};
+
+	/**
+	 * Default queue capacity
+	 */
+	static const size_t cDefaultCapacity = 4096;
+
+	/**
+	 * Max number of records written to the output at once
+	 */
+	static const size_t cMaxBatchSize = 256;
+
+	/**
+	 * @param[in] output   log output
+	 * @param[in] capacity queue capacity, rounded up to the power of 2
+	 * @param[in] policy   overflow policy
+	 */
+	explicit LogSink(LogOutputPtr output, size_t capacity = cDefaultCapacity,
+					 OverflowPolicy policy = OverflowPolicy::DROP);
+	LogSink(const LogSink&) = delete;
+	LogSink& operator=(LogSink const&) = delete;
+
+	/**
+	 * Writes all queued records and stops the writer thread
+	 */
+	~LogSink();
+
+	/**
+	 * Queues the log record. May be called from any thread.
+	 * @param[in] level log level
+	 * @param[in] text  formatted log line
+	 * @return <i>false</i> if the record is dropped
+	 */
+	bool push(LogLevel level, std::string&& text);
+
+	/**
+	 * Waits till all records queued before the call are written
+	 */
+	void flush();
+
+	/**
+	 * Returns number of dropped records
+	 */
+	uint64_t getNumDropped() const { return mNumDropped; }
+
+private:
+
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		LogRecord record;
+	};
+
+	LogOutputPtr mOutput;
+	OverflowPolicy mPolicy;
+	size_t mMask;
+	std::unique_ptr<Cell[]> mCells;
+
+	std::atomic<size_t> mEnqueuePos;
+	size_t mDequeuePos;
+	std::atomic<size_t> mNumWritten;
+	std::atomic<uint64_t> mNumDropped;
+
+	std::atomic_bool mTerminate;
+	std::atomic_bool mWriterWaiting;
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::condition_variable mFlushCondVar;
+	std::thread mThread;
+
+	bool pop(LogRecord& record);
+	void wakeupWriter();
+	void writerThread();
+};
+
+typedef std::shared_ptr<LogSink> LogSinkPtr;
+
+}
+
+#endif /* INCLUDE_LOGSINK_HPP_ */
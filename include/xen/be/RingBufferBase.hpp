@@ -21,17 +21,29 @@
 #ifndef INCLUDE_RINGBUFFERBASE_HPP_
 #define INCLUDE_RINGBUFFERBASE_HPP_
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 extern "C" {
 #include <xenctrl.h>
 #include <xen/io/ring.h>
 }
 
+#include "EventLoop.hpp"
+#include "RingCapture.hpp"
+#include "Utils.hpp"
 #include "XenEvtchn.hpp"
 #include "XenException.hpp"
 #include "XenGnttab.hpp"
 #include "Log.hpp"
+#include "Trace.hpp"
 
 namespace XenBackend {
 
@@ -44,31 +56,142 @@ class RingBufferException : public XenException
 	using XenException::XenException;
 };
 
+/***************************************************************************//**
+ * Snapshot of ring buffer counters.
+ * @ingroup backend
+ ******************************************************************************/
+struct RingBufferStats
+{
+	/**
+	 * Number of batch histogram buckets. The bucket <i>i</i> counts the
+	 * indications which consumed from 2^i to 2^(i+1) - 1 requests, the last
+	 * bucket counts all bigger batches.
+	 */
+	static const size_t cNumBatchBuckets = 16;
+
+	domid_t domId;
+	evtchn_port_t port;
+	uint64_t numRequests;
+	uint64_t numResponses;
+	uint64_t numEvents;
+	uint64_t numNotificationsSent;
+	uint64_t numNotificationsReceived;
+	uint64_t numSpuriousWakeups;
+	uint64_t numOverflows;
+	uint64_t batchHistogram[cNumBatchBuckets];
+};
+
 /***************************************************************************//**
  * Interface to implement custom ring buffer.
+ *
+ * The ring buffer keeps counters of consumed requests, pushed responses,
+ * sent events, notifications, spurious wakeups (indications without new
+ * requests), overflows and the histogram of requests consumed per
+ * indication. The counters are updated with relaxed atomic operations and
+ * may be read at any time with getStats().
+ *
+ * The traffic of the ring buffer (requests, responses, events and
+ * notifications) may be recorded for offline analysis and replay by
+ * setCapture(). When the capture is not set, the only overhead is the
+ * pointer check.
+ *
+ * A remote port may be bound only once. If the frontend uses one port for
+ * several rings (for example in and out rings of one queue), the first ring
+ * buffer creates the event channel and other ones are created with the
+ * channel returned by its getEventChannel(). The event channel notifies all
+ * ring buffers which share it. It is started, stopped and rebound by the ring
+ * buffer which created it, the sharing ring buffers should be deleted when
+ * the channel is stopped.
  * @ingroup backend
  ******************************************************************************/
 class RingBufferBase
 {
 public:
 
+	/**
+	 * Ring buffer state passed to the new backend instance on the live
+	 * restart (see BackendBase::saveHandoff())
+	 */
+	struct HandoffState
+	{
+		/**
+		 * Event channel port
+		 */
+		evtchn_port_t port;
+
+		/**
+		 * Grant references of the ring
+		 */
+		std::vector<grant_ref_t> refs;
+
+		/**
+		 * Private ring indexes which are not kept in the shared page
+		 */
+		std::vector<uint32_t> indexes;
+	};
+
 	/**
 	 * @param domId frontend domain id
 	 * @param port  event channel port number
 	 * @param ref   grant table reference
 	 */
 	RingBufferBase(domid_t domId, evtchn_port_t port, grant_ref_t ref);
+
+	/**
+	 * @param domId frontend domain id
+	 * @param port  event channel port number
+	 * @param refs  grant table references of multi-page ring
+	 */
+	RingBufferBase(domid_t domId, evtchn_port_t port,
+				   const std::vector<grant_ref_t>& refs);
+
+	/**
+	 * @param eventChannel event channel of other ring buffer to share
+	 * @param refs         grant table references of the ring
+	 */
+	RingBufferBase(XenEvtchnPtr eventChannel,
+				   const std::vector<grant_ref_t>& refs);
 	virtual ~RingBufferBase();
 
 	/**
-	 * Starts ring buffer handling.
+	 * Starts ring buffer handling. If the ring buffer is restored by
+	 * restoreState(), requests published while no backend was running are
+	 * drained before the event channel is started.
 	 */
 	void start();
 
 	/**
 	 * Stops ring buffer handling.
 	 */
-	void stop();
+	virtual void stop();
+
+	/**
+	 * Returns <i>true</i> if the ring buffer is started
+	 */
+	bool isStarted() const { return mEventChannel.isStarted(); }
+
+	/**
+	 * Resets the ring indexes to the initial state. It is used to reuse the
+	 * ring buffer (its grant mapping and event channel) when the frontend
+	 * reconnects with the same ring (see
+	 * FrontendHandlerBase::setFastReconnect()). Should be called when the
+	 * ring buffer is stopped.
+	 */
+	virtual void reset() {}
+
+	/**
+	 * Binds the event channel again, the grant mapping is kept. It is used to
+	 * reuse the parked ring buffer: the same port number doesn't mean the
+	 * frontend kept the channel. Should be called when the ring buffer is
+	 * stopped.
+	 */
+	void rebind();
+
+	/**
+	 * Returns the event channel of the ring buffer. It may be passed to other
+	 * ring buffer which uses the same port.
+	 */
+	XenEvtchnPtr getEventChannel() const { return mEventChannelPtr; }
 
 	/**
 	 * Returns event channel port.
@@ -76,9 +199,14 @@ public:
 	evtchn_port_t getPort() const { return mPort; }
 
 	/**
-	 * Returns grant table reference.
+	 * Returns grant table reference (first one for multi-page ring).
+	 */
+	grant_ref_t getRef() const { return mRefs.front(); }
+
+	/**
+	 * Returns all grant table references of the ring.
 	 */
-	grant_ref_t getRef() const { return mRef; }
+	const std::vector<grant_ref_t>& getRefs() const { return mRefs; }
 
 	/**
 	 * Sets error callback
@@ -86,8 +214,84 @@ public:
 	 */
 	void setErrorCallback(ErrorCallback errorCallback);
 
+	/**
+	 * Sets the shared event loop to handle the ring buffer notifications.
+	 * Should be called before start().
+	 * @param[in] eventLoop event loop
+	 * @param[in] thread    index of the event loop thread, -1 means any
+	 */
+	void setEventLoop(EventLoopPtr eventLoop, int thread = -1);
+
+	/**
+	 * Returns the shared event loop or <i>nullptr</i> if it is not set
+	 */
+	EventLoopPtr getEventLoop() const { return mEventChannel.getEventLoop(); }
+
+	/**
+	 * Sets configuration of the thread which handles the ring buffer
+	 * notifications if the event loop is not set. Should be called before
+	 * start().
+	 * @param[in] config thread configuration
+	 */
+	void setThreadConfig(const ThreadConfig& config)
+	{
+		mEventChannel.setThreadConfig(config);
+	}
+
+	/**
+	 * Returns configuration of the ring buffer thread
+	 */
+	const ThreadConfig& getThreadConfig() const
+	{
+		return mEventChannel.getThreadConfig();
+	}
+
+	/**
+	 * Sets the capture which records the ring buffer traffic.
+	 * Should be called before start().
+	 * @param[in] capture capture or <i>nullptr</i> to disable capturing
+	 */
+	void setCapture(RingCapturePtr capture) { mCapture = capture; }
+
+	/**
+	 * Returns snapshot of the ring buffer counters
+	 */
+	RingBufferStats getStats() const;
+
+	/**
+	 * Returns the ring buffer state for the live restart. Should be called
+	 * when the ring buffer is stopped.
+	 */
+	HandoffState saveState();
+
+	/**
+	 * Restores the state saved by saveState() of the previous backend
+	 * instance. The port and grant references shall be the same as the ones
+	 * of the ring buffer. Should be called before start().
+	 * @param[in] state ring buffer state
+	 */
+	void restoreState(const HandoffState& state);
+
+	/**
+	 * Returns <i>true</i> if the ring buffer state is restored by
+	 * restoreState()
+	 */
+	bool isRestored() const { return mRestored; }
+
 protected:
 
+	struct Counters
+	{
+		std::atomic<uint64_t> numRequests;
+		std::atomic<uint64_t> numResponses;
+		std::atomic<uint64_t> numEvents;
+		std::atomic<uint64_t> numNotificationsSent;
+		std::atomic<uint64_t> numNotificationsReceived;
+		std::atomic<uint64_t> numSpuriousWakeups;
+		std::atomic<uint64_t> numOverflows;
+		std::atomic<uint64_t> batchHistogram[RingBufferStats::cNumBatchBuckets];
+	};
+
 	/**
 	 * Is called when the notification from associated event channel is
 	 * received.
@@ -95,10 +299,84 @@ protected:
 	 */
 	virtual void onReceiveIndication() = 0;
 
+	/**
+	 * Returns private ring indexes (consumer index, private producer index
+	 * etc.) which are not kept in the shared page and should be passed to
+	 * the new backend instance on the live restart. The default
+	 * implementation returns no indexes.
+	 */
+	virtual std::vector<uint32_t> saveIndexes();
+
+	/**
+	 * Restores private ring indexes returned by saveIndexes()
+	 * @param indexes ring indexes
+	 */
+	virtual void restoreIndexes(const std::vector<uint32_t>& indexes);
+
+	/**
+	 * Reports the error which occurs outside of the event channel thread.
+	 * Calls the error callback if it is set, otherwise logs the error.
+	 * @param e exception
+	 */
+	void onError(const std::exception& e);
+
+	/**
+	 * Notifies the frontend through the event channel
+	 */
+	void notify()
+	{
+		updateCounter(mCounters.numNotificationsSent);
+
+		mEventChannel.notify();
+	}
+
+	/**
+	 * Increments the counter
+	 * @param counter counter
+	 * @param value   value to add
+	 */
+	static void updateCounter(std::atomic<uint64_t>& counter,
+							  uint64_t value = 1)
+	{
+		counter.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Updates batch histogram after the indication is handled
+	 * @param numRequests number of requests consumed during the indication
+	 */
+	void countBatch(size_t numRequests);
+
+	/**
+	 * Writes the record to the capture if it is set
+	 * @param type     record type
+	 * @param items    array of items
+	 * @param itemSize size of one item
+	 * @param count    number of items
+	 */
+	void capture(RingCaptureRecord::Type type, const void* items,
+				 size_t itemSize, size_t count)
+	{
+		if (mCapture)
+		{
+			mCapture->write(type, mDomId, mPort, items, itemSize, count);
+		}
+	}
+
+	/**
+	 * Ring buffer counters.
+	 */
+	Counters mCounters;
+
+	/**
+	 * Event channel, it may be shared with other ring buffers.
+	 */
+	XenEvtchnPtr mEventChannelPtr;
+
 	/**
 	 * Event channel.
 	 */
-	XenEvtchn mEventChannel;
+	XenEvtchn& mEventChannel;
 
 	/**
 	 * Grant table buffer.
@@ -109,37 +387,55 @@ protected:
 
 private:
 
+	domid_t mDomId;
 	evtchn_port_t mPort;
-	grant_ref_t mRef;
+	std::vector<grant_ref_t> mRefs;
+	ErrorCallback mErrorCallback;
+	RingCapturePtr mCapture;
+	bool mRestored;
+	bool mDrainOnStart;
+	// the event channel is created by other ring buffer
+	bool mSharedEventChannel;
+	size_t mCallbackId;
 
 	void onIndication();
 };
 
 /***************************************************************************//**
- * Base class to create the custom input ring buffer (for handling requests
- * from the frontend).
- * RingBufferInBase is a template with arguments taken from PV driver protocol.
- * The arguments of the template are structures defined with Xen
- * DEFINE_RING_TYPES() macro from ring.h. Also the in ring buffer takes a remote
- * event channel number and a grant reference on which the ring buffer is
- * mapped. Xen event channel is used to notify the backend that a new request is
- * available in the ring buffer. When a new request is received,
- * processRequest() method is called. To send the response, the client should
- * call sendResponse() method.
+ * Base class to create the input ring buffer with statically dispatched
+ * request handler.
  *
- * In order to create the in ring buffer the client should implement a class
- * inherited from RingBufferInBase and override processRequest() method.
+ * StaticRingBufferInBase is a CRTP template: the first argument is the
+ * derived class (handler) which implements processRequest() and optionally
+ * processRequests() as non virtual methods. The drain loop calls them
+ * directly, so the compiler may inline the protocol handler into the loop.
+ * The rest of arguments and the behavior (deferred responses, thread pool,
+ * busy polling) are the same as for RingBufferInBase, which is implemented on
+ * top of this class for protocols handled through virtual methods.
  *
- * @snippet ExampleBackend.hpp ExampleInRingBuffer
+ * The handler methods are called from the base class, thus they should be
+ * public or the base class should be declared as a friend:
  *
- * processRequest():
+ * @code
+ * class MyRingBuffer : public StaticRingBufferInBase<MyRingBuffer,
+ *                                        my_back_ring, my_sring, MyReq, MyRsp>
+ * {
+ *     ...
  *
- * @snippet ExampleBackend.cpp processRequest
+ * private:
+ *
+ *     friend class StaticRingBufferInBase<MyRingBuffer,
+ *                                         my_back_ring, my_sring, MyReq, MyRsp>;
+ *
+ *     void processRequest(const MyReq& req) { ... sendResponse(rsp); }
+ * };
+ * @endcode
  *
  * @ingroup backend
  ******************************************************************************/
-template<typename Ring, typename Page, typename Req, typename Rsp>
-class RingBufferInBase : public RingBufferBase
+template<typename Handler, typename Ring, typename Page, typename Req,
+		 typename Rsp>
+class StaticRingBufferInBase : public RingBufferBase
 {
 public:
 
@@ -149,22 +445,130 @@ public:
 	 * @param[in] ref      ring buffer ref number
 	 * @param[in] size ring buffer size
 	 */
-	RingBufferInBase(domid_t domId, evtchn_port_t port,
-					 grant_ref_t ref, int size = XC_PAGE_SIZE) :
-		RingBufferBase(domId, port, ref)
+	StaticRingBufferInBase(domid_t domId, evtchn_port_t port,
+						   grant_ref_t ref, int size = XC_PAGE_SIZE) :
+		RingBufferBase(domId, port, ref),
+		mDeferResponses(false),
+		mProcessing(false),
+		mPollTime(0),
+		mPollIterations(0),
+		mNumPendingRequests(0)
 	{
 		BACK_RING_INIT(&mRing, static_cast<Page*>(mBuffer.get()), size);
+
+		mRequests.resize(RING_SIZE(&mRing));
+	}
+
+	/**
+	 * @param[in] domId    frontend domain id
+	 * @param[in] port     event channel port number
+	 * @param[in] refs     grant references of multi-page ring buffer
+	 */
+	StaticRingBufferInBase(domid_t domId, evtchn_port_t port,
+						   const std::vector<grant_ref_t>& refs) :
+		RingBufferBase(domId, port, refs),
+		mDeferResponses(false),
+		mProcessing(false),
+		mPollTime(0),
+		mPollIterations(0),
+		mNumPendingRequests(0)
+	{
+		BACK_RING_INIT(&mRing, static_cast<Page*>(mBuffer.get()),
+					   mBuffer.size());
+
+		mRequests.resize(RING_SIZE(&mRing));
+	}
+
+	// the handler is already destroyed here: the ring buffer shall be stopped
+	// before (FrontendHandlerBase does it), otherwise requests processed by
+	// the thread pool or the event channel thread may call the handler
+	~StaticRingBufferInBase()
+	{
+		assert(!isStarted() && "The ring buffer is deleted without stop()");
+
+		stop();
+	}
+
+	/**
+	 * Stops ring buffer handling and waits for the requests processed by the
+	 * thread pool.
+	 */
+	void stop() override
+	{
+		RingBufferBase::stop();
+
+		std::unique_lock<std::mutex> lock(mMutex);
+
+		mCondVar.wait(lock, [this] { return mNumPendingRequests == 0; });
+	}
+
+	/**
+	 * Resets the consumer and private producer indexes
+	 */
+	void reset() override
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mRing.req_cons = 0;
+		mRing.rsp_prod_pvt = 0;
+	}
+
+	/**
+	 * Sets the thread pool to process requests in parallel.
+	 * Should be called before start().
+	 * @param[in] threadPool thread pool
+	 */
+	void setThreadPool(ThreadPoolPtr threadPool) { mThreadPool = threadPool; }
+
+	/**
+	 * Enables or disables deferred responses.
+	 * If enabled, responses sent from processRequest() are made visible to
+	 * the frontend at the end of the drain loop.
+	 * @param[in] defer <i>true</i> to defer responses
+	 */
+	void setDeferResponses(bool defer) { mDeferResponses = defer; }
+
+	/**
+	 * Sets busy polling budget.
+	 * After the ring is drained, the request producer index is polled until
+	 * the time or the number of iterations is exhausted. Zero value means no
+	 * limit for the corresponding parameter. If both are zero (default), the
+	 * busy polling is disabled. Should be called before start().
+	 * @param[in] time       polling time
+	 * @param[in] iterations number of polling iterations
+	 */
+	void setPollBudget(std::chrono::microseconds time,
+					   size_t iterations = 0)
+	{
+		mPollTime = time;
+		mPollIterations = iterations;
 	}
 
 protected:
 
 	/**
-	 * Processes frontend requests.
-	 * This function is called when the request from the frontend is received
-	 * and should be implemented in a derived class.
-	 * @param req request
+	 * Processes batch of frontend requests.
+	 * This function is called with all requests consumed from the ring during
+	 * one pass. The default implementation calls Handler::processRequest()
+	 * for each request. Handler may hide it by own processRequests(). The
+	 * requests array is valid only during this call.
+	 * @param reqs  array of requests
+	 * @param count number of requests
 	 */
-	virtual void processRequest(const Req& req) = 0;
+	void processRequests(const Req* reqs, size_t count)
+	{
+		if (mThreadPool)
+		{
+			dispatchRequests(reqs, count);
+
+			return;
+		}
+
+		for (size_t i = 0; i < count; i++)
+		{
+			handler().processRequest(reqs[i]);
+		}
+	}
 
 	/**
 	 * Sends the response to the frontend
@@ -172,78 +576,410 @@ protected:
 	 */
 	void sendResponse(const Rsp& rsp)
 	{
-		bool notify = false;
+		sendResponses(&rsp, 1);
+	}
+
+	/**
+	 * Sends array of responses to the frontend with one push and at most one
+	 * notification.
+	 * @param rsps  array of responses
+	 * @param count number of responses
+	 */
+	void sendResponses(const Rsp* rsps, size_t count)
+	{
+		std::unique_lock<std::mutex> lock(mMutex, std::defer_lock);
+
+		if (mThreadPool)
+		{
+			lock.lock();
+		}
+
+		for (size_t i = 0; i < count; i++)
+		{
+			*RING_GET_RESPONSE(&mRing, mRing.rsp_prod_pvt) = rsps[i];
+
+			mRing.rsp_prod_pvt++;
+		}
 
-		*RING_GET_RESPONSE(&mRing, mRing.rsp_prod_pvt) = rsp;
+		capture(RingCaptureRecord::Type::RESPONSE, rsps, sizeof(Rsp), count);
 
-		mRing.rsp_prod_pvt++;
+		if (!mThreadPool && mProcessing && mDeferResponses)
+		{
+			return;
+		}
+
+		pushResponses();
+	}
+
+	/**
+	 * Returns the consumer and private producer indexes
+	 */
+	std::vector<uint32_t> saveIndexes() override
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
 
-		RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&mRing, notify);
+		return { mRing.req_cons, mRing.rsp_prod_pvt };
+	}
 
-		if (notify)
+	/**
+	 * Restores the consumer and private producer indexes
+	 * @param indexes ring indexes
+	 */
+	void restoreIndexes(const std::vector<uint32_t>& indexes) override
+	{
+		if (indexes.size() != 2)
 		{
-			mEventChannel.notify();
+			throw RingBufferException("Invalid number of ring indexes");
 		}
+
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mRing.req_cons = indexes[0];
+		mRing.rsp_prod_pvt = indexes[1];
 	}
 
 private:
 
 	Ring mRing;
+	std::atomic_bool mDeferResponses;
+	bool mProcessing;
+	std::vector<Req> mRequests;
+	std::chrono::microseconds mPollTime;
+	size_t mPollIterations;
+	ThreadPoolPtr mThreadPool;
+	size_t mNumPendingRequests;
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
 
-	void onReceiveIndication()
+	void dispatchRequests(const Req* reqs, size_t count)
 	{
-		int numPendingRequests = 0;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
 
-		do {
-			Req req;
+			mNumPendingRequests += count;
+		}
 
-			auto rc = mRing.req_cons;
-			auto rp = mRing.sring->req_prod;
+		// one copy of the batch is shared by the tasks, each task processes
+		// a contiguous part of it
+		auto batch = std::make_shared<std::vector<Req>>(reqs, reqs + count);
+		auto numTasks = std::min(count, mThreadPool->getNumThreads());
 
-			xen_rmb();
+		for (size_t i = 0; i < numTasks; i++)
+		{
+			size_t begin = count * i / numTasks;
+			size_t end = count * (i + 1) / numTasks;
 
-			if (RING_REQUEST_PROD_OVERFLOW(&mRing, rp))
+			mThreadPool->call([this, batch, begin, end]
 			{
-				throw RingBufferException("Ring buffer producer overflow");
-			}
+				for (auto j = begin; j < end; j++)
+				{
+					try
+					{
+						TRACE_SCOPE("ring", "processRequest", getPort());
 
-			while (rc != rp)
-			{
+						handler().processRequest((*batch)[j]);
+					}
+					catch(const std::exception& e)
+					{
+						onError(e);
+					}
+				}
 
-				if (RING_REQUEST_CONS_OVERFLOW(&mRing, rc))
+				std::lock_guard<std::mutex> lock(mMutex);
+
+				mNumPendingRequests -= end - begin;
+
+				if (mNumPendingRequests == 0)
 				{
-					throw RingBufferException("Ring buffer consumer overflow");
+					mCondVar.notify_all();
 				}
+			});
+		}
+	}
+
+	bool pollRequests()
+	{
+		if (!mPollTime.count() && !mPollIterations)
+		{
+			return false;
+		}
 
-				req = *RING_GET_REQUEST(&mRing, rc);
+		// don't delay coalesced notifications while polling
+		XenEvtchnNotifyScope::flush();
 
-				mRing.req_cons = ++rc;
+		auto start = std::chrono::steady_clock::now();
 
-				xen_mb();
+		for (size_t i = 0; !mPollIterations || i < mPollIterations; i++)
+		{
+			xen_rmb();
 
-				processRequest(req);
+			if (RING_HAS_UNCONSUMED_REQUESTS(&mRing))
+			{
+				return true;
 			}
 
-			RING_FINAL_CHECK_FOR_REQUESTS(&mRing, numPendingRequests);
+			if (mPollTime.count() &&
+				std::chrono::steady_clock::now() - start >= mPollTime)
+			{
+				break;
+			}
 		}
-		while (numPendingRequests);
+
+		return false;
 	}
-};
 
-/***************************************************************************//**
- * Base class to create the custom output ring buffer (for sending events to
- * the frontend).
- * RingBufferOutBase is a template with arguments taken from PV driver protocol.
- * The arguments of the template are structures described the ring buffer and
- * events to be sent to the frontend. Also the out ring buffer takes a remote
- * event channel number, a grant reference on which the ring buffer is
- * mapped and offset where the events are stored in the ring buffer. Xen event
- * channel is used to notify the frontend that a new event is available in
- * the ring buffer.
- *
- * The out ring buffer can be instantiated directly, no need to implement a
+	void pushResponses()
+	{
+		TRACE_SCOPE("ring", "pushResponses", getPort());
+
+		bool needNotify = false;
+
+		updateCounter(mCounters.numResponses,
+			  mRing.rsp_prod_pvt - mRing.sring->rsp_prod);
+
+		RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&mRing, needNotify);
+
+		if (needNotify)
+		{
+			notify();
+		}
+	}
+
+	Handler& handler() { return *static_cast<Handler*>(this); }
+
+	void onReceiveIndication() final
+	{
+		mProcessing = true;
+
+		try
+		{
+			drainRequests();
+		}
+		catch(...)
+		{
+			mProcessing = false;
+
+			throw;
+		}
+
+		mProcessing = false;
+	}
+
+	void drainRequests()
+	{
+		int numPendingRequests = 0;
+		size_t numRequests = 0;
+
+		do {
+			size_t count = 0;
+
+			auto rc = mRing.req_cons;
+			auto rp = mRing.sring->req_prod;
+
+			xen_rmb();
+
+			if (RING_REQUEST_PROD_OVERFLOW(&mRing, rp))
+			{
+				updateCounter(mCounters.numOverflows);
+
+				throw RingBufferException("Ring buffer producer overflow");
+			}
+
+			while (rc != rp)
+			{
+
+				if (RING_REQUEST_CONS_OVERFLOW(&mRing, rc))
+				{
+					updateCounter(mCounters.numOverflows);
+
+					throw RingBufferException("Ring buffer consumer overflow");
+				}
+
+				mRequests[count++] = *RING_GET_REQUEST(&mRing, rc++);
+			}
+
+			mRing.req_cons = rc;
+
+			xen_mb();
+
+			if (count)
+			{
+				numRequests += count;
+
+				updateCounter(mCounters.numRequests, count);
+
+				capture(RingCaptureRecord::Type::REQUEST, mRequests.data(),
+						sizeof(Req), count);
+
+				TRACE_SCOPE("ring", "processRequests", getPort());
+
+				handler().processRequests(mRequests.data(), count);
+			}
+
+			// push responses deferred during this pass
+			if (!mThreadPool && mRing.rsp_prod_pvt != mRing.sring->rsp_prod)
+			{
+				pushResponses();
+			}
+
+			// keep polling for new requests without re-enabling notifications
+			if (pollRequests())
+			{
+				numPendingRequests = 1;
+
+				continue;
+			}
+
+			RING_FINAL_CHECK_FOR_REQUESTS(&mRing, numPendingRequests);
+		}
+		while (numPendingRequests);
+
+		countBatch(numRequests);
+	}
+};
+
+/***************************************************************************//**
+ * Base class to create the custom input ring buffer (for handling requests
+ * from the frontend).
+ * RingBufferInBase is a template with arguments taken from PV driver protocol.
+ * The arguments of the template are structures defined with Xen
+ * DEFINE_RING_TYPES() macro from ring.h. Also the in ring buffer takes a remote
+ * event channel number and a grant reference on which the ring buffer is
+ * mapped. For multi-page rings (see FrontendHandlerBase::readRingRefs()) the
+ * vector of grant references is passed instead. Xen event channel is used to
+ * notify the backend that a new request is available in the ring buffer. When
+ * a new request is received, processRequest() method is called. To send the
+ * response, the client should call sendResponse() method.
+ *
+ * By default each response is pushed to the ring and the frontend is notified
+ * (if required) immediately. If deferred responses are enabled by
+ * setDeferResponses(), responses sent while the ring is being drained are
+ * pushed once at the end of the drain loop. It gives one push and at most one
+ * notification per batch of requests.
+ *
+ * All requests available in the ring are copied into the staging array in one
+ * pass and passed to processRequests(). By default it calls processRequest()
+ * for each request. The client may override processRequests() in order to
+ * handle the whole batch at once (sort, merge, vectorize requests etc.).
+ *
+ * If the thread pool is set by setThreadPool(), the default processRequests()
+ * splits the batch into one part per pool thread and hands the parts to the
+ * pool, so requests of one ring are processed concurrently and may be
+ * completed in any order. In this mode sendResponse()
+ * and sendResponses() may be called from any thread: the response slots and
+ * the private producer index are protected by the lock. stop() waits until
+ * all requests passed to the pool are processed.
+ *
+ * For latency critical rings the busy polling can be enabled by
+ * setPollBudget(). In this mode, after the ring is drained, the ring buffer
+ * keeps polling the request producer index for the given budget before going
+ * back to wait for the event channel. While polling, the request event index
+ * is not updated, so the frontend doesn't send notifications for the requests
+ * picked up by polling. When the budget is exhausted without new requests,
+ * the usual RING_FINAL_CHECK_FOR_REQUESTS() handshake re-enables
+ * notifications.
+ *
+ * In order to create the in ring buffer the client should implement a class
+ * inherited from RingBufferInBase and override processRequest() method.
+ *
+ * @snippet ExampleBackend.hpp ExampleInRingBuffer
+ *
+ * processRequest():
+ *
+ * @snippet ExampleBackend.cpp processRequest
+ *
+ * @ingroup backend
+ ******************************************************************************/
+template<typename Ring, typename Page, typename Req, typename Rsp>
+class RingBufferInBase :
+	public StaticRingBufferInBase<RingBufferInBase<Ring, Page, Req, Rsp>,
+								  Ring, Page, Req, Rsp>
+{
+	typedef StaticRingBufferInBase<RingBufferInBase<Ring, Page, Req, Rsp>,
+								   Ring, Page, Req, Rsp> Base;
+
+	friend Base;
+
+public:
+
+	/**
+	 * @param[in] domId    frontend domain id
+	 * @param[in] port     event channel port number
+	 * @param[in] ref      ring buffer ref number
+	 * @param[in] size ring buffer size
+	 */
+	RingBufferInBase(domid_t domId, evtchn_port_t port,
+					 grant_ref_t ref, int size = XC_PAGE_SIZE) :
+		Base(domId, port, ref, size) {}
+
+	/**
+	 * @param[in] domId    frontend domain id
+	 * @param[in] port     event channel port number
+	 * @param[in] refs     grant references of multi-page ring buffer
+	 */
+	RingBufferInBase(domid_t domId, evtchn_port_t port,
+					 const std::vector<grant_ref_t>& refs) :
+		Base(domId, port, refs) {}
+
+protected:
+
+	/**
+	 * Processes frontend requests.
+	 * This function is called when the request from the frontend is received
+	 * and should be implemented in a derived class.
+	 * @param req request
+	 */
+	virtual void processRequest(const Req& req) = 0;
+
+	/**
+	 * Processes batch of frontend requests.
+	 * This function is called with all requests consumed from the ring during
+	 * one pass. The default implementation calls processRequest() for each
+	 * request. The requests array is valid only during this call.
+	 * @param reqs  array of requests
+	 * @param count number of requests
+	 */
+	virtual void processRequests(const Req* reqs, size_t count)
+	{
+		Base::processRequests(reqs, count);
+	}
+};
+
+/***************************************************************************//**
+ * Base class to create the custom output ring buffer (for sending events to
+ * the frontend).
+ * RingBufferOutBase is a template with arguments taken from PV driver protocol.
+ * The arguments of the template are structures described the ring buffer and
+ * events to be sent to the frontend. Also the out ring buffer takes a remote
+ * event channel number, a grant reference on which the ring buffer is
+ * mapped and offset where the events are stored in the ring buffer. Xen event
+ * channel is used to notify the frontend that a new event is available in
+ * the ring buffer.
+ *
+ * The out ring buffer can be instantiated directly, no need to implement a
  * class inherited from RingBufferOutBase.
  *
+ * Events may be sent from several threads concurrently. Producers reserve
+ * slots in the ring with an atomic operation and copy events without a lock,
+ * but the producer index is published in reservation order: a producer waits
+ * (yielding) until all preceding reservations are published. This path is
+ * not lock-free: a producer preempted between reserving and publishing
+ * delays all later producers until it runs again. sendEvents() writes a
+ * batch of events with one barrier and one notification.
+ *
+ * By default events which don't fit the ring are dropped. setBacklogSize()
+ * enables the bounded backlog: overflowed events are queued and moved to the
+ * ring when the frontend consumes events (on the next notification from the
+ * frontend, on the next send or on flushBacklog() call). Events are dropped
+ * only when the backlog is full as well. getBacklogDepth() and
+ * getNumDroppedEvents() may be used by producers to throttle.
+ *
+ * The frontend is not obliged to notify the backend when it consumes events.
+ * If the ring buffer is handled by the event loop, setBacklogRetryPeriod()
+ * enables the event loop timer which retries flushing while the backlog is
+ * not empty. Otherwise the client should call flushBacklog() periodically
+ * while getBacklogDepth() is not zero.
+ *
  * @snippet ExampleBackend.hpp ExampleOutRingBuffer
  *
  *The client should call sendEvent() method to send an event to the frontend:
@@ -263,15 +999,147 @@ public:
 	 * @param[in] ref      ring buffer ref number
 	 * @param[in] offset   start of the ring buffer inside mapped page
 	 * @param[in] size     size of the ring buffer
+	 * @param[in] state    state saved by the previous backend instance on
+	 *                     the live restart (see
+	 *                     FrontendHandlerBase::takeHandoffState()) or
+	 *                     <i>nullptr</i>
 	 */
 	RingBufferOutBase(domid_t domId, evtchn_port_t port, grant_ref_t ref,
-					  int offset, size_t size) :
+					  int offset, size_t size,
+					  const HandoffState* state = nullptr) :
 		RingBufferBase(domId, port, ref),
 		mPage(static_cast<Page*>(mBuffer.get())),
 		mEventBuffer(reinterpret_cast<Event*>(
 				static_cast<uint8_t*>(mBuffer.get()) + offset)),
-		mNumEvents(size/sizeof(Event))
+		mNumEvents(size/sizeof(Event)),
+		mReserved(0),
+		mCommitted(0),
+		mBacklogHead(0),
+		mBacklogDepth(0),
+		mNumDroppedEvents(0),
+		mRetryPeriod(0),
+		mRetryTimer(0),
+		mRetryArmed(false)
+	{
+		if (static_cast<size_t>(offset) + size > mBuffer.size())
+		{
+			throw RingBufferException("Ring buffer doesn't fit mapped page");
+		}
+
+		initProducer(state);
+	}
+
+	/**
+	 * @param[in] domId    frontend domain id
+	 * @param[in] port     event channel port number
+	 * @param[in] refs     grant references of multi-page ring buffer
+	 * @param[in] offset   start of the ring buffer inside mapped pages
+	 * @param[in] size     size of the ring buffer
+	 * @param[in] state    state saved by the previous backend instance on
+	 *                     the live restart or <i>nullptr</i>
+	 */
+	RingBufferOutBase(domid_t domId, evtchn_port_t port,
+					  const std::vector<grant_ref_t>& refs,
+					  int offset, size_t size,
+					  const HandoffState* state = nullptr) :
+		RingBufferBase(domId, port, refs),
+		mPage(static_cast<Page*>(mBuffer.get())),
+		mEventBuffer(reinterpret_cast<Event*>(
+				static_cast<uint8_t*>(mBuffer.get()) + offset)),
+		mNumEvents(size/sizeof(Event)),
+		mReserved(0),
+		mCommitted(0),
+		mBacklogHead(0),
+		mBacklogDepth(0),
+		mNumDroppedEvents(0),
+		mRetryPeriod(0),
+		mRetryTimer(0),
+		mRetryArmed(false)
 	{
+		if (static_cast<size_t>(offset) + size > mBuffer.size())
+		{
+			throw RingBufferException("Ring buffer doesn't fit mapped pages");
+		}
+
+		initProducer(state);
+	}
+
+	/**
+	 * Creates the ring buffer which shares the event channel with other ring
+	 * buffer (see RingBufferBase::getEventChannel()).
+	 * @param[in] eventChannel event channel of other ring buffer
+	 * @param[in] refs         grant references of the ring buffer
+	 * @param[in] offset       start of the ring buffer inside mapped pages
+	 * @param[in] size         size of the ring buffer
+	 * @param[in] state        state saved by the previous backend instance
+	 *                         on the live restart or <i>nullptr</i>
+	 */
+	RingBufferOutBase(XenEvtchnPtr eventChannel,
+					  const std::vector<grant_ref_t>& refs,
+					  int offset, size_t size,
+					  const HandoffState* state = nullptr) :
+		RingBufferBase(eventChannel, refs),
+		mPage(static_cast<Page*>(mBuffer.get())),
+		mEventBuffer(reinterpret_cast<Event*>(
+				static_cast<uint8_t*>(mBuffer.get()) + offset)),
+		mNumEvents(size/sizeof(Event)),
+		mReserved(0),
+		mCommitted(0),
+		mBacklogHead(0),
+		mBacklogDepth(0),
+		mNumDroppedEvents(0),
+		mRetryPeriod(0),
+		mRetryTimer(0),
+		mRetryArmed(false)
+	{
+		if (static_cast<size_t>(offset) + size > mBuffer.size())
+		{
+			throw RingBufferException("Ring buffer doesn't fit mapped pages");
+		}
+
+		initProducer(state);
+	}
+
+	// stop is required to prevent calling onReceiveIndication during deletion
+	~RingBufferOutBase() { stop(); }
+
+	/**
+	 * Stops ring buffer handling and removes the backlog retry timer
+	 */
+	void stop() override
+	{
+		RingBufferBase::stop();
+
+		EventLoop::TimerId timer = 0;
+
+		{
+			std::lock_guard<std::mutex> lock(mBacklogMutex);
+
+			timer = mRetryTimer;
+
+			mRetryTimer = 0;
+			mRetryArmed = false;
+		}
+
+		// waits for the running timer callback, thus is called unlocked
+		if (timer)
+		{
+			getEventLoop()->removeTimer(timer);
+		}
+	}
+
+	/**
+	 * Resets the producer index and drops the backlog
+	 */
+	void reset() override
+	{
+		std::lock_guard<std::mutex> lock(mBacklogMutex);
+
+		mReserved = 0;
+		mCommitted = 0;
+		mBacklogHead = 0;
+		mBacklogDepth = 0;
+
 		mPage->in_prod = 0;
 
 		xen_wmb();
@@ -283,34 +1151,161 @@ public:
 	 */
 	void sendEvent(const Event& event)
 	{
-		std::lock_guard<std::mutex> lock(mMutex);
+		sendEvents(&event, 1);
+	}
 
-		if (static_cast<int>(mPage->in_prod - mPage->in_cons) >= mNumEvents)
+	/**
+	 * Sends array of events to the frontend.
+	 * Events are written to the ring, then the producer index is updated and
+	 * the frontend is notified once. If there is no room for all events,
+	 * only the first ones which fit are sent, the rest are queued to the
+	 * backlog (if enabled) or dropped.
+	 * @param events array of events
+	 * @param count  number of events
+	 * @return number of sent or queued events
+	 */
+	size_t sendEvents(const Event* events, size_t count)
+	{
+		size_t num = 0;
+
+		if (mBacklogDepth == 0)
 		{
-			LOG(mLog, WARNING) << "Ring buffer overflow, port: " << getPort()
-							   <<", prod: " << mPage->in_prod
-							   << ", cons: " << mPage->in_cons;
+			num = writeEvents(events, count);
 
-			return;
+			if (num == count)
+			{
+				return num;
+			}
 		}
 
-		LOG(mLog, DEBUG) << "Send event, port: " << getPort()
-						 <<", prod: " << mPage->in_prod
-						 << ", cons: " << mPage->in_cons
-						 << ", num events: " << mNumEvents;
+		if (mBacklog.empty())
+		{
+			mNumDroppedEvents += count - num;
 
-		mEventBuffer[mPage->in_prod % mNumEvents] = event;
+			DLOG(mLog, WARNING) << "Ring buffer overflow, port: " << getPort()
+								<< ", dropped: " << count - num;
 
-		mPage->in_prod++;
+			return num;
+		}
 
-		xen_wmb();
+		std::lock_guard<std::mutex> lock(mBacklogMutex);
 
-		mEventChannel.notify();
+		// keep events order: the backlog goes to the ring first
+		doFlushBacklog();
+
+		if (mBacklogDepth == 0)
+		{
+			num += writeEvents(&events[num], count - num);
+		}
+
+		for (; num < count && mBacklogDepth < mBacklog.size(); num++)
+		{
+			mBacklog[(mBacklogHead + mBacklogDepth) % mBacklog.size()] =
+				events[num];
+
+			mBacklogDepth++;
+		}
+
+		mNumDroppedEvents += count - num;
+
+		if (mBacklogDepth)
+		{
+			armBacklogRetry();
+		}
+
+		return num;
+	}
+
+	/**
+	 * Sets the backlog size. The backlog is disabled if the size is 0.
+	 * Should be called before sending events.
+	 * @param size max number of queued events
+	 */
+	void setBacklogSize(size_t size)
+	{
+		std::lock_guard<std::mutex> lock(mBacklogMutex);
+
+		mBacklog.resize(size);
+		mBacklogHead = 0;
+		mBacklogDepth = 0;
+	}
+
+	/**
+	 * Sets the period of the backlog flush retry. While the backlog is not
+	 * empty, the event loop timer moves queued events to the ring with this
+	 * period. It requires the event loop (see setEventLoop()), the retry is
+	 * disabled if the period is 0 (default).
+	 * @param period retry period
+	 */
+	void setBacklogRetryPeriod(std::chrono::microseconds period)
+	{
+		std::lock_guard<std::mutex> lock(mBacklogMutex);
+
+		mRetryPeriod = period;
+	}
+
+	/**
+	 * Moves queued events from the backlog to the ring as much as possible.
+	 */
+	void flushBacklog()
+	{
+		if (mBacklogDepth == 0)
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mBacklogMutex);
+
+		doFlushBacklog();
 	}
 
+	/**
+	 * Returns number of events queued in the backlog
+	 */
+	size_t getBacklogDepth() const { return mBacklogDepth; }
+
+	/**
+	 * Returns number of events dropped due to overflow
+	 */
+	uint64_t getNumDroppedEvents() const { return mNumDroppedEvents; }
+
 protected:
 
-	void onReceiveIndication() {}
+	void onReceiveIndication() { flushBacklog(); }
+
+	/**
+	 * Returns the producer index
+	 */
+	std::vector<uint32_t> saveIndexes() override
+	{
+		return { mCommitted.load() };
+	}
+
+	/**
+	 * Restores the producer index and drops the backlog. The constructor
+	 * without the saved state clears the producer index in the shared page
+	 * which may be seen by the connected frontend, thus on the live restart
+	 * the state should be passed to the constructor.
+	 * @param indexes ring indexes
+	 */
+	void restoreIndexes(const std::vector<uint32_t>& indexes) override
+	{
+		if (indexes.size() != 1)
+		{
+			throw RingBufferException("Invalid number of ring indexes");
+		}
+
+		std::lock_guard<std::mutex> lock(mBacklogMutex);
+
+		mReserved = indexes[0];
+		mCommitted = indexes[0];
+		mBacklogHead = 0;
+		mBacklogDepth = 0;
+
+		mPage->in_prod = indexes[0];
+
+		xen_wmb();
+	}
 
 private:
 
@@ -318,7 +1313,146 @@ private:
 	Event* mEventBuffer;
 	int mNumEvents;
 
-	std::mutex mMutex;
+	std::atomic<uint32_t> mReserved;
+	std::atomic<uint32_t> mCommitted;
+
+	std::mutex mBacklogMutex;
+	std::vector<Event> mBacklog;
+	size_t mBacklogHead;
+	std::atomic<size_t> mBacklogDepth;
+	std::atomic<uint64_t> mNumDroppedEvents;
+
+	std::chrono::microseconds mRetryPeriod;
+	EventLoop::TimerId mRetryTimer;
+	bool mRetryArmed;
+
+	void initProducer(const HandoffState* state)
+	{
+		// on the live restart the producer index is set to the saved value
+		// only: the frontend shall not see it going back
+		if (state)
+		{
+			restoreState(*state);
+
+			return;
+		}
+
+		mPage->in_prod = 0;
+
+		xen_wmb();
+	}
+
+	void doFlushBacklog()
+	{
+		while (mBacklogDepth)
+		{
+			size_t count = std::min(mBacklogDepth.load(),
+									mBacklog.size() - mBacklogHead);
+
+			auto num = writeEvents(&mBacklog[mBacklogHead], count);
+
+			mBacklogHead = (mBacklogHead + num) % mBacklog.size();
+			mBacklogDepth -= num;
+
+			if (num < count)
+			{
+				break;
+			}
+		}
+
+		if (mRetryArmed && mBacklogDepth == 0)
+		{
+			getEventLoop()->setTimer(mRetryTimer, std::chrono::microseconds(0));
+
+			mRetryArmed = false;
+		}
+	}
+
+	void armBacklogRetry()
+	{
+		if (mRetryArmed || !mRetryPeriod.count() || !isStarted())
+		{
+			return;
+		}
+
+		auto eventLoop = getEventLoop();
+
+		if (!eventLoop)
+		{
+			return;
+		}
+
+		if (!mRetryTimer)
+		{
+			mRetryTimer = eventLoop->addTimer(
+				[this] { if (isStarted()) { flushBacklog(); } },
+				[this] (const std::exception& e) { onError(e); });
+		}
+
+		eventLoop->setTimer(mRetryTimer, mRetryPeriod, mRetryPeriod);
+
+		mRetryArmed = true;
+	}
+
+	size_t writeEvents(const Event* events, size_t count)
+	{
+		uint32_t prod = mReserved.load(std::memory_order_relaxed);
+		uint32_t num = 0;
+
+		do
+		{
+			uint32_t cons = mPage->in_cons;
+
+			xen_rmb();
+
+			uint32_t used = prod - cons;
+
+			if (used >= static_cast<uint32_t>(mNumEvents))
+			{
+				updateCounter(mCounters.numOverflows);
+
+				return 0;
+			}
+
+			if (!count)
+			{
+				return 0;
+			}
+
+			num = std::min(static_cast<uint32_t>(count),
+						   static_cast<uint32_t>(mNumEvents) - used);
+		}
+		while (!mReserved.compare_exchange_weak(prod, prod + num));
+
+		DLOG(mLog, DEBUG) << "Send events, port: " << getPort()
+						  << ", prod: " << prod << ", num: " << num;
+
+		for (uint32_t i = 0; i < num; i++)
+		{
+			mEventBuffer[(prod + i) % mNumEvents] = events[i];
+		}
+
+		// publish in reservation order: wait for preceding producers. This
+		// blocks while any earlier reserved producer hasn't published yet.
+		while (mCommitted.load(std::memory_order_acquire) != prod)
+		{
+			std::this_thread::yield();
+		}
+
+		xen_wmb();
+
+		mPage->in_prod = prod + num;
+
+		mCommitted.store(prod + num, std::memory_order_release);
+
+		updateCounter(mCounters.numEvents, num);
+
+		capture(RingCaptureRecord::Type::EVENT, events, sizeof(Event), num);
+
+		notify();
+
+		return num;
+	}
 };
 
 typedef std::shared_ptr<RingBufferBase> RingBufferPtr;
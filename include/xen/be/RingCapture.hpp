@@ -0,0 +1,207 @@
+/*
+ *  Ring buffer traffic capture
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef INCLUDE_RINGCAPTURE_HPP_
+#define INCLUDE_RINGCAPTURE_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "XenException.hpp"
+#include "Log.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by RingCapture and RingCaptureReader.
+ * @ingroup backend
+ ******************************************************************************/
+class RingCaptureException : public XenException
+{
+	using XenException::XenException;
+};
+
+/***************************************************************************//**
+ * One record of the ring buffer capture.
+ * @ingroup backend
+ ******************************************************************************/
+struct RingCaptureRecord
+{
+	/**
+	 * Record type
+	 */
+	enum class Type : uint16_t
+	{
+		REQUEST = 1,
+		RESPONSE,
+		EVENT,
+		INDICATION
+	};
+
+	/**
+	 * Time from the capture start in nanoseconds
+	 */
+	uint64_t time;
+
+	/**
+	 * Frontend domain id
+	 */
+	uint16_t domId;
+
+	/**
+	 * Event channel port of the ring buffer
+	 */
+	uint32_t port;
+
+	/**
+	 * Record type
+	 */
+	Type type;
+
+	/**
+	 * Size of one item (request, response or event)
+	 */
+	uint16_t itemSize;
+
+	/**
+	 * Items of the record
+	 */
+	std::vector<uint8_t> data;
+
+	/**
+	 * Returns number of items in the record
+	 */
+	size_t getCount() const { return itemSize ? data.size() / itemSize : 0; }
+};
+
+/***************************************************************************//**
+ * Writes the ring buffer traffic into the binary file.
+ *
+ * The capture is set to the ring buffers by RingBufferBase::setCapture() and
+ * may be shared by several ring buffers. For each pass of the drain loop the
+ * input ring buffer writes one record with all consumed requests and one
+ * record per sendResponses() call. The output ring buffer writes one record
+ * per sendEvents() call. Notifications from the frontend are written as
+ * records without items. Records are time stamped and keep the frontend
+ * domain id and the event channel port of the ring buffer.
+ *
+ * Records are accumulated in the memory buffer and written to the file when
+ * the buffer is full, on flush() and on deletion. If writing fails, the
+ * error is logged and the rest of traffic is not captured: the capture
+ * doesn't affect ring buffers handling.
+ *
+ * The file starts with the 16 bytes header (magic and version) followed by
+ * records. Each record is the 24 bytes header (time, port, data size, type,
+ * item size, domain id) followed by data. Values are stored in the host byte
+ * order. The capture may be read by RingCaptureReader.
+ * @ingroup backend
+ ******************************************************************************/
+class RingCapture
+{
+public:
+
+	/**
+	 * Default size of the memory buffer
+	 */
+	static const size_t cDefaultBufferSize = 64 * 1024;
+
+	/**
+	 * @param[in] fileName   capture file name. The file is truncated if it
+	 *                       exists.
+	 * @param[in] bufferSize size of the memory buffer
+	 */
+	explicit RingCapture(const std::string& fileName,
+						 size_t bufferSize = cDefaultBufferSize);
+	RingCapture(const RingCapture&) = delete;
+	RingCapture& operator=(RingCapture const&) = delete;
+	~RingCapture();
+
+	/**
+	 * Writes the record. This method is thread safe.
+	 * @param[in] type     record type
+	 * @param[in] domId    frontend domain id
+	 * @param[in] port     event channel port
+	 * @param[in] items    array of items
+	 * @param[in] itemSize size of one item
+	 * @param[in] count    number of items
+	 */
+	void write(RingCaptureRecord::Type type, uint16_t domId, uint32_t port,
+			   const void* items, size_t itemSize, size_t count);
+
+	/**
+	 * Writes buffered records to the file
+	 */
+	void flush();
+
+	/**
+	 * Returns number of captured records
+	 */
+	uint64_t getNumRecords() const;
+
+private:
+
+	int mFd;
+	size_t mBufferSize;
+	std::vector<uint8_t> mBuffer;
+	std::chrono::steady_clock::time_point mStartTime;
+	uint64_t mNumRecords;
+	bool mFailed;
+	mutable std::mutex mMutex;
+
+	Log mLog;
+
+	void writeBuffer();
+};
+
+typedef std::shared_ptr<RingCapture> RingCapturePtr;
+
+/***************************************************************************//**
+ * Reads the capture written by RingCapture.
+ * @ingroup backend
+ ******************************************************************************/
+class RingCaptureReader
+{
+public:
+
+	/**
+	 * @param[in] fileName capture file name
+	 */
+	explicit RingCaptureReader(const std::string& fileName);
+
+	/**
+	 * Reads the next record
+	 * @param[out] record record
+	 * @return <i>false</i> if there are no more records
+	 */
+	bool read(RingCaptureRecord& record);
+
+private:
+
+	std::ifstream mFile;
+};
+
+}
+
+#endif /* INCLUDE_RINGCAPTURE_HPP_ */
@@ -0,0 +1,262 @@
+/*
+ *  Tracing
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef INCLUDE_TRACE_HPP_
+#define INCLUDE_TRACE_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+/***************************************************************************//**
+ * @defgroup trace Tracing
+ *
+ * Tracepoints record timestamped events into per-thread buffers. Recorded
+ * events may be exported in Chrome trace JSON format (chrome://tracing,
+ * Perfetto) with XenBackend::Trace::write().
+ *
+ * Tracepoints are compiled in only if WITH_TRACE is defined (WITH_TRACE
+ * CMake option). Compiled in tracepoints cost one relaxed atomic load till
+ * tracing is started with XenBackend::Trace::start().
+ *
+ * @code{.cpp}
+ * void MyRingBuffer::processRequest(const Req& req)
+ * {
+ *     TRACE_SCOPE("ring", "processRequest", getPort());
+ *
+ *     ...
+ * }
+ *
+ * Trace::start();
+ *
+ * ...
+ *
+ * Trace::stop();
+ *
+ * std::ofstream file("trace.json");
+ *
+ * Trace::write(file);
+ * @endcode
+ *
+ * The category and the name should be string literals: only pointers are
+ * stored. The id is displayed as event argument and may be used to
+ * distinguish frontends (domain id, event channel port etc.).
+ ******************************************************************************/
+
+/// @cond HIDDEN_SYMBOLS
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_CONCAT_(a, b) a ## b
+/// @endcond
+
+#ifdef WITH_TRACE
+
+/**
+ * @def TRACE_SCOPE(category, name, id)
+ * Records the event which lasts till the end of the current scope.
+ * @param[in] category event category
+ * @param[in] name     event name
+ * @param[in] id       event id
+ * @ingroup trace
+ */
+#define TRACE_SCOPE(category, name, id) \
+	XenBackend::TraceScope TRACE_CONCAT(traceScope, __LINE__)(category, name, \
+															   id)
+
+/**
+ * @def TRACE_EVENT(category, name, id)
+ * Records the instant event.
+ * @param[in] category event category
+ * @param[in] name     event name
+ * @param[in] id       event id
+ * @ingroup trace
+ */
+#define TRACE_EVENT(category, name, id) \
+	XenBackend::Trace::isEnabled() ? \
+	XenBackend::Trace::addEvent(category, name, XenBackend::Trace::now(), \
+								XenBackend::Trace::cInstant, id) : (void) 0
+
+#else
+
+#define TRACE_SCOPE(category, name, id) (void) 0
+#define TRACE_EVENT(category, name, id) (void) 0
+
+#endif
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Trace control.
+ *
+ * Each thread records events into its own buffer, so recording doesn't take
+ * locks. The buffer grows on demand by chunks of cChunkSize events. When the
+ * buffer is full, new events are dropped and counted (see getNumDropped()).
+ *
+ * Buffers of finished threads are kept till the next start(), so their events
+ * are still available for write(). A buffer without events of the current
+ * trace is reused by the next new thread.
+ * @ingroup trace
+ ******************************************************************************/
+class Trace
+{
+public:
+
+	/**
+	 * Max number of events in the thread buffer
+	 */
+	static const size_t cBufferSize = 65536;
+
+	/**
+	 * Number of events allocated at once when the thread buffer grows
+	 */
+	static const size_t cChunkSize = 1024;
+
+	/**
+	 * Duration value which marks the instant event
+	 */
+	static const uint64_t cInstant = UINT64_MAX;
+
+	/**
+	 * Clears recorded events and starts tracing
+	 */
+	static void start();
+
+	/**
+	 * Stops tracing. Recorded events are kept till the next start().
+	 */
+	static void stop();
+
+	/**
+	 * Returns <i>true</i> if tracing is started
+	 */
+	static bool isEnabled()
+	{
+		return sEnabled.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Returns current timestamp in nanoseconds
+	 */
+	static uint64_t now();
+
+	/**
+	 * Records the event in the buffer of the calling thread
+	 * @param[in] category event category
+	 * @param[in] name     event name
+	 * @param[in] start    event start timestamp
+	 * @param[in] duration event duration or cInstant
+	 * @param[in] id       event id
+	 */
+	static void addEvent(const char* category, const char* name,
+						 uint64_t start, uint64_t duration, uint64_t id);
+
+	/**
+	 * Writes recorded events in Chrome trace JSON format
+	 * @param[out] stream output stream
+	 */
+	static void write(std::ostream& stream);
+
+	/**
+	 * Returns number of events dropped due to full buffers
+	 */
+	static uint64_t getNumDropped() { return sNumDropped; }
+
+	/**
+	 * Returns number of allocated thread buffers
+	 */
+	static size_t getNumBuffers();
+
+private:
+
+	struct Event
+	{
+		const char* category;
+		const char* name;
+		uint64_t start;
+		uint64_t duration;
+		uint64_t id;
+	};
+
+	struct Buffer
+	{
+		long tid;
+		// the buffer is owned by a running thread
+		bool used;
+		// trace generation the events belong to
+		std::atomic<uint64_t> generation;
+		std::atomic<size_t> size;
+		std::unique_ptr<Event[]> chunks[cBufferSize / cChunkSize];
+	};
+
+	typedef std::shared_ptr<Buffer> BufferPtr;
+
+	struct ThreadBuffer;
+
+	static std::atomic_bool sEnabled;
+	static std::atomic<uint64_t> sGeneration;
+	static std::atomic<uint64_t> sNumDropped;
+	static std::mutex sMutex;
+	static std::vector<BufferPtr> sBuffers;
+
+	static Buffer& getBuffer();
+};
+
+/***************************************************************************//**
+ * Records the event which lasts for the life time of the object.
+ * Usually it is created by TRACE_SCOPE() macro.
+ * @ingroup trace
+ ******************************************************************************/
+class TraceScope
+{
+public:
+
+	/**
+	 * @param[in] category event category
+	 * @param[in] name     event name
+	 * @param[in] id       event id
+	 */
+	TraceScope(const char* category, const char* name, uint64_t id = 0) :
+		mCategory(category), mName(name), mId(id),
+		mStart(Trace::isEnabled() ? Trace::now() : 0) {}
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(TraceScope const&) = delete;
+
+	~TraceScope()
+	{
+		if (mStart && Trace::isEnabled())
+		{
+			Trace::addEvent(mCategory, mName, mStart, Trace::now() - mStart,
+							mId);
+		}
+	}
+
+private:
+
+	const char* mCategory;
+	const char* mName;
+	uint64_t mId;
+	uint64_t mStart;
+};
+
+}
+
+#endif /* INCLUDE_TRACE_HPP_ */
@@ -22,10 +22,18 @@
 #define SRC_XEN_UTILS_HPP_
 
 #include <atomic>
+#include <chrono>
+#include <climits>
 #include <condition_variable>
-#include <list>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <new>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include <poll.h>
 #include <unistd.h>
@@ -64,17 +72,29 @@ public:
 /***************************************************************************//**
  * Class to poll file descriptor.
  *
- * The PollFd class also opens an additional pipe. On poll() method it waits
- * for both: the defined file descriptor and the internal pipe file descriptor.
- * The internal pipe file descriptor breaks poll() when stop() method is
- * invoked. It is used to unblock poll() when an object using PollFd is been
- * deleted.
+ * The PollFd class also opens an additional eventfd. On poll() method it
+ * waits for both: the defined file descriptor and the internal eventfd.
+ * The internal eventfd breaks poll() when stop() method is invoked. It is used
+ * to unblock poll() when an object using PollFd is been deleted.
+ *
+ * poll() with the timeout allows to bound the waiting time, for example to
+ * flush batched data when no new events arrive.
  * @ingroup backend
  ******************************************************************************/
 class PollFd
 {
 public:
 
+	/**
+	 * Result of the poll with the timeout
+	 */
+	enum class Result
+	{
+		READY,   ///< one of defined events occurred
+		TIMEOUT, ///< the timeout expired
+		STOPPED  ///< interrupted by calling stop()
+	};
+
 	/**
 	 * @param fd     file descriptor
 	 * @param events events to poll (same as in system poll function)
@@ -89,6 +109,13 @@ public:
 	 */
 	bool poll();
 
+	/**
+	 * Polls the file descriptors for defined events with the timeout
+	 * @param[in] timeout max waiting time, negative value means infinite
+	 * @return poll result
+	 */
+	Result poll(std::chrono::microseconds timeout);
+
 	/**
 	 * Stops polling
 	 */
@@ -96,29 +123,415 @@ public:
 
 private:
 
-	enum PipeType
-	{
-		READ = 0,
-		WRITE = 1
-	};
-
 	enum PollIndex
 	{
 		FILE = 0,
-		PIPE = 1
+		EVENT = 1
 	};
 
 	pollfd mFds[2];
-	int mPipeFds[2];
+	int mEventFd;
 
 	void init(int fd, short int events);
 	void release();
 };
 
+/***************************************************************************//**
+ * Configuration of the library thread.
+ *
+ * Defines the thread name, CPU affinity, scheduling policy and nice value
+ * applied to the thread when it is started. Fields which are not set keep
+ * values inherited from the creating thread.
+ *
+ * The configuration may be set per backend (BackendBase::setThreadConfig()),
+ * per frontend (FrontendHandlerBase::setThreadConfig()), per ring
+ * (RingBufferBase::setThreadConfig()) and for event loop and thread pool
+ * workers (EventLoop and ThreadPool constructors). The frontend inherits the
+ * backend configuration and the ring buffer handled by the dedicated thread
+ * inherits the frontend configuration if they don't have own one.
+ *
+ * @code{.cpp}
+ * ThreadConfig config;
+ *
+ * config.name = "vif-rx";
+ * config.cpus = { 2, 3 };
+ * config.policy = SCHED_FIFO;
+ * config.priority = 10;
+ *
+ * ringBuffer->setThreadConfig(config);
+ * @endcode
+ * @ingroup backend
+ ******************************************************************************/
+struct ThreadConfig
+{
+	/**
+	 * Value of not set policy and nice fields
+	 */
+	static const int cNotSet = INT_MIN;
+
+	/**
+	 * Thread name (pthread_setname_np()), truncated to 15 characters
+	 */
+	std::string name;
+
+	/**
+	 * CPUs the thread is allowed to run on
+	 */
+	std::vector<unsigned int> cpus;
+
+	/**
+	 * Scheduling policy: SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO or
+	 * SCHED_RR
+	 */
+	int policy;
+
+	/**
+	 * Static priority for SCHED_FIFO and SCHED_RR policies
+	 */
+	int priority;
+
+	/**
+	 * Nice value
+	 */
+	int nice;
+
+	ThreadConfig() : policy(cNotSet), priority(0), nice(cNotSet) {}
+
+	/**
+	 * Returns <i>true</i> if any field is set
+	 */
+	bool isSet() const
+	{
+		return !name.empty() || !cpus.empty() || policy != cNotSet ||
+			   nice != cNotSet;
+	}
+
+	/**
+	 * Applies the configuration to the calling thread
+	 */
+	void apply() const;
+
+	/**
+	 * Creates the thread with the configuration. The configuration is applied
+	 * before the function is called. If it fails, the function is not called
+	 * and the exception is thrown to the caller.
+	 * @param[in] func thread function
+	 * @return created thread
+	 */
+	std::thread createThread(std::function<void()> func) const;
+};
+
+/***************************************************************************//**
+ * Function with fixed-capacity inline storage
+ *
+ * The function object is stored inside the task, so creating and moving the
+ * task doesn't allocate. Function objects bigger than cSize bytes are
+ * rejected at compile time: such functions should capture a pointer to their
+ * state instead. The task can be moved but not copied.
+ *
+ * @ingroup backend
+ ******************************************************************************/
+class InlineTask
+{
+public:
+
+	/**
+	 * Max size of the stored function object
+	 */
+	static const size_t cSize = 64;
+
+	InlineTask() : mOps(nullptr) {}
+
+	/**
+	 * @param[in] f function object
+	 */
+	template<typename F, typename = typename std::enable_if<
+			 !std::is_same<typename std::decay<F>::type,
+						   InlineTask>::value>::type>
+	InlineTask(F&& f) : mOps(getOps<typename std::decay<F>::type>())
+	{
+		typedef typename std::decay<F>::type Func;
+
+		static_assert(sizeof(Func) <= cSize,
+					  "Function doesn't fit the task storage");
+		static_assert(alignof(Func) <= alignof(Storage),
+					  "Function alignment is not supported by the task");
+
+		new (&mStorage) Func(std::forward<F>(f));
+	}
+
+	InlineTask(InlineTask&& other) : mOps(other.mOps)
+	{
+		if (mOps)
+		{
+			mOps->move(&mStorage, &other.mStorage);
+			other.mOps = nullptr;
+		}
+	}
+
+	InlineTask& operator=(InlineTask&& other)
+	{
+		if (this != &other)
+		{
+			reset();
+
+			if (other.mOps)
+			{
+				other.mOps->move(&mStorage, &other.mStorage);
+				mOps = other.mOps;
+				other.mOps = nullptr;
+			}
+		}
+
+		return *this;
+	}
+
+	InlineTask(const InlineTask&) = delete;
+	InlineTask& operator=(InlineTask const&) = delete;
+
+	~InlineTask() { reset(); }
+
+	/**
+	 * Returns <i>true</i> if the task holds a function
+	 */
+	explicit operator bool() const { return mOps != nullptr; }
+
+	/**
+	 * Calls the stored function
+	 */
+	void operator()() { mOps->call(&mStorage); }
+
+	/**
+	 * Destroys the stored function
+	 */
+	void reset()
+	{
+		if (mOps)
+		{
+			mOps->destroy(&mStorage);
+			mOps = nullptr;
+		}
+	}
+
+private:
+
+	typedef std::aligned_storage<cSize>::type Storage;
+
+	struct Ops
+	{
+		void (*call)(void* func);
+		// move constructs dst from src and destroys src
+		void (*move)(void* dst, void* src);
+		void (*destroy)(void* func);
+	};
+
+	template<typename Func>
+	struct Impl
+	{
+		static void call(void* func) { (*static_cast<Func*>(func))(); }
+
+		static void move(void* dst, void* src)
+		{
+			new (dst) Func(std::move(*static_cast<Func*>(src)));
+			static_cast<Func*>(src)->~Func();
+		}
+
+		static void destroy(void* func) { static_cast<Func*>(func)->~Func(); }
+	};
+
+	template<typename Func>
+	static const Ops* getOps()
+	{
+		static const Ops sOps = { &Impl<Func>::call, &Impl<Func>::move,
+								  &Impl<Func>::destroy };
+
+		return &sOps;
+	}
+
+	Storage mStorage;
+	const Ops* mOps;
+};
+
+/***************************************************************************//**
+ * FIFO queue of tasks
+ *
+ * The tasks are stored in a ring buffer. The buffer grows when the queue is
+ * full and is reused afterwards, thus push() and pop() don't allocate once
+ * the queue has reached its working size. The queue is not thread safe.
+ *
+ * @ingroup backend
+ ******************************************************************************/
+class TaskQueue
+{
+public:
+
+	/**
+	 * Initial number of tasks the queue holds without growing
+	 */
+	static const size_t cInitialCapacity = 16;
+
+	TaskQueue() : mTasks(cInitialCapacity), mHead(0), mSize(0) {}
+
+	/**
+	 * Returns <i>true</i> if the queue is empty
+	 */
+	bool empty() const { return mSize == 0; }
+
+	/**
+	 * Returns number of queued tasks
+	 */
+	size_t size() const { return mSize; }
+
+	/**
+	 * Adds the task to the end of the queue
+	 * @param[in] task task
+	 */
+	void push(InlineTask&& task);
+
+	/**
+	 * Removes and returns the first task. The queue should not be empty.
+	 */
+	InlineTask pop();
+
+private:
+
+	std::vector<InlineTask> mTasks;
+	size_t mHead;
+	size_t mSize;
+};
+
+/***************************************************************************//**
+ * Implements pool of worker threads
+ *
+ * This class allows to call functions asynchronously in a fixed number of
+ * worker threads. The functions are called in any order and concurrently.
+ * The exceptions thrown by the functions are caught and logged, thus the
+ * caller should handle errors itself.
+ *
+ * Each worker has its own queue. A function added by a worker goes to the
+ * queue of this worker, functions added by other threads are distributed
+ * between the queues round robin. A worker takes functions from its own
+ * queue first and steals them from the queues of other workers when its
+ * queue is empty. The functions are stored in InlineTask, so adding them
+ * doesn't allocate (see TaskQueue).
+ *
+ * A function which blocks waiting for another function of the same pool may
+ * hang when all workers are blocked this way. Blocking I/O requests are run
+ * on the separate pool returned by getSharedIo() for this reason.
+ *
+ * @ingroup backend
+ ******************************************************************************/
+class ThreadPool
+{
+public:
+
+	/**
+	 * Function to be called by worker thread
+	 */
+	typedef InlineTask Task;
+
+	/**
+	 * @param[in] numThreads number of worker threads. If 0 is passed, the
+	 * number of available CPU cores is used.
+	 * @param[in] configs    thread configurations: worker i uses configs[i %
+	 *                       configs.size()]
+	 */
+	explicit ThreadPool(size_t numThreads = 0,
+						const std::vector<ThreadConfig>& configs = {});
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+	~ThreadPool();
+
+	/**
+	 * Returns number of worker threads
+	 */
+	size_t getNumThreads() const { return mThreads.size(); }
+
+	/**
+	 * Returns thread pool shared by the whole process. The pool is created on
+	 * first call and has one thread per CPU core but not less than
+	 * cMinSharedThreads.
+	 */
+	static std::shared_ptr<ThreadPool> getShared();
+
+	/**
+	 * Returns thread pool shared by the whole process for blocking I/O
+	 * requests (asynchronous XenStore calls). The pool is created on first
+	 * call and has cSharedIoThreads threads. The functions run on it should
+	 * only wait for the I/O, not for other tasks.
+	 */
+	static std::shared_ptr<ThreadPool> getSharedIo();
+
+	/**
+	 * Sets thread configurations of the shared pools. Should be called before
+	 * the first getShared() and getSharedIo() calls.
+	 * @param[in] configs thread configurations (see ThreadPool())
+	 */
+	static void setSharedConfigs(const std::vector<ThreadConfig>& configs);
+
+	/**
+	 * Minimal number of threads in the shared pool
+	 */
+	static const size_t cMinSharedThreads = 2;
+
+	/**
+	 * Number of threads in the shared I/O pool, the maximal number of
+	 * blocking requests processed concurrently
+	 */
+	static const size_t cSharedIoThreads = 4;
+
+	/**
+	 * Adds a function to be called by one of worker threads
+	 * @param[in] task function
+	 */
+	void call(Task task);
+
+private:
+
+	struct Worker
+	{
+		std::mutex mutex;
+		TaskQueue tasks;
+	};
+
+	bool mTerminate;
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::vector<std::unique_ptr<Worker>> mWorkers;
+	std::vector<std::thread> mThreads;
+
+	std::atomic<size_t> mNextWorker;
+	// tasks in all worker queues
+	std::atomic<long> mNumTasks;
+	// workers waiting for tasks
+	std::atomic<size_t> mNumIdle;
+
+	void run(size_t index);
+	bool getTask(size_t index, Task& task);
+	void stopThreads();
+};
+
+typedef std::shared_ptr<ThreadPool> ThreadPoolPtr;
+
 /***************************************************************************//**
  * Implements asynchronous context
  *
- * This class allows to call a function asynchronously.
+ * This class allows to call a function asynchronously. The functions are
+ * called one by one in the order they were added, but not necessary in the
+ * same thread: the context doesn't own a thread and runs its functions on a
+ * thread pool. If no pool is passed to the constructor, the pool returned by
+ * ThreadPool::getShared() is used, thus many contexts share a small number of
+ * threads. The functions of the context shall not wait for other functions
+ * of the same pool (see ThreadPool).
+ *
+ * Each call stores the function in the context queue and the context
+ * schedules one pool task while it has pending functions. The functions are
+ * stored in InlineTask, so calls don't allocate (see TaskQueue). Functions
+ * are run without the context lock held, thus call() is not blocked by a
+ * running function.
+ *
+ * The destructor waits till all queued functions are called, so the context
+ * must not be deleted from its own function.
  *
  * @ingroup backend
  ******************************************************************************/
@@ -127,27 +540,32 @@ class AsyncContext
 public:
 
 	/**
-	 * Callback which is called when the event channel is notified
+	 * Function to be called asynchronously
 	 */
-	typedef std::function<void()> AsyncCall;
+	typedef InlineTask AsyncCall;
 
-	AsyncContext();
+	/**
+	 * @param[in] pool thread pool to run functions on
+	 */
+	explicit AsyncContext(ThreadPoolPtr pool = nullptr);
+	AsyncContext(const AsyncContext&) = delete;
+	AsyncContext& operator=(AsyncContext const&) = delete;
 	~AsyncContext();
 
 	/**
 	 * Adds a function to be called asynchronously
-	 * @param f
+	 * @param[in] f function
 	 */
 	void call(AsyncCall f);
 
 private:
 
-	std::atomic_bool mTerminate;
+	ThreadPoolPtr mPool;
+	bool mRunning;
 	std::mutex mMutex;
 	std::condition_variable mCondVar;
-	std::thread mThread;
 
-	std::list<AsyncCall> mAsyncCalls;
+	TaskQueue mAsyncCalls;
 
 	void run();
 };
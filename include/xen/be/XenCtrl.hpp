@@ -22,6 +22,7 @@
 #ifndef SRC_XEN_XENCTRL_HPP_
 #define SRC_XEN_XENCTRL_HPP_
 
+#include <cstdint>
 #include <vector>
 
 extern "C" {
@@ -73,6 +74,81 @@ private:
 	void release();
 };
 
+/***************************************************************************//**
+ * Snapshot of the domain table.
+ *
+ * The snapshot keeps its buffers between refreshes, so periodic refresh
+ * doesn't allocate memory once the buffers have grown to the number of
+ * domains. The generation is incremented by refresh() only if domain set or
+ * domain flags are changed, thus it may be used to skip processing of an
+ * unchanged table.
+ *
+ * Domain infos are sorted by domain id.
+ * @ingroup xen
+ ******************************************************************************/
+class DomainInfoSnapshot
+{
+public:
+
+	DomainInfoSnapshot() : mGeneration(0) {}
+
+	/**
+	 * Reads the domain table. On error the previous content is kept.
+	 * @param[in] xenInterface Xen interface to read domain infos
+	 * @return <i>true</i> if the table is changed
+	 */
+	bool refresh(XenInterface& xenInterface);
+
+	/**
+	 * Returns generation of the snapshot
+	 */
+	uint64_t getGeneration() const { return mGeneration; }
+
+	/**
+	 * Returns domain infos
+	 */
+	const std::vector<xc_domaininfo_t>& getInfos() const { return mInfos; }
+
+	/**
+	 * Returns domain info
+	 * @param[in] domId domain id
+	 * @return domain info or <i>nullptr</i> if the domain doesn't exist
+	 */
+	const xc_domaininfo_t* find(domid_t domId) const;
+
+	/**
+	 * Checks if the domain exists
+	 * @param[in] domId domain id
+	 */
+	bool isExisting(domid_t domId) const { return find(domId) != nullptr; }
+
+	/**
+	 * Checks if the domain is running
+	 * @param[in] domId domain id
+	 */
+	bool isRunning(domid_t domId) const;
+
+	/**
+	 * Fills ids of existing domains
+	 * @param[out] domIds domain ids
+	 */
+	void getExistingDoms(std::vector<domid_t>& domIds) const;
+
+	/**
+	 * Fills ids of running domains
+	 * @param[out] domIds domain ids
+	 */
+	void getRunningDoms(std::vector<domid_t>& domIds) const;
+
+private:
+
+	uint64_t mGeneration;
+	std::vector<xc_domaininfo_t> mInfos;
+	std::vector<xc_domaininfo_t> mNewInfos;
+
+	bool isChanged() const;
+};
+
 }
 
 #endif /* SRC_XEN_XENCTRL_HPP_ */
@@ -22,14 +22,18 @@
 #define SRC_XEN_XENEVTCHN_HPP_
 
 #include <atomic>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <utility>
+#include <vector>
 
 extern "C" {
 #include <xenctrl.h>
 #include <xenevtchn.h>
 }
 
+#include "EventLoop.hpp"
 #include "XenException.hpp"
 #include "Log.hpp"
 #include "Utils.hpp"
@@ -69,6 +73,20 @@ class XenEvtchnException : public XenException
  * ...
  *
  * @endcode
+ *
+ * By default XenEvtchn creates own thread to wait for notifications. If the
+ * shared event loop is set by setEventLoop(), the event channel is handled by
+ * one of the event loop threads instead.
+ *
+ * Notifications issued while XenEvtchnNotifyScope is active on the calling
+ * thread are coalesced. The callback is always called inside such scope, thus
+ * notifying the peer several times while handling one event costs one real
+ * notification.
+ *
+ * A remote port may be bound only once, thus objects which share the port
+ * (for example in and out ring buffers of one queue) should share one
+ * XenEvtchn instance: addCallback() adds their callbacks to the one passed to
+ * the constructor.
  * @ingroup xen
  ******************************************************************************/
 class XenEvtchn
@@ -104,15 +122,80 @@ public:
 	void stop();
 
 	/**
-	 * Notifies the event channel
+	 * Returns <i>true</i> if the event channel is started
+	 */
+	bool isStarted() const { return mStarted; }
+
+	/**
+	 * Binds the remote port again. It is used when the remote domain may
+	 * have closed and reallocated the channel with the same port number.
+	 * Should be called when the event channel is stopped.
+	 */
+	void rebind();
+
+	/**
+	 * Adds the callback which is called on the notification after the
+	 * constructor callback. Should be called when the event channel is
+	 * stopped.
+	 * @param[in] callback callback
+	 * @return callback id to pass to removeCallback()
+	 */
+	size_t addCallback(Callback callback);
+
+	/**
+	 * Removes the callback added by addCallback(). Should be called when the
+	 * event channel is stopped.
+	 * @param[in] id callback id
+	 */
+	void removeCallback(size_t id);
+
+	/**
+	 * Notifies the event channel. If XenEvtchnNotifyScope is active on the
+	 * calling thread, the notification is deferred till the end of the scope.
 	 */
 	void notify();
 
+	/**
+	 * Sets the shared event loop to handle the event channel.
+	 * Should be called before start(). If the event loop is not set, the
+	 * dedicated thread is used.
+	 * @param[in] eventLoop event loop
+	 * @param[in] thread    index of the event loop thread, -1 means any
+	 */
+	void setEventLoop(EventLoopPtr eventLoop, int thread = -1);
+
+	/**
+	 * Returns the shared event loop or <i>nullptr</i> if it is not set
+	 */
+	EventLoopPtr getEventLoop() const { return mEventLoop; }
+
+	/**
+	 * Sets configuration of the dedicated thread. Should be called before
+	 * start(). Is not used if the event loop is set.
+	 * @param[in] config thread configuration
+	 */
+	void setThreadConfig(const ThreadConfig& config) { mThreadConfig = config; }
+
+	/**
+	 * Returns configuration of the dedicated thread
+	 */
+	const ThreadConfig& getThreadConfig() const { return mThreadConfig; }
+
 	/**
 	 * Returns event channel port
 	 */
 	xenevtchn_port_or_error_t getPort() const { return mPort; }
 
+	/**
+	 * Returns remote domain id
+	 */
+	domid_t getDomId() const { return mDomId; }
+
+	/**
+	 * Returns remote event channel port
+	 */
+	evtchn_port_t getRemotePort() const { return mRemotePort; }
+
 	/**
 	 * Sets error callback
 	 * @param errorCallback error callback
@@ -121,20 +204,85 @@ public:
 
 private:
 
+	friend class XenEvtchnNotifyScope;
+
+	domid_t mDomId;
+	evtchn_port_t mRemotePort;
 	xenevtchn_port_or_error_t mPort;
 	xenevtchn_handle *mHandle;
 	Callback mCallback;
+	std::vector<std::pair<size_t, Callback>> mCallbacks;
+	size_t mNextCallbackId;
 	ErrorCallback mErrorCallback;
 	std::atomic_bool mStarted;
 	Log mLog;
 
 	std::mutex mMutex;
 	std::thread mThread;
+	ThreadConfig mThreadConfig;
 	std::unique_ptr<PollFd> mPollFd;
 
+	EventLoopPtr mEventLoop;
+	int mEventLoopThread;
+
 	void init(domid_t domId, evtchn_port_t port);
 	void release();
 	void eventThread();
+	void handleEvent();
+	void onError(const std::exception& e);
+	void notifyNow();
+	bool hasCallbacks() const { return mCallback || !mCallbacks.empty(); }
+};
+
+typedef std::shared_ptr<XenEvtchn> XenEvtchnPtr;
+
+/***************************************************************************//**
+ * Coalesces event channel notifications.
+ *
+ * While the scope object exists, XenEvtchn::notify() called from the same
+ * thread only marks the event channel dirty. The real notification is sent
+ * once per event channel when the outermost scope is destroyed or flush() is
+ * called. It allows in and out ring buffers which share one event channel
+ * to send one notification per processing pass.
+ *
+ * Event channels notified inside the scope should not be deleted before the
+ * scope is finished.
+ *
+ * @code
+ * {
+ *     XenEvtchnNotifyScope scope;
+ *
+ *     ringBuffer1->sendEvent(event1);
+ *     ringBuffer2->sendEvent(event2);
+ * }
+ * @endcode
+ * @ingroup xen
+ ******************************************************************************/
+class XenEvtchnNotifyScope
+{
+public:
+
+	XenEvtchnNotifyScope();
+	XenEvtchnNotifyScope(const XenEvtchnNotifyScope&) = delete;
+	XenEvtchnNotifyScope& operator=(XenEvtchnNotifyScope const&) = delete;
+	~XenEvtchnNotifyScope();
+
+	/**
+	 * Sends deferred notifications of the calling thread
+	 */
+	static void flush();
+
+	/**
+	 * Returns <i>true</i> if the scope is active on the calling thread
+	 */
+	static bool isActive();
+
+private:
+
+	friend class XenEvtchn;
+
+	static bool defer(XenEvtchn* eventChannel);
+	static void remove(XenEvtchn* eventChannel);
 };
 
 }
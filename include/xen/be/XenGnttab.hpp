@@ -21,7 +21,17 @@
 #ifndef SRC_XEN_XENGNTTAB_HPP_
 #define SRC_XEN_XENGNTTAB_HPP_
 
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 extern "C" {
 #include <xenctrl.h>
@@ -44,18 +54,131 @@ class XenGnttabException : public XenException
 
 /***************************************************************************//**
  * Keeps common grant table handle.
+ *
+ * Besides mapping (see XenGnttabBuffer), the handle allows to copy data
+ * to/from grant references without mapping them. For small buffers the grant
+ * copy is cheaper than map and unmap. Many segments in both directions are
+ * copied with one call:
+ * @code
+ * std::vector<xengnttab_grant_copy_segment_t> segments;
+ *
+ * segments.push_back(XenGnttab::copyToRef(domId, ref, 0, data, size));
+ *
+ * XenGnttab::getInstance().copy(segments);
+ * @endcode
+ *
+ * By default all mappings in the process use one grant table handle. In
+ * order to avoid contention on one device file, the handles may be sharded
+ * by domain with setNumShards(). In this case getForDomain() returns the
+ * handle of the shard the domain belongs to. If the number of shards is 0,
+ * each domain gets own handle, which may be closed with releaseDomain() when
+ * the domain is gone. Buffers hold the handle they were mapped with, so the
+ * handle is actually closed when all its buffers are deleted.
+ *
+ * The number of pages mapped by each domain is tracked. The limit of mapped
+ * pages may be set per domain with setPageLimit() or for all domains with
+ * setDefaultPageLimit(). XenGnttabBuffer throws XenGnttabException if the
+ * mapping exceeds the limit, so one guest can't exhaust the mapping quota of
+ * the backend.
  * @ingroup xen
  ******************************************************************************/
 class XenGnttab
 {
+public:
+
+	~XenGnttab();
+
+	/**
+	 * Returns the common grant table instance
+	 */
+	static XenGnttab& getInstance();
+
+	/**
+	 * Returns the grant table handle which should be used for the domain
+	 * @param[in] domId domain id
+	 */
+	static std::shared_ptr<XenGnttab> getForDomain(domid_t domId);
+
+	/**
+	 * Sets number of grant table handle shards. 1 (default) means one common
+	 * handle, 0 means a handle per domain. Affects only new buffers.
+	 * @param[in] numShards number of shards
+	 */
+	static void setNumShards(size_t numShards);
+
+	/**
+	 * Releases the handle of the domain (only if a handle per domain is used)
+	 * @param[in] domId domain id
+	 */
+	static void releaseDomain(domid_t domId);
+
+	/**
+	 * Returns number of pages currently mapped by the domain
+	 * @param[in] domId domain id
+	 */
+	static size_t getNumMappedPages(domid_t domId);
+
+	/**
+	 * Sets the limit of mapped pages for the domain
+	 * @param[in] domId domain id
+	 * @param[in] limit max number of mapped pages, 0 - default limit
+	 */
+	static void setPageLimit(domid_t domId, size_t limit);
+
+	/**
+	 * Sets the limit of mapped pages for domains without own limit
+	 * @param[in] limit max number of mapped pages, 0 - no limit
+	 */
+	static void setDefaultPageLimit(size_t limit);
+
+	/**
+	 * Performs grant copy of the segments.
+	 * Throws XenGnttabException if the copy or any segment fails. The status
+	 * of each segment is stored in the segment status field.
+	 * @param[in,out] segments grant copy segments
+	 */
+	void copy(std::vector<xengnttab_grant_copy_segment_t>& segments);
+
+	/**
+	 * Creates segment to copy local buffer to the grant reference
+	 * @param[in] domId  domain id
+	 * @param[in] ref    grant reference id
+	 * @param[in] offset offset inside the granted page
+	 * @param[in] src    local buffer
+	 * @param[in] len    number of bytes to copy
+	 */
+	static xengnttab_grant_copy_segment_t copyToRef(domid_t domId,
+													grant_ref_t ref,
+													uint16_t offset,
+													const void* src,
+													uint16_t len);
+
+	/**
+	 * Creates segment to copy the grant reference to local buffer
+	 * @param[in] domId  domain id
+	 * @param[in] ref    grant reference id
+	 * @param[in] offset offset inside the granted page
+	 * @param[in] dst    local buffer
+	 * @param[in] len    number of bytes to copy
+	 */
+	static xengnttab_grant_copy_segment_t copyFromRef(domid_t domId,
+													  grant_ref_t ref,
+													  uint16_t offset,
+													  void* dst,
+													  uint16_t len);
+
 private:
 
 	friend class XenGnttabBuffer;
+	friend class XenGnttabUnmapQueue;
 
 	XenGnttab();
 	XenGnttab(const XenGnttab&) = delete;
 	XenGnttab& operator=(XenGnttab const&) = delete;
-	~XenGnttab();
+
+	static std::shared_ptr<XenGnttab> getDefault();
+	static void reservePages(domid_t domId, size_t count);
+	static void releasePages(domid_t domId, size_t count);
 
 	/**
 	 * Returns the grant table handle
@@ -66,6 +189,91 @@ private:
 	xengnttab_handle* mHandle;
 };
 
+typedef std::shared_ptr<XenGnttab> XenGnttabPtr;
+
+/***************************************************************************//**
+ * Deferred unmapping of grant table buffers.
+ * When the queue is enabled, XenGnttabBuffer doesn't unmap the buffer in the
+ * destructor but passes it to the queue. The background thread takes all
+ * collected buffers at once and unmaps them one by one: libxengnttab unmaps
+ * one mapping per call. It moves the unmap cost out of the thread which
+ * deletes buffers. The client which needs the memory to be returned before
+ * continuing should call flush(). FrontendHandlerBase flushes the queue
+ * before setting the Closed state on the frontend close.
+ * @code
+ * XenGnttabUnmapQueue::getInstance().setEnabled(true);
+ *
+ * ...
+ *
+ * XenGnttabUnmapQueue::getInstance().flush();
+ * @endcode
+ * @ingroup xen
+ ******************************************************************************/
+class XenGnttabUnmapQueue
+{
+public:
+
+	/**
+	 * Returns the queue instance
+	 */
+	static XenGnttabUnmapQueue& getInstance();
+
+	/**
+	 * Enables or disables deferred unmapping. When disabled, the pending
+	 * buffers are unmapped before returning.
+	 * @param[in] enabled <i>true</i> to enable deferred unmapping
+	 */
+	void setEnabled(bool enabled);
+
+	/**
+	 * Returns <i>true</i> if deferred unmapping is enabled
+	 */
+	bool isEnabled() const { return mEnabled; }
+
+	/**
+	 * Waits until all buffers queued before this call are unmapped
+	 */
+	void flush();
+
+	/**
+	 * Returns number of buffers pending for unmapping
+	 */
+	size_t getNumPending() const;
+
+private:
+
+	friend class XenGnttabBuffer;
+
+	struct Mapping
+	{
+		domid_t domId;
+		XenGnttabPtr gnttab;
+		void* address;
+		size_t count;
+	};
+
+	std::atomic_bool mEnabled;
+	bool mTerminate;
+	uint64_t mNumQueued;
+	uint64_t mNumUnmapped;
+
+	mutable std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::thread mThread;
+	std::vector<Mapping> mMappings;
+
+	Log mLog;
+
+	XenGnttabUnmapQueue();
+	XenGnttabUnmapQueue(const XenGnttabUnmapQueue&) = delete;
+	XenGnttabUnmapQueue& operator=(XenGnttabUnmapQueue const&) = delete;
+	~XenGnttabUnmapQueue();
+
+	void push(domid_t domId, XenGnttabPtr gnttab, void* address,
+			  size_t count);
+	void run();
+};
+
 /***************************************************************************//**
  * Gran table buffer.
  * XenGnttabBuffer instance maps grant table reference(s) into local linear
@@ -117,6 +325,8 @@ public:
 
 private:
 	void* mBuffer;
+	domid_t mDomId;
+	XenGnttabPtr mGnttab;
 	xengnttab_handle* mHandle;
 	size_t mCount;
 	Log mLog;
@@ -126,6 +336,260 @@ private:
 	void release();
 };
 
+typedef std::shared_ptr<XenGnttabBuffer> XenGnttabBufferPtr;
+
+/***************************************************************************//**
+ * Scatter-gather list over grant table buffers.
+ * XenGnttabSgList collects segments of mapped grant buffers (page, offset
+ * and length as they are given in ring requests) and provides them as
+ * iovec array, which may be passed directly to writev(), readv(), preadv()
+ * etc. It allows to pass the guest data to the kernel without intermediate
+ * copy. The segments which are adjacent in the linear mapping are merged
+ * into one iovec entry.
+ *
+ * The list doesn't hold the buffers, so they should exist while the iovec
+ * array is used.
+ * @code
+ * XenGnttabSgList sgList;
+ *
+ * for (auto& seg : req.segments)
+ * {
+ *     sgList.addSegment(buffer, seg.page, seg.offset, seg.length);
+ * }
+ *
+ * writev(fd, sgList.getIoVec(), sgList.getIoVecCount());
+ * @endcode
+ * @ingroup xen
+ ******************************************************************************/
+class XenGnttabSgList
+{
+public:
+
+	XenGnttabSgList() : mSize(0) {}
+
+	/**
+	 * Adds segment which is located inside one page of the buffer
+	 * @param[in] buffer mapped buffer
+	 * @param[in] page   page index inside the buffer
+	 * @param[in] offset offset inside the page
+	 * @param[in] length segment length
+	 */
+	void addSegment(const XenGnttabBuffer& buffer, size_t page,
+					size_t offset, size_t length);
+
+	/**
+	 * Adds arbitrary range of the buffer
+	 * @param[in] buffer mapped buffer
+	 * @param[in] offset offset inside the buffer
+	 * @param[in] length range length
+	 */
+	void addRange(const XenGnttabBuffer& buffer, size_t offset,
+				  size_t length);
+
+	/**
+	 * Returns pointer to the iovec array
+	 */
+	const iovec* getIoVec() const { return mIoVec.data(); }
+
+	/**
+	 * Returns number of entries in the iovec array
+	 */
+	int getIoVecCount() const { return static_cast<int>(mIoVec.size()); }
+
+	/**
+	 * Returns total length of all segments
+	 */
+	size_t size() const { return mSize; }
+
+	/**
+	 * Removes all segments
+	 */
+	void clear();
+
+private:
+
+	std::vector<iovec> mIoVec;
+	size_t mSize;
+
+	void add(uint8_t* address, size_t length);
+};
+
+/***************************************************************************//**
+ * Grant table buffer described by page directory.
+ * Large buffers are shared by the frontend with the page directory: the chain
+ * of pages which contain the grant references of the buffer pages. Each
+ * directory page starts with the grant reference of the next directory page
+ * followed by the array of buffer grant references.
+ * XenGnttabDirBuffer walks the directory, collects the references and maps
+ * the whole buffer with one call into a contiguous linear buffer.
+ * @code
+ * XenGnttabDirBuffer buffer(domId, dirRef, numPages);
+ *
+ * memcpy(buffer.get(), data, buffer.size());
+ * @endcode
+ * @ingroup xen
+ ******************************************************************************/
+class XenGnttabDirBuffer
+{
+public:
+
+	/**
+	 * Page directory layout
+	 */
+	struct Directory
+	{
+		grant_ref_t nextRef;
+		grant_ref_t refs[1];
+	};
+
+	/**
+	 * Number of grant references in one directory page
+	 */
+	static const size_t cNumRefsPerPage =
+			(XC_PAGE_SIZE - sizeof(grant_ref_t)) / sizeof(grant_ref_t);
+
+	/**
+	 * @param[in] domId    domain id
+	 * @param[in] dirRef   grant reference of the first directory page
+	 * @param[in] numPages number of buffer pages
+	 * @param[in] prot     same flag as in mmap()
+	 */
+	XenGnttabDirBuffer(domid_t domId, grant_ref_t dirRef, size_t numPages,
+					   int prot = PROT_READ | PROT_WRITE);
+	XenGnttabDirBuffer(const XenGnttabDirBuffer&) = delete;
+	XenGnttabDirBuffer& operator=(XenGnttabDirBuffer const&) = delete;
+
+	/**
+	 * Returns pointer to the mapped buffer.
+	 */
+	void* get() const { return mBuffer->get(); }
+
+	/**
+	 * Returns size of the mapped buffer.
+	 */
+	size_t size() const { return mBuffer->size(); }
+
+	/**
+	 * Returns grant references of the buffer pages.
+	 */
+	const std::vector<grant_ref_t>& getRefs() const { return mRefs; }
+
+private:
+
+	std::vector<grant_ref_t> mRefs;
+	std::unique_ptr<XenGnttabBuffer> mBuffer;
+
+	void readDirectory(domid_t domId, grant_ref_t dirRef, size_t numPages);
+};
+
+/***************************************************************************//**
+ * Persistent grant mapping cache.
+ * XenGnttabCache keeps grant references mapped after they are released by
+ * the client, so the next request with the same domain id and grant
+ * reference reuses the existing mapping instead of mapping it again.
+ * The number of cached pages is limited by the page budget. When the budget
+ * is exceeded, the least recently used mappings which are not in use are
+ * unmapped. If all cached mappings are in use, the new mapping is returned
+ * uncached and is unmapped when its last handle is released.
+ * @code
+ * XenGnttabCache cache(256);
+ *
+ * auto buffer = cache.get(domId, ref);
+ *
+ * memcpy(buffer->get(), data, size);
+ *
+ * ...
+ *
+ * @endcode
+ * @ingroup xen
+ ******************************************************************************/
+class XenGnttabCache
+{
+public:
+
+	/**
+	 * @param[in] maxPages max number of cached pages
+	 */
+	explicit XenGnttabCache(size_t maxPages);
+	XenGnttabCache(const XenGnttabCache&) = delete;
+	XenGnttabCache& operator=(XenGnttabCache const&) = delete;
+
+	/**
+	 * Returns the buffer mapped to the grant reference. Maps the grant
+	 * reference if it is not in the cache.
+	 * @param[in] domId domain id
+	 * @param[in] ref   grant reference id
+	 * @return buffer handle
+	 */
+	XenGnttabBufferPtr get(domid_t domId, grant_ref_t ref);
+
+	/**
+	 * Removes the grant reference from the cache. The mapping is released
+	 * when the last handle is released.
+	 * @param[in] domId domain id
+	 * @param[in] ref   grant reference id
+	 */
+	void remove(domid_t domId, grant_ref_t ref);
+
+	/**
+	 * Removes all grant references of the domain from the cache
+	 * @param[in] domId domain id
+	 */
+	void remove(domid_t domId);
+
+	/**
+	 * Removes all grant references from the cache
+	 */
+	void clear();
+
+	/**
+	 * Returns number of cached pages
+	 */
+	size_t getNumPages() const;
+
+	/**
+	 * Returns max number of cached pages
+	 */
+	size_t getMaxPages() const { return mMaxPages; }
+
+	/**
+	 * Returns number of requests satisfied from the cache
+	 */
+	uint64_t getNumHits() const { return mNumHits; }
+
+	/**
+	 * Returns number of requests which required mapping
+	 */
+	uint64_t getNumMisses() const { return mNumMisses; }
+
+private:
+
+	typedef uint64_t Key;
+
+	struct Entry
+	{
+		XenGnttabBufferPtr buffer;
+		std::list<Key>::iterator lruPos;
+	};
+
+	size_t mMaxPages;
+	uint64_t mNumHits;
+	uint64_t mNumMisses;
+
+	mutable std::mutex mMutex;
+	std::list<Key> mLru;
+	std::unordered_map<Key, Entry> mEntries;
+
+	Log mLog;
+
+	static Key getKey(domid_t domId, grant_ref_t ref)
+	{
+		return (static_cast<Key>(domId) << 32) | ref;
+	}
+
+	bool evict();
+};
+
 }
 
 #endif /* SRC_XEN_XENGNTTAB_HPP_ */
@@ -21,9 +21,14 @@
 #ifndef SRC_XEN_XENSTAT_HPP_
 #define SRC_XEN_XENSTAT_HPP_
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
 #include <vector>
 
 #include "XenCtrl.hpp"
+#include "XenStore.hpp"
 #include "Log.hpp"
 #include "XenException.hpp"
 
@@ -40,11 +45,33 @@ class XenStatException : public XenException
 
 /***************************************************************************//**
  * Provides different Xen domains statistics.
+ *
+ * By default each call reads the domain list from the hypervisor. When the
+ * domain monitoring is started by startMonitoring(), XenStat watches
+ * @introduceDomain and @releaseDomain Xen store entries. The domain list is
+ * re-read only when one of them fires and the callbacks are called for
+ * created and destroyed domains. getExistingDoms() returns the cached list in
+ * this case. getRunningDoms() always reads the list as the running state
+ * changes without notification.
+ *
+ * @code
+ * XenStat xenStat;
+ *
+ * xenStat.startMonitoring(xenStore,
+ *     [] (domid_t domId) { ... },  // domain is created
+ *     [] (domid_t domId) { ... }); // domain is destroyed
+ * @endcode
  * @ingroup xen
  ******************************************************************************/
 class XenStat
 {
 public:
+
+	/**
+	 * Callback which is called when a domain is created or destroyed
+	 */
+	typedef std::function<void(domid_t domId)> DomainCallback;
+
 	XenStat();
 	~XenStat();
 
@@ -58,10 +85,44 @@ public:
 	 */
 	std::vector<domid_t> getExistingDoms();
 
+	/**
+	 * Returns generation of the domain table. The generation is changed
+	 * when a domain is created, destroyed or its state flags are changed.
+	 */
+	uint64_t getGeneration();
+
+	/**
+	 * Starts domain monitoring. The added callback is called for all
+	 * domains which exist when the monitoring is started as well. Callbacks
+	 * are called from the XenStore watch context.
+	 * @param[in] xenStore      XenStore instance to set watches
+	 * @param[in] added         callback called when a domain is created
+	 * @param[in] removed       callback called when a domain is destroyed
+	 * @param[in] errorCallback callback called when the domain list can't be
+	 *                          read
+	 */
+	void startMonitoring(XenStore& xenStore, DomainCallback added,
+						 DomainCallback removed,
+						 ErrorCallback errorCallback = nullptr);
+
+	/**
+	 * Stops domain monitoring
+	 */
+	void stopMonitoring();
+
 private:
 
 	XenInterface mInterface;
+	std::mutex mMutex;
+	DomainInfoSnapshot mSnapshot;
+	bool mCacheValid;
+	std::unordered_set<domid_t> mKnownDomIds;
+	DomainCallback mAddedCallback;
+	DomainCallback mRemovedCallback;
+	std::unique_ptr<XenStore::WatchGroup> mWatchGroup;
 	Log mLog;
+
+	void domainsChanged();
 };
 
 }
@@ -22,8 +22,13 @@
 #define INCLUDE_XENSTORE_HPP_
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
 #include <list>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -63,6 +68,219 @@ public:
 	 */
 	typedef std::function<void(const std::string& path)> WatchCallback;
 
+	/**
+	 * Entry of the batch read (see readBatch())
+	 */
+	struct BatchItem
+	{
+		/**
+		 * Type the entry value is parsed to
+		 */
+		enum class Type
+		{
+			STRING, INT, UINT
+		};
+
+		/**
+		 * Result of reading the entry
+		 */
+		enum class Status
+		{
+			OK, NOT_FOUND, INVALID
+		};
+
+		/**
+		 * @param[in] path path to the entry
+		 * @param[in] type type of the entry value
+		 */
+		explicit BatchItem(const std::string& path, Type type = Type::STRING) :
+			path(path), type(type), status(Status::NOT_FOUND),
+			intValue(0), uintValue(0) {}
+
+		std::string path;
+		Type type;
+		Status status;
+		int intValue;
+		unsigned int uintValue;
+		std::string stringValue;
+	};
+
+	/***********************************************************************
+	 * XS transaction.
+	 *
+	 * Groups several reads and writes into one atomic XS transaction. The
+	 * transaction is started in the constructor and aborted in the
+	 * destructor unless commit() has been called. commit() returns
+	 * <i>false</i> if XS daemon reports a conflict with a concurrent
+	 * transaction (EAGAIN). In this case the whole transaction should be
+	 * repeated. XenStore::runTransaction() does it automatically.
+	 **********************************************************************/
+	class Transaction
+	{
+	public:
+
+		/**
+		 * @param[in] xenStore XenStore instance the transaction belongs to
+		 */
+		explicit Transaction(XenStore& xenStore);
+		Transaction(const Transaction&) = delete;
+		Transaction& operator=(Transaction const&) = delete;
+		~Transaction();
+
+		/**
+		 * Read XS entry as integer.
+		 * @param[in] path path to the entry
+		 * @return integer value
+		 */
+		int readInt(const std::string& path);
+
+		/**
+		 * Read XS entry as unsigned integer.
+		 * @param[in] path path to the entry
+		 * @return integer value
+		 */
+		unsigned int readUint(const std::string& path);
+
+		/**
+		 * Read XS entry as string.
+		 * @param[in] path path to the entry
+		 * @return string value
+		 */
+		std::string readString(const std::string& path);
+
+		/**
+		 * Writes integer value into XS entry.
+		 * @param[in] path  path to the entry
+		 * @param[in] value integer value
+		 */
+		void writeInt(const std::string& path, int value);
+
+		/**
+		 * Writes unsigned value into XS entry.
+		 * @param[in] path  path to the entry
+		 * @param[in] value unsigned value
+		 */
+		void writeUint(const std::string& path, unsigned int value);
+
+		/**
+		 * Writes string value into XS entry.
+		 * @param[in] path  path to the entry
+		 * @param[in] value string value
+		 */
+		void writeString(const std::string& path, const std::string& value);
+
+		/**
+		 * Removes XS entry.
+		 * @param[in] path path to the entry
+		 */
+		void removePath(const std::string& path);
+
+		/**
+		 * Checks if XS entry exists.
+		 * @param[in] path path to the entry
+		 * @return <i>true</i> if the entry exists
+		 */
+		bool checkIfExist(const std::string& path);
+
+		/**
+		 * Reads XS directory
+		 * @param[in] path path to the directory
+		 * @return string vector of directory items
+		 */
+		std::vector<std::string> readDirectory(const std::string& path);
+
+		/**
+		 * Reads several XS entries within the transaction.
+		 * @param[in,out] items entries to read
+		 * @return number of successfully read entries
+		 */
+		size_t readBatch(std::vector<BatchItem>& items);
+
+		/**
+		 * Commits the transaction.
+		 * @return <i>true</i> if the transaction is committed and
+		 * <i>false</i> if it has to be repeated
+		 */
+		bool commit();
+
+		/**
+		 * Aborts the transaction. All changes are discarded.
+		 */
+		void abort();
+
+	private:
+
+		XenStore& mXenStore;
+		xs_transaction_t mId;
+
+		xs_transaction_t getId();
+	};
+
+	/**
+	 * Callback which fills the transaction
+	 */
+	typedef std::function<void(Transaction& transaction)> TransactionCallback;
+
+	/***********************************************************************
+	 * Group of XS watches.
+	 *
+	 * Allows several clients (for example frontend handlers) to share one
+	 * XenStore connection and its watches thread. Each group registers own
+	 * watches with own tokens, thus several groups may watch the same path.
+	 * Exceptions thrown by the group callbacks are passed to the group
+	 * error callback and don't stop the watches thread.
+	 *
+	 * clearWatches() (and the destructor) removes watches of the group only
+	 * and waits till a running callback of the group is finished unless it
+	 * is called from the callback itself.
+	 **********************************************************************/
+	class WatchGroup
+	{
+	public:
+
+		/**
+		 * @param[in] xenStore      XenStore instance which watches are
+		 *                          registered in
+		 * @param[in] errorCallback callback called when a watch callback of
+		 *                          the group throws an exception
+		 */
+		explicit WatchGroup(XenStore& xenStore,
+							ErrorCallback errorCallback = nullptr);
+		WatchGroup(const WatchGroup&) = delete;
+		WatchGroup& operator=(WatchGroup const&) = delete;
+		~WatchGroup();
+
+		/**
+		 * Sets watch for XS entry change.
+		 * @param[in] path     path to the entry
+		 * @param[in] callback callback which will be called when the entry
+		 *                     is changed
+		 */
+		void setWatch(const std::string& path, WatchCallback callback);
+
+		/**
+		 * Clears watch for XS entry change.
+		 * @param[in] path path to the entry.
+		 */
+		void clearWatch(const std::string& path);
+
+		/**
+		 * Clears all watches of the group.
+		 */
+		void clearWatches();
+
+	private:
+
+		XenStore& mXenStore;
+		uint64_t mId;
+		ErrorCallback mErrorCallback;
+	};
+
+	/**
+	 * Max number of attempts done by runTransaction()
+	 */
+	static const int cMaxTransactionAttempts = 16;
+
 	/**
 	 * @param errorCallback callback called on XS watches error
 	 */
@@ -72,7 +290,7 @@ public:
 	~XenStore();
 
 	/**
-	 * Returns the home path of the domain.
+	 * Returns the home path of the domain. The result is memoized.
 	 * @param domId domain id
 	 */
 	std::string getDomainPath(domid_t domId);
@@ -139,8 +357,90 @@ public:
 	 */
 	std::vector<std::string> readDirectory(const std::string& path);
 
+	/**
+	 * Reads several XS entries.
+	 *
+	 * Integer entries are parsed directly from the buffer returned by XS.
+	 * The result of each entry is stored in its status field: missing or
+	 * malformed entries don't throw. The entries are read one by one, use
+	 * Transaction::readBatch() to get a consistent snapshot.
+	 * @param[in,out] items entries to read
+	 * @return number of successfully read entries
+	 */
+	size_t readBatch(std::vector<BatchItem>& items);
+
+	/**
+	 * Reads XS entry as string asynchronously.
+	 *
+	 * Asynchronous requests of this instance are executed in order on the
+	 * shared I/O pool (see ThreadPool::getSharedIo()), thus the caller is
+	 * not blocked by XS daemon latency. Errors are reported through the
+	 * returned future. The destructor blocks until all queued requests are
+	 * finished.
+	 * @param[in] path path to the entry
+	 * @return future of the string value
+	 */
+	std::future<std::string> readStringAsync(const std::string& path);
+
+	/**
+	 * Writes string value into XS entry asynchronously.
+	 * @param[in] path  path to the entry
+	 * @param[in] value string value
+	 * @return future which is ready when the value is written
+	 */
+	std::future<void> writeStringAsync(const std::string& path,
+									   const std::string& value);
+
+	/**
+	 * Removes XS entry asynchronously.
+	 * @param[in] path path to the entry
+	 * @return future which is ready when the entry is removed
+	 */
+	std::future<void> removePathAsync(const std::string& path);
+
+	/**
+	 * Reads XS directory asynchronously.
+	 * @param[in] path path to the directory
+	 * @return future of the directory items
+	 */
+	std::future<std::vector<std::string>> readDirectoryAsync(
+			const std::string& path);
+
+	/**
+	 * Enables or disables the read cache.
+	 *
+	 * When the cache is enabled, values of entries located under active
+	 * watches (including absence of the entry) are stored after the first
+	 * read. A cached value is invalidated when the corresponding watch is
+	 * triggered or when the entry is written or removed through this
+	 * instance. Changes done by other XS clients become visible when the
+	 * watch fires, so the cache fits best when the entries are read from
+	 * the watch callbacks. Reads inside transactions are never cached.
+	 * @param[in] enabled <i>true</i> to enable the cache
+	 */
+	void setCacheEnabled(bool enabled);
+
+	/**
+	 * Returns number of reads served from the cache
+	 */
+	uint64_t getNumCacheHits() const { return mNumCacheHits; }
+
+	/**
+	 * Runs the callback inside XS transaction and commits it. If the commit
+	 * fails due to a conflict with a concurrent transaction, the callback is
+	 * called again in a new transaction. Thus the callback should not have
+	 * side effects other than XS accesses done through the transaction.
+	 * @param[in] callback callback which performs XS accesses
+	 */
+	void runTransaction(TransactionCallback callback);
+
 	/**
 	 * Sets watch for XS entry change.
+	 *
+	 * Watches are recursive: the callback is called when the entry or any
+	 * of its children is changed. The path of the changed entry is passed
+	 * to the callback. If the path is already watched, the callback is
+	 * replaced.
 	 * @param path       path to the entry
 	 * @param callback   callback which will be called when the entry is
 	 * changed
@@ -154,10 +454,34 @@ public:
 	void clearWatch(const std::string& path);
 
 	/**
-	 * Clears all watches.
+	 * Clears all watches set by setWatch(). Watches of watch groups are not
+	 * affected.
 	 */
 	void clearWatches();
 
+	/**
+	 * Sets executor for watch callbacks.
+	 *
+	 * By default the callbacks are called in the watches thread one by one.
+	 * When the executor is set, the watches thread only fetches the events
+	 * and the callbacks are called in the executor threads. Callbacks of one
+	 * watch group, or of one watch set by setWatch(), are called in order,
+	 * while callbacks of different groups may run concurrently. Exceptions
+	 * not handled by the group error callback are passed to the XenStore
+	 * error callback and don't stop the watches handling.
+	 *
+	 * Should be called before start().
+	 * @param[in] executor thread pool which calls the callbacks
+	 */
+	void setExecutor(ThreadPoolPtr executor);
+
+	/**
+	 * Sets configuration of the watches thread. Should be called before
+	 * start().
+	 * @param[in] config thread configuration
+	 */
+	void setThreadConfig(const ThreadConfig& config) { mThreadConfig = config; }
+
 	/**
 	 * Starts handling watches.
 	 */
@@ -168,6 +492,11 @@ public:
 	 */
 	void stop();
 
+	/**
+	 * Returns <i>true</i> if watches are handled
+	 */
+	bool isStarted() const { return mStarted; }
+
 private:
 
 	xs_handle*	mXsHandle;
@@ -175,21 +504,125 @@ private:
 	std::atomic_bool mStarted;
 	Log mLog;
 
-	std::unordered_map<std::string, WatchCallback> mWatches;
+	struct Watch
+	{
+		std::string path;
+		WatchCallback callback;
+		uint64_t group;
+		ErrorCallback errorCallback;
+	};
+
+	// path components trie, each watched node keeps tokens of its watches
+	struct WatchNode
+	{
+		std::unordered_map<std::string, std::unique_ptr<WatchNode>> children;
+		std::vector<std::string> tokens;
+	};
+
+	std::unordered_map<std::string, Watch> mWatches;
+	WatchNode mWatchTree;
+	uint64_t mNextToken;
+	uint64_t mNextGroup;
+	std::unordered_map<uint64_t, size_t> mRunningGroups;
+	std::condition_variable mCondVar;
+
+	// queue of events which callbacks are called in order by the executor
+	struct Strand
+	{
+		Strand() : running(false) {}
+
+		std::deque<std::pair<std::string, std::string>> events;
+		bool running;
+	};
+
+	ThreadPoolPtr mExecutor;
+	std::unordered_map<std::string, Strand> mStrands;
+
+	struct CacheEntry
+	{
+		bool exists;
+		std::string value;
+	};
+
+	std::atomic_bool mCacheEnabled;
+	std::atomic<uint64_t> mNumCacheHits;
+	uint64_t mCacheGeneration;
+	std::map<std::string, CacheEntry> mCache;
+	std::unordered_map<domid_t, std::string> mDomainPathes;
+	std::mutex mCacheMutex;
 
 	std::thread mThread;
+	ThreadConfig mThreadConfig;
 	std::mutex mMutex;
 
 	std::unique_ptr<PollFd> mPollFd;
 
+	std::unique_ptr<AsyncContext> mAsyncContext;
+	std::mutex mAsyncMutex;
+
 	void init();
 	void release();
 
+	template<typename T>
+	std::future<T> callAsync(std::function<T()> f)
+	{
+		auto task = std::make_shared<std::packaged_task<T()>>(f);
+
+		{
+			std::lock_guard<std::mutex> lock(mAsyncMutex);
+
+			if (!mAsyncContext)
+			{
+				mAsyncContext.reset(
+						new AsyncContext(ThreadPool::getSharedIo()));
+			}
+
+			mAsyncContext->call([task] { (*task)(); });
+		}
+
+		return task->get_future();
+	}
+
+	bool doReadValue(xs_transaction_t t, const std::string& path,
+					 std::string& value);
+	std::string doRead(xs_transaction_t t, const std::string& path);
+	void doWrite(xs_transaction_t t, const std::string& path,
+				 const std::string& value);
+	void doRemove(xs_transaction_t t, const std::string& path);
+	bool doCheckIfExist(xs_transaction_t t, const std::string& path);
+	std::vector<std::string> doReadDirectory(xs_transaction_t t,
+											 const std::string& path);
+	size_t doReadBatch(xs_transaction_t t, std::vector<BatchItem>& items);
+	bool readCached(const std::string& path, std::string& value,
+					bool& exists);
+	static void parseBatchItem(BatchItem& item, const char* data);
+
+	bool isCacheable(const std::string& path);
+	void invalidateCache(const std::string& path);
+
 	void watchesThread();
-	std::string checkXsWatch();
-	WatchCallback getWatchCallback(std::string& path);
+	bool checkXsWatch(std::string& path, std::string& token);
+	bool resolveWatch(const std::string& path, std::string& token,
+					  uint64_t& group);
+	void dispatchWatch(const std::string& path, std::string token);
+	void runStrand(const std::string& key);
+	void runWatch(const std::string& path, const std::string& token);
+
+	void addWatch(uint64_t group, const std::string& path,
+				  WatchCallback callback, ErrorCallback errorCallback);
+	void removeWatch(uint64_t group, const std::string& path);
+	void removeWatches(uint64_t group);
+	void waitForGroup(std::unique_lock<std::mutex>& lock, uint64_t group);
+
+	static std::vector<std::string> splitPath(const std::string& path);
+	WatchNode* findNode(const std::string& path, bool exact);
+	std::string findToken(const std::string& path, uint64_t group);
+	void insertWatch(const std::string& path, const std::string& token);
+	void eraseWatch(const std::string& path, const std::string& token);
 };
 
+typedef std::shared_ptr<XenStore> XenStorePtr;
+
 }
 
 #endif /* INCLUDE_XENSTORE_HPP_ */
@@ -20,26 +20,43 @@
 
 #include "BackendBase.hpp"
 
-#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <unistd.h>
 
 #include "Utils.hpp"
+#include "XenStat.hpp"
 
 using std::bind;
 using std::exception;
-using std::find_if;
-using std::list;
+using std::lock_guard;
 using std::make_pair;
+using std::mutex;
 using std::unique_ptr;
 using std::pair;
 using std::placeholders::_1;
-using std::stoi;
 using std::string;
+using std::stringstream;
 using std::to_string;
+using std::unique_lock;
+using std::unordered_map;
+using std::unordered_set;
 using std::vector;
 
 namespace XenBackend {
 
+namespace {
+
+const char* cHandoffMagic = "xenbe-handoff";
+const unsigned int cHandoffVersion = 1;
+
+}
+
 /***************************************************************************//**
  * @mainpage libxenbe
  *
@@ -80,7 +97,9 @@ BackendBase::BackendBase(const string& name, const string& deviceName,
 						 domid_t domId) :
 	mDomId(domId),
 	mDeviceName(deviceName),
-	mXenStore(),
+	mXenStore(new XenStore()),
+	mWatchGroup(*mXenStore),
+	mNumFrontendHandlers(0),
 	mLog(name.empty() ? "Backend" : name)
 {
 	LOG(mLog, DEBUG) << "Create backend, device: " << deviceName << ", "
@@ -91,12 +110,22 @@ BackendBase::~BackendBase()
 {
 	stop();
 
-	for(auto frontend : mFrontendHandlers)
+	auto frontends = getFrontendHandlers();
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mFrontendHandlers.clear();
+		mNumFrontendHandlers = 0;
+	}
+
+	for(auto frontend : frontends)
 	{
 		frontend->stop();
 	}
 
-	mFrontendHandlers.clear();
+	// the connection is shared with the frontend handlers
+	mXenStore->stop();
 
 	LOG(mLog, DEBUG) << "Delete";
 }
@@ -107,20 +136,263 @@ BackendBase::~BackendBase()
 
 void BackendBase::start()
 {
-	mXenStore.start();
+	// the connection is kept started by stop()
+	if (!mXenStore->isStarted())
+	{
+		mXenStore->setThreadConfig(mThreadConfig);
+		mXenStore->start();
+	}
+
+	mFrontendListPath = mXenStore->getDomainPath(mDomId) + "/backend/" +
+						mDeviceName;
 
-	string frontendListPath = mXenStore.getDomainPath(mDomId) + "/backend/" +
-							  mDeviceName;
+	// don't wait for the watch to find frontends which already exist
+	discoverFrontends();
 
-	mXenStore.setWatch(frontendListPath,
-					   bind(&BackendBase::frontendListChanged, this, _1));
+	// one recursive watch covers all domains and devices of the backend
+	mWatchGroup.setWatch(mFrontendListPath,
+						 bind(&BackendBase::frontendListChanged, this, _1));
 }
 
 void BackendBase::stop()
 {
-	mXenStore.clearWatches();
+	mWatchGroup.clearWatches();
+
+	// the XenStore connection is not stopped: frontend handlers and
+	// bring-ups in progress use it
+	unique_lock<mutex> lock(mMutex);
+
+	mCondVar.wait(lock, [this] { return mPendingFrontends.empty(); });
+}
+
+void BackendBase::saveHandoff(int fd)
+{
+	stop();
+
+	auto frontends = getFrontendHandlers();
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mFrontendHandlers.clear();
+		mNumFrontendHandlers = 0;
+	}
+
+	stringstream ss;
+
+	ss << cHandoffMagic << " " << cHandoffVersion << " " << mDeviceName
+	   << " " << mDomId << " " << frontends.size() << "\n";
+
+	for (auto frontend : frontends)
+	{
+		auto state = frontend->detach();
+
+		ss << state.domId << " " << state.devId << " "
+		   << state.rings.size() << "\n";
+
+		for (auto& ring : state.rings)
+		{
+			ss << ring.port << " " << ring.refs.size();
+
+			for (auto ref : ring.refs)
+			{
+				ss << " " << ref;
+			}
+
+			ss << " " << ring.indexes.size();
+
+			for (auto index : ring.indexes)
+			{
+				ss << " " << index;
+			}
+
+			ss << "\n";
+		}
+	}
+
+	auto data = ss.str();
+	size_t written = 0;
 
-	mXenStore.stop();
+	while (written < data.size())
+	{
+		auto ret = write(fd, &data[written], data.size() - written);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			throw BackendException("Can't write handoff state: " +
+								   string(strerror(errno)));
+		}
+
+		written += ret;
+	}
+
+	LOG(mLog, INFO) << "Save handoff state, frontends: " << frontends.size();
+}
+
+void BackendBase::loadHandoff(int fd)
+{
+	string data;
+	char buffer[4096];
+	ssize_t ret;
+
+	while ((ret = read(fd, buffer, sizeof(buffer))) != 0)
+	{
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			throw BackendException("Can't read handoff state: " +
+								   string(strerror(errno)));
+		}
+
+		data.append(buffer, ret);
+	}
+
+	stringstream ss(data);
+	string magic, deviceName;
+	unsigned int version = 0;
+	domid_t domId = 0;
+	size_t numFrontends = 0;
+
+	if (!(ss >> magic >> version >> deviceName >> domId >> numFrontends) ||
+		magic != cHandoffMagic || version != cHandoffVersion)
+	{
+		throw BackendException("Invalid handoff state");
+	}
+
+	if (deviceName != mDeviceName || domId != mDomId)
+	{
+		throw BackendException("Handoff state of other backend, device: " +
+							   deviceName + ", dom id: " + to_string(domId));
+	}
+
+	unordered_map<uint32_t, FrontendHandlerBase::HandoffState> states;
+
+	for (size_t i = 0; i < numFrontends; i++)
+	{
+		FrontendHandlerBase::HandoffState state;
+		size_t numRings = 0;
+
+		ss >> state.domId >> state.devId >> numRings;
+
+		for (size_t j = 0; ss && j < numRings; j++)
+		{
+			RingBufferBase::HandoffState ring;
+			size_t num = 0;
+
+			ss >> ring.port >> num;
+
+			for (size_t k = 0; ss && k < num; k++)
+			{
+				grant_ref_t ref = 0;
+
+				ss >> ref;
+
+				ring.refs.push_back(ref);
+			}
+
+			ss >> num;
+
+			for (size_t k = 0; ss && k < num; k++)
+			{
+				uint32_t index = 0;
+
+				ss >> index;
+
+				ring.indexes.push_back(index);
+			}
+
+			state.rings.push_back(ring);
+		}
+
+		if (!ss)
+		{
+			throw BackendException("Invalid handoff state");
+		}
+
+		states[getFrontendKey(state.domId, state.devId)] = state;
+	}
+
+	LOG(mLog, INFO) << "Load handoff state, frontends: " << states.size();
+
+	lock_guard<mutex> lock(mMutex);
+
+	mHandoffStates.swap(states);
+}
+
+void BackendBase::setBringUpPool(ThreadPoolPtr pool)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mBringUpPool = pool;
+}
+
+FrontendHandlerPtr BackendBase::getFrontendHandler(domid_t domId,
+												   uint16_t devId)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto domIt = mFrontendHandlers.find(domId);
+
+	if (domIt != mFrontendHandlers.end())
+	{
+		auto it = domIt->second.find(devId);
+
+		if (it != domIt->second.end())
+		{
+			return it->second;
+		}
+	}
+
+	return FrontendHandlerPtr();
+}
+
+vector<FrontendHandlerPtr> BackendBase::getFrontendHandlers()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	vector<FrontendHandlerPtr> frontends;
+
+	frontends.reserve(mNumFrontendHandlers);
+
+	for (auto& domain : mFrontendHandlers)
+	{
+		for (auto& device : domain.second)
+		{
+			frontends.push_back(device.second);
+		}
+	}
+
+	return frontends;
+}
+
+size_t BackendBase::getNumFrontendHandlers()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mNumFrontendHandlers;
+}
+
+vector<RingBufferStats> BackendBase::getRingBufferStats()
+{
+	vector<RingBufferStats> stats;
+
+	for (auto frontend : getFrontendHandlers())
+	{
+		auto frontendStats = frontend->getRingBufferStats();
+
+		stats.insert(stats.end(), frontendStats.begin(), frontendStats.end());
+	}
+
+	return stats;
 }
 
 /*******************************************************************************
@@ -135,119 +407,386 @@ void BackendBase::addFrontendHandler(FrontendHandlerPtr frontendHandler)
 		throw BackendException("Frontend already exists");
 	}
 
+	if (mEventLoop && !frontendHandler->getEventLoop())
+	{
+		frontendHandler->setEventLoop(mEventLoop);
+	}
+
+	if (!frontendHandler->getThreadConfig().isSet())
+	{
+		frontendHandler->setThreadConfig(mThreadConfig);
+	}
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		auto it = mHandoffStates.find(getFrontendKey(
+				frontendHandler->getDomId(), frontendHandler->getDevId()));
+
+		if (it != mHandoffStates.end())
+		{
+			frontendHandler->setHandoffState(it->second);
+
+			mHandoffStates.erase(it);
+		}
+	}
+
 	frontendHandler->start();
 
-	mFrontendHandlers.push_back(frontendHandler);
+	lock_guard<mutex> lock(mMutex);
+
+	mFrontendHandlers[frontendHandler->getDomId()]
+					 [frontendHandler->getDevId()] = frontendHandler;
+
+	mNumFrontendHandlers++;
 }
 
 /*******************************************************************************
  * Private
  ******************************************************************************/
 
-void BackendBase::frontendListChanged(const string& path)
+void BackendBase::discoverFrontends()
 {
-	LOG(mLog, DEBUG) << "Frontend list changed";
+	unordered_set<domid_t> existingDomIds;
+	bool checkExisting = false;
 
-	// create list of existing doms
-	list<domid_t> removeDomIds = mFrontendDomIds;
+	try
+	{
+		XenStat xenStat;
 
-	for (auto frontend : mXenStore.readDirectory(path))
+		for (auto domId : xenStat.getExistingDoms())
+		{
+			existingDomIds.insert(domId);
+		}
+
+		checkExisting = true;
+	}
+	catch(const exception& e)
 	{
-		domid_t domId = stoi(frontend);
+		LOG(mLog, WARNING) << "Can't get existing domains: " << e.what();
+	}
 
-		auto it = find_if(mFrontendDomIds.begin(), mFrontendDomIds.end(),
-						  [domId](domid_t val) { return val == domId; });
+	for (auto frontend : mXenStore->readDirectory(mFrontendListPath))
+	{
+		unsigned long domId;
 
-		if (it == mFrontendDomIds.end())
+		if (!parseId(frontend, DOMID_FIRST_RESERVED - 1, domId))
 		{
-			// add new dom
-			mFrontendDomIds.push_back(domId);
+			continue;
+		}
 
-			mXenStore.setWatch(path + "/" + to_string(domId),
-							   bind(&BackendBase::deviceListChanged, this,
-									_1, domId));
+		// stale entries are handled by the watch as usual
+		if (checkExisting && existingDomIds.find(domId) == existingDomIds.end())
+		{
+			LOG(mLog, DEBUG) << "Skip not existing domain, dom id: " << domId;
+
+			continue;
 		}
-		else
+
+		deviceListChanged(mFrontendListPath + "/" + frontend, domId);
+	}
+}
+
+void BackendBase::frontendListChanged(const string& path)
+{
+	// watches are recursive: the path may point to any entry of the backend
+	// subtree: <list path>/<dom id>/<dev id>/...
+
+	if (path.compare(0, mFrontendListPath.length(), mFrontendListPath) != 0)
+	{
+		rescanFrontends();
+
+		return;
+	}
+
+	vector<string> components;
+	stringstream ss(path.substr(mFrontendListPath.length()));
+	string component;
+
+	while (getline(ss, component, '/'))
+	{
+		if (!component.empty())
 		{
-			// remove existing from removing list
-			removeDomIds.remove(domId);
+			components.push_back(component);
 		}
 	}
 
-	// remove not existing doms
-	for(auto domId : removeDomIds)
+	unsigned long domId = 0, devId = 0;
+	const unsigned long maxDomId = DOMID_FIRST_RESERVED - 1;
+
+	if (components.empty() || !parseId(components[0], maxDomId, domId) ||
+		(components.size() > 1 && !parseId(components[1], UINT16_MAX, devId)))
 	{
-		mFrontendDomIds.remove(domId);
+		// the list itself or an unknown entry is changed
+		rescanFrontends();
+
+		return;
+	}
 
-		mXenStore.clearWatch(path + "/" + to_string(domId));
+	// entry of the existing device is changed, nothing to do
+	if (components.size() > 2 && isFrontendKnown(domId, devId))
+	{
+		return;
 	}
+
+	deviceListChanged(mFrontendListPath + "/" + to_string(domId), domId);
+}
+
+void BackendBase::rescanFrontends()
+{
+	LOG(mLog, DEBUG) << "Rescan frontends";
+
+	unordered_set<domid_t> domIds;
+
+	for (auto frontend : mXenStore->readDirectory(mFrontendListPath))
+	{
+		unsigned long domId;
+
+		if (parseId(frontend, DOMID_FIRST_RESERVED - 1, domId))
+		{
+			domIds.insert(domId);
+		}
+	}
+
+	// domains which frontends are not in the list anymore
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		for (auto& domain : mFrontendHandlers)
+		{
+			domIds.insert(domain.first);
+		}
+	}
+
+	for (auto domId : domIds)
+	{
+		deviceListChanged(mFrontendListPath + "/" + to_string(domId), domId);
+	}
+}
+
+bool BackendBase::isFrontendKnown(domid_t domId, uint16_t devId)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (mPendingFrontends.find(getFrontendKey(domId, devId)) !=
+		mPendingFrontends.end())
+	{
+		return true;
+	}
+
+	auto domIt = mFrontendHandlers.find(domId);
+
+	return domIt != mFrontendHandlers.end() &&
+		   domIt->second.find(devId) != domIt->second.end();
+}
+
+bool BackendBase::parseId(const string& str, unsigned long max,
+						  unsigned long& id)
+{
+	char* end = nullptr;
+
+	errno = 0;
+
+	id = strtoul(str.c_str(), &end, 10);
+
+	return !str.empty() && *end == '\0' && errno == 0 && id <= max;
 }
 
 void BackendBase::deviceListChanged(const string& path, domid_t domId)
 {
-	LOG(mLog, DEBUG) << "Device list changed";
+	LOG(mLog, DEBUG) << "Device list changed, dom id: " << domId;
 
-	list<FrontendHandlerPtr> removeFrontends;
+	unordered_set<uint16_t> devIds;
 
-	// create list of existing frontend
-	for (auto frontend : mFrontendHandlers)
+	for (auto device : mXenStore->readDirectory(path))
 	{
-		if (frontend->getDomId() == domId)
+		unsigned long devId;
+
+		if (!parseId(device, UINT16_MAX, devId))
+		{
+			continue;
+		}
+
+		devIds.insert(devId);
+
+		if (!getFrontendHandler(domId, devId))
 		{
-			removeFrontends.push_back(frontend);
+			bringUpFrontend(domId, devId);
 		}
 	}
 
-	for (auto device : mXenStore.readDirectory(path))
+	// remove not existing frontends
+	vector<FrontendHandlerPtr> removeFrontends;
+
 	{
-		uint16_t devId = stoi(device);
+		lock_guard<mutex> lock(mMutex);
 
-		auto frontend = getFrontendHandler(domId, devId);
+		auto domIt = mFrontendHandlers.find(domId);
 
-		if (!frontend)
+		if (domIt != mFrontendHandlers.end())
 		{
-			LOG(mLog, INFO) << "Create new frontend: "
-							<< Utils::logDomId(domId, devId);
+			auto& devices = domIt->second;
 
-			try
+			for (auto it = devices.begin(); it != devices.end();)
 			{
-				onNewFrontend(domId, devId);
+				if (devIds.find(it->first) == devIds.end())
+				{
+					removeFrontends.push_back(it->second);
+
+					it = devices.erase(it);
+
+					mNumFrontendHandlers--;
+				}
+				else
+				{
+					it++;
+				}
 			}
-			catch(const exception& e)
+
+			if (devices.empty())
 			{
-				LOG(mLog, ERROR) << e.what();
+				mFrontendHandlers.erase(domIt);
 			}
 		}
-		else
+
+		// cancel bring-up of removed devices which are still queued
+		for (auto key : mPendingFrontends)
 		{
-			// remove existing frontend from removing list
-			removeFrontends.remove(frontend);
+			if ((key >> 16) == domId &&
+				devIds.find(key & 0xFFFF) == devIds.end())
+			{
+				mCancelledFrontends.insert(key);
+			}
 		}
 	}
 
-	// remove not existing frontends
 	for(auto frontend : removeFrontends)
 	{
 		frontend->stop();
+	}
+}
+
+void BackendBase::createFrontend(domid_t domId, uint16_t devId)
+{
+	LOG(mLog, INFO) << "Create new frontend: "
+					<< Utils::logDomId(domId, devId);
 
-		mFrontendHandlers.remove(frontend);
+	try
+	{
+		onNewFrontend(domId, devId);
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
 	}
 }
 
-FrontendHandlerPtr BackendBase::getFrontendHandler(domid_t domId,
-												   uint16_t devId)
+void BackendBase::bringUpFrontend(domid_t domId, uint16_t devId)
 {
-	auto it = find_if(mFrontendHandlers.begin(), mFrontendHandlers.end(),
-					  [&](FrontendHandlerPtr frontend) {
-							return (frontend->getDomId() == domId) &&
-								   (frontend->getDevId() == devId); } );
+	ThreadPoolPtr pool;
 
-	if (it != mFrontendHandlers.end())
 	{
-		return *it;
+		lock_guard<mutex> lock(mMutex);
+
+		pool = mBringUpPool;
+
+		// the frontend is being created already, the device may be removed
+		// and added again meanwhile
+		if (pool && !mPendingFrontends.insert(
+				getFrontendKey(domId, devId)).second)
+		{
+			mCancelledFrontends.erase(getFrontendKey(domId, devId));
+
+			return;
+		}
 	}
 
-	return FrontendHandlerPtr();
+	if (!pool)
+	{
+		createFrontend(domId, devId);
+
+		return;
+	}
+
+	pool->call([this, domId, devId]
+	{
+		auto key = getFrontendKey(domId, devId);
+
+		if (!isBringUpCancelled(key))
+		{
+			createFrontend(domId, devId);
+		}
+
+		FrontendHandlerPtr frontend;
+
+		{
+			lock_guard<mutex> lock(mMutex);
+
+			// the device is removed while the frontend is being created
+			if (mCancelledFrontends.erase(key))
+			{
+				frontend = takeFrontendHandler(domId, devId);
+			}
+
+			mPendingFrontends.erase(key);
+
+			mCondVar.notify_all();
+		}
+
+		if (frontend)
+		{
+			LOG(mLog, INFO) << "Device is removed during bring-up: "
+							<< Utils::logDomId(domId, devId);
+
+			frontend->stop();
+		}
+	});
+}
+
+bool BackendBase::isBringUpCancelled(uint32_t key)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (mCancelledFrontends.find(key) == mCancelledFrontends.end())
+	{
+		return false;
+	}
+
+	LOG(mLog, INFO) << "Cancel bring-up of removed device: "
+					<< Utils::logDomId(key >> 16, key & 0xFFFF);
+
+	return true;
+}
+
+FrontendHandlerPtr BackendBase::takeFrontendHandler(domid_t domId,
+													uint16_t devId)
+{
+	FrontendHandlerPtr frontend;
+
+	auto domIt = mFrontendHandlers.find(domId);
+
+	if (domIt == mFrontendHandlers.end())
+	{
+		return frontend;
+	}
+
+	auto it = domIt->second.find(devId);
+
+	if (it != domIt->second.end())
+	{
+		frontend = it->second;
+
+		domIt->second.erase(it);
+
+		mNumFrontendHandlers--;
+	}
+
+	if (domIt->second.empty())
+	{
+		mFrontendHandlers.erase(domIt);
+	}
+
+	return frontend;
 }
 
 }
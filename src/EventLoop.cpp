@@ -0,0 +1,525 @@
+/*
+ *  Shared event loop
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "EventLoop.hpp"
+
+#include <cstring>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using std::chrono::microseconds;
+using std::exception;
+using std::lock_guard;
+using std::make_pair;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::unique_lock;
+using std::vector;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * EventLoop
+ ******************************************************************************/
+
+EventLoop::EventLoop(size_t numThreads, const vector<ThreadConfig>& configs) :
+	mNextId(1),
+	mTerminate(false),
+	mLog("EventLoop")
+{
+	try
+	{
+		init(numThreads, configs);
+	}
+	catch(const exception& e)
+	{
+		release();
+
+		throw;
+	}
+}
+
+EventLoop::~EventLoop()
+{
+	release();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void EventLoop::addFd(int fd, short int events, Callback callback,
+					  ErrorCallback errorCallback, int thread)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (mFds.find(fd) != mFds.end())
+	{
+		throw EventLoopException("Fd is already added: " + to_string(fd));
+	}
+
+	auto index = selectWorker(thread);
+	auto& worker = *mWorkers[index];
+	auto id = mNextId++;
+
+	epoll_event event {};
+
+	event.events = static_cast<uint16_t>(events);
+	event.data.u64 = id;
+
+	{
+		lock_guard<mutex> workerLock(worker.mutex);
+
+		if (epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			throw EventLoopException("Can't add fd: " + to_string(fd) + ", " +
+									 string(strerror(errno)));
+		}
+
+		worker.entries[id] = EntryPtr(new Entry { fd, callback,
+												  errorCallback });
+	}
+
+	worker.numEntries++;
+
+	mFds[fd] = make_pair(index, id);
+
+	DLOG(mLog, DEBUG) << "Add fd: " << fd << ", thread: " << index;
+}
+
+void EventLoop::removeFd(int fd)
+{
+	Worker* worker = nullptr;
+	uint64_t id = 0;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		auto it = mFds.find(fd);
+
+		if (it == mFds.end())
+		{
+			return;
+		}
+
+		worker = mWorkers[it->second.first].get();
+		id = it->second.second;
+
+		worker->numEntries--;
+
+		mFds.erase(it);
+	}
+
+	unique_lock<mutex> lock(worker->mutex);
+
+	removeEntry(*worker, id);
+
+	DLOG(mLog, DEBUG) << "Remove fd: " << fd;
+
+	// wait till the callback is finished, skip waiting if we are called from
+	// the callback itself
+
+	if (worker->thread.get_id() != std::this_thread::get_id())
+	{
+		worker->condVar.wait(lock, [worker, id]
+							 { return worker->runningId != id; });
+	}
+}
+
+EventLoop::TimerId EventLoop::addTimer(Callback callback,
+									  ErrorCallback errorCallback, int thread)
+{
+	auto fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+	if (fd < 0)
+	{
+		throw EventLoopException("Can't create timerfd: " +
+								 string(strerror(errno)));
+	}
+
+	TimerId id;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		id = mNextId++;
+
+		mTimers[id] = fd;
+	}
+
+	try
+	{
+		addFd(fd, POLLIN, [fd, callback]
+		{
+			uint64_t expirations;
+
+			// the timer could be disarmed after it has been expired
+			if (read(fd, &expirations, sizeof(expirations)) < 0)
+			{
+				if (errno == EAGAIN)
+				{
+					return;
+				}
+
+				throw EventLoopException("Error reading timerfd: " +
+										 string(strerror(errno)));
+			}
+
+			callback();
+		}, errorCallback, thread);
+	}
+	catch(const exception& e)
+	{
+		{
+			lock_guard<mutex> lock(mMutex);
+
+			mTimers.erase(id);
+		}
+
+		close(fd);
+
+		throw;
+	}
+
+	DLOG(mLog, DEBUG) << "Add timer: " << id;
+
+	return id;
+}
+
+void EventLoop::setTimer(TimerId id, microseconds timeout, microseconds period)
+{
+	itimerspec spec {};
+
+	spec.it_value.tv_sec = timeout.count() / 1000000;
+	spec.it_value.tv_nsec = (timeout.count() % 1000000) * 1000;
+	spec.it_interval.tv_sec = period.count() / 1000000;
+	spec.it_interval.tv_nsec = (period.count() % 1000000) * 1000;
+
+	// the lock prevents closing the timerfd by removeTimer()
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = mTimers.find(id);
+
+	if (it == mTimers.end())
+	{
+		throw EventLoopException("Timer not found: " + to_string(id));
+	}
+
+	if (timerfd_settime(it->second, 0, &spec, nullptr) < 0)
+	{
+		throw EventLoopException("Can't set timer: " + to_string(id) + ", " +
+								 string(strerror(errno)));
+	}
+}
+
+void EventLoop::removeTimer(TimerId id)
+{
+	int fd;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		auto it = mTimers.find(id);
+
+		if (it == mTimers.end())
+		{
+			return;
+		}
+
+		fd = it->second;
+
+		mTimers.erase(it);
+	}
+
+	removeFd(fd);
+
+	close(fd);
+
+	DLOG(mLog, DEBUG) << "Remove timer: " << id;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void EventLoop::init(size_t numThreads, const vector<ThreadConfig>& configs)
+{
+	if (numThreads == 0)
+	{
+		numThreads = thread::hardware_concurrency();
+	}
+
+	if (numThreads == 0)
+	{
+		numThreads = 1;
+	}
+
+	for (size_t i = 0; i < numThreads; i++)
+	{
+		std::unique_ptr<Worker> worker(new Worker());
+
+		worker->epollFd = -1;
+		worker->wakeupFd = -1;
+		worker->numEntries = 0;
+		worker->runningId = 0;
+
+		mWorkers.push_back(std::move(worker));
+
+		auto& newWorker = *mWorkers.back();
+
+		newWorker.epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+		if (newWorker.epollFd < 0)
+		{
+			throw EventLoopException("Can't create epoll: " +
+									 string(strerror(errno)));
+		}
+
+		newWorker.wakeupFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+		if (newWorker.wakeupFd < 0)
+		{
+			throw EventLoopException("Can't create eventfd: " +
+									 string(strerror(errno)));
+		}
+
+		epoll_event event {};
+
+		event.events = EPOLLIN;
+		event.data.u64 = 0;
+
+		if (epoll_ctl(newWorker.epollFd, EPOLL_CTL_ADD, newWorker.wakeupFd,
+					  &event) < 0)
+		{
+			throw EventLoopException("Can't add eventfd: " +
+									 string(strerror(errno)));
+		}
+
+		auto config = configs.empty() ? ThreadConfig() :
+										configs[i % configs.size()];
+
+		newWorker.thread = config.createThread([this, &newWorker]
+											   { workerThread(newWorker); });
+	}
+
+	LOG(mLog, DEBUG) << "Create event loop, threads: " << numThreads;
+}
+
+void EventLoop::release()
+{
+	mTerminate = true;
+
+	for (auto& worker : mWorkers)
+	{
+		if (worker->wakeupFd >= 0)
+		{
+			uint64_t value = 1;
+
+			if (write(worker->wakeupFd, &value, sizeof(value)) < 0)
+			{
+				LOG(mLog, ERROR) << "Can't wakeup thread: "
+								 << strerror(errno);
+			}
+		}
+
+		if (worker->thread.joinable())
+		{
+			worker->thread.join();
+		}
+
+		if (worker->wakeupFd >= 0)
+		{
+			close(worker->wakeupFd);
+		}
+
+		if (worker->epollFd >= 0)
+		{
+			close(worker->epollFd);
+		}
+	}
+
+	mWorkers.clear();
+	mFds.clear();
+
+	for (auto& timer : mTimers)
+	{
+		close(timer.second);
+	}
+
+	mTimers.clear();
+
+	LOG(mLog, DEBUG) << "Delete event loop";
+}
+
+size_t EventLoop::selectWorker(int thread)
+{
+	if (thread >= 0)
+	{
+		return static_cast<size_t>(thread) % mWorkers.size();
+	}
+
+	size_t index = 0;
+
+	for (size_t i = 1; i < mWorkers.size(); i++)
+	{
+		if (mWorkers[i]->numEntries < mWorkers[index]->numEntries)
+		{
+			index = i;
+		}
+	}
+
+	return index;
+}
+
+void EventLoop::removeEntry(Worker& worker, uint64_t id)
+{
+	auto it = worker.entries.find(id);
+
+	if (it == worker.entries.end())
+	{
+		return;
+	}
+
+	epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, it->second->fd, nullptr);
+
+	worker.entries.erase(it);
+}
+
+void EventLoop::removeFailedEntry(Worker& worker, uint64_t id, int fd)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = mFds.find(fd);
+
+	// the entry could be removed by removeFd() concurrently
+	if (it == mFds.end() || it->second.second != id)
+	{
+		return;
+	}
+
+	worker.numEntries--;
+
+	mFds.erase(it);
+
+	lock_guard<mutex> workerLock(worker.mutex);
+
+	removeEntry(worker, id);
+}
+
+void EventLoop::workerThread(Worker& worker)
+{
+	static const int cMaxEvents = 32;
+
+	epoll_event events[cMaxEvents];
+
+	while(!mTerminate)
+	{
+		auto numEvents = epoll_wait(worker.epollFd, events, cMaxEvents, -1);
+
+		if (numEvents < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			LOG(mLog, ERROR) << "Error polling files: " << strerror(errno);
+
+			break;
+		}
+
+		for (int i = 0; i < numEvents && !mTerminate; i++)
+		{
+			if (events[i].data.u64 == 0)
+			{
+				uint64_t value;
+
+				if (read(worker.wakeupFd, &value, sizeof(value)) < 0 &&
+					errno != EAGAIN)
+				{
+					LOG(mLog, ERROR) << "Error reading eventfd: "
+									 << strerror(errno);
+				}
+
+				continue;
+			}
+
+			handleEvent(worker, events[i].data.u64, events[i].events);
+		}
+	}
+}
+
+void EventLoop::handleEvent(Worker& worker, uint64_t id, uint32_t events)
+{
+	EntryPtr entry;
+
+	{
+		lock_guard<mutex> lock(worker.mutex);
+
+		auto it = worker.entries.find(id);
+
+		// the entry could be removed while we were handling other events
+		if (it == worker.entries.end())
+		{
+			return;
+		}
+
+		entry = it->second;
+
+		worker.runningId = id;
+	}
+
+	try
+	{
+		if (events & (EPOLLERR | EPOLLHUP))
+		{
+			throw EventLoopException("Error reading file");
+		}
+
+		entry->callback();
+	}
+	catch(const exception& e)
+	{
+		removeFailedEntry(worker, id, entry->fd);
+
+		if (entry->errorCallback)
+		{
+			entry->errorCallback(e);
+		}
+		else
+		{
+			LOG(mLog, ERROR) << e.what();
+		}
+	}
+
+	lock_guard<mutex> lock(worker.mutex);
+
+	worker.runningId = 0;
+
+	worker.condVar.notify_all();
+}
+
+}
@@ -35,6 +35,7 @@ extern "C" {
 using std::bind;
 using std::exception;
 using std::find;
+using std::find_if;
 using std::lock_guard;
 using std::make_pair;
 using std::mutex;
@@ -55,14 +56,23 @@ namespace XenBackend {
 FrontendHandlerBase::FrontendHandlerBase(const string& name,
 										 const string& devName,
 										 domid_t beDomId, domid_t feDomId,
-										 uint16_t devId) :
+										 uint16_t devId, XenStorePtr xenStore) :
 	mBeDomId(beDomId),
 	mFeDomId(feDomId),
 	mDevId(devId),
 	mDevName(devName),
 	mBackendState(XenbusStateUnknown),
 	mFrontendState(XenbusStateUnknown),
-	mXenStore(bind(&FrontendHandlerBase::onError, this, _1)),
+	mMaxRingPageOrder(0),
+	mMaxQueues(1),
+	mFastReconnect(false),
+	mDetached(false),
+	mHasHandoffState(false),
+	mResuming(false),
+	mXenStore(xenStore ? xenStore : XenStorePtr(new XenStore(
+			  bind(&FrontendHandlerBase::onError, this, _1)))),
+	mOwnXenStore(!xenStore),
+	mWatchGroup(*mXenStore, bind(&FrontendHandlerBase::onError, this, _1)),
 	mLog(name.empty() ? "FrontendHandler" : name)
 {
 	LOG(mLog, DEBUG) << Utils::logDomId(mFeDomId, mDevId)
@@ -70,7 +80,7 @@ FrontendHandlerBase::FrontendHandlerBase(const string& name,
 
 	initXenStorePathes();
 
-	mDomName = mXenStore.readString(mXenStore.getDomainPath(mFeDomId) +
+	mDomName = mXenStore->readString(mXenStore->getDomainPath(mFeDomId) +
 									"/name");
 }
 
@@ -88,31 +98,104 @@ FrontendHandlerBase::~FrontendHandlerBase()
 
 void FrontendHandlerBase::start()
 {
-	mXenStore.start();
+	if (mOwnXenStore)
+	{
+		mXenStore->setThreadConfig(mThreadConfig);
+		mXenStore->start();
+	}
 
-	setBackendState(XenbusStateInitialising);
+	if (!mHasHandoffState || !resume())
+	{
+		setBackendState(XenbusStateInitialising);
+	}
 
-	mXenStore.setWatch(mFeStatePath,
-					   bind(&FrontendHandlerBase::frontendStateChanged, this));
+	mWatchGroup.setWatch(mFeStatePath, bind(
+			&FrontendHandlerBase::frontendStateChanged, this));
 
-	mXenStore.setWatch(mBeStatePath,
-					   bind(&FrontendHandlerBase::backendStateChanged, this));
+	mWatchGroup.setWatch(mBeStatePath, bind(
+			&FrontendHandlerBase::backendStateChanged, this));
 }
 
 void FrontendHandlerBase::stop()
 {
-	mXenStore.clearWatches();
+	mWatchGroup.clearWatches();
 
-	mXenStore.stop();
+	if (mOwnXenStore)
+	{
+		mXenStore->stop();
+	}
 
 	close(XenbusStateClosed);
+
+	releaseParkedRingBuffers();
+}
+
+FrontendHandlerBase::HandoffState FrontendHandlerBase::detach()
+{
+	mWatchGroup.clearWatches();
+
+	if (mOwnXenStore)
+	{
+		mXenStore->stop();
+	}
+
+	lock_guard<mutex> lock(mMutex);
+
+	HandoffState state;
+
+	state.domId = mFeDomId;
+	state.devId = mDevId;
+
+	for (auto ringBuffer : mRingBuffers)
+	{
+		ringBuffer->stop();
+
+		state.rings.push_back(ringBuffer->saveState());
+	}
+
+	mRingBuffers.clear();
+	mParkedRingBuffers.clear();
+
+	// the frontend is handled by the new backend instance from now
+	mDetached = true;
+
+	LOG(mLog, INFO) << Utils::logDomId(mFeDomId, mDevId)
+					<< "Detach frontend, ring buffers: " << state.rings.size();
+
+	return state;
+}
+
+void FrontendHandlerBase::setHandoffState(const HandoffState& state)
+{
+	if (state.domId != mFeDomId || state.devId != mDevId)
+	{
+		throw FrontendHandlerException("Handoff state doesn't match frontend");
+	}
+
+	mHandoffRings = state.rings;
+	mHasHandoffState = true;
+}
+
+vector<RingBufferStats> FrontendHandlerBase::getRingBufferStats()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	vector<RingBufferStats> stats;
+
+	for (auto ringBuffer : mRingBuffers)
+	{
+		stats.push_back(ringBuffer->getStats());
+	}
+
+	return stats;
 }
 
 /*******************************************************************************
  * Protected
  ******************************************************************************/
 
-void FrontendHandlerBase::addRingBuffer(RingBufferPtr ringBuffer)
+void FrontendHandlerBase::addRingBuffer(RingBufferPtr ringBuffer,
+										  bool useEventLoop, int thread)
 {
 	lock_guard<mutex> lock(mMutex);
 
@@ -122,29 +205,305 @@ void FrontendHandlerBase::addRingBuffer(RingBufferPtr ringBuffer)
 					<< ringBuffer->getPort();
 
 	ringBuffer->setErrorCallback(bind(&FrontendHandlerBase::onError, this, _1));
+
+	if (mEventLoop && useEventLoop)
+	{
+		ringBuffer->setEventLoop(mEventLoop, thread);
+	}
+	else if (!ringBuffer->getThreadConfig().isSet())
+	{
+		ringBuffer->setThreadConfig(mThreadConfig);
+	}
+
+	// ring buffers created with the state from takeHandoffState() are
+	// already restored
+	if (mResuming && !ringBuffer->isRestored())
+	{
+		auto it = find_if(mHandoffRings.begin(), mHandoffRings.end(),
+						  [&ringBuffer] (const RingBufferBase::HandoffState& s)
+						  { return s.port == ringBuffer->getPort() &&
+								   s.refs == ringBuffer->getRefs(); });
+
+		if (it == mHandoffRings.end())
+		{
+			throw FrontendHandlerException("No handoff state for port: " +
+										   to_string(ringBuffer->getPort()));
+		}
+
+		ringBuffer->restoreState(*it);
+
+		mHandoffRings.erase(it);
+	}
+
 	ringBuffer->start();
 
 	mRingBuffers.push_back(ringBuffer);
 }
 
+RingBufferPtr FrontendHandlerBase::takeParkedRingBuffer(
+		evtchn_port_t port, const vector<grant_ref_t>& refs)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = find_if(mParkedRingBuffers.begin(), mParkedRingBuffers.end(),
+					  [port, &refs] (const RingBufferPtr& ringBuffer)
+					  { return ringBuffer->getPort() == port &&
+							   ringBuffer->getRefs() == refs; });
+
+	if (it == mParkedRingBuffers.end())
+	{
+		return nullptr;
+	}
+
+	auto ringBuffer = *it;
+
+	mParkedRingBuffers.erase(it);
+
+	// the frontend may have closed the channel and allocated the same port
+	// again, thus only the grant mapping is reused
+	try
+	{
+		ringBuffer->rebind();
+	}
+	catch(const XenException& e)
+	{
+		LOG(mLog, WARNING) << Utils::logDomId(mFeDomId, mDevId)
+						   << "Can't reuse ring buffer, port: " << port
+						   << ", " << e.what();
+
+		return nullptr;
+	}
+
+	ringBuffer->reset();
+
+	LOG(mLog, DEBUG) << Utils::logDomId(mFeDomId, mDevId)
+					 << "Reuse ring buffer, ref: " << ringBuffer->getRef()
+					 << ", port: " << port;
+
+	return ringBuffer;
+}
+
+bool FrontendHandlerBase::takeHandoffState(evtchn_port_t port,
+										  const vector<grant_ref_t>& refs,
+										  RingBufferBase::HandoffState& state)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (!mResuming)
+	{
+		return false;
+	}
+
+	auto it = find_if(mHandoffRings.begin(), mHandoffRings.end(),
+					  [port, &refs] (const RingBufferBase::HandoffState& s)
+					  { return s.port == port && s.refs == refs; });
+
+	if (it == mHandoffRings.end())
+	{
+		return false;
+	}
+
+	state = *it;
+
+	mHandoffRings.erase(it);
+
+	return true;
+}
+
+void FrontendHandlerBase::setMaxRingPageOrder(unsigned int order)
+{
+	LOG(mLog, DEBUG) << Utils::logDomId(mFeDomId, mDevId)
+					 << "Set max ring page order: " << order;
+
+	mMaxRingPageOrder = order;
+
+	mXenStore->writeUint(mXsBackendPath + "/max-ring-page-order", order);
+}
+
+vector<grant_ref_t> FrontendHandlerBase::readRingRefs(const string& path,
+													  const string& refName)
+{
+	auto basePath = path.empty() ? mXsFrontendPath : path;
+
+	// ring-page-order may be located in the ring path or in the frontend path
+	// (per queue rings)
+	auto orderPath = basePath + "/ring-page-order";
+
+	if (!mXenStore->checkIfExist(orderPath))
+	{
+		orderPath = mXsFrontendPath + "/ring-page-order";
+	}
+
+	vector<grant_ref_t> refs;
+
+	if (!mXenStore->checkIfExist(orderPath))
+	{
+		refs.push_back(mXenStore->readUint(basePath + "/" + refName));
+
+		return refs;
+	}
+
+	auto order = mXenStore->readUint(orderPath);
+
+	if (order > mMaxRingPageOrder)
+	{
+		throw FrontendHandlerException("Invalid ring page order: " +
+									   to_string(order));
+	}
+
+	size_t numRefs = 1 << order;
+
+	vector<XenStore::BatchItem> items;
+
+	items.reserve(numRefs);
+
+	for (size_t i = 0; i < numRefs; i++)
+	{
+		items.emplace_back(basePath + "/" + refName + to_string(i),
+						   XenStore::BatchItem::Type::UINT);
+	}
+
+	if (mXenStore->readBatch(items) != numRefs)
+	{
+		throw FrontendHandlerException("Can't read ring refs from: " +
+									   basePath);
+	}
+
+	refs.reserve(numRefs);
+
+	for (auto& item : items)
+	{
+		refs.push_back(item.uintValue);
+	}
+
+	LOG(mLog, DEBUG) << Utils::logDomId(mFeDomId, mDevId)
+					 << "Ring page order: " << order;
+
+	return refs;
+}
+
+void FrontendHandlerBase::setMaxQueues(unsigned int numQueues)
+{
+	LOG(mLog, DEBUG) << Utils::logDomId(mFeDomId, mDevId)
+					 << "Set max queues: " << numQueues;
+
+	mMaxQueues = numQueues;
+
+	mXenStore->writeUint(mXsBackendPath + "/multi-queue-max-queues",
+						 numQueues);
+}
+
+unsigned int FrontendHandlerBase::readNumQueues()
+{
+	auto path = mXsFrontendPath + "/multi-queue-num-queues";
+
+	if (!mXenStore->checkIfExist(path))
+	{
+		return 1;
+	}
+
+	auto numQueues = mXenStore->readUint(path);
+
+	if (numQueues == 0 || numQueues > mMaxQueues)
+	{
+		throw FrontendHandlerException("Invalid number of queues: " +
+									   to_string(numQueues));
+	}
+
+	return numQueues;
+}
+
+string FrontendHandlerBase::getQueuePath(unsigned int queue,
+										 unsigned int numQueues) const
+{
+	if (numQueues <= 1)
+	{
+		return mXsFrontendPath;
+	}
+
+	return mXsFrontendPath + "/queue-" + to_string(queue);
+}
+
+int FrontendHandlerBase::getQueueThread(unsigned int queue,
+										unsigned int numQueues) const
+{
+	if (!mEventLoop || numQueues <= 1)
+	{
+		return -1;
+	}
+
+	return (mFeDomId + mDevId + queue) % mEventLoop->getNumThreads();
+}
+
+vector<FrontendHandlerBase::QueueInfo> FrontendHandlerBase::readQueues(
+		const string& refName, const string& portName)
+{
+	auto numQueues = readNumQueues();
+
+	vector<QueueInfo> queues(numQueues);
+
+	for (unsigned int i = 0; i < numQueues; i++)
+	{
+		auto& queue = queues[i];
+
+		queue.index = i;
+		queue.path = getQueuePath(i, numQueues);
+		queue.refs = readRingRefs(queue.path, refName);
+		queue.port = mXenStore->readUint(queue.path + "/" + portName);
+		queue.thread = getQueueThread(i, numQueues);
+	}
+
+	LOG(mLog, DEBUG) << Utils::logDomId(mFeDomId, mDevId)
+					 << "Number of queues: " << numQueues;
+
+	return queues;
+}
+
 void FrontendHandlerBase::setBackendState(xenbus_state state)
+{
+	setBackendState(state, nullptr);
+}
+
+void FrontendHandlerBase::setBackendState(xenbus_state state,
+										  XenStore::TransactionCallback publish)
 {
 	lock_guard<mutex> lock(mMutex);
 
-	if (state == mBackendState)
+	auto changed = state != mBackendState;
+
+	if (!changed && !publish)
 	{
 		return;
 	}
 
-	LOG(mLog, INFO) << Utils::logDomId(mFeDomId, mDevId)
-					<< "Set backend state to: "
-					<< Utils::logState(state);
+	if (changed)
+	{
+		LOG(mLog, INFO) << Utils::logDomId(mFeDomId, mDevId)
+						<< "Set backend state to: "
+						<< Utils::logState(state);
+	}
 
 	auto path = mXsBackendPath + "/state";
 
-	mBackendState = state;
+	if (publish)
+	{
+		mXenStore->runTransaction([&publish, &path, state, changed]
+								 (XenStore::Transaction& transaction)
+		{
+			publish(transaction);
+
+			if (changed)
+			{
+				transaction.writeInt(path, state);
+			}
+		});
+	}
+	else
+	{
+		mXenStore->writeInt(path, state);
+	}
 
-	mXenStore.writeInt(path, state);
+	mBackendState = state;
 }
 
 void FrontendHandlerBase::onStateUnknown()
@@ -158,7 +517,7 @@ void FrontendHandlerBase::onStateInitializing()
 		LOG(mLog, WARNING) << Utils::logDomId(mFeDomId, mDevId)
 						   << "Frontend restarted";
 
-		close(XenbusStateInitWait);
+		close(XenbusStateInitWait, mFastReconnect);
 	}
 
 	if (mBackendState == XenbusStateInitialising ||
@@ -180,6 +539,8 @@ void FrontendHandlerBase::onStateInitialized()
 	{
 		onBind();
 
+		releaseParkedRingBuffers();
+
 		setBackendState(XenbusStateConnected);
 	}
 }
@@ -191,6 +552,8 @@ void FrontendHandlerBase::onStateConnected()
 	{
 		onBind();
 
+		releaseParkedRingBuffers();
+
 		setBackendState(XenbusStateConnected);
 	}
 }
@@ -231,7 +594,7 @@ void FrontendHandlerBase::initXenStorePathes()
 {
 	stringstream ss;
 
-	ss << mXenStore.getDomainPath(mFeDomId) << "/device/"
+	ss << mXenStore->getDomainPath(mFeDomId) << "/device/"
 	   << mDevName << "/" << mDevId;
 
 	mXsFrontendPath = ss.str();
@@ -239,7 +602,7 @@ void FrontendHandlerBase::initXenStorePathes()
 	ss.str("");
 	ss.clear();
 
-	ss << mXenStore.getDomainPath(mBeDomId) << "/backend/"
+	ss << mXenStore->getDomainPath(mBeDomId) << "/backend/"
 	   << mDevName << "/"
 	   << mFeDomId << "/" << mDevId;
 
@@ -255,14 +618,14 @@ void FrontendHandlerBase::initXenStorePathes()
 
 void FrontendHandlerBase::frontendStateChanged()
 {
-	if (!mXenStore.checkIfExist(mFeStatePath))
+	if (!mXenStore->checkIfExist(mFeStatePath))
 	{
 		stop();
 
 		return;
 	}
 
-	auto state = static_cast<xenbus_state>(mXenStore.readInt(mFeStatePath));
+	auto state = static_cast<xenbus_state>(mXenStore->readInt(mFeStatePath));
 
 	if (state == mFrontendState)
 	{
@@ -280,12 +643,12 @@ void FrontendHandlerBase::frontendStateChanged()
 
 void FrontendHandlerBase::backendStateChanged()
 {
-	if (!mXenStore.checkIfExist(mBeStatePath))
+	if (!mXenStore->checkIfExist(mBeStatePath))
 	{
 		return;
 	}
 
-	auto state = static_cast<xenbus_state>(mXenStore.readInt(mBeStatePath));
+	auto state = static_cast<xenbus_state>(mXenStore->readInt(mBeStatePath));
 
 	if (state == mBackendState)
 	{
@@ -345,7 +708,74 @@ void FrontendHandlerBase::onError(const std::exception& e)
 	mAsyncContext.call([this] () { close(XenbusStateInitWait); });
 }
 
-void FrontendHandlerBase::release()
+bool FrontendHandlerBase::resume()
+{
+	mHasHandoffState = false;
+
+	auto beState = mXenStore->checkIfExist(mBeStatePath) ?
+			static_cast<xenbus_state>(mXenStore->readInt(mBeStatePath)) :
+			XenbusStateUnknown;
+	auto feState = mXenStore->checkIfExist(mFeStatePath) ?
+			static_cast<xenbus_state>(mXenStore->readInt(mFeStatePath)) :
+			XenbusStateUnknown;
+
+	if (beState != XenbusStateConnected || feState != XenbusStateConnected)
+	{
+		LOG(mLog, WARNING) << Utils::logDomId(mFeDomId, mDevId)
+						   << "Can't resume frontend, backend state: "
+						   << Utils::logState(beState) << ", frontend state: "
+						   << Utils::logState(feState);
+
+		mHandoffRings.clear();
+
+		return false;
+	}
+
+	// the states are not written: the frontend doesn't notice the restart
+	mBackendState = XenbusStateConnected;
+	mFrontendState = XenbusStateConnected;
+
+	try
+	{
+		mResuming = true;
+
+		onBind();
+
+		mResuming = false;
+
+		if (!mHandoffRings.empty())
+		{
+			throw FrontendHandlerException("Ring buffers are not restored: " +
+										   to_string(mHandoffRings.size()));
+		}
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << Utils::logDomId(mFeDomId, mDevId)
+						 << "Can't resume frontend: " << e.what();
+
+		mResuming = false;
+
+		onClosing();
+
+		release(false);
+
+		mHandoffRings.clear();
+
+		// renegotiate from the beginning
+		mBackendState = XenbusStateUnknown;
+		mFrontendState = XenbusStateUnknown;
+
+		return false;
+	}
+
+	LOG(mLog, INFO) << Utils::logDomId(mFeDomId, mDevId)
+					<< "Frontend resumed, ring buffers: " << mRingBuffers.size();
+
+	return true;
+}
+
+void FrontendHandlerBase::release(bool park)
 {
 	lock_guard<mutex> lock(mMutex);
 
@@ -356,18 +786,51 @@ void FrontendHandlerBase::release()
 		ringBuffer->stop();
 	}
 
+	// parked ring buffers keep grant mappings and event channels till the
+	// frontend is bound again
+
+	mParkedRingBuffers.clear();
+
+	if (park)
+	{
+		mParkedRingBuffers.swap(mRingBuffers);
+	}
+
 	mRingBuffers.clear();
 }
 
-void FrontendHandlerBase::close(xenbus_state stateAfterClose)
+void FrontendHandlerBase::releaseParkedRingBuffers()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (!mParkedRingBuffers.empty())
+	{
+		LOG(mLog, DEBUG) << Utils::logDomId(mFeDomId, mDevId)
+						 << "Release parked ring buffers: "
+						 << mParkedRingBuffers.size();
+	}
+
+	mParkedRingBuffers.clear();
+}
+
+void FrontendHandlerBase::close(xenbus_state stateAfterClose, bool park)
 {
+	if (mDetached)
+	{
+		return;
+	}
+
 	if (mBackendState != XenbusStateClosed)
 	{
 		setBackendState(XenbusStateClosing);
 
 		onClosing();
 
-		release();
+		release(park);
+
+		// the frontend may free the granted pages once Closed is seen, thus
+		// the deferred unmapping of the ring buffers should be finished
+		XenGnttabUnmapQueue::getInstance().flush();
 
 		setBackendState(XenbusStateClosed);
 
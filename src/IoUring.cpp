@@ -0,0 +1,534 @@
+/*
+ *  io_uring I/O helper
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "IoUring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using std::exception;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace XenBackend {
+
+namespace {
+
+int ioUringSetup(unsigned entries, io_uring_params* params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+				 unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+				   nullptr, 0);
+}
+
+int ioUringRegister(int fd, unsigned opcode, const void* arg,
+					unsigned numArgs)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, numArgs);
+}
+
+unsigned* getRingField(void* ring, uint32_t offset)
+{
+	return reinterpret_cast<unsigned*>(static_cast<uint8_t*>(ring) + offset);
+}
+
+}
+
+/*******************************************************************************
+ * IoUring
+ ******************************************************************************/
+
+const unsigned IoUring::cDefaultEntries;
+const unsigned IoUring::cMaxBatchSize;
+
+IoUring::IoUring(EventLoopPtr eventLoop, unsigned entries,
+				 BatchCallback batchCallback, ErrorCallback errorCallback,
+				 int thread) :
+	mEventLoop(eventLoop),
+	mBatchCallback(batchCallback),
+	mFd(-1),
+	mEventFd(-1),
+	mSqRing(MAP_FAILED),
+	mSqRingSize(0),
+	mCqRing(MAP_FAILED),
+	mCqRingSize(0),
+	mSqes(nullptr),
+	mSqesSize(0),
+	mSqHead(nullptr),
+	mSqTail(nullptr),
+	mSqArray(nullptr),
+	mSqMask(0),
+	mSqEntries(0),
+	mCqHead(nullptr),
+	mCqTail(nullptr),
+	mCqes(nullptr),
+	mCqMask(0),
+	mCqEntries(0),
+	mNumQueued(0),
+	mBuffersRegistered(false),
+	mNextId(1),
+	mLog("IoUring")
+{
+	if (!mEventLoop)
+	{
+		throw IoUringException("Event loop is not set");
+	}
+
+	try
+	{
+		init(entries);
+
+		mEventLoop->addFd(mEventFd, POLLIN, [this] { handleCompletions(); },
+						  errorCallback, thread);
+	}
+	catch(const exception& e)
+	{
+		release();
+
+		throw;
+	}
+
+	LOG(mLog, DEBUG) << "Create io_uring, sq entries: " << mSqEntries
+					 << ", cq entries: " << mCqEntries;
+}
+
+IoUring::~IoUring()
+{
+	mEventLoop->removeFd(mEventFd);
+
+	if (!mCallbacks.empty())
+	{
+		LOG(mLog, WARNING) << "Destroy with pending requests: "
+						   << mCallbacks.size();
+	}
+
+	release();
+
+	LOG(mLog, DEBUG) << "Delete io_uring";
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool IoUring::isSupported()
+{
+	io_uring_params params {};
+
+	auto fd = ioUringSetup(1, &params);
+
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	close(fd);
+
+	return true;
+}
+
+void IoUring::read(int fd, void* buf, size_t len, off_t offset,
+				   Callback callback)
+{
+	queueRw(IORING_OP_READ, fd, buf, len, offset, std::move(callback));
+}
+
+void IoUring::write(int fd, const void* buf, size_t len, off_t offset,
+					Callback callback)
+{
+	queueRw(IORING_OP_WRITE, fd, buf, len, offset, std::move(callback));
+}
+
+void IoUring::readv(int fd, const iovec* iov, size_t count, off_t offset,
+					Callback callback)
+{
+	queueRw(IORING_OP_READV, fd, iov, count, offset, std::move(callback));
+}
+
+void IoUring::writev(int fd, const iovec* iov, size_t count, off_t offset,
+					 Callback callback)
+{
+	queueRw(IORING_OP_WRITEV, fd, iov, count, offset, std::move(callback));
+}
+
+void IoUring::readFixed(int fd, void* buf, size_t len, off_t offset,
+						unsigned index, Callback callback)
+{
+	queueRw(IORING_OP_READ_FIXED, fd, buf, len, offset, std::move(callback),
+			index);
+}
+
+void IoUring::writeFixed(int fd, const void* buf, size_t len, off_t offset,
+						 unsigned index, Callback callback)
+{
+	queueRw(IORING_OP_WRITE_FIXED, fd, buf, len, offset, std::move(callback),
+			index);
+}
+
+void IoUring::fsync(int fd, Callback callback)
+{
+	queueRw(IORING_OP_FSYNC, fd, nullptr, 0, 0, std::move(callback));
+}
+
+void IoUring::submit()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (mNumQueued)
+	{
+		enter(mNumQueued);
+	}
+}
+
+void IoUring::registerBuffers(const vector<iovec>& buffers)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (mBuffersRegistered)
+	{
+		ioUringRegister(mFd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+
+		mBuffersRegistered = false;
+	}
+
+	if (ioUringRegister(mFd, IORING_REGISTER_BUFFERS, buffers.data(),
+						buffers.size()) < 0)
+	{
+		throw IoUringException("Can't register buffers: " +
+							   string(strerror(errno)));
+	}
+
+	mBuffersRegistered = true;
+
+	DLOG(mLog, DEBUG) << "Register buffers: " << buffers.size();
+}
+
+void IoUring::unregisterBuffers()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (!mBuffersRegistered)
+	{
+		return;
+	}
+
+	if (ioUringRegister(mFd, IORING_UNREGISTER_BUFFERS, nullptr, 0) < 0)
+	{
+		throw IoUringException("Can't unregister buffers: " +
+							   string(strerror(errno)));
+	}
+
+	mBuffersRegistered = false;
+
+	DLOG(mLog, DEBUG) << "Unregister buffers";
+}
+
+size_t IoUring::getNumPending() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mCallbacks.size();
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void IoUring::init(unsigned entries)
+{
+	io_uring_params params {};
+
+	mFd = ioUringSetup(entries, &params);
+
+	if (mFd < 0)
+	{
+		throw IoUringException("Can't setup io_uring: " +
+							   string(strerror(errno)));
+	}
+
+	mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	mCqRingSize = params.cq_off.cqes +
+				  params.cq_entries * sizeof(io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+	}
+
+	mSqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+
+	if (mSqRing == MAP_FAILED)
+	{
+		throw IoUringException("Can't map submission queue: " +
+							   string(strerror(errno)));
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		mCqRing = mSqRing;
+	}
+	else
+	{
+		mCqRing = mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+
+		if (mCqRing == MAP_FAILED)
+		{
+			throw IoUringException("Can't map completion queue: " +
+								   string(strerror(errno)));
+		}
+	}
+
+	mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+	auto sqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+
+	if (sqes == MAP_FAILED)
+	{
+		throw IoUringException("Can't map submission entries: " +
+							   string(strerror(errno)));
+	}
+
+	mSqes = static_cast<io_uring_sqe*>(sqes);
+
+	mSqHead = getRingField(mSqRing, params.sq_off.head);
+	mSqTail = getRingField(mSqRing, params.sq_off.tail);
+	mSqArray = getRingField(mSqRing, params.sq_off.array);
+	mSqMask = *getRingField(mSqRing, params.sq_off.ring_mask);
+	mSqEntries = params.sq_entries;
+
+	mCqHead = getRingField(mCqRing, params.cq_off.head);
+	mCqTail = getRingField(mCqRing, params.cq_off.tail);
+	mCqes = reinterpret_cast<io_uring_cqe*>(
+			static_cast<uint8_t*>(mCqRing) + params.cq_off.cqes);
+	mCqMask = *getRingField(mCqRing, params.cq_off.ring_mask);
+	mCqEntries = params.cq_entries;
+
+	mEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (mEventFd < 0)
+	{
+		throw IoUringException("Can't create eventfd: " +
+							   string(strerror(errno)));
+	}
+
+	if (ioUringRegister(mFd, IORING_REGISTER_EVENTFD, &mEventFd, 1) < 0)
+	{
+		throw IoUringException("Can't register eventfd: " +
+							   string(strerror(errno)));
+	}
+
+	mCallbacks.reserve(mCqEntries);
+	mCompleted.reserve(cMaxBatchSize);
+}
+
+void IoUring::release()
+{
+	if (mSqes)
+	{
+		munmap(mSqes, mSqesSize);
+	}
+
+	if (mCqRing != MAP_FAILED && mCqRing != mSqRing)
+	{
+		munmap(mCqRing, mCqRingSize);
+	}
+
+	if (mSqRing != MAP_FAILED)
+	{
+		munmap(mSqRing, mSqRingSize);
+	}
+
+	if (mEventFd >= 0)
+	{
+		close(mEventFd);
+	}
+
+	if (mFd >= 0)
+	{
+		close(mFd);
+	}
+}
+
+io_uring_sqe* IoUring::getSqe(Callback&& callback)
+{
+	if (mCallbacks.size() >= mCqEntries)
+	{
+		throw IoUringException("Too many requests in flight: " +
+							   to_string(mCallbacks.size()));
+	}
+
+	auto tail = *mSqTail;
+
+	if (tail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) >= mSqEntries)
+	{
+		// submission queue is full: pass queued requests to the kernel
+		enter(mNumQueued);
+
+		if (tail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) >= mSqEntries)
+		{
+			throw IoUringException("Submission queue is full");
+		}
+	}
+
+	auto index = tail & mSqMask;
+	auto sqe = &mSqes[index];
+	auto id = mNextId++;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->user_data = id;
+
+	mSqArray[index] = index;
+
+	// the kernel reads the entry after the tail update
+	__atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+
+	mCallbacks[id] = std::move(callback);
+
+	mNumQueued++;
+
+	return sqe;
+}
+
+void IoUring::queueRw(uint8_t opcode, int fd, const void* addr, size_t len,
+					  off_t offset, Callback&& callback, unsigned index)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto sqe = getSqe(std::move(callback));
+
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uintptr_t>(addr);
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->buf_index = index;
+}
+
+void IoUring::enter(unsigned toSubmit)
+{
+	while (toSubmit)
+	{
+		auto ret = ioUringEnter(mFd, toSubmit, 0, 0);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			throw IoUringException("Can't submit requests: " +
+								   string(strerror(errno)));
+		}
+
+		if (ret == 0)
+		{
+			break;
+		}
+
+		toSubmit -= ret;
+		mNumQueued -= ret;
+	}
+}
+
+void IoUring::handleCompletions()
+{
+	uint64_t value;
+
+	if (::read(mEventFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+	{
+		throw IoUringException("Can't read eventfd: " +
+							   string(strerror(errno)));
+	}
+
+	bool completed = false;
+
+	while (true)
+	{
+		mCompleted.clear();
+
+		{
+			lock_guard<mutex> lock(mMutex);
+
+			// only this thread consumes completions
+			auto head = *mCqHead;
+			auto tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+
+			for (; head != tail && mCompleted.size() < cMaxBatchSize; head++)
+			{
+				auto& cqe = mCqes[head & mCqMask];
+				auto it = mCallbacks.find(cqe.user_data);
+
+				if (it != mCallbacks.end())
+				{
+					mCompleted.emplace_back(std::move(it->second), cqe.res);
+
+					mCallbacks.erase(it);
+				}
+			}
+
+			__atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+		}
+
+		if (mCompleted.empty())
+		{
+			break;
+		}
+
+		DLOG(mLog, DEBUG) << "Handle completions: " << mCompleted.size();
+
+		for (auto& completion : mCompleted)
+		{
+			if (completion.first)
+			{
+				completion.first(completion.second);
+			}
+		}
+
+		completed = true;
+	}
+
+	if (completed && mBatchCallback)
+	{
+		mBatchCallback();
+	}
+}
+
+}
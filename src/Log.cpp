@@ -22,8 +22,14 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <ctime>
 #include <iomanip>
 #include <iostream>
+#include <thread>
+#include <unordered_map>
+
+#include "LogSink.hpp"
 
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
@@ -31,18 +37,19 @@ using std::chrono::system_clock;
 using std::chrono::system_clock;
 using std::cout;
 using std::endl;
-using std::localtime;
 using std::lock_guard;
 using std::make_pair;
 using std::mutex;
 using std::ostringstream;
 using std::pair;
 using std::put_time;
-using std::setfill;
-using std::setw;
+using std::shared_ptr;
 using std::string;
+using std::time_t;
 using std::to_string;
 using std::transform;
+using std::unique_ptr;
+using std::unordered_map;
 using std::vector;
 
 namespace XenBackend {
@@ -53,12 +60,99 @@ namespace XenBackend {
 
 LogLevel Log::sCurrentLevel(LogLevel::logINFO);
 bool Log::sShowFileAndLine(false);
-string Log::sLogMask;
-vector<pair<string, LogLevel>> Log::sLogMaskItems;
+std::atomic<LogSink*> Log::sSink(nullptr);
+std::atomic<int> Log::sSinkUsers(0);
+shared_ptr<LogSink> Log::sSinkHolder;
+mutex Log::sSinkMutex;
+
+const int8_t LogCategory::cNotSet;
 
 /// @cond HIDDEN_SYMBOLS
 
-size_t LogLine::sAlignmentLength = 0;
+std::atomic<size_t> LogLine::sAlignmentLength(0);
+
+namespace {
+
+typedef vector<pair<string, LogLevel>> MaskItems;
+
+struct CategoryRegistry
+{
+	mutex registryMutex;
+	string mask;
+	MaskItems maskItems;
+	unordered_map<string, unique_ptr<LogCategory>> categories;
+};
+
+CategoryRegistry& getRegistry()
+{
+	// Log instances may be created during static initialization of other
+	// translation units
+	static CategoryRegistry registry;
+
+	return registry;
+}
+
+int getMaskLevel(const MaskItems& items, const string& name)
+{
+	int level = LogCategory::cNotSet;
+
+	// the last matched item wins
+	for (auto& item : items)
+	{
+		if (!item.first.empty() && item.first.back() == '*')
+		{
+			if (name.compare(0, item.first.length() - 1, item.first, 0,
+							 item.first.length() - 1) == 0)
+			{
+				level = static_cast<int>(item.second);
+			}
+		}
+		else if (item.first == name)
+		{
+			level = static_cast<int>(item.second);
+		}
+	}
+
+	return level;
+}
+
+void splitMask(const string& mask, vector<string>& splitVector, char delim)
+{
+	size_t curPos = 0;
+	size_t delimPos = 0;
+
+	splitVector.clear();
+
+	if (mask.empty())
+	{
+		return;
+	}
+
+	do
+	{
+		delimPos = mask.find(delim, curPos);
+
+		if (delimPos != string::npos)
+		{
+			splitVector.push_back(mask.substr(curPos, delimPos - curPos));
+
+			curPos = ++delimPos;
+
+			if (delimPos == mask.length())
+			{
+				delimPos = string::npos;
+			}
+		}
+		else
+		{
+			splitVector.push_back(mask.substr(curPos, mask.length() -
+											  curPos));
+		}
+	}
+	while (delimPos != string::npos);
+}
+
+}
 
 /*******************************************************************************
  * Log
@@ -75,13 +169,10 @@ bool Log::setLogLevel(const string& strLevel)
 
 bool Log::setLogMask(const string& mask)
 {
-	sLogMask = mask;
-
 	vector<string> items;
+	MaskItems maskItems;
 
-	splitMask(items, ';');
-
-	sLogMaskItems.clear();
+	splitMask(mask, items, ';');
 
 	for(auto item : items)
 	{
@@ -98,43 +189,84 @@ bool Log::setLogMask(const string& mask)
 		{
 			if (!getLogLevelByString(item.substr(sepPos + 1), logLevel))
 			{
-				sLogMaskItems.clear();
+				maskItems.clear();
 
-				return false;
+				break;
 			}
 		}
 
-		sLogMaskItems.push_back(make_pair(item.substr(0, sepPos), logLevel));
+		maskItems.push_back(make_pair(item.substr(0, sepPos), logLevel));
 	}
 
-	return true;
+	auto& registry = getRegistry();
+
+	lock_guard<mutex> lock(registry.registryMutex);
+
+	registry.mask = mask;
+	registry.maskItems = maskItems;
+
+	// apply the mask centrally: instances read the level from the category
+	for (auto& category : registry.categories)
+	{
+		category.second->maskLevel.store(getMaskLevel(maskItems,
+													  category.first),
+										 std::memory_order_relaxed);
+	}
+
+	return maskItems.size() == items.size();
+}
+
+string Log::getLogMask()
+{
+	auto& registry = getRegistry();
+
+	lock_guard<mutex> lock(registry.registryMutex);
+
+	return registry.mask;
+}
+
+void Log::setSink(shared_ptr<LogSink> sink)
+{
+	lock_guard<mutex> lock(sSinkMutex);
+
+	sSink = sink.get();
+
+	// wait till the logging threads release the previous sink
+	while (sSinkUsers)
+	{
+		std::this_thread::yield();
+	}
+
+	sSinkHolder = sink;
 }
 
 /*******************************************************************************
  * Private
  ******************************************************************************/
 
-void Log::setLogLevelByMask()
+const LogCategory* Log::getCategory(const string& name)
 {
-	for(auto item : sLogMaskItems)
-	{
-		if (item.first.back() == '*')
-		{
-			item.first.pop_back();
+	auto& registry = getRegistry();
 
-			if (mName.compare(0, item.first.length(), item.first) == 0)
-			{
-				mLevel = item.second;
-			}
-		}
-		else
-		{
-			if (item.first == mName)
-			{
-				mLevel = item.second;
-			}
-		}
+	lock_guard<mutex> lock(registry.registryMutex);
+
+	auto it = registry.categories.find(name);
+
+	if (it != registry.categories.end())
+	{
+		return it->second.get();
 	}
+
+	unique_ptr<LogCategory> category(new LogCategory());
+
+	category->name = name;
+	category->maskLevel = getMaskLevel(registry.maskItems, name);
+
+	auto result = category.get();
+
+	registry.categories[name] = std::move(category);
+
+	return result;
 }
 
 bool Log::getLogLevelByString(const string& strLevel, LogLevel& level)
@@ -167,52 +299,32 @@ bool Log::getLogLevelByString(const string& strLevel, LogLevel& level)
 	return false;
 }
 
-void Log::splitMask(vector<string>& splitVector, char delim)
-{
-	size_t curPos = 0;
-	size_t delimPos = 0;
+/*******************************************************************************
+ * LogLine
+ ******************************************************************************/
 
-	splitVector.clear();
+mutex LogLine::mMutex;
 
-	if (sLogMask.empty())
+LogLine::~LogLine()
+{
+	if (mCurrentLevel <= mSetLevel && mSetLevel > LogLevel::logDISABLE)
 	{
-		return;
-	}
+		Log::sSinkUsers++;
 
-	do
-	{
-		delimPos = sLogMask.find(delim, curPos);
+		auto sink = Log::sSink.load();
 
-		if (delimPos != string::npos)
+		if (sink)
 		{
-			splitVector.push_back(sLogMask.substr(curPos, delimPos - curPos));
+			sink->push(mCurrentLevel, mStream.str());
+		}
 
-			curPos = ++delimPos;
+		Log::sSinkUsers--;
 
-			if (delimPos == sLogMask.length())
-			{
-				delimPos = string::npos;
-			}
-		}
-		else
+		if (sink)
 		{
-			splitVector.push_back(sLogMask.substr(curPos, sLogMask.length() -
-												  curPos));
+			return;
 		}
-	}
-	while (delimPos != string::npos);
-}
 
-/*******************************************************************************
- * LogLine
- ******************************************************************************/
-
-mutex LogLine::mMutex;
-
-LogLine::~LogLine()
-{
-	if (mCurrentLevel <= mSetLevel && mSetLevel > LogLevel::logDISABLE)
-	{
 		mStream << endl;
 
 		lock_guard<mutex> lock(mMutex);
@@ -230,15 +342,15 @@ ostringstream& LogLine::get(const Log& log, const char* file,
 							int line, LogLevel level)
 {
 	mCurrentLevel = level;
-	mSetLevel = log.mLevel;
+	mSetLevel = log.getLevel();
 
-	if (log.mFileAndLine)
+	if (log.getFileAndLine())
 	{
 		putHeader(string(file) + " " + to_string(line));
 	}
 	else
 	{
-		putHeader(log.mName);
+		putHeader(log.getName());
 	}
 
 	return mStream;
@@ -270,14 +382,22 @@ void LogLine::putHeader(const string& header)
 {
 	if (mCurrentLevel <= mSetLevel && mSetLevel > LogLevel::logDISABLE)
 	{
-		if (header.length() > sAlignmentLength)
+		auto alignment = sAlignmentLength.load(std::memory_order_relaxed);
+
+		while (header.length() > alignment &&
+			   !sAlignmentLength.compare_exchange_weak(alignment,
+													   header.length()))
+		{
+		}
+
+		if (header.length() > alignment)
 		{
-			sAlignmentLength = header.length();
+			alignment = header.length();
 		}
 
 		mStream << nowTime()
 				<< " | " << header << " "
-				<< string(sAlignmentLength - header.length(), ' ') << "| "
+				<< string(alignment - header.length(), ' ') << "| "
 				<< levelToString(mCurrentLevel) << " - ";
 	}
 }
@@ -291,16 +411,33 @@ string LogLine::levelToString(LogLevel level)
 
 string LogLine::nowTime()
 {
+	// the date and time part changes once per second, keep it formatted
+	thread_local time_t tLastTime = 0;
+	thread_local string tLastTimeStr;
+
 	auto now = system_clock::now();
 	auto time = system_clock::to_time_t(now);
 	auto ms = duration_cast<milliseconds>(now.time_since_epoch()) % 1000;
 
-	std::stringstream ss;
+	if (time != tLastTime || tLastTimeStr.empty())
+	{
+		std::tm tm;
+
+		localtime_r(&time, &tm);
+
+		std::stringstream ss;
+
+		ss << put_time(&tm, "%d.%m.%y %X.");
+
+		tLastTime = time;
+		tLastTimeStr = ss.str();
+	}
+
+	char msStr[4];
 
-	ss << put_time(localtime(&time), "%d.%m.%y %X.")
-	   << setfill('0') << setw(3) << ms.count();
+	snprintf(msStr, sizeof(msStr), "%03d", static_cast<int>(ms.count()));
 
-	return ss.str();
+	return tLastTimeStr + msStr;
 }
 
 /// @endcond
@@ -0,0 +1,330 @@
+/*
+ *  Asynchronous log sink
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "LogSink.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * LogFdOutput
+ ******************************************************************************/
+
+void LogFdOutput::write(const vector<LogRecord>& records)
+{
+	mBuffer.clear();
+
+	for (auto& record : records)
+	{
+		mBuffer += record.text;
+		mBuffer += '\n';
+	}
+
+	size_t offset = 0;
+
+	while (offset < mBuffer.size())
+	{
+		auto size = ::write(mFd, &mBuffer[offset], mBuffer.size() - offset);
+
+		if (size < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			// there is no place to report the error
+			return;
+		}
+
+		offset += size;
+	}
+}
+
+/*******************************************************************************
+ * LogFileOutput
+ ******************************************************************************/
+
+LogFileOutput::LogFileOutput(const string& path) :
+	LogFdOutput(-1)
+{
+	mFd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	if (mFd < 0)
+	{
+		throw LogSinkException("Can't open log file: " + path + ", " +
+							   string(strerror(errno)));
+	}
+}
+
+LogFileOutput::~LogFileOutput()
+{
+	close(mFd);
+}
+
+/*******************************************************************************
+ * LogSyslogOutput
+ ******************************************************************************/
+
+LogSyslogOutput::LogSyslogOutput(const string& ident) :
+	mIdent(ident)
+{
+	// openlog keeps the pointer, mIdent lives till closelog
+	openlog(mIdent.c_str(), LOG_PID, LOG_DAEMON);
+}
+
+LogSyslogOutput::~LogSyslogOutput()
+{
+	closelog();
+}
+
+void LogSyslogOutput::write(const vector<LogRecord>& records)
+{
+	static const int priorities[] = {LOG_DEBUG, LOG_ERR, LOG_WARNING,
+									 LOG_INFO, LOG_DEBUG};
+
+	for (auto& record : records)
+	{
+		syslog(priorities[static_cast<int>(record.level)], "%s",
+			   record.text.c_str());
+	}
+}
+
+/*******************************************************************************
+ * LogSink
+ ******************************************************************************/
+
+const size_t LogSink::cDefaultCapacity;
+const size_t LogSink::cMaxBatchSize;
+
+LogSink::LogSink(LogOutputPtr output, size_t capacity,
+				 OverflowPolicy policy) :
+	mOutput(std::move(output)),
+	mPolicy(policy),
+	mMask(0),
+	mEnqueuePos(0),
+	mDequeuePos(0),
+	mNumWritten(0),
+	mNumDropped(0),
+	mTerminate(false),
+	mWriterWaiting(false)
+{
+	if (!mOutput)
+	{
+		throw LogSinkException("Log output is not set");
+	}
+
+	size_t size = 2;
+
+	while (size < capacity)
+	{
+		size <<= 1;
+	}
+
+	mMask = size - 1;
+	mCells.reset(new Cell[size]);
+
+	for (size_t i = 0; i < size; i++)
+	{
+		mCells[i].sequence.store(i, memory_order_relaxed);
+	}
+
+	mThread = thread(&LogSink::writerThread, this);
+}
+
+LogSink::~LogSink()
+{
+	mTerminate = true;
+
+	wakeupWriter();
+
+	if (mThread.joinable())
+	{
+		mThread.join();
+	}
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool LogSink::push(LogLevel level, string&& text)
+{
+	auto pos = mEnqueuePos.load(memory_order_relaxed);
+	Cell* cell = nullptr;
+
+	// bounded MPMC queue: a cell is free for the position when its sequence
+	// is equal to the position
+	while (true)
+	{
+		cell = &mCells[pos & mMask];
+
+		auto sequence = cell->sequence.load(memory_order_acquire);
+		auto diff = static_cast<intptr_t>(sequence) -
+					static_cast<intptr_t>(pos);
+
+		if (diff == 0)
+		{
+			if (mEnqueuePos.compare_exchange_weak(pos, pos + 1,
+												  memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			if (mPolicy == OverflowPolicy::DROP)
+			{
+				mNumDropped.fetch_add(1, memory_order_relaxed);
+
+				return false;
+			}
+
+			wakeupWriter();
+
+			std::this_thread::yield();
+
+			pos = mEnqueuePos.load(memory_order_relaxed);
+		}
+		else
+		{
+			pos = mEnqueuePos.load(memory_order_relaxed);
+		}
+	}
+
+	cell->record.level = level;
+	cell->record.text = std::move(text);
+	cell->sequence.store(pos + 1, memory_order_release);
+
+	if (mWriterWaiting.load(memory_order_relaxed))
+	{
+		wakeupWriter();
+	}
+
+	return true;
+}
+
+void LogSink::flush()
+{
+	auto pos = mEnqueuePos.load();
+
+	wakeupWriter();
+
+	unique_lock<mutex> lock(mMutex);
+
+	mFlushCondVar.wait(lock, [this, pos] { return mNumWritten >= pos ||
+										   mTerminate; });
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+bool LogSink::pop(LogRecord& record)
+{
+	auto& cell = mCells[mDequeuePos & mMask];
+
+	if (cell.sequence.load(memory_order_acquire) != mDequeuePos + 1)
+	{
+		return false;
+	}
+
+	record = std::move(cell.record);
+
+	cell.sequence.store(mDequeuePos + mMask + 1, memory_order_release);
+
+	mDequeuePos++;
+
+	return true;
+}
+
+void LogSink::wakeupWriter()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mCondVar.notify_one();
+}
+
+void LogSink::writerThread()
+{
+	vector<LogRecord> records;
+	LogRecord record;
+
+	records.reserve(cMaxBatchSize);
+
+	while (true)
+	{
+		records.clear();
+
+		while (records.size() < cMaxBatchSize && pop(record))
+		{
+			records.push_back(std::move(record));
+		}
+
+		if (!records.empty())
+		{
+			mOutput->write(records);
+
+			lock_guard<mutex> lock(mMutex);
+
+			mNumWritten += records.size();
+
+			mFlushCondVar.notify_all();
+
+			continue;
+		}
+
+		unique_lock<mutex> lock(mMutex);
+
+		if (mTerminate)
+		{
+			break;
+		}
+
+		// producers don't take the lock, thus a wakeup may be missed: the
+		// timeout bounds the latency in this case
+		mWriterWaiting = true;
+
+		mCondVar.wait_for(lock, milliseconds(10));
+
+		mWriterWaiting = false;
+	}
+}
+
+}
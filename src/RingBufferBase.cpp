@@ -20,34 +20,98 @@
 
 #include "RingBufferBase.hpp"
 
+#include <cassert>
+
 #include "Log.hpp"
 
 using std::bind;
+using std::to_string;
+using std::vector;
 
 namespace XenBackend {
 
+namespace {
+
+const Log& getRingLog()
+{
+	static Log log("RingBuffer");
+
+	return log;
+}
+
+}
+
 /*******************************************************************************
  * RingBufferBase
  ******************************************************************************/
 
 RingBufferBase::RingBufferBase(domid_t domId, evtchn_port_t port,
 							   grant_ref_t ref) :
-	mEventChannel(domId, port, [this] { onReceiveIndication(); }),
-	mBuffer(domId, ref, PROT_READ | PROT_WRITE),
-	mLog("RingBuffer"),
+	RingBufferBase(domId, port, vector<grant_ref_t>(1, ref))
+{
+}
+
+RingBufferBase::RingBufferBase(domid_t domId, evtchn_port_t port,
+							   const vector<grant_ref_t>& refs) :
+	mCounters(),
+	mEventChannelPtr(new XenEvtchn(domId, port, [this] { onIndication(); })),
+	mEventChannel(*mEventChannelPtr),
+	mBuffer(domId, refs.data(), refs.size(), PROT_READ | PROT_WRITE),
+	mLog(getRingLog()),
+	mDomId(domId),
 	mPort(port),
-	mRef(ref)
+	mRefs(refs),
+	mRestored(false),
+	mDrainOnStart(false),
+	mSharedEventChannel(false),
+	mCallbackId(0)
 {
 	LOG(mLog, DEBUG) << "Create ring buffer, port: " << mPort
-					 << ", ref: " << mRef;
+					 << ", ref: " << getRef() << ", pages: " << mRefs.size();
+}
+
+RingBufferBase::RingBufferBase(XenEvtchnPtr eventChannel,
+							   const vector<grant_ref_t>& refs) :
+	mCounters(),
+	mEventChannelPtr(eventChannel),
+	mEventChannel(*mEventChannelPtr),
+	mBuffer(eventChannel->getDomId(), refs.data(), refs.size(),
+			PROT_READ | PROT_WRITE),
+	mLog(getRingLog()),
+	mDomId(eventChannel->getDomId()),
+	mPort(eventChannel->getRemotePort()),
+	mRefs(refs),
+	mRestored(false),
+	mDrainOnStart(false),
+	mSharedEventChannel(true),
+	mCallbackId(mEventChannel.addCallback([this] { onIndication(); }))
+{
+	LOG(mLog, DEBUG) << "Create ring buffer with shared event channel, port: "
+					 << mPort << ", ref: " << getRef() << ", pages: "
+					 << mRefs.size();
 }
 
 RingBufferBase::~RingBufferBase()
 {
 	stop();
 
+	if (mSharedEventChannel)
+	{
+		// the callback may be called while the channel is started
+		assert(!mEventChannel.isStarted());
+
+		try
+		{
+			mEventChannel.removeCallback(mCallbackId);
+		}
+		catch(const XenException& e)
+		{
+			LOG(mLog, ERROR) << e.what();
+		}
+	}
+
 	LOG(mLog, DEBUG) << "Delete ring buffer, port: " << mPort
-					 << ", ref: " << mRef;
+					 << ", ref: " << getRef();
 }
 
 /*******************************************************************************
@@ -56,17 +120,163 @@ RingBufferBase::~RingBufferBase()
 
 void RingBufferBase::start()
 {
-	mEventChannel.start();
+	// the frontend may publish requests while no backend is running and
+	// doesn't notify again. The ring is drained before the event channel
+	// is started, thus not concurrently with the event channel thread.
+	if (mDrainOnStart)
+	{
+		mDrainOnStart = false;
+
+		onReceiveIndication();
+	}
+
+	if (!mSharedEventChannel)
+	{
+		mEventChannel.start();
+	}
 }
 
 void RingBufferBase::stop()
 {
-	mEventChannel.stop();
+	if (!mSharedEventChannel)
+	{
+		mEventChannel.stop();
+	}
+}
+
+void RingBufferBase::rebind()
+{
+	if (!mSharedEventChannel)
+	{
+		mEventChannel.rebind();
+	}
 }
 
 void RingBufferBase::setErrorCallback(ErrorCallback errorCallback)
 {
-	mEventChannel.setErrorCallback(errorCallback);
+	mErrorCallback = errorCallback;
+
+	if (!mSharedEventChannel)
+	{
+		mEventChannel.setErrorCallback(errorCallback);
+	}
+}
+
+void RingBufferBase::setEventLoop(EventLoopPtr eventLoop, int thread)
+{
+	mEventChannel.setEventLoop(eventLoop, thread);
+}
+
+RingBufferStats RingBufferBase::getStats() const
+{
+	RingBufferStats stats {};
+
+	stats.domId = mDomId;
+	stats.port = mPort;
+	stats.numRequests = mCounters.numRequests;
+	stats.numResponses = mCounters.numResponses;
+	stats.numEvents = mCounters.numEvents;
+	stats.numNotificationsSent = mCounters.numNotificationsSent;
+	stats.numNotificationsReceived = mCounters.numNotificationsReceived;
+	stats.numSpuriousWakeups = mCounters.numSpuriousWakeups;
+	stats.numOverflows = mCounters.numOverflows;
+
+	for (size_t i = 0; i < RingBufferStats::cNumBatchBuckets; i++)
+	{
+		stats.batchHistogram[i] = mCounters.batchHistogram[i];
+	}
+
+	return stats;
+}
+
+RingBufferBase::HandoffState RingBufferBase::saveState()
+{
+	HandoffState state;
+
+	state.port = mPort;
+	state.refs = mRefs;
+	state.indexes = saveIndexes();
+
+	return state;
+}
+
+void RingBufferBase::restoreState(const HandoffState& state)
+{
+	if (state.port != mPort || state.refs != mRefs)
+	{
+		throw RingBufferException("Ring buffer state doesn't match, port: " +
+								  to_string(state.port));
+	}
+
+	restoreIndexes(state.indexes);
+
+	mRestored = true;
+	mDrainOnStart = true;
+
+	LOG(mLog, DEBUG) << "Restore ring buffer, port: " << mPort
+					 << ", ref: " << getRef();
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+vector<uint32_t> RingBufferBase::saveIndexes()
+{
+	return vector<uint32_t>();
+}
+
+void RingBufferBase::restoreIndexes(const vector<uint32_t>& indexes)
+{
+	if (!indexes.empty())
+	{
+		throw RingBufferException("Invalid number of ring indexes");
+	}
+}
+
+void RingBufferBase::onError(const std::exception& e)
+{
+	if (mErrorCallback)
+	{
+		mErrorCallback(e);
+	}
+	else
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+void RingBufferBase::countBatch(size_t numRequests)
+{
+	if (numRequests == 0)
+	{
+		updateCounter(mCounters.numSpuriousWakeups);
+
+		return;
+	}
+
+	size_t bucket = 0;
+
+	while ((numRequests >>= 1) &&
+		   bucket < RingBufferStats::cNumBatchBuckets - 1)
+	{
+		bucket++;
+	}
+
+	updateCounter(mCounters.batchHistogram[bucket]);
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void RingBufferBase::onIndication()
+{
+	updateCounter(mCounters.numNotificationsReceived);
+
+	capture(RingCaptureRecord::Type::INDICATION, nullptr, 0, 0);
+
+	onReceiveIndication();
 }
 
 }
@@ -0,0 +1,270 @@
+/*
+ *  Ring buffer traffic capture
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "RingCapture.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::ifstream;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::to_string;
+
+namespace XenBackend {
+
+namespace {
+
+const char cMagic[8] = { 'X', 'E', 'N', 'B', 'E', 'C', 'A', 'P' };
+const uint32_t cVersion = 1;
+
+struct FileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct RecordHeader
+{
+	uint64_t time;
+	uint32_t port;
+	uint32_t size;
+	uint16_t type;
+	uint16_t itemSize;
+	uint16_t domId;
+	uint16_t reserved;
+};
+
+static_assert(sizeof(FileHeader) == 16, "Wrong capture file header size");
+static_assert(sizeof(RecordHeader) == 24, "Wrong capture record header size");
+
+}
+
+/*******************************************************************************
+ * RingCapture
+ ******************************************************************************/
+
+RingCapture::RingCapture(const string& fileName, size_t bufferSize) :
+	mFd(-1),
+	mBufferSize(bufferSize),
+	mStartTime(steady_clock::now()),
+	mNumRecords(0),
+	mFailed(false),
+	mLog("RingCapture")
+{
+	mFd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			   0644);
+
+	if (mFd < 0)
+	{
+		throw RingCaptureException("Can't open capture file: " + fileName +
+								   ", " + string(strerror(errno)));
+	}
+
+	mBuffer.reserve(mBufferSize);
+
+	FileHeader header {};
+
+	memcpy(header.magic, cMagic, sizeof(cMagic));
+	header.version = cVersion;
+
+	auto data = reinterpret_cast<const uint8_t*>(&header);
+
+	mBuffer.insert(mBuffer.end(), data, data + sizeof(header));
+
+	LOG(mLog, DEBUG) << "Create ring capture: " << fileName;
+}
+
+RingCapture::~RingCapture()
+{
+	flush();
+
+	close(mFd);
+
+	LOG(mLog, DEBUG) << "Delete ring capture, records: " << mNumRecords;
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void RingCapture::write(RingCaptureRecord::Type type, uint16_t domId,
+						uint32_t port, const void* items, size_t itemSize,
+						size_t count)
+{
+	RecordHeader header {};
+
+	header.time = duration_cast<nanoseconds>(
+			steady_clock::now() - mStartTime).count();
+	header.port = port;
+	header.domId = domId;
+	header.size = itemSize * count;
+	header.type = static_cast<uint16_t>(type);
+	header.itemSize = itemSize;
+
+	lock_guard<mutex> lock(mMutex);
+
+	if (mFailed)
+	{
+		return;
+	}
+
+	if (mBuffer.size() + sizeof(header) + header.size > mBufferSize)
+	{
+		writeBuffer();
+	}
+
+	auto data = reinterpret_cast<const uint8_t*>(&header);
+
+	mBuffer.insert(mBuffer.end(), data, data + sizeof(header));
+
+	data = static_cast<const uint8_t*>(items);
+
+	mBuffer.insert(mBuffer.end(), data, data + header.size);
+
+	mNumRecords++;
+}
+
+void RingCapture::flush()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	writeBuffer();
+}
+
+uint64_t RingCapture::getNumRecords() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mNumRecords;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void RingCapture::writeBuffer()
+{
+	size_t written = 0;
+
+	while (!mFailed && written < mBuffer.size())
+	{
+		auto ret = ::write(mFd, &mBuffer[written], mBuffer.size() - written);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			LOG(mLog, ERROR) << "Can't write capture file, stop capturing: "
+							 << strerror(errno);
+
+			mFailed = true;
+		}
+		else
+		{
+			written += ret;
+		}
+	}
+
+	mBuffer.clear();
+}
+
+/*******************************************************************************
+ * RingCaptureReader
+ ******************************************************************************/
+
+RingCaptureReader::RingCaptureReader(const string& fileName) :
+	mFile(fileName, ifstream::binary)
+{
+	if (!mFile)
+	{
+		throw RingCaptureException("Can't open capture file: " + fileName);
+	}
+
+	FileHeader header {};
+
+	if (!mFile.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		memcmp(header.magic, cMagic, sizeof(cMagic)) != 0)
+	{
+		throw RingCaptureException("Invalid capture file: " + fileName);
+	}
+
+	if (header.version != cVersion)
+	{
+		throw RingCaptureException("Unsupported capture version: " +
+								   to_string(header.version));
+	}
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool RingCaptureReader::read(RingCaptureRecord& record)
+{
+	RecordHeader header {};
+
+	if (!mFile.read(reinterpret_cast<char*>(&header), sizeof(header)))
+	{
+		if (mFile.gcount() != 0)
+		{
+			throw RingCaptureException("Truncated capture record");
+		}
+
+		return false;
+	}
+
+	typedef RingCaptureRecord::Type Type;
+
+	if (header.type < static_cast<uint16_t>(Type::REQUEST) ||
+		header.type > static_cast<uint16_t>(Type::INDICATION))
+	{
+		throw RingCaptureException("Invalid capture record type: " +
+								   to_string(header.type));
+	}
+
+	record.time = header.time;
+	record.domId = header.domId;
+	record.port = header.port;
+	record.type = static_cast<RingCaptureRecord::Type>(header.type);
+	record.itemSize = header.itemSize;
+	record.data.resize(header.size);
+
+	if (header.size && !mFile.read(reinterpret_cast<char*>(
+			record.data.data()), header.size))
+	{
+		throw RingCaptureException("Truncated capture record");
+	}
+
+	return true;
+}
+
+}
@@ -0,0 +1,280 @@
+/*
+ *  Tracing
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::mutex;
+using std::ostream;
+using std::remove_if;
+using std::vector;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * Static
+ ******************************************************************************/
+
+const size_t Trace::cBufferSize;
+const size_t Trace::cChunkSize;
+const uint64_t Trace::cInstant;
+
+std::atomic_bool Trace::sEnabled(false);
+std::atomic<uint64_t> Trace::sGeneration(0);
+std::atomic<uint64_t> Trace::sNumDropped(0);
+mutex Trace::sMutex;
+vector<Trace::BufferPtr> Trace::sBuffers;
+
+namespace {
+
+void writeString(ostream& stream, const char* str)
+{
+	stream << '"';
+
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+		{
+			stream << '\\';
+		}
+
+		stream << *str;
+	}
+
+	stream << '"';
+}
+
+void writeTime(ostream& stream, uint64_t time)
+{
+	// Chrome trace format uses microseconds
+
+	auto fraction = time % 1000;
+
+	stream << time / 1000 << '.'
+		   << fraction / 100 << (fraction / 10) % 10 << fraction % 10;
+}
+
+}
+
+/*******************************************************************************
+ * ThreadBuffer
+ ******************************************************************************/
+
+// releases the buffer when the thread exits
+struct Trace::ThreadBuffer
+{
+	BufferPtr buffer;
+
+	~ThreadBuffer()
+	{
+		if (buffer)
+		{
+			lock_guard<mutex> lock(sMutex);
+
+			buffer->used = false;
+		}
+	}
+};
+
+/*******************************************************************************
+ * Trace
+ ******************************************************************************/
+
+void Trace::start()
+{
+	lock_guard<mutex> lock(sMutex);
+
+	// Buffers are owned by the recording threads, so they are cleared lazily
+	// on the next event of the new generation. Buffers of finished threads
+	// are freed.
+
+	sBuffers.erase(remove_if(sBuffers.begin(), sBuffers.end(),
+							 [](const BufferPtr& buffer)
+							 { return !buffer->used; }),
+				   sBuffers.end());
+
+	sGeneration++;
+	sNumDropped = 0;
+
+	sEnabled = true;
+}
+
+void Trace::stop()
+{
+	sEnabled = false;
+}
+
+uint64_t Trace::now()
+{
+	return duration_cast<nanoseconds>(
+			steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::addEvent(const char* category, const char* name,
+					 uint64_t start, uint64_t duration, uint64_t id)
+{
+	auto& buffer = getBuffer();
+	auto generation = sGeneration.load(memory_order_relaxed);
+	auto size = buffer.size.load(memory_order_relaxed);
+
+	// only the owner thread modifies the buffer
+	if (buffer.generation.load(memory_order_relaxed) != generation)
+	{
+		size = 0;
+
+		buffer.size.store(size, memory_order_relaxed);
+		buffer.generation.store(generation, memory_order_release);
+	}
+
+	if (size >= cBufferSize)
+	{
+		sNumDropped.fetch_add(1, memory_order_relaxed);
+
+		return;
+	}
+
+	auto& chunk = buffer.chunks[size / cChunkSize];
+
+	if (!chunk)
+	{
+		chunk.reset(new Event[cChunkSize]);
+	}
+
+	chunk[size % cChunkSize] = { category, name, start, duration, id };
+
+	// publish the event for write()
+	buffer.size.store(size + 1, memory_order_release);
+}
+
+void Trace::write(ostream& stream)
+{
+	lock_guard<mutex> lock(sMutex);
+
+	auto pid = getpid();
+	bool first = true;
+
+	stream << "{\"traceEvents\":[";
+
+	auto generation = sGeneration.load(memory_order_relaxed);
+
+	for (auto& buffer : sBuffers)
+	{
+		// events of previous generations are not cleared yet
+		if (buffer->generation.load(memory_order_acquire) != generation)
+		{
+			continue;
+		}
+
+		auto size = buffer->size.load(memory_order_acquire);
+
+		for (size_t i = 0; i < size; i++)
+		{
+			auto& event = buffer->chunks[i / cChunkSize][i % cChunkSize];
+
+			stream << (first ? "\n" : ",\n") << "{\"name\":";
+			writeString(stream, event.name);
+			stream << ",\"cat\":";
+			writeString(stream, event.category);
+
+			if (event.duration == cInstant)
+			{
+				stream << ",\"ph\":\"i\",\"s\":\"t\"";
+			}
+			else
+			{
+				stream << ",\"ph\":\"X\",\"dur\":";
+				writeTime(stream, event.duration);
+			}
+
+			stream << ",\"ts\":";
+			writeTime(stream, event.start);
+			stream << ",\"pid\":" << pid << ",\"tid\":" << buffer->tid
+				   << ",\"args\":{\"id\":" << event.id << "}}";
+
+			first = false;
+		}
+	}
+
+	stream << "\n]}\n";
+}
+
+size_t Trace::getNumBuffers()
+{
+	lock_guard<mutex> lock(sMutex);
+
+	return sBuffers.size();
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+Trace::Buffer& Trace::getBuffer()
+{
+	thread_local ThreadBuffer tBuffer;
+
+	if (!tBuffer.buffer)
+	{
+		lock_guard<mutex> lock(sMutex);
+
+		auto generation = sGeneration.load(memory_order_relaxed);
+
+		// reuse the buffer of finished thread if it has no events to write
+		for (auto& buffer : sBuffers)
+		{
+			if (!buffer->used &&
+				(buffer->generation.load(memory_order_relaxed) != generation ||
+				 buffer->size.load(memory_order_relaxed) == 0))
+			{
+				tBuffer.buffer = buffer;
+
+				break;
+			}
+		}
+
+		if (!tBuffer.buffer)
+		{
+			tBuffer.buffer.reset(new Buffer());
+			tBuffer.buffer->generation = generation;
+			tBuffer.buffer->size = 0;
+
+			sBuffers.push_back(tBuffer.buffer);
+		}
+
+		tBuffer.buffer->tid = syscall(SYS_gettid);
+		tBuffer.buffer->used = true;
+	}
+
+	return *tBuffer.buffer;
+}
+
+}
@@ -20,13 +20,28 @@
 
 #include "Utils.hpp"
 
+#include <algorithm>
 #include <cstring>
+#include <future>
 #include <vector>
 
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "Log.hpp"
 #include "XenException.hpp"
 
+using std::chrono::microseconds;
+using std::current_exception;
 using std::exception;
+using std::function;
+using std::lock_guard;
+using std::make_shared;
 using std::mutex;
+using std::promise;
 using std::string;
 using std::thread;
 using std::to_string;
@@ -66,7 +81,8 @@ string Utils::logState(xenbus_state state)
  * PollFd
  ******************************************************************************/
 
-PollFd::PollFd(int fd, short int events)
+PollFd::PollFd(int fd, short int events) :
+	mEventFd(-1)
 {
 	try
 	{
@@ -86,11 +102,28 @@ PollFd::~PollFd()
 }
 
 bool PollFd::poll()
+{
+	return poll(microseconds(-1)) == Result::READY;
+}
+
+PollFd::Result PollFd::poll(microseconds timeout)
 {
 	mFds[PollIndex::FILE].revents = 0;
-	mFds[PollIndex::PIPE].revents = 0;
+	mFds[PollIndex::EVENT].revents = 0;
+
+	timespec ts {};
+	timespec* pTs = nullptr;
+
+	if (timeout.count() >= 0)
+	{
+		ts.tv_sec = timeout.count() / 1000000;
+		ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+		pTs = &ts;
+	}
+
+	auto ret = ppoll(mFds, 2, pTs, nullptr);
 
-	if (::poll(mFds, 2, -1) < 0)
+	if (ret < 0)
 	{
 		if (errno != EINTR)
 		{
@@ -99,17 +132,22 @@ bool PollFd::poll()
 		}
 	}
 
-	if (mFds[PollIndex::PIPE].revents & POLLIN)
+	if (ret == 0)
 	{
-		uint8_t data;
+		return Result::TIMEOUT;
+	}
 
-		if (read(mFds[PollIndex::PIPE].fd, &data, sizeof(data)) < 0)
+	if (mFds[PollIndex::EVENT].revents & POLLIN)
+	{
+		uint64_t value;
+
+		if (read(mEventFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
 		{
-			throw XenException("Error reading pipe: " +
+			throw XenException("Error reading eventfd: " +
 							   string(strerror(errno)));
 		}
 
-		return false;
+		return Result::STOPPED;
 	}
 
 	if (mFds[PollIndex::FILE].revents & (~mFds[PollIndex::FILE].events))
@@ -117,99 +155,472 @@ bool PollFd::poll()
 		throw XenException("Error reading file");
 	}
 
-	return true;
+	return Result::READY;
 }
 
 void PollFd::stop()
 {
-	uint8_t data = 0xFF;
+	uint64_t value = 1;
 
-	if (write(mPipeFds[PipeType::WRITE], &data, sizeof(data)) < 0)
+	if (write(mEventFd, &value, sizeof(value)) < 0)
 	{
-		throw XenException("Error writing pipe: " + string(strerror(errno)));
+		throw XenException("Error writing eventfd: " +
+						   string(strerror(errno)));
 	}
 }
 
 void PollFd::init(int fd, short int events)
 {
-	mPipeFds[PipeType::READ] = -1;
-	mPipeFds[PipeType::WRITE] = -1;
+	mEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
 
-	if (pipe(mPipeFds) < 0)
+	if (mEventFd < 0)
 	{
-		throw XenException("Can't create pipe: " + string(strerror(errno)));
+		throw XenException("Can't create eventfd: " + string(strerror(errno)));
 	}
 
 	mFds[PollIndex::FILE].fd = fd;
 	mFds[PollIndex::FILE].events = events;
 
-	mFds[PollIndex::PIPE].fd = mPipeFds[PipeType::READ];
-	mFds[PollIndex::PIPE].events = POLLIN;
+	mFds[PollIndex::EVENT].fd = mEventFd;
+	mFds[PollIndex::EVENT].events = POLLIN;
 }
 
 void PollFd::release()
 {
-	if (mPipeFds[PipeType::READ] >= 0)
+	if (mEventFd >= 0)
+	{
+		close(mEventFd);
+	}
+}
+
+/*******************************************************************************
+ * ThreadConfig
+ ******************************************************************************/
+
+const int ThreadConfig::cNotSet;
+
+void ThreadConfig::apply() const
+{
+	auto self = pthread_self();
+	int ret = 0;
+
+	if (!name.empty())
+	{
+		// the kernel limits the name to 16 bytes including terminating null
+		ret = pthread_setname_np(self, name.substr(0, 15).c_str());
+
+		if (ret)
+		{
+			throw XenException("Can't set thread name: " + name + ", " +
+							   string(strerror(ret)));
+		}
+	}
+
+	if (!cpus.empty())
+	{
+		cpu_set_t cpuSet;
+
+		CPU_ZERO(&cpuSet);
+
+		for (auto cpu : cpus)
+		{
+			if (cpu >= CPU_SETSIZE)
+			{
+				throw XenException("Invalid CPU: " + to_string(cpu));
+			}
+
+			CPU_SET(cpu, &cpuSet);
+		}
+
+		ret = pthread_setaffinity_np(self, sizeof(cpuSet), &cpuSet);
+
+		if (ret)
+		{
+			throw XenException("Can't set thread affinity: " +
+							   string(strerror(ret)));
+		}
+	}
+
+	if (policy != cNotSet)
+	{
+		sched_param param {};
+
+		param.sched_priority = priority;
+
+		ret = pthread_setschedparam(self, policy, &param);
+
+		if (ret)
+		{
+			throw XenException("Can't set thread scheduling policy: " +
+							   to_string(policy) + ", " +
+							   string(strerror(ret)));
+		}
+	}
+
+	if (nice != cNotSet)
+	{
+		// on Linux the nice value is the attribute of the thread
+		if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) < 0)
+		{
+			throw XenException("Can't set thread nice value: " +
+							   to_string(nice) + ", " +
+							   string(strerror(errno)));
+		}
+	}
+}
+
+thread ThreadConfig::createThread(function<void()> func) const
+{
+	if (!isSet())
 	{
-		close(mPipeFds[PipeType::READ]);
+		return thread(func);
 	}
 
-	if (mPipeFds[PipeType::WRITE] >= 0)
+	auto applied = make_shared<promise<void>>();
+	auto result = applied->get_future();
+	auto config = *this;
+
+	thread newThread([config, func, applied] {
+		try
+		{
+			config.apply();
+		}
+		catch(...)
+		{
+			applied->set_exception(current_exception());
+
+			return;
+		}
+
+		applied->set_value();
+
+		func();
+	});
+
+	try
 	{
-		close(mPipeFds[PipeType::WRITE]);
+		result.get();
 	}
+	catch(...)
+	{
+		newThread.join();
+
+		throw;
+	}
+
+	return newThread;
 }
 
 /*******************************************************************************
- * AsyncContext
+ * TaskQueue
  ******************************************************************************/
 
-AsyncContext::AsyncContext() :
-	mTerminate(false)
+const size_t InlineTask::cSize;
+const size_t TaskQueue::cInitialCapacity;
+
+void TaskQueue::push(InlineTask&& task)
 {
-	mThread = thread(&AsyncContext::run, this);
+	if (mSize == mTasks.size())
+	{
+		vector<InlineTask> tasks(mTasks.size() * 2);
+
+		for (size_t i = 0; i < mSize; i++)
+		{
+			tasks[i] = std::move(mTasks[(mHead + i) % mTasks.size()]);
+		}
+
+		mTasks.swap(tasks);
+		mHead = 0;
+	}
+
+	mTasks[(mHead + mSize) % mTasks.size()] = std::move(task);
+	mSize++;
 }
 
-AsyncContext::~AsyncContext()
+InlineTask TaskQueue::pop()
 {
+	auto task = std::move(mTasks[mHead]);
+
+	mHead = (mHead + 1) % mTasks.size();
+	mSize--;
+
+	return task;
+}
+
+/*******************************************************************************
+ * ThreadPool
+ ******************************************************************************/
+
+const size_t ThreadPool::cMinSharedThreads;
+const size_t ThreadPool::cSharedIoThreads;
+
+namespace {
+
+// pool and worker index of the calling thread
+thread_local ThreadPool* tCurrentPool = nullptr;
+thread_local size_t tCurrentWorker = 0;
+
+mutex gSharedConfigsMutex;
+vector<ThreadConfig> gSharedConfigs;
+
+const Log& getPoolLog()
+{
+	static Log log("ThreadPool");
+
+	return log;
+}
+
+vector<ThreadConfig> getSharedConfigs()
+{
+	lock_guard<mutex> lock(gSharedConfigsMutex);
+
+	return gSharedConfigs;
+}
+
+}
+
+ThreadPool::ThreadPool(size_t numThreads,
+					   const vector<ThreadConfig>& configs) :
+	mTerminate(false),
+	mNextWorker(0),
+	mNumTasks(0),
+	mNumIdle(0)
+{
+	if (numThreads == 0)
 	{
-		unique_lock<mutex> lock(mMutex);
+		numThreads = thread::hardware_concurrency();
+	}
+
+	if (numThreads == 0)
+	{
+		numThreads = 1;
+	}
+
+	// all queues are created before threads as workers steal from each other
+	for (size_t i = 0; i < numThreads; i++)
+	{
+		mWorkers.emplace_back(new Worker());
+	}
+
+	try
+	{
+		for (size_t i = 0; i < numThreads; i++)
+		{
+			auto config = configs.empty() ? ThreadConfig() :
+											configs[i % configs.size()];
+
+			mThreads.push_back(config.createThread([this, i] { run(i); }));
+		}
+	}
+	catch(const exception& e)
+	{
+		stopThreads();
+
+		throw;
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	stopThreads();
+}
+
+ThreadPoolPtr ThreadPool::getShared()
+{
+	static ThreadPoolPtr sPool(new ThreadPool(
+			std::max<size_t>(thread::hardware_concurrency(),
+							 cMinSharedThreads), getSharedConfigs()));
+
+	return sPool;
+}
+
+ThreadPoolPtr ThreadPool::getSharedIo()
+{
+	static ThreadPoolPtr sPool(new ThreadPool(cSharedIoThreads,
+											  getSharedConfigs()));
+
+	return sPool;
+}
+
+void ThreadPool::setSharedConfigs(const vector<ThreadConfig>& configs)
+{
+	lock_guard<mutex> lock(gSharedConfigsMutex);
+
+	gSharedConfigs = configs;
+}
+
+void ThreadPool::stopThreads()
+{
+	{
+		lock_guard<mutex> lock(mMutex);
 
 		mTerminate = true;
 
 		mCondVar.notify_all();
 	}
 
-	if (mThread.joinable())
+	for (auto& thread : mThreads)
 	{
-		mThread.join();
+		if (thread.joinable())
+		{
+			thread.join();
+		}
 	}
 }
 
-void AsyncContext::call(AsyncCall f)
+void ThreadPool::call(Task task)
+{
+	// the worker keeps its own tasks, idle workers steal them
+	auto index = tCurrentPool == this ?
+				 tCurrentWorker : mNextWorker++ % mWorkers.size();
+	auto& worker = *mWorkers[index];
+
+	{
+		lock_guard<mutex> lock(worker.mutex);
+
+		worker.tasks.push(std::move(task));
+	}
+
+	// pairs with mNumIdle increment in run(): either the worker sees the task
+	// or we see the waiting worker
+	mNumTasks++;
+
+	if (mNumIdle > 0)
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mCondVar.notify_one();
+	}
+}
+
+bool ThreadPool::getTask(size_t index, Task& task)
+{
+	// own queue first, then steal from others
+	for (size_t i = 0; i < mWorkers.size(); i++)
+	{
+		auto& worker = *mWorkers[(index + i) % mWorkers.size()];
+
+		lock_guard<mutex> lock(worker.mutex);
+
+		if (!worker.tasks.empty())
+		{
+			task = worker.tasks.pop();
+
+			mNumTasks--;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::run(size_t index)
+{
+	tCurrentPool = this;
+	tCurrentWorker = index;
+
+	while(true)
+	{
+		Task task;
+
+		if (getTask(index, task))
+		{
+			try
+			{
+				task();
+			}
+			catch(const exception& e)
+			{
+				LOG(getPoolLog(), ERROR) << "Task failed: " << e.what();
+			}
+			catch(...)
+			{
+				LOG(getPoolLog(), ERROR) << "Task failed: unknown exception";
+			}
+
+			continue;
+		}
+
+		unique_lock<mutex> lock(mMutex);
+
+		mNumIdle++;
+
+		mCondVar.wait(lock, [this] { return mTerminate || mNumTasks > 0; });
+
+		mNumIdle--;
+
+		// pending tasks are finished before terminating
+		if (mTerminate && mNumTasks <= 0)
+		{
+			break;
+		}
+	}
+
+	tCurrentPool = nullptr;
+}
+
+/*******************************************************************************
+ * AsyncContext
+ ******************************************************************************/
+
+AsyncContext::AsyncContext(ThreadPoolPtr pool) :
+	mPool(pool ? pool : ThreadPool::getShared()),
+	mRunning(false)
+{
+}
+
+AsyncContext::~AsyncContext()
 {
 	unique_lock<mutex> lock(mMutex);
 
-	mAsyncCalls.push_back(f);
+	mCondVar.wait(lock, [this] { return !mRunning; });
+}
 
-	mCondVar.notify_all();
+void AsyncContext::call(AsyncCall f)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mAsyncCalls.push(std::move(f));
+
+	if (!mRunning)
+	{
+		mRunning = true;
+
+		mPool->call([this] { run(); });
+	}
 }
 
 void AsyncContext::run()
 {
-	while(!mTerminate)
+	unique_lock<mutex> lock(mMutex);
+
+	while(!mAsyncCalls.empty())
 	{
-		unique_lock<mutex> lock(mMutex);
+		auto asyncCall = mAsyncCalls.pop();
 
-		mCondVar.wait(lock, [this] { return mTerminate ||
-									 !mAsyncCalls.empty(); });
+		// don't block new calls while the current one is running
+		lock.unlock();
 
-		while(!mAsyncCalls.empty())
+		try
+		{
+			asyncCall();
+		}
+		catch(const exception& e)
 		{
-			mAsyncCalls.front()();
-			mAsyncCalls.pop_front();
+			LOG(getPoolLog(), ERROR) << "Async call failed: " << e.what();
 		}
+		catch(...)
+		{
+			LOG(getPoolLog(), ERROR) << "Async call failed: unknown exception";
+		}
+
+		lock.lock();
 	}
+
+	mRunning = false;
+
+	mCondVar.notify_all();
 }
 
 }
@@ -20,6 +20,9 @@
 
 #include "XenCtrl.hpp"
 
+#include <algorithm>
+
+using std::lower_bound;
 using std::vector;
 
 namespace XenBackend {
@@ -54,34 +57,37 @@ XenInterface::~XenInterface()
 
 void XenInterface::getDomainsInfo(vector<xc_domaininfo_t>& infos)
 {
-	vector<xc_domaininfo_t> domainInfo(cDomInfoChunkSize);
+	// read chunks directly into the result, so the capacity of infos is
+	// reused by subsequent calls
 
 	int newDomains = cDomInfoChunkSize;
 	int startDomain = 0;
-
-	infos.clear();
+	size_t numDomains = 0;
 
 	while(newDomains == cDomInfoChunkSize)
 	{
+		infos.resize(numDomains + cDomInfoChunkSize);
+
 		newDomains = xc_domain_getinfolist(mHandle, startDomain,
 										   cDomInfoChunkSize,
-										   domainInfo.data());
+										   &infos[numDomains]);
 
 		if (newDomains < 0)
 		{
+			infos.clear();
+
 			throw XenCtrlException("Can't get domain info");
 		}
 
-		if (newDomains)
-		{
-			startDomain = domainInfo[newDomains - 1].domain + 1;
-		}
+		numDomains += newDomains;
 
-		for(auto i = 0; i < newDomains; i++)
+		if (newDomains)
 		{
-			infos.push_back(domainInfo[i]);
+			startDomain = infos[numDomains - 1].domain + 1;
 		}
 	}
+
+	infos.resize(numDomains);
 }
 
 /*******************************************************************************
@@ -110,4 +116,93 @@ void XenInterface::release()
 	}
 }
 
+/*******************************************************************************
+ * DomainInfoSnapshot
+ ******************************************************************************/
+
+bool DomainInfoSnapshot::refresh(XenInterface& xenInterface)
+{
+	// read into the second buffer so the snapshot is kept on error
+	xenInterface.getDomainsInfo(mNewInfos);
+
+	auto changed = isChanged();
+
+	mInfos.swap(mNewInfos);
+
+	if (changed)
+	{
+		mGeneration++;
+	}
+
+	return changed;
+}
+
+const xc_domaininfo_t* DomainInfoSnapshot::find(domid_t domId) const
+{
+	auto it = lower_bound(mInfos.begin(), mInfos.end(), domId,
+						  [] (const xc_domaininfo_t& info, domid_t id)
+						  { return info.domain < id; });
+
+	if (it == mInfos.end() || it->domain != domId)
+	{
+		return nullptr;
+	}
+
+	return &(*it);
+}
+
+bool DomainInfoSnapshot::isRunning(domid_t domId) const
+{
+	auto info = find(domId);
+
+	return info && (info->flags & XEN_DOMINF_running);
+}
+
+void DomainInfoSnapshot::getExistingDoms(vector<domid_t>& domIds) const
+{
+	domIds.clear();
+
+	for (auto& info : mInfos)
+	{
+		domIds.push_back(info.domain);
+	}
+}
+
+void DomainInfoSnapshot::getRunningDoms(vector<domid_t>& domIds) const
+{
+	domIds.clear();
+
+	for (auto& info : mInfos)
+	{
+		if (info.flags & XEN_DOMINF_running)
+		{
+			domIds.push_back(info.domain);
+		}
+	}
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+bool DomainInfoSnapshot::isChanged() const
+{
+	if (mNewInfos.size() != mInfos.size())
+	{
+		return true;
+	}
+
+	// other fields (CPU time, memory etc.) change permanently
+	for (size_t i = 0; i < mInfos.size(); i++)
+	{
+		if (mNewInfos[i].domain != mInfos[i].domain ||
+			mNewInfos[i].flags != mInfos[i].flags)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
 }
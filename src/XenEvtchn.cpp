@@ -20,28 +20,52 @@
 
 #include "XenEvtchn.hpp"
 
+#include <algorithm>
+#include <vector>
+
 #include <poll.h>
 
+#include "Trace.hpp"
+
 using std::exception;
 using std::lock_guard;
 using std::mutex;
 using std::thread;
 using std::to_string;
+using std::vector;
 
 namespace XenBackend {
 
+namespace {
+
+thread_local int tNotifyScopeLevel = 0;
+thread_local vector<XenEvtchn*> tPendingNotifications;
+
+const Log& getEvtchnLog()
+{
+	static Log log("XenEvtchn");
+
+	return log;
+}
+
+}
+
 /*******************************************************************************
  * XenEvtchn
  ******************************************************************************/
 
 XenEvtchn::XenEvtchn(domid_t domId, evtchn_port_t port, Callback callback,
 					 ErrorCallback errorCallback) :
+	mDomId(domId),
+	mRemotePort(port),
 	mPort(-1),
 	mHandle(nullptr),
 	mCallback(callback),
+	mNextCallbackId(0),
 	mErrorCallback(errorCallback),
 	mStarted(false),
-	mLog("XenEvtchn")
+	mLog(getEvtchnLog()),
+	mEventLoopThread(-1)
 {
 	try
 	{
@@ -58,6 +82,9 @@ XenEvtchn::XenEvtchn(domid_t domId, evtchn_port_t port, Callback callback,
 XenEvtchn::~XenEvtchn()
 {
 	stop();
+
+	XenEvtchnNotifyScope::remove(this);
+
 	release();
 }
 
@@ -76,13 +103,56 @@ void XenEvtchn::start()
 
 	mStarted = true;
 
-	mThread = thread(&XenEvtchn::eventThread, this);
+	try
+	{
+		if (mEventLoop)
+		{
+			if (hasCallbacks())
+			{
+				mEventLoop->addFd(xenevtchn_fd(mHandle), POLLIN,
+								  [this] { handleEvent(); },
+								  [this] (const exception& e) { onError(e); },
+								  mEventLoopThread);
+			}
+
+			return;
+		}
+
+		// the thread may be finished already on error
+		if (mThread.joinable())
+		{
+			mThread.join();
+		}
+
+		// only the dedicated thread needs own poll fd
+		mPollFd.reset(new PollFd(xenevtchn_fd(mHandle), POLLIN));
+
+		mThread = mThreadConfig.createThread([this] { eventThread(); });
+	}
+	catch(const exception& e)
+	{
+		mStarted = false;
+
+		throw;
+	}
 }
 
 void XenEvtchn::stop()
 {
 	DLOG(mLog, DEBUG) << "Stop event channel, port: " << mPort;
 
+	if (mEventLoop)
+	{
+		if (mHandle)
+		{
+			mEventLoop->removeFd(xenevtchn_fd(mHandle));
+		}
+
+		mStarted = false;
+
+		return;
+	}
+
 	if (mPollFd)
 	{
 		mPollFd->stop();
@@ -94,14 +164,66 @@ void XenEvtchn::stop()
 	}
 }
 
-void XenEvtchn::notify()
+void XenEvtchn::rebind()
 {
-	DLOG(mLog, DEBUG) << "Notify event channel, port: " << mPort;
+	if (mStarted)
+	{
+		throw XenEvtchnException("Can't rebind started event channel");
+	}
 
-	if (xenevtchn_notify(mHandle, mPort) < 0)
+	if (mPort != -1)
 	{
-		throw XenEvtchnException("Can't notify event channel");
+		xenevtchn_unbind(mHandle, mPort);
 	}
+
+	mPort = xenevtchn_bind_interdomain(mHandle, mDomId, mRemotePort);
+
+	if (mPort == -1)
+	{
+		throw XenEvtchnException("Can't bind event channel: " +
+								 to_string(mRemotePort));
+	}
+
+	DLOG(mLog, DEBUG) << "Rebind event channel, dom: " << mDomId
+					  << ", remote port: " << mRemotePort << ", local port: "
+					  << mPort;
+}
+
+size_t XenEvtchn::addCallback(Callback callback)
+{
+	if (mStarted)
+	{
+		throw XenEvtchnException("Can't add callback: "
+								 "event channel is started");
+	}
+
+	mCallbacks.emplace_back(mNextCallbackId, callback);
+
+	return mNextCallbackId++;
+}
+
+void XenEvtchn::removeCallback(size_t id)
+{
+	if (mStarted)
+	{
+		throw XenEvtchnException("Can't remove callback: "
+								 "event channel is started");
+	}
+
+	mCallbacks.erase(std::remove_if(mCallbacks.begin(), mCallbacks.end(),
+									[id] (const std::pair<size_t, Callback>&
+										  item) { return item.first == id; }),
+					 mCallbacks.end());
+}
+
+void XenEvtchn::notify()
+{
+	if (XenEvtchnNotifyScope::defer(this))
+	{
+		return;
+	}
+
+	notifyNow();
 }
 
 void XenEvtchn::setErrorCallback(ErrorCallback errorCallback)
@@ -111,6 +233,18 @@ void XenEvtchn::setErrorCallback(ErrorCallback errorCallback)
 	mErrorCallback = errorCallback;
 }
 
+void XenEvtchn::setEventLoop(EventLoopPtr eventLoop, int thread)
+{
+	if (mStarted)
+	{
+		throw XenEvtchnException("Can't set event loop: "
+								 "event channel is started");
+	}
+
+	mEventLoop = eventLoop;
+	mEventLoopThread = thread;
+}
+
 /*******************************************************************************
  * Private
  ******************************************************************************/
@@ -131,8 +265,6 @@ void XenEvtchn::init(domid_t domId, evtchn_port_t port)
 		throw XenEvtchnException("Can't bind event channel: " + to_string(port));
 	}
 
-	mPollFd.reset(new PollFd(xenevtchn_fd(mHandle), POLLIN));
-
 	DLOG(mLog, DEBUG) << "Create event channel, dom: " << domId
 					  << ", remote port: " << port << ", local port: "
 					  << mPort;
@@ -157,48 +289,161 @@ void XenEvtchn::eventThread()
 {
 	try
 	{
-		while(mCallback && mPollFd->poll())
+		while(hasCallbacks() && mPollFd->poll())
 		{
-			auto port = xenevtchn_pending(mHandle);
+			handleEvent();
+		}
+	}
+	catch(const exception& e)
+	{
+		onError(e);
+	}
 
-			if (port < 0)
-			{
-				throw XenEvtchnException("Can't get pending port");
-			}
+	mStarted = false;
+}
 
-			if (xenevtchn_unmask(mHandle, port) < 0)
-			{
-				throw XenEvtchnException("Can't unmask event channel");
-			}
+void XenEvtchn::handleEvent()
+{
+	TRACE_SCOPE("evtchn", "event", mPort);
 
-			if (port != mPort)
-			{
-				throw XenEvtchnException("Error port number: " +
-										 to_string(port) + ", expected: " +
-										 to_string(mPort));
-			}
+	auto port = xenevtchn_pending(mHandle);
 
-			DLOG(mLog, DEBUG) << "Event received, port: " << mPort;
+	if (port < 0)
+	{
+		throw XenEvtchnException("Can't get pending port");
+	}
 
-			mCallback();
-		}
+	if (xenevtchn_unmask(mHandle, port) < 0)
+	{
+		throw XenEvtchnException("Can't unmask event channel");
+	}
+
+	if (port != mPort)
+	{
+		throw XenEvtchnException("Error port number: " +
+								 to_string(port) + ", expected: " +
+								 to_string(mPort));
+	}
+
+	DLOG(mLog, DEBUG) << "Event received, port: " << mPort;
+
+	XenEvtchnNotifyScope scope;
+
+	if (mCallback)
+	{
+		mCallback();
+	}
+
+	for (auto& callback : mCallbacks)
+	{
+		callback.second();
+	}
+
+	XenEvtchnNotifyScope::flush();
+}
+
+void XenEvtchn::onError(const exception& e)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (mEventLoop)
+	{
+		mStarted = false;
+	}
+
+	if (mErrorCallback)
+	{
+		mErrorCallback(e);
+	}
+	else
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+void XenEvtchn::notifyNow()
+{
+	DLOG(mLog, DEBUG) << "Notify event channel, port: " << mPort;
+
+	if (xenevtchn_notify(mHandle, mPort) < 0)
+	{
+		throw XenEvtchnException("Can't notify event channel");
+	}
+}
+
+/*******************************************************************************
+ * XenEvtchnNotifyScope
+ ******************************************************************************/
+
+XenEvtchnNotifyScope::XenEvtchnNotifyScope()
+{
+	tNotifyScopeLevel++;
+}
+
+XenEvtchnNotifyScope::~XenEvtchnNotifyScope()
+{
+	if (--tNotifyScopeLevel > 0)
+	{
+		return;
+	}
+
+	try
+	{
+		flush();
 	}
 	catch(const exception& e)
 	{
-		lock_guard<mutex> lock(mMutex);
+		LOG("XenEvtchn", ERROR) << e.what();
+	}
+}
 
-		if (mErrorCallback)
-		{
-			mErrorCallback(e);
-		}
-		else
-		{
-			LOG(mLog, ERROR) << e.what();
-		}
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void XenEvtchnNotifyScope::flush()
+{
+	while (!tPendingNotifications.empty())
+	{
+		auto eventChannel = tPendingNotifications.back();
+
+		tPendingNotifications.pop_back();
+
+		eventChannel->notifyNow();
 	}
+}
 
-	mStarted = false;
+bool XenEvtchnNotifyScope::isActive()
+{
+	return tNotifyScopeLevel > 0;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+bool XenEvtchnNotifyScope::defer(XenEvtchn* eventChannel)
+{
+	if (!isActive())
+	{
+		return false;
+	}
+
+	if (find(tPendingNotifications.begin(), tPendingNotifications.end(),
+			 eventChannel) == tPendingNotifications.end())
+	{
+		tPendingNotifications.push_back(eventChannel);
+	}
+
+	return true;
 }
 
+void XenEvtchnNotifyScope::remove(XenEvtchn* eventChannel)
+{
+	tPendingNotifications.erase(std::remove(tPendingNotifications.begin(),
+											tPendingNotifications.end(),
+											eventChannel),
+								tPendingNotifications.end());
 }
 
+}
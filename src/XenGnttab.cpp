@@ -20,8 +20,46 @@
 
 #include "XenGnttab.hpp"
 
+#include <algorithm>
+
+#include "Trace.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using std::thread;
+using std::unique_lock;
+using std::to_string;
+using std::unordered_map;
+using std::vector;
+
 namespace XenBackend {
 
+namespace {
+
+mutex gShardsMutex;
+size_t gNumShards = 1;
+unordered_map<size_t, XenGnttabPtr> gShards;
+
+struct DomainPages
+{
+	size_t numPages;
+	size_t limit;
+};
+
+mutex gPagesMutex;
+size_t gDefaultPageLimit = 0;
+unordered_map<domid_t, DomainPages> gDomainPages;
+
+const Log& getBufferLog()
+{
+	// shared by all instances: copying the log doesn't look up the category
+	static Log log("XenGnttabBuffer");
+
+	return log;
+}
+
+}
+
 /*******************************************************************************
  * XenGnttab
  ******************************************************************************/
@@ -44,6 +82,185 @@ XenGnttab::~XenGnttab()
 	}
 }
 
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+XenGnttab& XenGnttab::getInstance()
+{
+	return *getDefault();
+}
+
+XenGnttabPtr XenGnttab::getForDomain(domid_t domId)
+{
+	lock_guard<mutex> lock(gShardsMutex);
+
+	if (gNumShards == 1)
+	{
+		return getDefault();
+	}
+
+	size_t shard = gNumShards ? domId % gNumShards : domId;
+
+	auto& gnttab = gShards[shard];
+
+	if (!gnttab)
+	{
+		gnttab.reset(new XenGnttab());
+	}
+
+	return gnttab;
+}
+
+void XenGnttab::setNumShards(size_t numShards)
+{
+	lock_guard<mutex> lock(gShardsMutex);
+
+	gNumShards = numShards;
+
+	gShards.clear();
+}
+
+void XenGnttab::releaseDomain(domid_t domId)
+{
+	lock_guard<mutex> lock(gShardsMutex);
+
+	if (gNumShards == 0)
+	{
+		gShards.erase(domId);
+	}
+}
+
+void XenGnttab::copy(vector<xengnttab_grant_copy_segment_t>& segments)
+{
+	if (segments.empty())
+	{
+		return;
+	}
+
+	if (xengnttab_grant_copy(mHandle, segments.size(), segments.data()) < 0)
+	{
+		throw XenGnttabException("Can't copy grant refs");
+	}
+
+	for (size_t i = 0; i < segments.size(); i++)
+	{
+		if (segments[i].status != GNTST_okay)
+		{
+			throw XenGnttabException("Grant copy failed, segment: " +
+									 to_string(i) + ", status: " +
+									 to_string(segments[i].status));
+		}
+	}
+}
+
+xengnttab_grant_copy_segment_t XenGnttab::copyToRef(domid_t domId,
+													grant_ref_t ref,
+													uint16_t offset,
+													const void* src,
+													uint16_t len)
+{
+	xengnttab_grant_copy_segment_t segment {};
+
+	segment.source.virt = const_cast<void*>(src);
+	segment.dest.foreign.ref = ref;
+	segment.dest.foreign.offset = offset;
+	segment.dest.foreign.domid = domId;
+	segment.len = len;
+	segment.flags = GNTCOPY_dest_gref;
+
+	return segment;
+}
+
+xengnttab_grant_copy_segment_t XenGnttab::copyFromRef(domid_t domId,
+													  grant_ref_t ref,
+													  uint16_t offset,
+													  void* dst,
+													  uint16_t len)
+{
+	xengnttab_grant_copy_segment_t segment {};
+
+	segment.source.foreign.ref = ref;
+	segment.source.foreign.offset = offset;
+	segment.source.foreign.domid = domId;
+	segment.dest.virt = dst;
+	segment.len = len;
+	segment.flags = GNTCOPY_source_gref;
+
+	return segment;
+}
+
+size_t XenGnttab::getNumMappedPages(domid_t domId)
+{
+	lock_guard<mutex> lock(gPagesMutex);
+
+	auto it = gDomainPages.find(domId);
+
+	return it != gDomainPages.end() ? it->second.numPages : 0;
+}
+
+void XenGnttab::setPageLimit(domid_t domId, size_t limit)
+{
+	lock_guard<mutex> lock(gPagesMutex);
+
+	gDomainPages[domId].limit = limit;
+}
+
+void XenGnttab::setDefaultPageLimit(size_t limit)
+{
+	lock_guard<mutex> lock(gPagesMutex);
+
+	gDefaultPageLimit = limit;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+XenGnttabPtr XenGnttab::getDefault()
+{
+	static XenGnttabPtr gnttab(new XenGnttab());
+
+	return gnttab;
+}
+
+void XenGnttab::reservePages(domid_t domId, size_t count)
+{
+	lock_guard<mutex> lock(gPagesMutex);
+
+	auto& pages = gDomainPages[domId];
+
+	auto limit = pages.limit ? pages.limit : gDefaultPageLimit;
+
+	if (limit && pages.numPages + count > limit)
+	{
+		throw XenGnttabException("Mapped pages limit exceeded, dom: " +
+								 to_string(domId) + ", limit: " +
+								 to_string(limit));
+	}
+
+	pages.numPages += count;
+}
+
+void XenGnttab::releasePages(domid_t domId, size_t count)
+{
+	lock_guard<mutex> lock(gPagesMutex);
+
+	auto it = gDomainPages.find(domId);
+
+	if (it == gDomainPages.end())
+	{
+		return;
+	}
+
+	it->second.numPages -= std::min(count, it->second.numPages);
+
+	if (!it->second.numPages && !it->second.limit)
+	{
+		gDomainPages.erase(it);
+	}
+}
+
 /*******************************************************************************
  * XenGnttabBuffer
  ******************************************************************************/
@@ -56,7 +273,7 @@ XenGnttabBuffer::XenGnttabBuffer(domid_t domId, grant_ref_t ref, int prot) :
 
 XenGnttabBuffer::XenGnttabBuffer(domid_t domId, const grant_ref_t* refs,
 								 size_t count, int prot) :
-	mLog("XenGnttabBuffer")
+	mLog(getBufferLog())
 {
 	init(domId, refs, count, prot);
 }
@@ -73,25 +290,34 @@ XenGnttabBuffer::~XenGnttabBuffer()
 void XenGnttabBuffer::init(domid_t domId, const grant_ref_t* refs,
 						   size_t count, int prot)
 {
-	static XenGnttab gnttab;
-
-	mHandle = gnttab.getHandle();
+	mGnttab = XenGnttab::getForDomain(domId);
+	mHandle = mGnttab->getHandle();
 	mBuffer = nullptr;
+	mDomId = domId;
 	mCount = count;
 
+	if (!count)
+	{
+		throw XenGnttabException("No grant references to map");
+	}
+
 	DLOG(mLog, DEBUG) << "Create grant table buffer, dom: " << domId
 					  << ", count: " << count << ", ref: " << *refs;
 
+	XenGnttab::reservePages(domId, count);
+
+	TRACE_SCOPE("gnttab", "map", domId);
 
 	mBuffer = xengnttab_map_domain_grant_refs(mHandle, count, domId,
 											  const_cast<grant_ref_t*>(refs),
-											  PROT_READ | PROT_WRITE);
+											  prot);
 
 	if (!mBuffer)
 	{
+		XenGnttab::releasePages(domId, count);
+
 		throw XenGnttabException("Can't map buffer");
 	}
-
 }
 
 void XenGnttabBuffer::release()
@@ -100,8 +326,415 @@ void XenGnttabBuffer::release()
 
 	if (mBuffer)
 	{
-		xengnttab_unmap(mHandle, mBuffer, mCount);
+		auto& unmapQueue = XenGnttabUnmapQueue::getInstance();
+
+		if (unmapQueue.isEnabled())
+		{
+			unmapQueue.push(mDomId, mGnttab, mBuffer, mCount);
+		}
+		else
+		{
+			xengnttab_unmap(mHandle, mBuffer, mCount);
+
+			XenGnttab::releasePages(mDomId, mCount);
+		}
+	}
+}
+
+/*******************************************************************************
+ * XenGnttabSgList
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void XenGnttabSgList::addSegment(const XenGnttabBuffer& buffer, size_t page,
+								 size_t offset, size_t length)
+{
+	if (offset + length > XC_PAGE_SIZE)
+	{
+		throw XenGnttabException("Segment crosses page boundary");
+	}
+
+	if (page >= buffer.size() / XC_PAGE_SIZE)
+	{
+		throw XenGnttabException("Wrong segment page: " + to_string(page));
+	}
+
+	add(static_cast<uint8_t*>(buffer.get()) + page * XC_PAGE_SIZE + offset,
+		length);
+}
+
+void XenGnttabSgList::addRange(const XenGnttabBuffer& buffer, size_t offset,
+							   size_t length)
+{
+	if (offset + length > buffer.size())
+	{
+		throw XenGnttabException("Range is out of buffer");
+	}
+
+	add(static_cast<uint8_t*>(buffer.get()) + offset, length);
+}
+
+void XenGnttabSgList::clear()
+{
+	mIoVec.clear();
+	mSize = 0;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void XenGnttabSgList::add(uint8_t* address, size_t length)
+{
+	if (!length)
+	{
+		return;
+	}
+
+	mSize += length;
+
+	if (!mIoVec.empty())
+	{
+		auto& last = mIoVec.back();
+
+		if (static_cast<uint8_t*>(last.iov_base) + last.iov_len == address)
+		{
+			last.iov_len += length;
+
+			return;
+		}
+	}
+
+	mIoVec.push_back(iovec { address, length });
+}
+
+/*******************************************************************************
+ * XenGnttabDirBuffer
+ ******************************************************************************/
+
+const size_t XenGnttabDirBuffer::cNumRefsPerPage;
+
+XenGnttabDirBuffer::XenGnttabDirBuffer(domid_t domId, grant_ref_t dirRef,
+									   size_t numPages, int prot)
+{
+	readDirectory(domId, dirRef, numPages);
+
+	mBuffer.reset(new XenGnttabBuffer(domId, mRefs.data(), mRefs.size(),
+									  prot));
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void XenGnttabDirBuffer::readDirectory(domid_t domId, grant_ref_t dirRef,
+									   size_t numPages)
+{
+	if (!numPages)
+	{
+		throw XenGnttabException("No pages in directory");
+	}
+
+	mRefs.reserve(numPages);
+
+	while (mRefs.size() < numPages)
+	{
+		XenGnttabBuffer dirBuffer(domId, dirRef, PROT_READ);
+
+		auto dir = static_cast<const Directory*>(dirBuffer.get());
+
+		auto count = std::min(numPages - mRefs.size(), cNumRefsPerPage);
+
+		mRefs.insert(mRefs.end(), dir->refs, dir->refs + count);
+
+		dirRef = dir->nextRef;
+
+		if (mRefs.size() < numPages && !dirRef)
+		{
+			throw XenGnttabException("Page directory is too short");
+		}
+	}
+}
+
+/*******************************************************************************
+ * XenGnttabUnmapQueue
+ ******************************************************************************/
+
+XenGnttabUnmapQueue::XenGnttabUnmapQueue() :
+	mEnabled(false),
+	mTerminate(false),
+	mNumQueued(0),
+	mNumUnmapped(0),
+	mLog("XenGnttabUnmapQueue")
+{
+}
+
+XenGnttabUnmapQueue::~XenGnttabUnmapQueue()
+{
+	setEnabled(false);
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+XenGnttabUnmapQueue& XenGnttabUnmapQueue::getInstance()
+{
+	static XenGnttabUnmapQueue unmapQueue;
+
+	return unmapQueue;
+}
+
+void XenGnttabUnmapQueue::setEnabled(bool enabled)
+{
+	unique_lock<mutex> lock(mMutex);
+
+	if (enabled == mEnabled)
+	{
+		return;
+	}
+
+	mEnabled = enabled;
+
+	if (enabled)
+	{
+		mTerminate = false;
+
+		mThread = thread(&XenGnttabUnmapQueue::run, this);
+
+		return;
+	}
+
+	// the thread unmaps all pending buffers before exit
+	mTerminate = true;
+
+	mCondVar.notify_all();
+
+	lock.unlock();
+
+	if (mThread.joinable())
+	{
+		mThread.join();
+	}
+}
+
+void XenGnttabUnmapQueue::flush()
+{
+	unique_lock<mutex> lock(mMutex);
+
+	auto numQueued = mNumQueued;
+
+	mCondVar.wait(lock, [this, numQueued]
+				  { return mNumUnmapped >= numQueued; });
+}
+
+size_t XenGnttabUnmapQueue::getNumPending() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mNumQueued - mNumUnmapped;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void XenGnttabUnmapQueue::push(domid_t domId, XenGnttabPtr gnttab,
+							   void* address, size_t count)
+{
+	unique_lock<mutex> lock(mMutex);
+
+	// the queue is disabled concurrently: unmap synchronously
+	if (!mEnabled)
+	{
+		lock.unlock();
+
+		xengnttab_unmap(gnttab->getHandle(), address, count);
+
+		XenGnttab::releasePages(domId, count);
+
+		return;
 	}
+
+	mMappings.push_back(Mapping { domId, gnttab, address, count });
+
+	mNumQueued++;
+
+	mCondVar.notify_all();
+}
+
+void XenGnttabUnmapQueue::run()
+{
+	unique_lock<mutex> lock(mMutex);
+
+	while(true)
+	{
+		mCondVar.wait(lock, [this]
+					  { return mTerminate || !mMappings.empty(); });
+
+		if (mMappings.empty())
+		{
+			break;
+		}
+
+		vector<Mapping> mappings;
+
+		mappings.swap(mMappings);
+
+		lock.unlock();
+
+		auto numMappings = mappings.size();
+
+		DLOG(mLog, DEBUG) << "Unmap buffers: " << numMappings;
+
+		for (auto& mapping : mappings)
+		{
+			if (xengnttab_unmap(mapping.gnttab->getHandle(), mapping.address,
+								mapping.count) < 0)
+			{
+				LOG(mLog, ERROR) << "Can't unmap buffer";
+			}
+
+			XenGnttab::releasePages(mapping.domId, mapping.count);
+		}
+
+		// release handles outside of the lock
+		mappings.clear();
+
+		lock.lock();
+
+		mNumUnmapped += numMappings;
+
+		mCondVar.notify_all();
+	}
+}
+
+/*******************************************************************************
+ * XenGnttabCache
+ ******************************************************************************/
+
+XenGnttabCache::XenGnttabCache(size_t maxPages) :
+	mMaxPages(maxPages),
+	mNumHits(0),
+	mNumMisses(0),
+	mLog("XenGnttabCache")
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+XenGnttabBufferPtr XenGnttabCache::get(domid_t domId, grant_ref_t ref)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto key = getKey(domId, ref);
+	auto it = mEntries.find(key);
+
+	if (it != mEntries.end())
+	{
+		mNumHits++;
+
+		mLru.splice(mLru.begin(), mLru, it->second.lruPos);
+
+		return it->second.buffer;
+	}
+
+	mNumMisses++;
+
+	XenGnttabBufferPtr buffer(new XenGnttabBuffer(domId, ref));
+
+	while (mEntries.size() >= mMaxPages)
+	{
+		if (!evict())
+		{
+			DLOG(mLog, DEBUG) << "Cache is full, dom: " << domId
+							  << ", ref: " << ref;
+
+			return buffer;
+		}
+	}
+
+	mLru.push_front(key);
+
+	mEntries[key] = Entry { buffer, mLru.begin() };
+
+	return buffer;
+}
+
+void XenGnttabCache::remove(domid_t domId, grant_ref_t ref)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = mEntries.find(getKey(domId, ref));
+
+	if (it != mEntries.end())
+	{
+		mLru.erase(it->second.lruPos);
+		mEntries.erase(it);
+	}
+}
+
+void XenGnttabCache::remove(domid_t domId)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	for (auto it = mEntries.begin(); it != mEntries.end();)
+	{
+		if ((it->first >> 32) == domId)
+		{
+			mLru.erase(it->second.lruPos);
+			it = mEntries.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+void XenGnttabCache::clear()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mEntries.clear();
+	mLru.clear();
+}
+
+size_t XenGnttabCache::getNumPages() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mEntries.size();
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+bool XenGnttabCache::evict()
+{
+	for (auto it = mLru.rbegin(); it != mLru.rend(); ++it)
+	{
+		auto entry = mEntries.find(*it);
+
+		// skip mappings which are in use
+		if (entry->second.buffer.use_count() > 1)
+		{
+			continue;
+		}
+
+		mEntries.erase(entry);
+		mLru.erase(std::next(it).base());
+
+		return true;
+	}
+
+	return false;
 }
 
 }
@@ -20,6 +20,10 @@
 
 #include "XenStat.hpp"
 
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unordered_set;
 using std::vector;
 
 namespace XenBackend {
@@ -29,6 +33,7 @@ namespace XenBackend {
  ******************************************************************************/
 
 XenStat::XenStat() :
+	mCacheValid(false),
 	mLog("XenStat")
 {
 	LOG(mLog, DEBUG) << "Create xen stat";
@@ -36,6 +41,8 @@ XenStat::XenStat() :
 
 XenStat::~XenStat()
 {
+	stopMonitoring();
+
 	LOG(mLog, DEBUG) << "Delete xen stat";
 }
 
@@ -45,37 +52,146 @@ XenStat::~XenStat()
 
 vector<domid_t> XenStat::getRunningDoms()
 {
+	lock_guard<mutex> lock(mMutex);
+
 	vector<domid_t> runningDomains;
 
-	vector<xc_domaininfo_t> domInfos;
+	mSnapshot.refresh(mInterface);
 
-	mInterface.getDomainsInfo(domInfos);
-
-	for(auto info : domInfos)
-	{
-		if (info.flags & XEN_DOMINF_running)
-		{
-			runningDomains.push_back(info.domain);
-		}
-	}
+	mSnapshot.getRunningDoms(runningDomains);
 
 	return runningDomains;
 }
 
 vector<domid_t> XenStat::getExistingDoms()
 {
+	lock_guard<mutex> lock(mMutex);
+
 	vector<domid_t> existingDomains;
 
-	vector<xc_domaininfo_t> domInfos;
+	if (!mCacheValid)
+	{
+		mSnapshot.refresh(mInterface);
+	}
+
+	mSnapshot.getExistingDoms(existingDomains);
+
+	return existingDomains;
+}
+
+uint64_t XenStat::getGeneration()
+{
+	lock_guard<mutex> lock(mMutex);
 
-	mInterface.getDomainsInfo(domInfos);
+	return mSnapshot.getGeneration();
+}
+
+void XenStat::startMonitoring(XenStore& xenStore, DomainCallback added,
+							  DomainCallback removed,
+							  ErrorCallback errorCallback)
+{
+	stopMonitoring();
 
-	for(auto info : domInfos)
 	{
-		existingDomains.push_back(info.domain);
+		lock_guard<mutex> lock(mMutex);
+
+		mAddedCallback = added;
+		mRemovedCallback = removed;
+		mKnownDomIds.clear();
 	}
 
-	return existingDomains;
+	LOG(mLog, DEBUG) << "Start domain monitoring";
+
+	mWatchGroup.reset(new XenStore::WatchGroup(xenStore, errorCallback));
+
+	// the initial watch event reports already existing domains
+	mWatchGroup->setWatch("@introduceDomain",
+						  [this] (const string&) { domainsChanged(); });
+	mWatchGroup->setWatch("@releaseDomain",
+						  [this] (const string&) { domainsChanged(); });
+}
+
+void XenStat::stopMonitoring()
+{
+	if (!mWatchGroup)
+	{
+		return;
+	}
+
+	LOG(mLog, DEBUG) << "Stop domain monitoring";
+
+	// waits for the running callback
+	mWatchGroup.reset();
+
+	lock_guard<mutex> lock(mMutex);
+
+	mCacheValid = false;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void XenStat::domainsChanged()
+{
+	vector<domid_t> addedDomIds;
+	vector<domid_t> removedDomIds;
+	DomainCallback added, removed;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mCacheValid = false;
+
+		mSnapshot.refresh(mInterface);
+
+		mCacheValid = true;
+
+		unordered_set<domid_t> domIds;
+
+		for (auto& info : mSnapshot.getInfos())
+		{
+			domIds.insert(info.domain);
+
+			if (mKnownDomIds.find(info.domain) == mKnownDomIds.end())
+			{
+				addedDomIds.push_back(info.domain);
+			}
+		}
+
+		for (auto domId : mKnownDomIds)
+		{
+			if (domIds.find(domId) == domIds.end())
+			{
+				removedDomIds.push_back(domId);
+			}
+		}
+
+		mKnownDomIds.swap(domIds);
+
+		added = mAddedCallback;
+		removed = mRemovedCallback;
+	}
+
+	for (auto domId : removedDomIds)
+	{
+		LOG(mLog, DEBUG) << "Domain destroyed, dom id: " << domId;
+
+		if (removed)
+		{
+			removed(domId);
+		}
+	}
+
+	for (auto domId : addedDomIds)
+	{
+		LOG(mLog, DEBUG) << "Domain created, dom id: " << domId;
+
+		if (added)
+		{
+			added(domId);
+		}
+	}
 }
 
 }
@@ -19,18 +19,36 @@
  */
 #include "XenStore.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
 #include <poll.h>
 
+#include "Trace.hpp"
+
 using std::exception;
+using std::future;
 using std::lock_guard;
 using std::mutex;
 using std::string;
 using std::thread;
+using std::unique_lock;
 using std::to_string;
 using std::vector;
 
 namespace XenBackend {
 
+namespace {
+
+// XenStore instance and watch group which callback is running in this thread
+thread_local XenStore* tCallbackStore = nullptr;
+thread_local uint64_t tCallbackGroup = 0;
+
+}
+
 /*******************************************************************************
  * XenStore
  ******************************************************************************/
@@ -39,7 +57,12 @@ XenStore::XenStore(ErrorCallback errorCallback) :
 	mXsHandle(nullptr),
 	mErrorCallback(errorCallback),
 	mStarted(false),
-	mLog("XenStore")
+	mLog("XenStore"),
+	mNextToken(1),
+	mNextGroup(1),
+	mCacheEnabled(false),
+	mNumCacheHits(0),
+	mCacheGeneration(0)
 {
 	try
 	{
@@ -59,6 +82,9 @@ XenStore::~XenStore()
 
 	stop();
 
+	// blocks until queued asynchronous requests are finished
+	mAsyncContext.reset();
+
 	release();
 }
 
@@ -68,6 +94,15 @@ XenStore::~XenStore()
 
 string XenStore::getDomainPath(domid_t domId)
 {
+	lock_guard<mutex> lock(mCacheMutex);
+
+	auto it = mDomainPathes.find(domId);
+
+	if (it != mDomainPathes.end())
+	{
+		return it->second;
+	}
+
 	auto domPath = xs_get_domain_path(mXsHandle, domId);
 
 	if (!domPath)
@@ -79,6 +114,8 @@ string XenStore::getDomainPath(domid_t domId)
 
 	free(domPath);
 
+	mDomainPathes[domId] = result;
+
 	return result;
 }
 
@@ -102,22 +139,7 @@ unsigned int XenStore::readUint(const string& path)
 
 string XenStore::readString(const string& path)
 {
-	unsigned length;
-	auto pData = static_cast<char*>(xs_read(mXsHandle, XBT_NULL, path.c_str(),
-											&length));
-
-	if (!pData)
-	{
-		throw XenStoreException("Can't read from: " + path);
-	}
-
-	string result(pData);
-
-	free(pData);
-
-	LOG(mLog, DEBUG) << "Read string " << path << " : " << result;
-
-	return result;
+	return doRead(XBT_NULL, path);
 }
 
 void XenStore::writeInt(const string& path, int value)
@@ -140,99 +162,100 @@ void XenStore::writeUint(const string& path, unsigned int value)
 
 void XenStore::writeString(const string& path, const string& value)
 {
-	LOG(mLog, DEBUG) << "Write string " << path << " : " << value;
-
-	if (!xs_write(mXsHandle, XBT_NULL, path.c_str(), value.c_str(),
-				  value.length()))
-	{
-		throw XenStoreException("Can't write value to " + path);
-	}
+	doWrite(XBT_NULL, path, value);
 }
 
 void XenStore::removePath(const string& path)
 {
-	LOG(mLog, DEBUG) << "Remove path " << path;
-
-	if (!xs_rm(mXsHandle, XBT_NULL, path.c_str()))
-	{
-		throw XenStoreException("Can't remove path " + path);
-	}
+	doRemove(XBT_NULL, path);
 }
 
 vector<string> XenStore::readDirectory(const string& path)
 {
-	unsigned int num;
-	auto items = xs_directory(mXsHandle, XBT_NULL, path.c_str(), &num);
+	return doReadDirectory(XBT_NULL, path);
+}
 
-	if (items && num)
-	{
-		vector<string> result;
+bool XenStore::checkIfExist(const string& path)
+{
+	return doCheckIfExist(XBT_NULL, path);
+}
 
-		result.reserve(num);
+size_t XenStore::readBatch(vector<BatchItem>& items)
+{
+	return doReadBatch(XBT_NULL, items);
+}
 
-		for(unsigned int i = 0; i < num; i++)
-		{
-			result.push_back(items[i]);
-		}
+future<string> XenStore::readStringAsync(const string& path)
+{
+	return callAsync<string>([this, path] { return readString(path); });
+}
 
-		free(items);
+future<void> XenStore::writeStringAsync(const string& path,
+											 const string& value)
+{
+	return callAsync<void>([this, path, value] { writeString(path, value); });
+}
 
-		return result;
-	}
+future<void> XenStore::removePathAsync(const string& path)
+{
+	return callAsync<void>([this, path] { removePath(path); });
+}
 
-	return vector<string>();
+future<vector<string>> XenStore::readDirectoryAsync(const string& path)
+{
+	return callAsync<vector<string>>([this, path]
+									 { return readDirectory(path); });
 }
 
-bool XenStore::checkIfExist(const string& path)
+void XenStore::setCacheEnabled(bool enabled)
 {
-	unsigned length;
-	auto pData = xs_read(mXsHandle, XBT_NULL, path.c_str(), &length);
+	lock_guard<mutex> lock(mCacheMutex);
 
-	if (!pData)
+	if (enabled == mCacheEnabled)
 	{
-		return false;
+		return;
 	}
 
-	free(pData);
+	LOG(mLog, DEBUG) << "Set cache enabled: " << enabled;
 
-	return true;
+	mCacheEnabled = enabled;
+
+	mCache.clear();
+	mCacheGeneration++;
 }
 
-void XenStore::setWatch(const string& path, WatchCallback callback)
+void XenStore::runTransaction(TransactionCallback callback)
 {
-	lock_guard<mutex> lock(mMutex);
+	for (int i = 0; i < cMaxTransactionAttempts; i++)
+	{
+		Transaction transaction(*this);
 
-	LOG(mLog, DEBUG) << "Set watch: " << path;
+		callback(transaction);
 
-	if (!xs_watch(mXsHandle, path.c_str(), ""))
-	{
-		throw XenStoreException("Can't set xs watch for " + path);
+		if (transaction.commit())
+		{
+			return;
+		}
+
+		LOG(mLog, DEBUG) << "Transaction conflict, retry: " << i + 1;
 	}
 
-	mWatches[path] = callback;
+	throw XenStoreException("Can't commit transaction: too many conflicts");
 }
 
-void XenStore::clearWatch(const string& path)
+void XenStore::setWatch(const string& path, WatchCallback callback)
 {
-	lock_guard<mutex> lock(mMutex);
-
-	LOG(mLog, DEBUG) << "Clear watch: " << path;
-
-	xs_unwatch(mXsHandle, path.c_str(), "");
+	addWatch(0, path, callback, nullptr);
+}
 
-	mWatches.erase(path);
+void XenStore::clearWatch(const string& path)
+{
+	removeWatch(0, path);
 }
 
 void XenStore::clearWatches()
 {
-	lock_guard<mutex> lock(mMutex);
-
-	for (auto watch : mWatches)
-	{
-		xs_unwatch(mXsHandle, watch.first.c_str(), "");
-	}
-
-	mWatches.clear();
+	removeWatches(0);
 }
 
 void XenStore::start()
@@ -246,7 +269,16 @@ void XenStore::start()
 
 	mStarted = true;
 
-	mThread = thread(&XenStore::watchesThread, this);
+	try
+	{
+		mThread = mThreadConfig.createThread([this] { watchesThread(); });
+	}
+	catch(const exception& e)
+	{
+		mStarted = false;
+
+		throw;
+	}
 }
 
 void XenStore::stop()
@@ -262,6 +294,27 @@ void XenStore::stop()
 	{
 		mThread.join();
 	}
+
+	unique_lock<mutex> lock(mMutex);
+
+	// wait for callbacks queued to the executor unless we are called from
+	// one of them
+	if (tCallbackStore != this)
+	{
+		mCondVar.wait(lock, [this] { return mStrands.empty(); });
+	}
+}
+
+void XenStore::setExecutor(ThreadPoolPtr executor)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (mStarted)
+	{
+		throw XenStoreException("Can't set executor: XenStore is started");
+	}
+
+	mExecutor = executor;
 }
 
 /*******************************************************************************
@@ -292,79 +345,873 @@ void XenStore::release()
 	}
 }
 
-string XenStore::checkXsWatch()
+bool XenStore::doReadValue(xs_transaction_t t, const string& path,
+						   string& value)
 {
-	string path;
+	TRACE_SCOPE("xenstore", "read", t);
 
-	auto result = xs_check_watch(mXsHandle);
+	auto cacheable = t == XBT_NULL && mCacheEnabled && isCacheable(path);
+	uint64_t generation = 0;
+
+	if (cacheable)
+	{
+		lock_guard<mutex> lock(mCacheMutex);
+
+		auto it = mCache.find(path);
+
+		if (it != mCache.end())
+		{
+			mNumCacheHits++;
+
+			value = it->second.value;
+
+			return it->second.exists;
+		}
+
+		generation = mCacheGeneration;
+	}
+
+	unsigned length;
+	auto pData = static_cast<char*>(xs_read(mXsHandle, t, path.c_str(),
+											&length));
+
+	bool exists = pData != nullptr;
+
+	value = exists ? string(pData) : string();
+
+	free(pData);
 
-	if (result)
+	if (cacheable)
 	{
-		path = result[XS_WATCH_PATH];
+		lock_guard<mutex> lock(mCacheMutex);
 
-		free(result);
+		// the entry could be changed while it was being read
+		if (generation == mCacheGeneration)
+		{
+			mCache[path] = { exists, value };
+		}
 	}
 
-	return path;
+	return exists;
 }
 
-XenStore::WatchCallback XenStore::getWatchCallback(string& path)
+string XenStore::doRead(xs_transaction_t t, const string& path)
 {
-	lock_guard<mutex> lock(mMutex);
+	string result;
 
-	WatchCallback callback = nullptr;
-/*
-	auto result = find_if(mWatches.begin(), mWatches.end(),
-						  [&path] (const pair<string, WatchCallback> &val)
-						  { return path.compare(0, val.first.length(),
-						                           val.first) == 0; });
-*/
-	auto result = mWatches.find(path);
+	if (!doReadValue(t, path, result))
+	{
+		throw XenStoreException("Can't read from: " + path);
+	}
+
+	LOG(mLog, DEBUG) << "Read string " << path << " : " << result;
+
+	return result;
+}
+
+void XenStore::doWrite(xs_transaction_t t, const string& path,
+					   const string& value)
+{
+	TRACE_SCOPE("xenstore", "write", t);
+
+	LOG(mLog, DEBUG) << "Write string " << path << " : " << value;
 
-	if (result != mWatches.end())
+	if (!xs_write(mXsHandle, t, path.c_str(), value.c_str(), value.length()))
 	{
-		callback = result->second;
+		throw XenStoreException("Can't write value to " + path);
 	}
 
-	return callback;
+	invalidateCache(path);
 }
 
-void XenStore::watchesThread()
+void XenStore::doRemove(xs_transaction_t t, const string& path)
 {
-	try
+	TRACE_SCOPE("xenstore", "remove", t);
+
+	LOG(mLog, DEBUG) << "Remove path " << path;
+
+	if (!xs_rm(mXsHandle, t, path.c_str()))
 	{
-		while(mPollFd->poll())
+		throw XenStoreException("Can't remove path " + path);
+	}
+
+	invalidateCache(path);
+}
+
+bool XenStore::doCheckIfExist(xs_transaction_t t, const string& path)
+{
+	string value;
+
+	return doReadValue(t, path, value);
+}
+
+size_t XenStore::doReadBatch(xs_transaction_t t, vector<BatchItem>& items)
+{
+	size_t numRead = 0;
+
+	for (auto& item : items)
+	{
+		string value;
+		bool exists;
+
+		// the cache keeps only strings, no need to avoid allocation here
+		if (t == XBT_NULL && readCached(item.path, value, exists))
+		{
+			parseBatchItem(item, exists ? value.c_str() : nullptr);
+		}
+		else
 		{
-			string path;
+			unsigned length;
+			auto pData = static_cast<char*>(xs_read(mXsHandle, t,
+													item.path.c_str(),
+													&length));
 
-			while(!(path = checkXsWatch()).empty())
-			{
-				LOG(mLog, DEBUG) << "Path triggered: " << path;
+			parseBatchItem(item, pData);
+
+			free(pData);
+		}
 
-				auto callback = getWatchCallback(path);
+		if (item.status == BatchItem::Status::OK)
+		{
+			numRead++;
+		}
+	}
 
-				if (callback)
-				{
-					LOG(mLog, DEBUG) << "Watch triggered: " << path;
+	LOG(mLog, DEBUG) << "Read batch, items: " << items.size()
+					 << ", read: " << numRead;
 
-					callback(path);
-				}
-			}
+	return numRead;
+}
+
+bool XenStore::readCached(const string& path, string& value, bool& exists)
+{
+	if (!mCacheEnabled || !isCacheable(path))
+	{
+		return false;
+	}
+
+	exists = doReadValue(XBT_NULL, path, value);
+
+	return true;
+}
+
+void XenStore::parseBatchItem(BatchItem& item, const char* data)
+{
+	if (!data)
+	{
+		item.status = BatchItem::Status::NOT_FOUND;
+
+		return;
+	}
+
+	char* end = nullptr;
+
+	errno = 0;
+
+	switch (item.type)
+	{
+	case BatchItem::Type::STRING:
+		item.stringValue = data;
+		item.status = BatchItem::Status::OK;
+
+		return;
+
+	case BatchItem::Type::INT:
+	{
+		auto value = strtol(data, &end, 10);
+
+		item.intValue = static_cast<int>(value);
+
+		if (value < INT_MIN || value > INT_MAX)
+		{
+			errno = ERANGE;
 		}
+
+		break;
 	}
-	catch(const exception& e)
+
+	case BatchItem::Type::UINT:
 	{
-		if (mErrorCallback)
+		auto value = strtoul(data, &end, 10);
+
+		item.uintValue = static_cast<unsigned int>(value);
+
+		if (value > UINT_MAX || strchr(data, '-'))
 		{
-			mErrorCallback(e);
+			errno = ERANGE;
 		}
-		else
+
+		break;
+	}
+	}
+
+	item.status = (end == data || *end != '\0' || errno) ?
+				  BatchItem::Status::INVALID : BatchItem::Status::OK;
+}
+
+vector<string> XenStore::doReadDirectory(xs_transaction_t t,
+										 const string& path)
+{
+	TRACE_SCOPE("xenstore", "readDirectory", t);
+
+	unsigned int num;
+	auto items = xs_directory(mXsHandle, t, path.c_str(), &num);
+
+	if (items && num)
+	{
+		vector<string> result;
+
+		result.reserve(num);
+
+		for(unsigned int i = 0; i < num; i++)
 		{
-			LOG(mLog, ERROR) << e.what();
+			result.push_back(items[i]);
 		}
+
+		free(items);
+
+		return result;
 	}
 
-	mStarted = false;
+	free(items);
+
+	return vector<string>();
+}
+
+bool XenStore::isCacheable(const string& path)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	// XS watches are recursive: the watch covers the entry and all its
+	// children
+	return findNode(path, false) != nullptr;
+}
+
+void XenStore::invalidateCache(const string& path)
+{
+	lock_guard<mutex> lock(mCacheMutex);
+
+	mCacheGeneration++;
+
+	if (mCache.empty())
+	{
+		return;
+	}
+
+	if (path == "/")
+	{
+		mCache.clear();
+
+		return;
+	}
+
+	mCache.erase(path);
+
+	// the cache is ordered: children of the entry follow each other
+	auto prefix = !path.empty() && path.back() == '/' ? path : path + "/";
+	auto it = mCache.lower_bound(prefix);
+
+	while (it != mCache.end() &&
+		   it->first.compare(0, prefix.length(), prefix) == 0)
+	{
+		it = mCache.erase(it);
+	}
+}
+
+bool XenStore::checkXsWatch(string& path, string& token)
+{
+	auto result = xs_check_watch(mXsHandle);
+
+	if (!result)
+	{
+		return false;
+	}
+
+	path = result[XS_WATCH_PATH];
+	token = result[XS_WATCH_TOKEN] ? result[XS_WATCH_TOKEN] : "";
+
+	free(result);
+
+	return true;
+}
+
+bool XenStore::resolveWatch(const string& path, string& token,
+							uint64_t& group)
+{
+	auto it = mWatches.find(token);
+
+	// fall back to the path matching if there is no token. Events with
+	// unknown tokens belong to removed watches and are dropped.
+	if (it == mWatches.end() && token.empty())
+	{
+		auto node = findNode(path, false);
+
+		if (node)
+		{
+			it = mWatches.find(node->tokens.front());
+		}
+	}
+
+	if (it == mWatches.end())
+	{
+		return false;
+	}
+
+	token = it->first;
+	group = it->second.group;
+
+	return true;
+}
+
+void XenStore::dispatchWatch(const string& path, string token)
+{
+	unique_lock<mutex> lock(mMutex);
+
+	uint64_t group;
+
+	if (!resolveWatch(path, token, group))
+	{
+		return;
+	}
+
+	if (!mExecutor)
+	{
+		lock.unlock();
+
+		runWatch(path, token);
+
+		return;
+	}
+
+	// callbacks of one group or of one own watch are called in order
+	auto key = group ? "group:" + to_string(group) : "watch:" + token;
+	auto& strand = mStrands[key];
+
+	strand.events.emplace_back(path, token);
+
+	if (!strand.running)
+	{
+		strand.running = true;
+
+		mExecutor->call([this, key] { runStrand(key); });
+	}
+}
+
+void XenStore::runStrand(const string& key)
+{
+	while(true)
+	{
+		unique_lock<mutex> lock(mMutex);
+
+		auto& strand = mStrands[key];
+
+		if (strand.events.empty())
+		{
+			mStrands.erase(key);
+
+			mCondVar.notify_all();
+
+			return;
+		}
+
+		auto event = strand.events.front();
+
+		strand.events.pop_front();
+
+		lock.unlock();
+
+		try
+		{
+			runWatch(event.first, event.second);
+		}
+		catch(const exception& e)
+		{
+			if (mErrorCallback)
+			{
+				mErrorCallback(e);
+			}
+			else
+			{
+				LOG(mLog, ERROR) << e.what();
+			}
+		}
+	}
+}
+
+void XenStore::runWatch(const string& path, const string& token)
+{
+	Watch watch;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		// the watch could be removed while the event was queued
+		auto it = mWatches.find(token);
+
+		if (it == mWatches.end())
+		{
+			return;
+		}
+
+		watch = it->second;
+
+		mRunningGroups[watch.group]++;
+	}
+
+	LOG(mLog, DEBUG) << "Watch triggered: " << path;
+
+	auto prevStore = tCallbackStore;
+	auto prevGroup = tCallbackGroup;
+
+	tCallbackStore = this;
+	tCallbackGroup = watch.group;
+
+	auto finish = [this, &watch, prevStore, prevGroup]
+	{
+		tCallbackStore = prevStore;
+		tCallbackGroup = prevGroup;
+
+		lock_guard<mutex> lock(mMutex);
+
+		if (--mRunningGroups[watch.group] == 0)
+		{
+			mRunningGroups.erase(watch.group);
+		}
+
+		mCondVar.notify_all();
+	};
+
+	try
+	{
+		watch.callback(path);
+	}
+	catch(const exception& e)
+	{
+		if (!watch.errorCallback)
+		{
+			finish();
+
+			throw;
+		}
+
+		watch.errorCallback(e);
+	}
+
+	finish();
+}
+
+void XenStore::addWatch(uint64_t group, const string& path,
+						WatchCallback callback, ErrorCallback errorCallback)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto token = findToken(path, group);
+
+	if (!token.empty())
+	{
+		LOG(mLog, DEBUG) << "Replace watch: " << path;
+
+		mWatches[token].callback = callback;
+
+		return;
+	}
+
+	token = to_string(mNextToken++);
+
+	LOG(mLog, DEBUG) << "Set watch: " << path << ", token: " << token;
+
+	if (!xs_watch(mXsHandle, path.c_str(), token.c_str()))
+	{
+		throw XenStoreException("Can't set xs watch for " + path);
+	}
+
+	mWatches[token] = { path, callback, group, errorCallback };
+
+	insertWatch(path, token);
+}
+
+void XenStore::removeWatch(uint64_t group, const string& path)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	LOG(mLog, DEBUG) << "Clear watch: " << path;
+
+	auto token = findToken(path, group);
+
+	if (token.empty())
+	{
+		return;
+	}
+
+	xs_unwatch(mXsHandle, path.c_str(), token.c_str());
+
+	mWatches.erase(token);
+
+	eraseWatch(path, token);
+
+	// cached entries may be not covered by the watches anymore
+	invalidateCache("/");
+}
+
+void XenStore::removeWatches(uint64_t group)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	for (auto it = mWatches.begin(); it != mWatches.end();)
+	{
+		if (it->second.group == group)
+		{
+			xs_unwatch(mXsHandle, it->second.path.c_str(), it->first.c_str());
+
+			eraseWatch(it->second.path, it->first);
+
+			it = mWatches.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+
+	invalidateCache("/");
+}
+
+void XenStore::waitForGroup(unique_lock<mutex>& lock, uint64_t group)
+{
+	// skip waiting if we are called from the callback itself
+	if (tCallbackStore == this && tCallbackGroup == group)
+	{
+		return;
+	}
+
+	mCondVar.wait(lock, [this, group]
+				  { return mRunningGroups.find(group) ==
+						   mRunningGroups.end(); });
+}
+
+vector<string> XenStore::splitPath(const string& path)
+{
+	vector<string> components;
+
+	size_t start = 0;
+
+	while (start < path.length())
+	{
+		auto end = path.find('/', start);
+
+		if (end == string::npos)
+		{
+			end = path.length();
+		}
+
+		if (end > start)
+		{
+			components.push_back(path.substr(start, end - start));
+		}
+
+		start = end + 1;
+	}
+
+	return components;
+}
+
+XenStore::WatchNode* XenStore::findNode(const string& path, bool exact)
+{
+	auto node = &mWatchTree;
+	WatchNode* found = node->tokens.empty() ? nullptr : node;
+
+	for (auto& component : splitPath(path))
+	{
+		auto it = node->children.find(component);
+
+		if (it == node->children.end())
+		{
+			return exact ? nullptr : found;
+		}
+
+		node = it->second.get();
+
+		// the deepest watch wins
+		if (!node->tokens.empty())
+		{
+			found = node;
+		}
+	}
+
+	return exact ? node : found;
+}
+
+string XenStore::findToken(const string& path, uint64_t group)
+{
+	auto node = findNode(path, true);
+
+	if (node)
+	{
+		for (auto& token : node->tokens)
+		{
+			if (mWatches[token].group == group)
+			{
+				return token;
+			}
+		}
+	}
+
+	return "";
+}
+
+void XenStore::insertWatch(const string& path, const string& token)
+{
+	auto node = &mWatchTree;
+
+	for (auto& component : splitPath(path))
+	{
+		auto& child = node->children[component];
+
+		if (!child)
+		{
+			child.reset(new WatchNode());
+		}
+
+		node = child.get();
+	}
+
+	node->tokens.push_back(token);
+}
+
+void XenStore::eraseWatch(const string& path, const string& token)
+{
+	auto components = splitPath(path);
+	vector<WatchNode*> nodes = { &mWatchTree };
+
+	for (auto& component : components)
+	{
+		auto it = nodes.back()->children.find(component);
+
+		if (it == nodes.back()->children.end())
+		{
+			return;
+		}
+
+		nodes.push_back(it->second.get());
+	}
+
+	auto& tokens = nodes.back()->tokens;
+
+	tokens.erase(std::remove(tokens.begin(), tokens.end(), token),
+				 tokens.end());
+
+	// remove empty nodes
+	for (size_t i = components.size(); i > 0; i--)
+	{
+		auto node = nodes[i];
+
+		if (!node->tokens.empty() || !node->children.empty())
+		{
+			break;
+		}
+
+		nodes[i - 1]->children.erase(components[i - 1]);
+	}
+}
+
+void XenStore::watchesThread()
+{
+	try
+	{
+		while(mPollFd->poll())
+		{
+			string path, token;
+
+			while(checkXsWatch(path, token))
+			{
+				LOG(mLog, DEBUG) << "Path triggered: " << path
+								 << ", token: " << token;
+
+				invalidateCache(path);
+
+				dispatchWatch(path, token);
+			}
+		}
+	}
+	catch(const exception& e)
+	{
+		if (mErrorCallback)
+		{
+			mErrorCallback(e);
+		}
+		else
+		{
+			LOG(mLog, ERROR) << e.what();
+		}
+	}
+
+	mStarted = false;
+}
+
+/*******************************************************************************
+ * XenStore::Transaction
+ ******************************************************************************/
+
+XenStore::Transaction::Transaction(XenStore& xenStore) :
+	mXenStore(xenStore),
+	mId(xs_transaction_start(xenStore.mXsHandle))
+{
+	if (mId == XBT_NULL)
+	{
+		throw XenStoreException("Can't start transaction");
+	}
+
+	DLOG(mXenStore.mLog, DEBUG) << "Start transaction: " << mId;
+}
+
+XenStore::Transaction::~Transaction()
+{
+	abort();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+int XenStore::Transaction::readInt(const string& path)
+{
+	return stoi(readString(path));
+}
+
+unsigned int XenStore::Transaction::readUint(const string& path)
+{
+	return stoul(readString(path));
+}
+
+string XenStore::Transaction::readString(const string& path)
+{
+	return mXenStore.doRead(getId(), path);
+}
+
+void XenStore::Transaction::writeInt(const string& path, int value)
+{
+	writeString(path, to_string(value));
+}
+
+void XenStore::Transaction::writeUint(const string& path, unsigned int value)
+{
+	writeString(path, to_string(value));
+}
+
+void XenStore::Transaction::writeString(const string& path,
+										const string& value)
+{
+	mXenStore.doWrite(getId(), path, value);
+}
+
+void XenStore::Transaction::removePath(const string& path)
+{
+	mXenStore.doRemove(getId(), path);
+}
+
+bool XenStore::Transaction::checkIfExist(const string& path)
+{
+	return mXenStore.doCheckIfExist(getId(), path);
+}
+
+vector<string> XenStore::Transaction::readDirectory(const string& path)
+{
+	return mXenStore.doReadDirectory(getId(), path);
+}
+
+size_t XenStore::Transaction::readBatch(vector<BatchItem>& items)
+{
+	return mXenStore.doReadBatch(getId(), items);
+}
+
+bool XenStore::Transaction::commit()
+{
+	auto id = getId();
+
+	mId = XBT_NULL;
+
+	if (!xs_transaction_end(mXenStore.mXsHandle, id, false))
+	{
+		if (errno == EAGAIN)
+		{
+			return false;
+		}
+
+		throw XenStoreException("Can't commit transaction: " +
+								string(strerror(errno)));
+	}
+
+	DLOG(mXenStore.mLog, DEBUG) << "Commit transaction: " << id;
+
+	return true;
+}
+
+void XenStore::Transaction::abort()
+{
+	if (mId != XBT_NULL)
+	{
+		xs_transaction_end(mXenStore.mXsHandle, mId, true);
+
+		DLOG(mXenStore.mLog, DEBUG) << "Abort transaction: " << mId;
+
+		mId = XBT_NULL;
+	}
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+xs_transaction_t XenStore::Transaction::getId()
+{
+	if (mId == XBT_NULL)
+	{
+		throw XenStoreException("Transaction is not active");
+	}
+
+	return mId;
+}
+
+/*******************************************************************************
+ * XenStore::WatchGroup
+ ******************************************************************************/
+
+XenStore::WatchGroup::WatchGroup(XenStore& xenStore,
+								 ErrorCallback errorCallback) :
+	mXenStore(xenStore),
+	mErrorCallback(errorCallback)
+{
+	lock_guard<mutex> lock(mXenStore.mMutex);
+
+	mId = mXenStore.mNextGroup++;
+}
+
+XenStore::WatchGroup::~WatchGroup()
+{
+	clearWatches();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void XenStore::WatchGroup::setWatch(const string& path, WatchCallback callback)
+{
+	mXenStore.addWatch(mId, path, callback, mErrorCallback);
+}
+
+void XenStore::WatchGroup::clearWatch(const string& path)
+{
+	mXenStore.removeWatch(mId, path);
+}
+
+void XenStore::WatchGroup::clearWatches()
+{
+	mXenStore.removeWatches(mId);
+
+	unique_lock<mutex> lock(mXenStore.mMutex);
+
+	mXenStore.waitForGroup(lock, mId);
 }
 
 }
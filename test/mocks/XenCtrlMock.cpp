@@ -84,6 +84,7 @@ int xc_domain_getinfolist(xc_interface* xch,
 
 XenCtrlMock* XenCtrlMock::sLastInstance = nullptr;
 bool XenCtrlMock::mErrorMode = false;
+std::list<xc_domaininfo_t> XenCtrlMock::mDomInfos;
 
 XenCtrlMock::XenCtrlMock()
 {
@@ -103,6 +104,8 @@ void XenCtrlMock::addDomInfo(const xc_domaininfo_t& info)
 	if (it != mDomInfos.end())
 	{
 		*it = info;
+
+		return;
 	}
 
 	mDomInfos.push_back(info);
@@ -37,7 +37,8 @@ public:
 	static void setErrorMode(bool errorMode) { mErrorMode = errorMode; }
 	static bool getErrorMode() { return mErrorMode; }
 
-	void addDomInfo(const xc_domaininfo_t& info);
+	static void addDomInfo(const xc_domaininfo_t& info);
+	static void clearDomInfos() { mDomInfos.clear(); }
 	int getDomInfos(domid_t firstDom, unsigned int maxDoms,
 					xc_domaininfo_t* info);
 
@@ -46,7 +47,7 @@ private:
 	static XenCtrlMock* sLastInstance;
 	static bool mErrorMode;
 
-	std::list<xc_domaininfo_t> mDomInfos;
+	static std::list<xc_domaininfo_t> mDomInfos;
 };
 
 #endif /* TEST_MOCKS_XENCTRLMOCK_HPP_ */
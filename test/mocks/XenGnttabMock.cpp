@@ -21,6 +21,7 @@
 #include "XenGnttabMock.hpp"
 
 #include <cstdlib>
+#include <cstring>
 
 extern "C" {
 #include <xenctrl.h>
@@ -82,7 +83,7 @@ void* xengnttab_map_domain_grant_refs(xengnttab_handle* xgt,
 		return nullptr;
 	}
 
-	return xgt->mock->mapGrantRefs(count, domid, refs);
+	return xgt->mock->mapGrantRefs(count, domid, refs, prot);
 }
 
 int xengnttab_unmap(xengnttab_handle* xgt, void* start_address, uint32_t count)
@@ -97,39 +98,125 @@ int xengnttab_unmap(xengnttab_handle* xgt, void* start_address, uint32_t count)
 	return 0;
 }
 
+int xengnttab_grant_copy(xengnttab_handle* xgt, uint32_t count,
+						 xengnttab_grant_copy_segment_t* segs)
+{
+	if (XenGnttabMock::getErrorMode())
+	{
+		return -1;
+	}
+
+	XenGnttabMock::setLastInstance(xgt->mock);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		auto& seg = segs[i];
+
+		uint8_t* src = static_cast<uint8_t*>(seg.source.virt);
+		uint8_t* dst = static_cast<uint8_t*>(seg.dest.virt);
+
+		if (seg.flags & GNTCOPY_source_gref)
+		{
+			src = xgt->mock->getGrantPage(seg.source.foreign.domid,
+										  seg.source.foreign.ref) +
+				  seg.source.foreign.offset;
+
+			if (seg.source.foreign.offset + seg.len > XC_PAGE_SIZE)
+			{
+				seg.status = -1;
+
+				continue;
+			}
+		}
+
+		if (seg.flags & GNTCOPY_dest_gref)
+		{
+			dst = xgt->mock->getGrantPage(seg.dest.foreign.domid,
+										  seg.dest.foreign.ref) +
+				  seg.dest.foreign.offset;
+
+			if (seg.dest.foreign.offset + seg.len > XC_PAGE_SIZE)
+			{
+				seg.status = -1;
+
+				continue;
+			}
+		}
+
+		memcpy(dst, src, seg.len);
+
+		seg.status = GNTST_okay;
+	}
+
+	return 0;
+}
+
 /*******************************************************************************
  * XenGnttabMock
  ******************************************************************************/
 
 XenGnttabMock* XenGnttabMock::sLastInstance = nullptr;
 bool XenGnttabMock::mErrorMode = false;
+std::function<void()> XenGnttabMock::sUnmapCbk;
 
 XenGnttabMock::XenGnttabMock() :
-	mLastMappedAddress(nullptr)
+	mLastMappedAddress(nullptr),
+	mLastProt(0)
 {
 	sLastInstance = this;
 }
 
+XenGnttabMock::~XenGnttabMock()
+{
+	if (sLastInstance == this)
+	{
+		sLastInstance = nullptr;
+	}
+}
+
 /*******************************************************************************
  * Public
  ******************************************************************************/
 
 void* XenGnttabMock::mapGrantRefs(uint32_t count, uint32_t domId,
-								  uint32_t *refs)
+								  uint32_t *refs, int prot)
 {
+	mLastProt = prot;
+
 	MapBuffer buffer = { count, domId, count * XC_PAGE_SIZE };
 
 	void* address = malloc(buffer.size);
 
+	// fill the buffer with the content of granted pages if any
+	for (uint32_t i = 0; i < count; i++)
+	{
+		auto it = mGrantPages.find((static_cast<uint64_t>(domId) << 32) |
+								   refs[i]);
+
+		if (it != mGrantPages.end())
+		{
+			memcpy(static_cast<uint8_t*>(address) + i * XC_PAGE_SIZE,
+				   it->second.data(), XC_PAGE_SIZE);
+		}
+	}
+
 	mMapBuffers[address] = buffer;
 
 	mLastMappedAddress = address;
 
+	// last instance is the one which is used last
+	sLastInstance = this;
+
 	return address;
 }
 
 void XenGnttabMock::unmapGrantRefs(void* address, uint32_t count)
 {
+	if (sUnmapCbk)
+	{
+		sUnmapCbk();
+	}
+
 	auto it = mMapBuffers.find(address);
 
 	if (it == mMapBuffers.end())
@@ -163,3 +250,12 @@ size_t XenGnttabMock::checkMapBuffers()
 {
 	return mMapBuffers.size();
 }
+
+uint8_t* XenGnttabMock::getGrantPage(uint32_t domId, uint32_t ref)
+{
+	auto& page = mGrantPages[(static_cast<uint64_t>(domId) << 32) | ref];
+
+	page.resize(XC_PAGE_SIZE);
+
+	return page.data();
+}
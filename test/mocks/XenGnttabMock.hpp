@@ -21,28 +21,37 @@
 #ifndef TEST_MOCKS_XENGNTTABMOCK_HPP_
 #define TEST_MOCKS_XENGNTTABMOCK_HPP_
 
+#include <functional>
 #include <unordered_map>
+#include <vector>
 
 class XenGnttabMock
 {
 public:
 
 	XenGnttabMock();
+	~XenGnttabMock();
 
 	static XenGnttabMock* getLastInstance() { return sLastInstance; }
+	static void setLastInstance(XenGnttabMock* mock) { sLastInstance = mock; }
 	static void setErrorMode(bool errorMode) { mErrorMode = errorMode; }
 	static bool getErrorMode() { return mErrorMode; }
+	static void setUnmapCbk(std::function<void()> cbk) { sUnmapCbk = cbk; }
 
-	void* mapGrantRefs(uint32_t count, uint32_t domId, uint32_t *refs);
+	void* mapGrantRefs(uint32_t count, uint32_t domId, uint32_t *refs,
+					   int prot);
 	void unmapGrantRefs(void* address, uint32_t count);
 	void* getLastBuffer() const { return mLastMappedAddress; }
+	int getLastProt() const { return mLastProt; }
 	size_t getMapBufferSize(void* address);
 	size_t checkMapBuffers();
+	uint8_t* getGrantPage(uint32_t domId, uint32_t ref);
 
 private:
 
 	static XenGnttabMock* sLastInstance;
 	static bool mErrorMode;
+	static std::function<void()> sUnmapCbk;
 
 	struct MapBuffer
 	{
@@ -52,7 +61,9 @@ private:
 	};
 
 	void* mLastMappedAddress;
+	int mLastProt;
 	std::unordered_map<void*, MapBuffer> mMapBuffers;
+	std::unordered_map<uint64_t, std::vector<uint8_t>> mGrantPages;
 };
 
 #endif /* TEST_MOCKS_XENGNTTABMOCK_HPP_ */
@@ -21,6 +21,7 @@
 #include "XenStoreMock.hpp"
 
 #include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
@@ -30,9 +31,12 @@ extern "C" {
 }
 
 using std::find;
+using std::list;
 using std::lock_guard;
+using std::make_pair;
 using std::mutex;
 using std::string;
+using std::unique_lock;
 using std::unordered_map;
 using std::vector;
 
@@ -105,7 +109,8 @@ void* xs_read(xs_handle* h, xs_transaction_t t,
 		return nullptr;
 	}
 
-	auto value = h->mock->readValue(path);
+	auto value = t == XBT_NULL ? h->mock->readValue(path) :
+								 h->mock->readValue(t, path);
 
 	char* result = nullptr;
 	*len = 0;
@@ -130,7 +135,16 @@ bool xs_write(xs_handle* h, xs_transaction_t t,
 		return false;
 	}
 
-	h->mock->writeValue(path, static_cast<const char*>(data));
+	string value(static_cast<const char*>(data), len);
+
+	if (t == XBT_NULL)
+	{
+		h->mock->writeValue(path, value);
+	}
+	else
+	{
+		h->mock->writeValue(t, path, value);
+	}
 
 	return true;
 }
@@ -142,7 +156,8 @@ bool xs_rm(xs_handle* h, xs_transaction_t t, const char* path)
 		return false;
 	}
 
-	return h->mock->deleteEntry(path);
+	return t == XBT_NULL ? h->mock->deleteEntry(path) :
+						   h->mock->deleteEntry(t, path);
 }
 
 char **xs_directory(xs_handle* h, xs_transaction_t t,
@@ -192,7 +207,7 @@ bool xs_watch(xs_handle* h, const char* path, const char* token)
 		return false;
 	}
 
-	return h->mock->watch(path);
+	return h->mock->watch(path, token);
 }
 
 bool xs_unwatch(xs_handle* h, const char* path, const char* token)
@@ -202,7 +217,7 @@ bool xs_unwatch(xs_handle* h, const char* path, const char* token)
 		return false;
 	}
 
-	return h->mock->unwatch(path);
+	return h->mock->unwatch(path, token);
 }
 
 char** xs_check_watch(xs_handle* h)
@@ -213,25 +228,59 @@ char** xs_check_watch(xs_handle* h)
 	}
 
 	char** value = nullptr;
-	string path;
+	string path, token;
 
-	if (h->mock->getChangedEntry(path))
+	if (h->mock->getChangedEntry(path, token))
 	{
-		size_t totalLength = 2 * sizeof(char*) + path.length() + 1;
+		size_t totalLength = 2 * sizeof(char*) + path.length() + 1 +
+							 token.length() + 1;
 
 		value = static_cast<char**>(malloc(totalLength));
 		char* pos = reinterpret_cast<char*>(&value[2]);
 
-		value[0] = pos;
+		value[XS_WATCH_PATH] = pos;
 
 		strcpy(pos, path.c_str());
 
-		value[1] = nullptr;
+		pos += path.length() + 1;
+
+		value[XS_WATCH_TOKEN] = pos;
+
+		strcpy(pos, token.c_str());
 	}
 
 	return value;
 }
 
+xs_transaction_t xs_transaction_start(xs_handle* h)
+{
+	if (XenStoreMock::getErrorMode())
+	{
+		return XBT_NULL;
+	}
+
+	return h->mock->startTransaction();
+}
+
+bool xs_transaction_end(xs_handle* h, xs_transaction_t t, bool abort)
+{
+	if (XenStoreMock::getErrorMode())
+	{
+		errno = EINVAL;
+
+		return false;
+	}
+
+	if (!h->mock->endTransaction(t, abort))
+	{
+		errno = EAGAIN;
+
+		return false;
+	}
+
+	return true;
+}
+
 /*******************************************************************************
  * XenStoreMock
  ******************************************************************************/
@@ -242,7 +291,13 @@ bool XenStoreMock::mErrorMode = false;
 unordered_map<unsigned int, string> XenStoreMock::mDomPathes;
 unordered_map<string, string> XenStoreMock::mEntries;
 
-XenStoreMock::XenStoreMock()
+XenStoreMock::XenStoreMock() :
+	mNextTransactionId(1),
+	mNumConflicts(0),
+	mNumCommits(0),
+	mNumReads(0),
+	mNumDirectoryReads(0),
+	mWatchBusy(false)
 {
 	sLastInstance = this;
 }
@@ -290,6 +345,8 @@ const char* XenStoreMock::readValue(const std::string& path)
 {
 	lock_guard<mutex> lock(mMutex);
 
+	mNumReads++;
+
 	auto it = mEntries.find(path);
 
 	if (it != mEntries.end())
@@ -304,24 +361,41 @@ bool XenStoreMock::deleteEntry(const std::string& path)
 {
 	lock_guard<mutex> lock(mMutex);
 
-	auto it = mEntries.find(path);
+	bool deleted = false;
 
-	if (it != mEntries.end())
+	// as xenstored, remove the entry together with its children
+	for (auto it = mEntries.begin(); it != mEntries.end();)
 	{
-		mEntries.erase(it);
+		auto& element = it->first;
 
-		pushWatch(path);
+		if (element.compare(0, path.length(), path) == 0 &&
+			(element.length() == path.length() ||
+			 element[path.length()] == '/'))
+		{
+			it = mEntries.erase(it);
 
-		return true;
+			deleted = true;
+		}
+		else
+		{
+			it++;
+		}
 	}
 
-	return false;
+	if (deleted)
+	{
+		pushWatch(path);
+	}
+
+	return deleted;
 }
 
 vector<string> XenStoreMock::readDirectory(const string& path)
 {
 	lock_guard<mutex> lock(mMutex);
 
+	mNumDirectoryReads++;
+
 	vector<string> result;
 
 	string dirPath = path;
@@ -364,25 +438,31 @@ vector<string> XenStoreMock::readDirectory(const string& path)
 	return result;
 }
 
-bool XenStoreMock::watch(const std::string& path)
+bool XenStoreMock::watch(const std::string& path, const std::string& token)
 {
 	lock_guard<mutex> lock(mMutex);
 
-	if (find(mWatches.begin(), mWatches.end(), path) == mWatches.end())
+	auto watch = make_pair(path, token);
+
+	if (find(mWatches.begin(), mWatches.end(), watch) != mWatches.end())
 	{
-		mWatches.push_back(path);
+		return false;
 	}
 
-	pushWatch(path);
+	mWatches.push_back(watch);
+
+	// xenstored fires the watch once it is registered
+	mChangedEntries.push_back(watch);
+	mPipe.write();
 
 	return true;
 }
 
-bool XenStoreMock::unwatch(const std::string& path)
+bool XenStoreMock::unwatch(const std::string& path, const std::string& token)
 {
 	lock_guard<mutex> lock(mMutex);
 
-	auto it = find(mWatches.begin(), mWatches.end(), path);
+	auto it = find(mWatches.begin(), mWatches.end(), make_pair(path, token));
 
 	if (it != mWatches.end())
 	{
@@ -394,29 +474,152 @@ bool XenStoreMock::unwatch(const std::string& path)
 	return false;
 }
 
-bool XenStoreMock::getChangedEntry(std::string& path)
+bool XenStoreMock::getChangedEntry(std::string& path, std::string& token)
 {
 	lock_guard<mutex> lock(mMutex);
 
 	if (mChangedEntries.size())
 	{
-		path = mChangedEntries.front();
+		path = mChangedEntries.front().first;
+		token = mChangedEntries.front().second;
 
 		mChangedEntries.pop_front();
 
 		mPipe.read();
 
+		mWatchBusy = true;
+
 		return true;
 	}
 
+	mWatchBusy = false;
+
+	mCondVar.notify_all();
+
 	return false;
 }
 
+bool XenStoreMock::waitForWatches(std::chrono::milliseconds timeout)
+{
+	unique_lock<mutex> lock(mMutex);
+
+	return mCondVar.wait_for(lock, timeout, [this]
+		{ return mChangedEntries.empty() && !mWatchBusy; });
+}
+
 void XenStoreMock::pushWatch(const std::string& path)
 {
-	if (find(mWatches.begin(), mWatches.end(), path) != mWatches.end())
+	// watches are recursive: the watch is triggered for its children as well
+	for (auto& watch : mWatches)
+	{
+		auto& watchPath = watch.first;
+
+		if (path.compare(0, watchPath.length(), watchPath) == 0 &&
+			(path.length() == watchPath.length() ||
+			 path[watchPath.length()] == '/'))
+		{
+			mChangedEntries.push_back(make_pair(path, watch.second));
+			mPipe.write();
+		}
+	}
+}
+
+unsigned int XenStoreMock::startTransaction()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto id = mNextTransactionId++;
+
+	mTransactions[id];
+
+	return id;
+}
+
+bool XenStoreMock::endTransaction(unsigned int id, bool abort)
+{
+	list<Change> changes;
+
 	{
-		mChangedEntries.push_back(path);
-		mPipe.write();
+		lock_guard<mutex> lock(mMutex);
+
+		auto it = mTransactions.find(id);
+
+		if (it == mTransactions.end())
+		{
+			return false;
+		}
+
+		changes = it->second;
+
+		mTransactions.erase(it);
+
+		if (abort)
+		{
+			return true;
+		}
+
+		if (mNumConflicts > 0)
+		{
+			mNumConflicts--;
+
+			return false;
+		}
+
+		mNumCommits++;
+	}
+
+	for (auto change : changes)
+	{
+		if (change.removed)
+		{
+			deleteEntry(change.path);
+		}
+		else
+		{
+			writeValue(change.path, change.value);
+		}
 	}
+
+	return true;
+}
+
+void XenStoreMock::writeValue(unsigned int id, const string& path,
+							  const string& value)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mTransactions[id].push_back({path, value, false});
+}
+
+const char* XenStoreMock::readValue(unsigned int id, const string& path)
+{
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		auto& changes = mTransactions[id];
+
+		for (auto it = changes.rbegin(); it != changes.rend(); it++)
+		{
+			if (it->path == path)
+			{
+				return it->removed ? nullptr : it->value.c_str();
+			}
+		}
+	}
+
+	return readValue(path);
+}
+
+bool XenStoreMock::deleteEntry(unsigned int id, const string& path)
+{
+	if (!readValue(id, path))
+	{
+		return false;
+	}
+
+	lock_guard<mutex> lock(mMutex);
+
+	mTransactions[id].push_back({path, "", true});
+
+	return true;
 }
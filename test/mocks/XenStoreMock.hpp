@@ -21,6 +21,8 @@
 #ifndef TEST_MOCKS_XENSTOREMOCK_HPP_
 #define TEST_MOCKS_XENSTOREMOCK_HPP_
 
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <list>
 #include <mutex>
@@ -47,9 +49,24 @@ public:
 	const char* readValue(const std::string& path);
 	bool deleteEntry(const std::string& path);
 	std::vector<std::string> readDirectory(const std::string& path);
-	bool watch(const std::string& path);
-	bool unwatch(const std::string& path);
-	bool getChangedEntry(std::string& path);
+	bool watch(const std::string& path, const std::string& token);
+	bool unwatch(const std::string& path, const std::string& token);
+	bool getChangedEntry(std::string& path, std::string& token);
+	// waits till fired watches are read and the reader comes back for more,
+	// i.e. callbacks called in the watches thread are finished
+	bool waitForWatches(std::chrono::milliseconds timeout =
+							std::chrono::milliseconds(1000));
+
+	unsigned int startTransaction();
+	bool endTransaction(unsigned int id, bool abort);
+	void writeValue(unsigned int id, const std::string& path,
+					const std::string& value);
+	const char* readValue(unsigned int id, const std::string& path);
+	bool deleteEntry(unsigned int id, const std::string& path);
+	void setNumConflicts(int numConflicts) { mNumConflicts = numConflicts; }
+	int getNumCommits() const { return mNumCommits; }
+	int getNumReads() const { return mNumReads; }
+	int getNumDirectoryReads() const { return mNumDirectoryReads; }
 
 	typedef std::function<void(const std::string& path,
 							   const std::string& value)> Callback;
@@ -62,14 +79,32 @@ private:
 	static bool mErrorMode;
 
 	std::mutex mMutex;
+	std::condition_variable mCondVar;
 
 	Pipe mPipe;
 
 	static std::unordered_map<unsigned int, std::string> mDomPathes;
 	static std::unordered_map<std::string, std::string> mEntries;
 
-	std::list<std::string> mWatches;
-	std::list<std::string> mChangedEntries;
+	struct Change
+	{
+		std::string path;
+		std::string value;
+		bool removed;
+	};
+
+	std::unordered_map<unsigned int, std::list<Change>> mTransactions;
+	unsigned int mNextTransactionId;
+	int mNumConflicts;
+	int mNumCommits;
+	int mNumReads;
+	int mNumDirectoryReads;
+
+	// path and token pairs
+	std::list<std::pair<std::string, std::string>> mWatches;
+	std::list<std::pair<std::string, std::string>> mChangedEntries;
+	// the last changed entry is read and being handled
+	bool mWatchBusy;
 	Callback mCallback;
 
 	void pushWatch(const std::string& path);
@@ -1,9 +1,15 @@
 #define CATCH_CONFIG_RUNNER
 #define CATCH_CONFIG_COLOUR_NONE
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstdlib>
+#include <cstring>
 #include <mutex>
+#include <thread>
+
+#include <unistd.h>
 
 #include <catch.hpp>
 
@@ -14,7 +20,9 @@
 #include "mocks/XenStoreMock.hpp"
 #include "testBackend.hpp"
 #include "testFrontendHandler.hpp"
+#include "testRingBuffer.hpp"
 
+using std::atomic;
 using std::chrono::milliseconds;
 using std::condition_variable;
 using std::mutex;
@@ -22,9 +30,12 @@ using std::string;
 using std::to_string;
 using std::unique_lock;
 
+using XenBackend::BackendException;
 using XenBackend::FrontendHandlerPtr;
 using XenBackend::Log;
 using XenBackend::LogLevel;
+using XenBackend::ThreadPool;
+using XenBackend::ThreadPoolPtr;
 
 static mutex gMutex;
 static condition_variable gCondVar;
@@ -37,6 +48,7 @@ static const char* gDevName = "test_device";
 static bool gNewFrontend = false;
 static domid_t gNewFrontDomId = 0;
 static uint16_t gNewFrontDevId = 0;
+static int gNumNewFrontends = 0;
 
 void TestBackend::onNewFrontend(domid_t domId, uint16_t devId)
 {
@@ -44,12 +56,15 @@ void TestBackend::onNewFrontend(domid_t domId, uint16_t devId)
 
 	gNewFrontDomId = domId;
 	gNewFrontDevId = devId;
+	gNumNewFrontends++;
 
 
-	FrontendHandlerPtr frontendHandler(new TestFrontendHandler(gDevName,
+	// share the backend XenStore connection
+	FrontendHandlerPtr frontendHandler(new TestFrontendHandler(getDeviceName(),
 															   getDomId(),
 															   domId,
-															   devId));
+															   devId,
+															   getXenStore()));
 
 	addFrontendHandler(frontendHandler);
 
@@ -73,6 +88,24 @@ bool waitForFrontend()
 	return true;
 }
 
+static string readHandoffFile(int fd)
+{
+	string data;
+	char buffer[256];
+	ssize_t ret;
+
+	lseek(fd, 0, SEEK_SET);
+
+	while ((ret = read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		data.append(buffer, ret);
+	}
+
+	lseek(fd, 0, SEEK_SET);
+
+	return data;
+}
+
 TEST_CASE("BackendHandler", "[backendhandler]")
 {
 	XenEvtchnMock::setErrorMode(false);
@@ -106,11 +139,385 @@ TEST_CASE("BackendHandler", "[backendhandler]")
 
 		REQUIRE(gNewFrontDomId == gFrontDomId);
 		REQUIRE(gNewFrontDevId == gFrontDevId);
+
+		auto frontend = testBackend.getFrontendHandler(gFrontDomId,
+													   gFrontDevId);
+
+		REQUIRE(frontend);
+		REQUIRE(frontend->getDomId() == gFrontDomId);
+		REQUIRE(frontend->getDevId() == gFrontDevId);
+		REQUIRE_FALSE(testBackend.getFrontendHandler(gFrontDomId,
+													 gFrontDevId + 1));
+
+		REQUIRE(testBackend.getNumFrontendHandlers() == 1);
+		REQUIRE(testBackend.getFrontendHandlers().size() == 1);
+		REQUIRE(testBackend.getFrontendHandlers()[0] == frontend);
+	}
+
+	SECTION("Check frontend after stop")
+	{
+		REQUIRE(waitForFrontend());
+
+		auto frontend = testBackend.getFrontendHandler(gFrontDomId,
+													   gFrontDevId);
+
+		REQUIRE(frontend);
+
+		testBackend.stop();
+
+		// the frontend handler still gets state changes
+		testBackend.getXenStore()->writeString(
+				frontend->getXsFrontendPath() + "/state",
+				to_string(XenbusStateInitialising));
+
+		for (int i = 0; i < 100 &&
+			 frontend->getBackendState() != XenbusStateInitWait; i++)
+		{
+			std::this_thread::sleep_for(milliseconds(10));
+		}
+
+		REQUIRE(frontend->getBackendState() == XenbusStateInitWait);
+
+		// the backend may be started again
+		testBackend.start();
+
+		REQUIRE(testBackend.getFrontendHandler(gFrontDomId, gFrontDevId) ==
+				frontend);
+	}
+
+	SECTION("Check incremental update")
+	{
+		REQUIRE(waitForFrontend());
+
+		auto storeMock = XenStoreMock::getLastInstance();
+
+		string bePath = "/local/domain/" + to_string(gDomId) + "/backend/" +
+						gDevName + "/" + to_string(gFrontDomId) + "/";
+		string fePath = "/local/domain/" + to_string(gFrontDomId) +
+						"/device/" + gDevName + "/";
+
+		// let the initial watch event be handled
+		REQUIRE(storeMock->waitForWatches());
+
+		auto numDirReads = storeMock->getNumDirectoryReads();
+
+		// entry of the existing device doesn't cause rescan
+		storeMock->writeValue(bePath + to_string(gFrontDevId) + "/feature",
+							  "1");
+
+		REQUIRE(storeMock->waitForWatches());
+
+		REQUIRE(storeMock->getNumDirectoryReads() == numDirReads);
+
+		// new device causes reading of its domain only
+		uint16_t devId = gFrontDevId + 1;
+
+		storeMock->writeValue(fePath + to_string(devId) + "/state",
+							  to_string(XenbusStateUnknown));
+		storeMock->writeValue(fePath + to_string(devId) + "/ring-ref", "165");
+		storeMock->writeValue(bePath + to_string(devId) + "/state",
+							  to_string(XenbusStateUnknown));
+
+		REQUIRE(waitForFrontend());
+
+		REQUIRE(gNewFrontDevId == devId);
+		REQUIRE(storeMock->getNumDirectoryReads() == numDirReads + 1);
+		REQUIRE(testBackend.getNumFrontendHandlers() == 2);
+
+		testBackend.stop();
+
+		storeMock->deleteEntry(fePath + to_string(devId) + "/state");
+		storeMock->deleteEntry(fePath + to_string(devId) + "/ring-ref");
+		storeMock->deleteEntry(bePath + to_string(devId) + "/state");
 	}
 
 	testBackend.stop();
 }
 
+TEST_CASE("BackendHandlerBringUp", "[backendhandler]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+
+	const char* devName = "test_bringup";
+	const uint16_t numDevices = 8;
+
+	for (uint16_t devId = 0; devId < numDevices; devId++)
+	{
+		TestFrontendHandler::prepareXenStore("DomU", devName, gDomId,
+											 gFrontDomId, devId);
+	}
+
+	TestBackend testBackend(devName, gDomId);
+
+	testBackend.setBringUpPool(ThreadPoolPtr(new ThreadPool(4)));
+
+	testBackend.start();
+
+	for (int i = 0; i < 100 &&
+		 testBackend.getNumFrontendHandlers() < numDevices; i++)
+	{
+		std::this_thread::sleep_for(milliseconds(10));
+	}
+
+	REQUIRE(testBackend.getNumFrontendHandlers() == numDevices);
+
+	for (uint16_t devId = 0; devId < numDevices; devId++)
+	{
+		REQUIRE(testBackend.getFrontendHandler(gFrontDomId, devId));
+	}
+
+	testBackend.stop();
+}
+
+TEST_CASE("BackendHandlerRemoveDuringBringUp", "[backendhandler]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+
+	const char* devName = "test_bringup_remove";
+	const uint16_t numDevices = 2;
+
+	for (uint16_t devId = 0; devId < numDevices; devId++)
+	{
+		TestFrontendHandler::prepareXenStore("DomU", devName, gDomId,
+											 gFrontDomId, devId);
+	}
+
+	ThreadPoolPtr pool(new ThreadPool(1));
+	mutex blockMutex;
+	condition_variable blockCondVar;
+	bool blocked = true;
+
+	// keep bring-ups queued till the device is removed
+	pool->call([&]
+	{
+		unique_lock<mutex> lock(blockMutex);
+
+		blockCondVar.wait(lock, [&] { return !blocked; });
+	});
+
+	TestBackend testBackend(devName, gDomId);
+
+	auto storeMock = XenStoreMock::getLastInstance();
+
+	gNumNewFrontends = 0;
+
+	testBackend.setBringUpPool(pool);
+
+	testBackend.start();
+
+	// the toolstack removes the whole device directory
+	testBackend.getXenStore()->removePath("/local/domain/" +
+										  to_string(gDomId) + "/backend/" +
+										  devName + "/" +
+										  to_string(gFrontDomId) + "/1");
+
+	// let the watch event be handled
+	auto watchesHandled = storeMock->waitForWatches();
+
+	{
+		unique_lock<mutex> lock(blockMutex);
+
+		blocked = false;
+
+		blockCondVar.notify_all();
+	}
+
+	REQUIRE(watchesHandled);
+
+	for (int i = 0; i < 100 &&
+		 !testBackend.getFrontendHandler(gFrontDomId, 0); i++)
+	{
+		std::this_thread::sleep_for(milliseconds(10));
+	}
+
+	testBackend.stop();
+
+	// onNewFrontend() is not called for the removed device
+	REQUIRE(gNumNewFrontends == 1);
+	REQUIRE(testBackend.getFrontendHandler(gFrontDomId, 0));
+	REQUIRE_FALSE(testBackend.getFrontendHandler(gFrontDomId, 1));
+	REQUIRE(testBackend.getNumFrontendHandlers() == 1);
+}
+
+TEST_CASE("BackendHandlerWarmStart", "[backendhandler]")
+{
+	XenCtrlMock::setErrorMode(false);
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+
+	const char* devName = "test_warmstart";
+
+	xc_domaininfo_t info = {};
+
+	info.domain = gFrontDomId;
+
+	XenCtrlMock::clearDomInfos();
+
+	XenCtrlMock::addDomInfo(info);
+
+	TestFrontendHandler::prepareXenStore("DomU", devName, gDomId,
+										 gFrontDomId, 0);
+
+	TestBackend testBackend(devName, gDomId);
+
+	testBackend.start();
+
+	// existing frontends are created before start() returns
+	REQUIRE(testBackend.getFrontendHandler(gFrontDomId, 0));
+
+	testBackend.stop();
+}
+
+TEST_CASE("BackendHandlerHandoff", "[backendhandler]")
+{
+	XenCtrlMock::setErrorMode(false);
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+
+	const char* devName = "test_handoff";
+
+	xc_domaininfo_t info = {};
+
+	info.domain = gFrontDomId;
+
+	XenCtrlMock::clearDomInfos();
+
+	XenCtrlMock::addDomInfo(info);
+
+	TestFrontendHandler::prepareXenStore("DomU", devName, gDomId,
+										 gFrontDomId, 0);
+
+	string bePath = "/local/domain/" + to_string(gDomId) + "/backend/" +
+					devName + "/" + to_string(gFrontDomId) + "/0/state";
+	string fePath = "/local/domain/" + to_string(gFrontDomId) +
+					"/device/" + devName + "/0/state";
+
+	char path[] = "/tmp/testHandoffXXXXXX";
+	int fd = mkstemp(path);
+
+	REQUIRE(fd >= 0);
+
+	unlink(path);
+
+	string savedState;
+
+	{
+		TestBackend testBackend(devName, gDomId);
+
+		auto storeMock = XenStoreMock::getLastInstance();
+
+		testBackend.start();
+
+		REQUIRE(testBackend.getFrontendHandler(gFrontDomId, 0));
+
+		storeMock->writeValue(fePath, to_string(XenbusStateInitialised));
+
+		for (int i = 0; i < 100 && string(storeMock->readValue(bePath)) !=
+			 to_string(XenbusStateConnected); i++)
+		{
+			std::this_thread::sleep_for(milliseconds(10));
+		}
+
+		storeMock->writeValue(fePath, to_string(XenbusStateConnected));
+
+		testBackend.saveHandoff(fd);
+
+		REQUIRE(testBackend.getNumFrontendHandlers() == 0);
+	}
+
+	// the detached frontend is not closed
+	REQUIRE(string(XenStoreMock().readValue(bePath)) ==
+			to_string(XenbusStateConnected));
+
+	savedState = readHandoffFile(fd);
+
+	REQUIRE(savedState.find(devName) != string::npos);
+	// port, refs and indexes of the ring
+	REQUIRE(savedState.find("12 1 165 2 0 0\n") != string::npos);
+
+	// the frontend publishes the request while no backend is running: the
+	// grant page content is copied into the mapping of the new backend
+	auto gnttabMock = XenGnttabMock::getLastInstance();
+	auto sring = reinterpret_cast<xen_test_sring*>(
+			gnttabMock->getGrantPage(gDomId, 165));
+	xen_test_front_ring frontRing;
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&frontRing, sring, XC_PAGE_SIZE);
+
+	auto req = RING_GET_REQUEST(&frontRing, frontRing.req_prod_pvt++);
+
+	req->id = XENTEST_CMD1;
+	req->seq = 1;
+	req->op.command1.u32data1 = 2;
+	req->op.command1.u32data2 = 3;
+
+	RING_PUSH_REQUESTS(&frontRing);
+
+	{
+		TestBackend testBackend(devName, gDomId);
+
+		auto storeMock = XenStoreMock::getLastInstance();
+		atomic<int> numStateWrites(0);
+
+		storeMock->setWriteValueCbk([&] (const string& path,
+										 const string& value)
+			{ if (path == bePath) { numStateWrites++; }});
+
+		testBackend.loadHandoff(fd);
+		testBackend.start();
+
+		auto frontend = testBackend.getFrontendHandler(gFrontDomId, 0);
+
+		REQUIRE(frontend);
+		REQUIRE(frontend->getBackendState() == XenbusStateConnected);
+
+		// the pending request is handled by the restored ring
+		auto mappedRing = static_cast<xen_test_sring*>(
+				gnttabMock->getLastBuffer());
+
+		REQUIRE(mappedRing->rsp_prod == 1);
+		REQUIRE(mappedRing->ring[0].rsp.seq == 1);
+
+		// let the initial watch events be handled
+		REQUIRE(storeMock->waitForWatches());
+
+		REQUIRE(numStateWrites == 0);
+
+		// restored rings are handed off with the updated indexes
+		REQUIRE(ftruncate(fd, 0) == 0);
+		REQUIRE(lseek(fd, 0, SEEK_SET) == 0);
+
+		testBackend.saveHandoff(fd);
+
+		REQUIRE(readHandoffFile(fd).find("12 1 165 2 1 1\n") !=
+				string::npos);
+
+		storeMock->setWriteValueCbk(nullptr);
+	}
+
+	{
+		TestBackend testBackend("other_device", gDomId);
+
+		REQUIRE_THROWS_AS(testBackend.loadHandoff(fd), BackendException);
+	}
+
+	close(fd);
+
+	memset(sring, 0, XC_PAGE_SIZE);
+
+	XenStoreMock storeMock;
+
+	storeMock.writeValue(fePath, to_string(XenbusStateUnknown));
+	storeMock.writeValue(bePath, to_string(XenbusStateUnknown));
+}
+
 int main( int argc, char* argv[] )
 {
 	Log::setLogMask("*:Disable");
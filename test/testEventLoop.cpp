@@ -0,0 +1,262 @@
+/*
+ *  Test EventLoop
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <poll.h>
+#include <pthread.h>
+
+#include <catch.hpp>
+
+#include "mocks/Pipe.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "EventLoop.hpp"
+#include "XenEvtchn.hpp"
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::exception;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+
+using XenBackend::EventLoop;
+using XenBackend::EventLoopException;
+using XenBackend::EventLoopPtr;
+using XenBackend::ThreadConfig;
+using XenBackend::XenEvtchn;
+
+static mutex gMutex;
+static condition_variable gCondVar;
+
+static int gNumCallbacks = 0;
+static int gNumErrors = 0;
+
+static void errorHandling(const exception& e)
+{
+	unique_lock<mutex> lock(gMutex);
+
+	gNumErrors++;
+
+	gCondVar.notify_all();
+}
+
+static void callback()
+{
+	unique_lock<mutex> lock(gMutex);
+
+	gNumCallbacks++;
+
+	gCondVar.notify_all();
+}
+
+static bool waitForCallbacks(int numCallbacks)
+{
+	unique_lock<mutex> lock(gMutex);
+
+	return gCondVar.wait_for(lock, milliseconds(1000), [numCallbacks]
+							 { return gNumCallbacks >= numCallbacks; });
+}
+
+static bool waitForErrors()
+{
+	unique_lock<mutex> lock(gMutex);
+
+	return gCondVar.wait_for(lock, milliseconds(1000), []
+							 { return gNumErrors > 0; });
+}
+
+TEST_CASE("EventLoop", "[eventloop]")
+{
+	gNumCallbacks = 0;
+	gNumErrors = 0;
+
+	EventLoopPtr eventLoop(new EventLoop(2));
+
+	REQUIRE(eventLoop->getNumThreads() == 2);
+
+	SECTION("Check fd callback")
+	{
+		Pipe pipe;
+
+		eventLoop->addFd(pipe.getFd(), POLLIN, [&pipe]
+						 { pipe.read(); callback(); }, errorHandling);
+
+		REQUIRE_THROWS_AS(eventLoop->addFd(pipe.getFd(), POLLIN, callback),
+						  EventLoopException);
+
+		for (int i = 1; i <= 10; i++)
+		{
+			pipe.write();
+
+			REQUIRE(waitForCallbacks(i));
+		}
+
+		eventLoop->removeFd(pipe.getFd());
+
+		REQUIRE(gNumErrors == 0);
+	}
+
+	SECTION("Check error in callback")
+	{
+		Pipe pipe;
+
+		eventLoop->addFd(pipe.getFd(), POLLIN, []
+						 { throw EventLoopException("Error"); },
+						 errorHandling);
+
+		pipe.write();
+
+		REQUIRE(waitForErrors());
+
+		// fd is removed on error, it is possible to add it again
+		eventLoop->addFd(pipe.getFd(), POLLIN, [&pipe]
+						 { pipe.read(); callback(); });
+
+		REQUIRE(waitForCallbacks(1));
+
+		eventLoop->removeFd(pipe.getFd());
+	}
+
+	SECTION("Check event channels")
+	{
+		XenEvtchnMock::setErrorMode(false);
+
+		XenEvtchn eventChannel1(3, 24, callback, errorHandling);
+		auto mock1 = XenEvtchnMock::getLastInstance();
+
+		XenEvtchn eventChannel2(3, 25, callback, errorHandling);
+		auto mock2 = XenEvtchnMock::getLastInstance();
+
+		eventChannel1.setEventLoop(eventLoop);
+		eventChannel2.setEventLoop(eventLoop);
+
+		eventChannel1.start();
+		eventChannel2.start();
+
+		REQUIRE_THROWS(eventChannel1.setEventLoop(eventLoop));
+
+		mock1->signalPort(eventChannel1.getPort());
+		mock2->signalPort(eventChannel2.getPort());
+
+		REQUIRE(waitForCallbacks(2));
+
+		eventChannel1.stop();
+		eventChannel2.stop();
+
+		REQUIRE(gNumErrors == 0);
+	}
+
+	SECTION("Check timers")
+	{
+		auto timer = eventLoop->addTimer(callback, errorHandling);
+
+		// one-shot timer
+		auto start = steady_clock::now();
+
+		eventLoop->setTimer(timer, microseconds(20000));
+
+		REQUIRE(waitForCallbacks(1));
+		REQUIRE(steady_clock::now() - start >= milliseconds(20));
+
+		std::this_thread::sleep_for(milliseconds(50));
+
+		REQUIRE(gNumCallbacks == 1);
+
+		// periodic timer
+		eventLoop->setTimer(timer, microseconds(1000), microseconds(1000));
+
+		REQUIRE(waitForCallbacks(5));
+
+		// disarmed timer
+		eventLoop->setTimer(timer, microseconds(0));
+
+		std::this_thread::sleep_for(milliseconds(10));
+
+		int numCallbacks = gNumCallbacks;
+
+		std::this_thread::sleep_for(milliseconds(20));
+
+		REQUIRE(gNumCallbacks == numCallbacks);
+
+		eventLoop->removeTimer(timer);
+
+		REQUIRE_THROWS_AS(eventLoop->setTimer(timer, microseconds(1000)),
+						  EventLoopException);
+
+		REQUIRE(gNumErrors == 0);
+	}
+
+	SECTION("Check timer rearm from callback")
+	{
+		EventLoop::TimerId timer = 0;
+		int numExpirations = 0;
+
+		timer = eventLoop->addTimer([&] {
+			if (++numExpirations < 3)
+			{
+				eventLoop->setTimer(timer, microseconds(1000));
+			}
+
+			callback();
+		});
+
+		eventLoop->setTimer(timer, microseconds(1000));
+
+		REQUIRE(waitForCallbacks(3));
+
+		eventLoop->removeTimer(timer);
+	}
+
+	SECTION("Check thread config")
+	{
+		ThreadConfig config0, config1;
+
+		config0.name = "test-worker-0";
+		config1.name = "test-worker-1";
+
+		EventLoop configuredLoop(2, { config0, config1 });
+		Pipe pipe;
+		string name;
+
+		configuredLoop.addFd(pipe.getFd(), POLLIN, [&pipe, &name] {
+			char buffer[16] = {};
+
+			pthread_getname_np(pthread_self(), buffer, sizeof(buffer));
+
+			name = buffer;
+
+			pipe.read();
+			callback();
+		}, errorHandling, 1);
+
+		pipe.write();
+
+		REQUIRE(waitForCallbacks(1));
+		REQUIRE(name == "test-worker-1");
+
+		configuredLoop.removeFd(pipe.getFd());
+	}
+}
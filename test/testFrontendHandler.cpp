@@ -21,6 +21,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <vector>
 
 #include <catch.hpp>
 
@@ -40,9 +41,12 @@ using std::this_thread::sleep_for;
 using std::to_string;
 using std::unique_lock;
 
+using XenBackend::EventLoop;
+using XenBackend::EventLoopPtr;
 using XenBackend::FrontendHandlerBase;
 using XenBackend::RingBufferInBase;
 using XenBackend::RingBufferPtr;
+using XenBackend::XenGnttabUnmapQueue;
 
 static mutex gMutex;
 static condition_variable gCondVar;
@@ -54,7 +58,9 @@ static const char* gDevName = "test_device";
 
 static XenbusState gBeState = XenbusStateUnknown;
 static bool gOnBind = false;
+static bool gRingReused = false;
 static std::list<XenbusState> gBeStates;
+static std::vector<int> gQueueThreads;
 
 void TestFrontendHandler::prepareXenStore(const string& domName,
 										  const string& devName,
@@ -77,13 +83,37 @@ void TestFrontendHandler::prepareXenStore(const string& domName,
 					to_string(feDomId) + "/" + to_string(devId);
 
 	storeMock.writeValue(fePath + "/state", to_string(XenbusStateUnknown));
+	storeMock.writeValue(fePath + "/ring-ref", "165");
 
 	storeMock.writeValue(bePath + "/state", to_string(XenbusStateUnknown));
 }
 
 void TestFrontendHandler::onBind()
 {
-	RingBufferPtr ringBuffer(new TestRingBufferIn(gDomId, 12, 165));
+	if (readNumQueues() > 1)
+	{
+		for (auto& queue : readQueues())
+		{
+			addRingBuffer(RingBufferPtr(new TestRingBufferIn(
+					gDomId, queue.port, queue.refs)), true, queue.thread);
+
+			gQueueThreads.push_back(queue.thread);
+		}
+
+		gOnBind = true;
+
+		return;
+	}
+
+	auto refs = readRingRefs();
+	auto ringBuffer = takeParkedRingBuffer(12, refs);
+
+	gRingReused = ringBuffer != nullptr;
+
+	if (!ringBuffer)
+	{
+		ringBuffer.reset(new TestRingBufferIn(gDomId, 12, refs));
+	}
 
 	addRingBuffer(ringBuffer);
 
@@ -130,6 +160,8 @@ TEST_CASE("FrontendHandler", "[frontendhandler]")
 
 	gBeStates.clear();
 	gOnBind = false;
+	gRingReused = false;
+	gQueueThreads.clear();
 
 	TestFrontendHandler frontendHandler(gDevName, 0, gDomId, gDevId);
 
@@ -265,6 +297,187 @@ TEST_CASE("FrontendHandler", "[frontendhandler]")
 		frontendHandler.stop();
 	}
 
+	SECTION("Check deferred unmapping on close")
+	{
+		auto& unmapQueue = XenGnttabUnmapQueue::getInstance();
+		size_t numPendingOnClosed = 0;
+
+		storeMock->writeValue(fePath + "/state",
+							  to_string(XenbusStateConnected));
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateConnected);
+
+		storeMock->setWriteValueCbk([&] (const string& path,
+										 const string& value)
+		{
+			if (path != bePath + "/state")
+			{
+				return;
+			}
+
+			auto state = static_cast<XenbusState>(stoi(value));
+
+			if (state == XenbusStateClosed)
+			{
+				numPendingOnClosed = unmapQueue.getNumPending();
+			}
+
+			backendStateChanged(state);
+		});
+
+		// slow unmapping: Closed shall be written after the ring is unmapped
+		XenGnttabMock::setUnmapCbk([] { sleep_for(milliseconds(50)); });
+		unmapQueue.setEnabled(true);
+
+		storeMock->writeValue(fePath + "/state",
+							  to_string(XenbusStateClosing));
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateClosing);
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateClosed);
+		REQUIRE(numPendingOnClosed == 0);
+
+		frontendHandler.stop();
+
+		unmapQueue.setEnabled(false);
+		XenGnttabMock::setUnmapCbk(nullptr);
+	}
+
+	SECTION("Check multi-page ring")
+	{
+		REQUIRE(storeMock->readValue(bePath + "/max-ring-page-order"));
+
+		storeMock->writeValue(fePath + "/ring-page-order", "1");
+		storeMock->writeValue(fePath + "/ring-ref0", "165");
+		storeMock->writeValue(fePath + "/ring-ref1", "166");
+
+		// Initialize -> InitWait
+		storeMock->writeValue(fePath + "/state",
+							  to_string(XenbusStateInitialising));
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateInitWait);
+
+		// Initialized -> Connected
+		storeMock->writeValue(fePath + "/state",
+							  to_string(XenbusStateInitialised));
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateConnected);
+		REQUIRE(gOnBind);
+
+		auto gnttabMock = XenGnttabMock::getLastInstance();
+
+		REQUIRE(gnttabMock->getMapBufferSize(gnttabMock->getLastBuffer()) ==
+				2 * XC_PAGE_SIZE);
+
+		frontendHandler.stop();
+
+		storeMock->deleteEntry(fePath + "/ring-page-order");
+		storeMock->deleteEntry(fePath + "/ring-ref0");
+		storeMock->deleteEntry(fePath + "/ring-ref1");
+	}
+
+	SECTION("Check multi-queue")
+	{
+		REQUIRE(string(storeMock->readValue(bePath +
+											"/multi-queue-max-queues")) == "4");
+
+		EventLoopPtr eventLoop(new EventLoop(4));
+
+		frontendHandler.setEventLoop(eventLoop);
+
+		storeMock->writeValue(fePath + "/multi-queue-num-queues", "2");
+		storeMock->writeValue(fePath + "/queue-0/ring-ref", "170");
+		storeMock->writeValue(fePath + "/queue-0/event-channel", "20");
+		storeMock->writeValue(fePath + "/queue-1/ring-ref", "171");
+		storeMock->writeValue(fePath + "/queue-1/event-channel", "21");
+
+		// Initialized -> Connected
+		storeMock->writeValue(fePath + "/state",
+							  to_string(XenbusStateInitialised));
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateConnected);
+		REQUIRE(gOnBind);
+
+		auto stats = frontendHandler.getRingBufferStats();
+
+		REQUIRE(stats.size() == 2);
+
+		// queues are pinned to different workers
+		REQUIRE(gQueueThreads.size() == 2);
+		REQUIRE(gQueueThreads[0] >= 0);
+		REQUIRE(gQueueThreads[1] == (gQueueThreads[0] + 1) % 4);
+
+		frontendHandler.stop();
+
+		for (auto entry : {"multi-queue-num-queues", "queue-0/ring-ref",
+						   "queue-0/event-channel", "queue-1/ring-ref",
+						   "queue-1/event-channel"})
+		{
+			storeMock->deleteEntry(fePath + "/" + entry);
+		}
+	}
+
+	SECTION("Check fast reconnect")
+	{
+		frontendHandler.setFastReconnect(true);
+
+		// Initialized -> Connected
+		storeMock->writeValue(fePath + "/state",
+							  to_string(XenbusStateInitialised));
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateConnected);
+		REQUIRE_FALSE(gRingReused);
+
+		auto evtchnMock = XenEvtchnMock::getLastInstance();
+		auto localPort = evtchnMock->getLastBoundPort();
+
+		for (auto ringRef : {"165", "167"})
+		{
+			storeMock->writeValue(fePath + "/ring-ref", ringRef);
+
+			// Initializing -> Closing -> Closed -> InitWait
+			storeMock->writeValue(fePath + "/state",
+								  to_string(XenbusStateInitialising));
+
+			REQUIRE(waitBeStateChanged());
+			REQUIRE(gBeState == XenbusStateClosing);
+
+			REQUIRE(waitBeStateChanged());
+			REQUIRE(gBeState == XenbusStateClosed);
+
+			REQUIRE(waitBeStateChanged());
+			REQUIRE(gBeState == XenbusStateInitWait);
+
+			// Initialized -> Connected
+			storeMock->writeValue(fePath + "/state",
+								  to_string(XenbusStateInitialised));
+
+			REQUIRE(waitBeStateChanged());
+			REQUIRE(gBeState == XenbusStateConnected);
+
+			// the ring is reused only if the ref is not changed
+			REQUIRE(gRingReused == (string(ringRef) == "165"));
+
+			if (gRingReused)
+			{
+				// the event channel of the reused ring is bound again
+				REQUIRE(XenEvtchnMock::getLastInstance() == evtchnMock);
+				REQUIRE(evtchnMock->getLastBoundPort() != localPort);
+			}
+		}
+
+		frontendHandler.stop();
+
+		storeMock->writeValue(fePath + "/ring-ref", "165");
+	}
+
 	SECTION("Check error")
 	{
 		// Initialize -> InitWait
@@ -28,10 +28,14 @@ class TestFrontendHandler : public XenBackend::FrontendHandlerBase
 public:
 
 	TestFrontendHandler(const std::string& devName,
-						domid_t beDomId, domid_t feDomId, uint16_t devId) :
+						domid_t beDomId, domid_t feDomId, uint16_t devId,
+						XenBackend::XenStorePtr xenStore = nullptr) :
 		XenBackend::FrontendHandlerBase("TestFrontend", devName,
-										beDomId, feDomId, devId)
-	{}
+										beDomId, feDomId, devId, xenStore)
+	{
+		setMaxRingPageOrder(2);
+		setMaxQueues(4);
+	}
 
 	static void prepareXenStore(const std::string& domName,
 								const std::string& devName,
@@ -0,0 +1,189 @@
+/*
+ *  Test IoUring
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <unistd.h>
+
+#include <catch.hpp>
+
+#include "IoUring.hpp"
+
+using std::chrono::milliseconds;
+using std::condition_variable;
+using std::mutex;
+using std::unique_lock;
+using std::vector;
+
+using XenBackend::EventLoop;
+using XenBackend::EventLoopPtr;
+using XenBackend::IoUring;
+
+static mutex gMutex;
+static condition_variable gCondVar;
+
+static vector<int> gResults;
+static int gNumBatches = 0;
+
+static void completion(int result)
+{
+	unique_lock<mutex> lock(gMutex);
+
+	gResults.push_back(result);
+}
+
+static void batch()
+{
+	unique_lock<mutex> lock(gMutex);
+
+	gNumBatches++;
+
+	gCondVar.notify_all();
+}
+
+static bool waitForResults(size_t numResults)
+{
+	unique_lock<mutex> lock(gMutex);
+
+	return gCondVar.wait_for(lock, milliseconds(1000), [numResults]
+							 { return gResults.size() >= numResults; });
+}
+
+TEST_CASE("IoUring", "[iouring]")
+{
+	if (!IoUring::isSupported())
+	{
+		WARN("io_uring is not supported, skip");
+
+		return;
+	}
+
+	gResults.clear();
+	gNumBatches = 0;
+
+	char path[] = "/tmp/testIoUringXXXXXX";
+	int fd = mkstemp(path);
+
+	REQUIRE(fd >= 0);
+
+	unlink(path);
+
+	EventLoopPtr eventLoop(new EventLoop(1));
+	IoUring ioUring(eventLoop, 8, batch);
+
+	vector<uint8_t> data(4096);
+
+	for (size_t i = 0; i < data.size(); i++)
+	{
+		data[i] = i;
+	}
+
+	SECTION("Check read write")
+	{
+		ioUring.write(fd, data.data(), data.size(), 0, completion);
+		ioUring.submit();
+
+		REQUIRE(waitForResults(1));
+		REQUIRE(gResults[0] == static_cast<int>(data.size()));
+
+		vector<uint8_t> part1(1024), part2(3072);
+		iovec iov[] = {{ part1.data(), part1.size() },
+					   { part2.data(), part2.size() }};
+
+		ioUring.readv(fd, iov, 2, 0, completion);
+		ioUring.read(fd, part1.data(), 16, 4096, completion);
+		ioUring.submit();
+
+		REQUIRE(waitForResults(3));
+		REQUIRE(gResults[1] == static_cast<int>(data.size()));
+		// end of file
+		REQUIRE(gResults[2] == 0);
+		REQUIRE(memcmp(part1.data(), &data[0], part1.size()) == 0);
+		REQUIRE(memcmp(part2.data(), &data[1024], part2.size()) == 0);
+		REQUIRE(ioUring.getNumPending() == 0);
+	}
+
+	SECTION("Check fixed buffers")
+	{
+		vector<uint8_t> buffer(8192);
+
+		// the kernel may not allow to pin memory in restricted environment
+		try
+		{
+			ioUring.registerBuffers({{ buffer.data(), buffer.size() }});
+		}
+		catch(const XenBackend::IoUringException& e)
+		{
+			WARN(e.what());
+
+			close(fd);
+
+			return;
+		}
+
+		memcpy(buffer.data(), data.data(), data.size());
+
+		ioUring.writeFixed(fd, buffer.data(), data.size(), 0, 0, completion);
+		ioUring.fsync(fd, completion);
+		ioUring.submit();
+
+		REQUIRE(waitForResults(2));
+
+		ioUring.readFixed(fd, &buffer[4096], data.size(), 0, 0, completion);
+		ioUring.submit();
+
+		REQUIRE(waitForResults(3));
+		REQUIRE(gResults[2] == static_cast<int>(data.size()));
+		REQUIRE(memcmp(&buffer[4096], data.data(), data.size()) == 0);
+
+		ioUring.unregisterBuffers();
+	}
+
+	SECTION("Check errors")
+	{
+		ioUring.read(-1, data.data(), data.size(), 0, completion);
+		ioUring.submit();
+
+		REQUIRE(waitForResults(1));
+		REQUIRE(gResults[0] == -EBADF);
+		REQUIRE(gNumBatches > 0);
+	}
+
+	SECTION("Check full queue")
+	{
+		// more requests than the submission queue size: the queue is
+		// submitted implicitly
+		for (int i = 0; i < 12; i++)
+		{
+			ioUring.read(fd, data.data(), data.size(), 0, completion);
+		}
+
+		ioUring.submit();
+
+		REQUIRE(waitForResults(12));
+	}
+
+	close(fd);
+}
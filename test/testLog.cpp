@@ -0,0 +1,199 @@
+/*
+ *  Test Log
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <catch.hpp>
+
+#include "Log.hpp"
+#include "LogSink.hpp"
+
+using std::lock_guard;
+using std::mutex;
+using std::promise;
+using std::shared_future;
+using std::string;
+using std::to_string;
+using std::vector;
+
+using XenBackend::Log;
+using XenBackend::LogLevel;
+using XenBackend::LogOutput;
+using XenBackend::LogOutputPtr;
+using XenBackend::LogRecord;
+using XenBackend::LogSink;
+using XenBackend::LogSinkPtr;
+
+class TestLogOutput : public LogOutput
+{
+public:
+
+	TestLogOutput(vector<LogRecord>& records,
+				  shared_future<void> ready = shared_future<void>()) :
+		mRecords(records), mReady(ready) {}
+
+	void write(const vector<LogRecord>& records) override
+	{
+		if (mReady.valid())
+		{
+			mReady.wait();
+		}
+
+		mRecords.insert(mRecords.end(), records.begin(), records.end());
+	}
+
+private:
+
+	vector<LogRecord>& mRecords;
+	shared_future<void> mReady;
+};
+
+static int gNumEvaluations = 0;
+
+static int evaluate()
+{
+	return ++gNumEvaluations;
+}
+
+TEST_CASE("Log", "[log]")
+{
+	gNumEvaluations = 0;
+
+	SECTION("Check filtered out level")
+	{
+		// the log mask disables all instances in tests
+		Log log("TestLog", LogLevel::logDEBUG);
+
+		LOG(log, ERROR) << evaluate();
+		LOG(log, DEBUG) << evaluate();
+
+		auto level = Log::getLogLevel();
+
+		Log::setLogLevel(LogLevel::logERROR);
+
+		LOG("TestLog", WARNING) << evaluate();
+		LOG(nullptr, DEBUG) << evaluate();
+
+		Log::setLogLevel(level);
+
+		REQUIRE(gNumEvaluations == 0);
+	}
+
+	SECTION("Check shared categories")
+	{
+		auto mask = Log::getLogMask();
+
+		Log log1("TestLogCategory");
+		Log log2(log1);
+		Log log3("TestLogCategory", LogLevel::logDEBUG);
+
+		REQUIRE(sizeof(Log) <= 2 * sizeof(void*));
+		REQUIRE(log2.getName() == "TestLogCategory");
+
+		// the mask is applied to existing instances
+		REQUIRE(Log::setLogMask("TestLogCat*:Error;TestLogOther:Debug"));
+
+		REQUIRE(log1.getLevel() == LogLevel::logERROR);
+		REQUIRE(log2.getLevel() == LogLevel::logERROR);
+		REQUIRE(log3.getLevel() == LogLevel::logERROR);
+		REQUIRE(Log("TestLogOther").getLevel() == LogLevel::logDEBUG);
+
+		LOG(log1, WARNING) << evaluate();
+		LOG(log2, ERROR) << evaluate();
+
+		REQUIRE(gNumEvaluations == 1);
+
+		// without mask the instance level or the current level is used
+		REQUIRE(Log::setLogMask(""));
+
+		REQUIRE(log1.getLevel() == Log::getLogLevel());
+		REQUIRE(log3.getLevel() == LogLevel::logDEBUG);
+
+		REQUIRE_FALSE(Log::setLogMask("TestLogCategory:Wrong"));
+
+		Log::setLogMask(mask);
+	}
+}
+
+TEST_CASE("LogSink", "[log]")
+{
+	vector<LogRecord> records;
+
+	SECTION("Check async sink")
+	{
+		LogSinkPtr sink(new LogSink(LogOutputPtr(new TestLogOutput(records))));
+
+		Log::setSink(sink);
+
+		for (int i = 0; i < 100; i++)
+		{
+			LOG("TestLogSink", ERROR) << "line " << i;
+		}
+
+		sink->flush();
+
+		Log::setSink(nullptr);
+
+		REQUIRE(records.size() == 100);
+
+		for (int i = 0; i < 100; i++)
+		{
+			REQUIRE(records[i].level == LogLevel::logERROR);
+			REQUIRE(records[i].text.find("TestLogSink") != string::npos);
+			REQUIRE(records[i].text.find("line " + to_string(i)) !=
+					string::npos);
+		}
+
+		REQUIRE(sink->getNumDropped() == 0);
+	}
+
+	SECTION("Check overflow")
+	{
+		promise<void> ready;
+
+		{
+			LogSink sink(LogOutputPtr(new TestLogOutput(
+					records, ready.get_future().share())), 4);
+
+			size_t numPushed = 0;
+
+			for (int i = 0; i < 100; i++)
+			{
+				if (sink.push(LogLevel::logINFO, to_string(i)))
+				{
+					numPushed++;
+				}
+			}
+
+			REQUIRE(sink.getNumDropped() == 100 - numPushed);
+			REQUIRE(sink.getNumDropped() > 0);
+
+			ready.set_value();
+
+			sink.flush();
+
+			REQUIRE(records.size() == numPushed);
+		}
+	}
+}
@@ -20,9 +20,17 @@
 
 #include "testRingBuffer.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstdlib>
+#include <cstring>
 #include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
 
 #include <catch.hpp>
 
@@ -35,8 +43,17 @@ using std::mutex;
 using std::this_thread::sleep_for;
 using std::unique_lock;
 
+using XenBackend::EventLoop;
+using XenBackend::EventLoopPtr;
 using XenBackend::RingBufferInBase;
 using XenBackend::RingBufferOutBase;
+using XenBackend::RingCapture;
+using XenBackend::RingCaptureException;
+using XenBackend::RingCapturePtr;
+using XenBackend::RingCaptureReader;
+using XenBackend::RingCaptureRecord;
+using XenBackend::ThreadPool;
+using XenBackend::ThreadPoolPtr;
 
 static domid_t gDomId = 3;
 static evtchn_port_t gPort = 65;
@@ -194,6 +211,29 @@ void TestRingBufferIn::processRequest(const xentest_req& req)
 	sendResponse(rsp);
 }
 
+void TestRingBufferIn::processRequests(const xentest_req* reqs, size_t count)
+{
+	if (count > mMaxBatchSize)
+	{
+		mMaxBatchSize = count;
+	}
+
+	RingBufferInBase::processRequests(reqs, count);
+}
+
+void TestStaticRingBufferIn::processRequest(const xentest_req& req)
+{
+	xentest_rsp rsp { req.id };
+
+	rsp.seq = req.seq;
+	rsp.status = 0;
+	rsp.u32data = calculateCommand(req);
+
+	mNumRequests++;
+
+	sendResponse(rsp);
+}
+
 void errorCallback(const std::exception& e)
 {
 	gError = true;
@@ -268,6 +308,185 @@ TEST_CASE("RingBufferIn", "[ringbuffer]")
 				REQUIRE_FALSE(gError);
 			}
 		}
+
+		auto stats = ringBuffer.getStats();
+
+		REQUIRE(stats.domId == gDomId);
+		REQUIRE(stats.port == gPort);
+		REQUIRE(stats.numRequests == 3000);
+		REQUIRE(stats.numResponses == 3000);
+		REQUIRE(stats.numNotificationsSent == 3000);
+		REQUIRE(stats.numNotificationsReceived > 0);
+		REQUIRE(stats.batchHistogram[0] > 0);
+		REQUIRE(stats.numOverflows == 0);
+	}
+
+	SECTION("Check deferred responses")
+	{
+		int numNotifications = 0;
+
+		ringBuffer.setDeferResponses(true);
+
+		evtchnMock->setNotifyCbk([&numNotifications]
+								 { numNotifications++; respNotification(); });
+
+		// send batch of requests with one notification
+		for(int j = 0; j < 3; j++)
+		{
+			req[j].seq = seqNumber++;
+
+			*RING_GET_REQUEST(&ring, ring.req_prod_pvt) = req[j];
+
+			ring.req_prod_pvt++;
+		}
+
+		RING_PUSH_REQUESTS(&ring);
+
+		evtchnMock->signalLastBoundPort();
+
+		xentest_rsp rsp {};
+
+		REQUIRE(receiveResp(rsp, ring));
+
+		REQUIRE(ring.rsp_cons == 3);
+		REQUIRE(req[2].seq == rsp.seq);
+		REQUIRE(numNotifications == 1);
+		REQUIRE(ringBuffer.getMaxBatchSize() == 3);
+		REQUIRE_FALSE(gError);
+
+		// the histogram is updated at the end of the indication
+		ringBuffer.stop();
+
+		REQUIRE(ringBuffer.getStats().batchHistogram[1] == 1);
+	}
+
+	SECTION("Check thread pool")
+	{
+		const int cNumRequests = 30;
+
+		ringBuffer.stop();
+		ringBuffer.setThreadPool(ThreadPoolPtr(new ThreadPool(4)));
+		ringBuffer.start();
+
+		for(int i = 0; i < cNumRequests; i++)
+		{
+			req[i % 3].seq = seqNumber++;
+
+			*RING_GET_REQUEST(&ring, ring.req_prod_pvt) = req[i % 3];
+
+			ring.req_prod_pvt++;
+		}
+
+		RING_PUSH_REQUESTS(&ring);
+
+		evtchnMock->signalLastBoundPort();
+
+		xentest_rsp rsp {};
+
+		while (ring.rsp_cons != cNumRequests)
+		{
+			REQUIRE(receiveResp(rsp, ring));
+		}
+
+		ringBuffer.stop();
+
+		REQUIRE_FALSE(gError);
+	}
+
+	SECTION("Check busy polling")
+	{
+		ringBuffer.setPollBudget(milliseconds(200));
+
+		int notify = 0;
+
+		req[0].seq = seqNumber++;
+
+		sendReq(req[0], ring);
+
+		xentest_rsp rsp {};
+
+		REQUIRE(receiveResp(rsp, ring));
+		REQUIRE(req[0].seq == rsp.seq);
+
+		// the backend is polling: the request is picked up without notification
+		req[1].seq = seqNumber++;
+
+		*RING_GET_REQUEST(&ring, ring.req_prod_pvt) = req[1];
+
+		ring.req_prod_pvt++;
+
+		RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&ring, notify);
+
+		REQUIRE_FALSE(notify);
+		REQUIRE(receiveResp(rsp, ring));
+		REQUIRE(req[1].seq == rsp.seq);
+		REQUIRE_FALSE(gError);
+	}
+
+	SECTION("Check capture")
+	{
+		char path[] = "/tmp/testCaptureXXXXXX";
+		int fd = mkstemp(path);
+
+		REQUIRE(fd >= 0);
+
+		close(fd);
+
+		{
+			// small buffer to write the file several times
+			RingCapturePtr capture(new RingCapture(path, 256));
+
+			ringBuffer.setCapture(capture);
+
+			for(int i = 0; i < 3; i++)
+			{
+				req[i].seq = i;
+
+				sendReq(req[i], ring);
+
+				xentest_rsp rsp {};
+
+				REQUIRE(receiveResp(rsp, ring));
+			}
+
+			ringBuffer.setCapture(nullptr);
+
+			REQUIRE(capture->getNumRecords() == 9);
+		}
+
+		RingCaptureReader reader(path);
+		RingCaptureRecord record;
+		uint64_t time = 0;
+
+		for(int i = 0; i < 3; i++)
+		{
+			REQUIRE(reader.read(record));
+			REQUIRE(record.type == RingCaptureRecord::Type::INDICATION);
+			REQUIRE(record.domId == gDomId);
+			REQUIRE(record.port == gPort);
+			REQUIRE(record.time >= time);
+
+			time = record.time;
+
+			REQUIRE(reader.read(record));
+			REQUIRE(record.type == RingCaptureRecord::Type::REQUEST);
+			REQUIRE(record.itemSize == sizeof(xentest_req));
+			REQUIRE(record.getCount() == 1);
+			REQUIRE(memcmp(record.data.data(), &req[i], sizeof(req[i])) == 0);
+
+			REQUIRE(reader.read(record));
+			REQUIRE(record.type == RingCaptureRecord::Type::RESPONSE);
+			REQUIRE(record.getCount() == 1);
+			REQUIRE(reinterpret_cast<const xentest_rsp*>(
+					record.data.data())->seq == req[i].seq);
+		}
+
+		REQUIRE_FALSE(reader.read(record));
+
+		unlink(path);
+
+		REQUIRE_THROWS_AS(RingCaptureReader{path},
+						  RingCaptureException);
 	}
 
 	SECTION("Check overflow")
@@ -280,7 +499,153 @@ TEST_CASE("RingBufferIn", "[ringbuffer]")
 		sleep_for(milliseconds(100));
 
 		REQUIRE(gError);
+		REQUIRE(ringBuffer.getStats().numOverflows == 1);
 	}
+
+	ringBuffer.stop();
+}
+
+TEST_CASE("StaticRingBufferIn", "[ringbuffer]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	gError = false;
+
+	TestStaticRingBufferIn ringBuffer(gDomId, gPort, gRef);
+
+	ringBuffer.setErrorCallback(errorCallback);
+
+	ringBuffer.start();
+
+	auto gnttabMock = XenGnttabMock::getLastInstance();
+	auto evtchnMock = XenEvtchnMock::getLastInstance();
+
+	evtchnMock->setNotifyCbk(respNotification);
+
+	xen_test_front_ring ring;
+	auto sring = static_cast<xen_test_sring*>(gnttabMock->getLastBuffer());
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&ring, sring, XC_PAGE_SIZE);
+
+	xentest_req req {XENTEST_CMD2};
+
+	SECTION("Send and receive")
+	{
+		for(uint32_t i = 0; i < 100; i++)
+		{
+			req.seq = i;
+			req.op.command2.u64data1 = i * 2;
+
+			sendReq(req, ring);
+
+			xentest_rsp rsp {};
+
+			REQUIRE(receiveResp(rsp, ring));
+
+			REQUIRE(rsp.seq == i);
+			REQUIRE(rsp.u32data == i * 2);
+		}
+
+		REQUIRE(ringBuffer.getNumRequests() == 100);
+		REQUIRE(ringBuffer.getStats().numResponses == 100);
+		REQUIRE_FALSE(gError);
+	}
+
+	SECTION("Check thread pool")
+	{
+		const uint32_t cNumRequests = 30;
+
+		ringBuffer.stop();
+		ringBuffer.setThreadPool(ThreadPoolPtr(new ThreadPool(4)));
+		ringBuffer.start();
+
+		for(uint32_t i = 0; i < cNumRequests; i++)
+		{
+			req.seq = i;
+
+			*RING_GET_REQUEST(&ring, ring.req_prod_pvt) = req;
+
+			ring.req_prod_pvt++;
+		}
+
+		RING_PUSH_REQUESTS(&ring);
+
+		evtchnMock->signalLastBoundPort();
+
+		xentest_rsp rsp {};
+
+		while (ring.rsp_cons != cNumRequests)
+		{
+			REQUIRE(receiveResp(rsp, ring));
+		}
+
+		ringBuffer.stop();
+
+		REQUIRE(ringBuffer.getNumRequests() == cNumRequests);
+		REQUIRE_FALSE(gError);
+	}
+
+	ringBuffer.stop();
+}
+
+TEST_CASE("RingBufferInMultiPage", "[ringbuffer]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	gError = false;
+
+	std::vector<grant_ref_t> refs = { 23, 24, 25, 26 };
+
+	TestRingBufferIn ringBuffer(gDomId, gPort, refs);
+
+	ringBuffer.setErrorCallback(errorCallback);
+
+	REQUIRE(ringBuffer.getRef() == refs[0]);
+	REQUIRE(ringBuffer.getRefs() == refs);
+
+	ringBuffer.start();
+
+	auto gnttabMock = XenGnttabMock::getLastInstance();
+	auto evtchnMock = XenEvtchnMock::getLastInstance();
+
+	REQUIRE(gnttabMock->getMapBufferSize(gnttabMock->getLastBuffer()) ==
+			refs.size() * XC_PAGE_SIZE);
+
+	evtchnMock->setNotifyCbk(respNotification);
+
+	xen_test_front_ring ring;
+	auto sring = static_cast<xen_test_sring*>(gnttabMock->getLastBuffer());
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&ring, sring, refs.size() * XC_PAGE_SIZE);
+
+	REQUIRE(RING_SIZE(&ring) > __CONST_RING_SIZE(xen_test, XC_PAGE_SIZE));
+
+	xentest_req req {XENTEST_CMD2};
+
+	req.op.command2.u64data1 = 64;
+
+	// go through the whole ring few times
+	for(unsigned int i = 0; i < 3 * RING_SIZE(&ring); i++)
+	{
+		req.seq = i;
+
+		sendReq(req, ring);
+
+		xentest_rsp rsp {};
+
+		REQUIRE(receiveResp(rsp, ring));
+
+		REQUIRE(req.seq == rsp.seq);
+		REQUIRE(calculateCommand(req) == rsp.u32data);
+	}
+
+	REQUIRE_FALSE(gError);
+
+	ringBuffer.stop();
 }
 
 TEST_CASE("RingBufferOut", "[ringbuffer]")
@@ -349,4 +714,315 @@ TEST_CASE("RingBufferOut", "[ringbuffer]")
 			}
 		}
 	}
+
+	SECTION("Send batch of events")
+	{
+		std::atomic_int numNotifications(0);
+
+		evtchnMock->setNotifyCbk([&numNotifications]
+								 { numNotifications++; });
+
+		for(int j = 0; j < 3; j++)
+		{
+			events[j].seq = seqNumber++;
+		}
+
+		REQUIRE(ringBuffer.sendEvents(events, 3) == 3);
+		REQUIRE(numNotifications == 1);
+		REQUIRE(ringBuffer.getStats().numEvents == 3);
+		REQUIRE(ringBuffer.getStats().numNotificationsSent == 1);
+
+		for(int j = 0; j < 3; j++)
+		{
+			xentest_evt receivedEvt {};
+
+			REQUIRE(receiveEvent(eventPage, eventBuffer, receivedEvt));
+			REQUIRE(events[j].seq == receivedEvt.seq);
+		}
+	}
+
+	SECTION("Check backlog")
+	{
+		const uint32_t cBacklogSize = 4;
+
+		ringBuffer.setBacklogSize(cBacklogSize);
+
+		std::vector<xentest_evt> sentEvents(XENTEST_IN_RING_LEN +
+											cBacklogSize + 2);
+
+		for (auto& evt : sentEvents)
+		{
+			evt.id = XENTEST_EVT2;
+			evt.seq = seqNumber++;
+		}
+
+		// fill the ring, backlog and drop 2 events
+		REQUIRE(ringBuffer.sendEvents(sentEvents.data(), sentEvents.size()) ==
+				XENTEST_IN_RING_LEN + cBacklogSize);
+		REQUIRE(ringBuffer.getBacklogDepth() == cBacklogSize);
+		REQUIRE(ringBuffer.getNumDroppedEvents() == 2);
+		REQUIRE(ringBuffer.getStats().numOverflows > 0);
+
+		xentest_evt receivedEvt {};
+
+		for (uint32_t i = 0; i < XENTEST_IN_RING_LEN + cBacklogSize; i++)
+		{
+			if (i == XENTEST_IN_RING_LEN)
+			{
+				ringBuffer.flushBacklog();
+
+				REQUIRE(ringBuffer.getBacklogDepth() == 0);
+			}
+
+			REQUIRE(receiveEvent(eventPage, eventBuffer, receivedEvt));
+			REQUIRE(receivedEvt.seq == sentEvents[i].seq);
+		}
+
+		REQUIRE_FALSE(receiveEvent(eventPage, eventBuffer, receivedEvt));
+	}
+
+	SECTION("Check backlog retry")
+	{
+		const uint32_t cBacklogSize = 4;
+
+		ringBuffer.stop();
+
+		TestRingBufferOut retryRing(gDomId, gPort, gRef);
+
+		auto retryPage = static_cast<xentest_event_page*>(
+				gnttabMock->getLastBuffer());
+		auto retryBuffer = reinterpret_cast<xentest_evt*>(
+				reinterpret_cast<uint8_t*>(retryPage) + XENTEST_IN_RING_OFFS);
+
+		retryPage->in_cons = 0;
+
+		retryRing.setEventLoop(EventLoopPtr(new EventLoop(1)));
+		retryRing.setBacklogSize(cBacklogSize);
+		retryRing.setBacklogRetryPeriod(std::chrono::microseconds(1000));
+		retryRing.start();
+
+		std::vector<xentest_evt> sentEvents(XENTEST_IN_RING_LEN +
+											cBacklogSize);
+
+		for (auto& evt : sentEvents)
+		{
+			evt.id = XENTEST_EVT2;
+			evt.seq = seqNumber++;
+		}
+
+		REQUIRE(retryRing.sendEvents(sentEvents.data(), sentEvents.size()) ==
+				sentEvents.size());
+		REQUIRE(retryRing.getBacklogDepth() == cBacklogSize);
+
+		// the frontend consumes events without notification
+		xentest_evt receivedEvt {};
+
+		retryPage->in_cons = retryPage->in_prod;
+
+		for (int i = 0; i < 100 && retryRing.getBacklogDepth(); i++)
+		{
+			sleep_for(milliseconds(10));
+		}
+
+		REQUIRE(retryRing.getBacklogDepth() == 0);
+
+		for (uint32_t i = 0; i < cBacklogSize; i++)
+		{
+			REQUIRE(receiveEvent(retryPage, retryBuffer, receivedEvt));
+			REQUIRE(receivedEvt.seq ==
+					sentEvents[XENTEST_IN_RING_LEN + i].seq);
+		}
+
+		retryRing.stop();
+	}
+
+	SECTION("Send events from several threads")
+	{
+		const uint32_t cNumThreads = 4;
+		const uint32_t cNumEvents = XENTEST_IN_RING_LEN / cNumThreads;
+
+		std::vector<std::thread> threads;
+
+		for (uint32_t i = 0; i < cNumThreads; i++)
+		{
+			threads.emplace_back([&ringBuffer, i, cNumEvents]
+			{
+				for (uint32_t j = 0; j < cNumEvents; j++)
+				{
+					xentest_evt evt { XENTEST_EVT2 };
+
+					evt.seq = i * cNumEvents + j;
+
+					ringBuffer.sendEvent(evt);
+				}
+			});
+		}
+
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+
+		REQUIRE(eventPage->in_prod == cNumThreads * cNumEvents);
+
+		std::vector<bool> received(cNumThreads * cNumEvents, false);
+
+		xentest_evt receivedEvt {};
+
+		while (receiveEvent(eventPage, eventBuffer, receivedEvt))
+		{
+			REQUIRE(receivedEvt.seq < received.size());
+			REQUIRE_FALSE(received[receivedEvt.seq]);
+
+			received[receivedEvt.seq] = true;
+		}
+
+		REQUIRE(std::find(received.begin(), received.end(), false) ==
+				received.end());
+	}
+
+	SECTION("Restore state")
+	{
+		REQUIRE(ringBuffer.sendEvents(events, 3) == 3);
+
+		ringBuffer.stop();
+
+		auto state = ringBuffer.saveState();
+
+		REQUIRE(state.indexes == std::vector<uint32_t>(1, 3));
+
+		TestRingBufferOut restoredRing(gDomId, gPort, gRef, &state);
+
+		auto restoredPage = static_cast<xentest_event_page*>(
+				gnttabMock->getLastBuffer());
+
+		// the producer index is not cleared by the constructor
+		REQUIRE(restoredRing.isRestored());
+		REQUIRE(restoredPage->in_prod == 3);
+
+		state.port++;
+
+		REQUIRE_THROWS_AS(TestRingBufferOut(gDomId, gPort, gRef, &state),
+						  XenBackend::RingBufferException);
+	}
+
+	SECTION("Check out of page ring")
+	{
+		typedef XenBackend::RingBufferOutBase<xentest_event_page,
+											  xentest_evt> OutRing;
+
+		ringBuffer.stop();
+
+		REQUIRE_THROWS_AS(OutRing(gDomId, gPort, gRef, XC_PAGE_SIZE,
+								  XENTEST_IN_RING_SIZE),
+						  XenBackend::RingBufferException);
+		REQUIRE_THROWS_AS(OutRing(gDomId, gPort, gRef, XENTEST_IN_RING_OFFS,
+								  XC_PAGE_SIZE),
+						  XenBackend::RingBufferException);
+	}
+
+	ringBuffer.stop();
+}
+
+TEST_CASE("RingBufferSharedEventChannel", "[ringbuffer]")
+{
+	typedef RingBufferOutBase<xentest_event_page, xentest_evt> OutRing;
+
+	const uint32_t cBacklogSize = 2;
+
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	gError = false;
+
+	TestRingBufferIn inRing(gDomId, gPort, gRef);
+
+	auto gnttabMock = XenGnttabMock::getLastInstance();
+	auto evtchnMock = XenEvtchnMock::getLastInstance();
+
+	xen_test_front_ring ring;
+	auto sring = static_cast<xen_test_sring*>(gnttabMock->getLastBuffer());
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&ring, sring, XC_PAGE_SIZE);
+
+	OutRing outRing(inRing.getEventChannel(), {gRef + 1},
+					XENTEST_IN_RING_OFFS, XENTEST_IN_RING_SIZE);
+
+	auto eventPage = static_cast<xentest_event_page*>(
+			gnttabMock->getLastBuffer());
+
+	eventPage->in_cons = 0;
+
+	// the channel should be stopped before the sharing ring is deleted
+	struct StopGuard
+	{
+		XenBackend::RingBufferBase& ring;
+		~StopGuard() { ring.stop(); }
+	} stopGuard {inRing};
+
+	// the port is bound once
+	REQUIRE(XenEvtchnMock::getLastInstance() == evtchnMock);
+	REQUIRE(outRing.getEventChannel() == inRing.getEventChannel());
+	REQUIRE(outRing.getPort() == gPort);
+	REQUIRE(outRing.getRef() == gRef + 1);
+
+	inRing.setErrorCallback(errorCallback);
+	outRing.setErrorCallback(errorCallback);
+	outRing.setBacklogSize(cBacklogSize);
+
+	evtchnMock->setNotifyCbk(respNotification);
+
+	inRing.start();
+	outRing.start();
+
+	REQUIRE(outRing.isStarted());
+
+	std::vector<xentest_evt> events(XENTEST_IN_RING_LEN + cBacklogSize);
+
+	REQUIRE(outRing.sendEvents(events.data(), events.size()) ==
+			events.size());
+	REQUIRE(outRing.getBacklogDepth() == cBacklogSize);
+
+	// the frontend consumes events and sends the request: the notification
+	// is received by both ring buffers
+	eventPage->in_cons = eventPage->in_prod;
+
+	xentest_req req {XENTEST_CMD2};
+	xentest_rsp rsp {};
+
+	req.op.command2.u64data1 = 64;
+	req.seq = 1;
+
+	{
+		unique_lock<mutex> lock(gMutex);
+
+		// skip the notification of sent events
+		gRespNtf = false;
+	}
+
+	sendReq(req, ring);
+
+	REQUIRE(receiveResp(rsp, ring));
+	REQUIRE(rsp.seq == req.seq);
+
+	for (int i = 0; i < 100 && outRing.getBacklogDepth(); i++)
+	{
+		sleep_for(milliseconds(10));
+	}
+
+	REQUIRE(outRing.getBacklogDepth() == 0);
+	REQUIRE(eventPage->in_prod == eventPage->in_cons + cBacklogSize);
+	REQUIRE_FALSE(gError);
+
+	// stopping the sharing ring buffer doesn't stop the channel
+	outRing.stop();
+
+	REQUIRE(inRing.isStarted());
+
+	inRing.stop();
+
+	REQUIRE_FALSE(outRing.isStarted());
+
+	evtchnMock->setNotifyCbk(nullptr);
 }
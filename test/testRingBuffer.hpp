@@ -21,6 +21,8 @@
 #ifndef TEST_TESTRINGBUFFER_HPP_
 #define TEST_TESTRINGBUFFER_HPP_
 
+#include <atomic>
+
 #include "RingBufferBase.hpp"
 
 extern "C" {
@@ -36,20 +38,60 @@ public:
 	TestRingBufferIn(domid_t domId, evtchn_port_t port, grant_ref_t ref) :
 		XenBackend::RingBufferInBase<xen_test_back_ring, xen_test_sring,
 						 	 	 	 xentest_req, xentest_rsp>
-		(domId, port, ref) {}
+		(domId, port, ref), mMaxBatchSize(0) {}
+
+	TestRingBufferIn(domid_t domId, evtchn_port_t port,
+					 const std::vector<grant_ref_t>& refs) :
+		XenBackend::RingBufferInBase<xen_test_back_ring, xen_test_sring,
+									 xentest_req, xentest_rsp>
+		(domId, port, refs), mMaxBatchSize(0) {}
+
+	size_t getMaxBatchSize() const { return mMaxBatchSize; }
 
 private:
 
+	size_t mMaxBatchSize;
+
 	void processRequest(const xentest_req& req) override;
+	void processRequests(const xentest_req* reqs, size_t count) override;
+};
+
+class TestStaticRingBufferIn : public XenBackend::StaticRingBufferInBase<
+									TestStaticRingBufferIn,
+									xen_test_back_ring, xen_test_sring,
+									xentest_req, xentest_rsp>
+{
+public:
+
+	TestStaticRingBufferIn(domid_t domId, evtchn_port_t port,
+						   grant_ref_t ref) :
+		XenBackend::StaticRingBufferInBase<TestStaticRingBufferIn,
+										   xen_test_back_ring, xen_test_sring,
+										   xentest_req, xentest_rsp>
+		(domId, port, ref), mNumRequests(0) {}
+
+	size_t getNumRequests() const { return mNumRequests; }
+
+private:
+
+	friend class XenBackend::StaticRingBufferInBase<TestStaticRingBufferIn,
+										xen_test_back_ring, xen_test_sring,
+										xentest_req, xentest_rsp>;
+
+	std::atomic<size_t> mNumRequests;
+
+	void processRequest(const xentest_req& req);
 };
 
 class TestRingBufferOut : public XenBackend::RingBufferOutBase<
 									xentest_event_page, xentest_evt>
 {
 public:
-	TestRingBufferOut(domid_t domId, evtchn_port_t port, grant_ref_t ref) :
+	TestRingBufferOut(domid_t domId, evtchn_port_t port, grant_ref_t ref,
+					  const HandoffState* state = nullptr) :
 		XenBackend::RingBufferOutBase<xentest_event_page, xentest_evt>(
-			domId, port, ref, XENTEST_IN_RING_OFFS, XENTEST_IN_RING_SIZE)
+			domId, port, ref, XENTEST_IN_RING_OFFS, XENTEST_IN_RING_SIZE,
+			state)
 	{}
 };
 
@@ -0,0 +1,247 @@
+/*
+ *  Test Trace
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+
+#include <atomic>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch.hpp>
+
+#include "Trace.hpp"
+
+using std::atomic_bool;
+using std::string;
+using std::stringstream;
+using std::thread;
+using std::vector;
+
+using XenBackend::Trace;
+using XenBackend::TraceScope;
+
+static size_t countEntries(const string& str, const string& entry)
+{
+	size_t count = 0;
+
+	for (auto pos = str.find(entry); pos != string::npos;
+		 pos = str.find(entry, pos + 1))
+	{
+		count++;
+	}
+
+	return count;
+}
+
+TEST_CASE("Trace", "[trace]")
+{
+	SECTION("Check disabled")
+	{
+		Trace::stop();
+
+		{
+			TraceScope scope("test", "disabledScope", 1);
+		}
+
+		stringstream ss;
+
+		Trace::write(ss);
+
+		REQUIRE(ss.str().find("disabledScope") == string::npos);
+	}
+
+	SECTION("Check events")
+	{
+		Trace::start();
+
+		vector<thread> threads;
+
+		for (int i = 0; i < 4; i++)
+		{
+			threads.emplace_back([i]
+			{
+				for (int j = 0; j < 10; j++)
+				{
+					TraceScope scope("test", "scope", i);
+				}
+
+				Trace::addEvent("test", "instant", Trace::now(),
+								Trace::cInstant, i);
+			});
+		}
+
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+
+		Trace::stop();
+
+		stringstream ss;
+
+		Trace::write(ss);
+
+		auto str = ss.str();
+
+		REQUIRE(str.find("{\"traceEvents\":[") == 0);
+		REQUIRE(countEntries(str, "\"name\":\"scope\"") == 40);
+		REQUIRE(countEntries(str, "\"ph\":\"X\"") == 40);
+		REQUIRE(countEntries(str, "\"name\":\"instant\"") == 4);
+		REQUIRE(countEntries(str, "\"ph\":\"i\"") == 4);
+		REQUIRE(Trace::getNumDropped() == 0);
+
+		// events are cleared on start
+		Trace::start();
+		Trace::stop();
+
+		ss.str("");
+
+		Trace::write(ss);
+
+		REQUIRE(ss.str().find("\"name\"") == string::npos);
+	}
+
+	SECTION("Check buffer growth")
+	{
+		Trace::start();
+
+		thread([]
+		{
+			for (size_t i = 0; i < Trace::cBufferSize + 10; i++)
+			{
+				Trace::addEvent("test", "grow", Trace::now(), 1, i);
+			}
+		}).join();
+
+		Trace::stop();
+
+		stringstream ss;
+
+		Trace::write(ss);
+
+		REQUIRE(countEntries(ss.str(), "\"name\":\"grow\"") ==
+				Trace::cBufferSize);
+		REQUIRE(Trace::getNumDropped() == 10);
+	}
+
+	SECTION("Check finished threads")
+	{
+		Trace::start();
+
+		auto numBuffers = Trace::getNumBuffers();
+
+		for (int i = 0; i < 4; i++)
+		{
+			thread([i]
+			{
+				Trace::addEvent("test", "finished", Trace::now(),
+								Trace::cInstant, i);
+			}).join();
+		}
+
+		// buffers with events are kept for write()
+		REQUIRE(Trace::getNumBuffers() == numBuffers + 4);
+
+		stringstream ss;
+
+		Trace::write(ss);
+
+		REQUIRE(countEntries(ss.str(), "\"name\":\"finished\"") == 4);
+
+		// buffers of finished threads are freed on start
+		Trace::start();
+
+		REQUIRE(Trace::getNumBuffers() == numBuffers);
+
+		// buffer without events of the current trace is reused
+		atomic_bool restarted(false);
+
+		thread first([&restarted]
+		{
+			Trace::addEvent("test", "old", Trace::now(), Trace::cInstant, 0);
+
+			while (!restarted)
+			{
+				std::this_thread::yield();
+			}
+		});
+
+		while (Trace::getNumBuffers() != numBuffers + 1)
+		{
+			std::this_thread::yield();
+		}
+
+		Trace::start();
+
+		restarted = true;
+
+		first.join();
+
+		thread([]
+		{
+			Trace::addEvent("test", "new", Trace::now(), Trace::cInstant, 0);
+		}).join();
+
+		REQUIRE(Trace::getNumBuffers() == numBuffers + 1);
+
+		Trace::stop();
+
+		ss.str("");
+
+		Trace::write(ss);
+
+		REQUIRE(ss.str().find("\"name\":\"old\"") == string::npos);
+		REQUIRE(countEntries(ss.str(), "\"name\":\"new\"") == 1);
+	}
+
+	SECTION("Check restart while recording")
+	{
+		atomic_bool done(false);
+
+		Trace::start();
+
+		thread recorder([&done]
+		{
+			while (!done)
+			{
+				TraceScope scope("test", "recording", 0);
+			}
+		});
+
+		for (int i = 0; i < 100; i++)
+		{
+			Trace::start();
+
+			stringstream ss;
+
+			Trace::write(ss);
+
+			REQUIRE(countEntries(ss.str(), "\"name\"") <=
+					Trace::cBufferSize);
+		}
+
+		done = true;
+
+		recorder.join();
+
+		Trace::stop();
+	}
+}
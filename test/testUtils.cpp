@@ -0,0 +1,383 @@
+/*
+ *  Test Utils
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <catch.hpp>
+
+#include "mocks/Pipe.hpp"
+#include "Utils.hpp"
+
+using std::atomic_int;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::string;
+using std::vector;
+
+using XenBackend::AsyncContext;
+using XenBackend::InlineTask;
+using XenBackend::PollFd;
+using XenBackend::TaskQueue;
+using XenBackend::ThreadConfig;
+using XenBackend::ThreadPool;
+using XenBackend::ThreadPoolPtr;
+
+TEST_CASE("TaskQueue", "[utils]")
+{
+	SECTION("Check inline task")
+	{
+		auto value = std::make_shared<int>(0);
+
+		InlineTask task([value] { (*value)++; });
+
+		REQUIRE(task);
+		REQUIRE(value.use_count() == 2);
+
+		InlineTask other(std::move(task));
+
+		REQUIRE_FALSE(task);
+		REQUIRE(value.use_count() == 2);
+
+		other();
+
+		REQUIRE(*value == 1);
+
+		task = std::move(other);
+		task();
+
+		REQUIRE(*value == 2);
+
+		// the captures are released with the task
+		task.reset();
+
+		REQUIRE_FALSE(task);
+		REQUIRE(value.use_count() == 1);
+	}
+
+	SECTION("Check order")
+	{
+		TaskQueue queue;
+		vector<int> values;
+		int next = 0;
+
+		// wrap around the ring buffer and grow it
+		for (int i = 0; i < 10; i++)
+		{
+			queue.push([&values, i] { values.push_back(i); });
+		}
+
+		for (int i = 0; i < 5; i++)
+		{
+			queue.pop()();
+		}
+
+		for (int i = 10; i < 100; i++)
+		{
+			queue.push([&values, i] { values.push_back(i); });
+		}
+
+		REQUIRE(queue.size() == 95);
+
+		while (!queue.empty())
+		{
+			queue.pop()();
+		}
+
+		REQUIRE(values.size() == 100);
+
+		for (auto value : values)
+		{
+			REQUIRE(value == next++);
+		}
+	}
+}
+
+TEST_CASE("AsyncContext", "[utils]")
+{
+	SECTION("Check order")
+	{
+		vector<int> values;
+
+		{
+			AsyncContext context;
+
+			for (int i = 0; i < 100; i++)
+			{
+				context.call([&values, i] { values.push_back(i); });
+			}
+		}
+
+		// destructor waits for all calls
+		REQUIRE(values.size() == 100);
+
+		for (int i = 0; i < 100; i++)
+		{
+			REQUIRE(values[i] == i);
+		}
+	}
+
+	SECTION("Check shared pool")
+	{
+		ThreadPoolPtr pool(new ThreadPool(2));
+		atomic_int numCalls(0);
+
+		{
+			vector<std::unique_ptr<AsyncContext>> contexts;
+
+			for (int i = 0; i < 16; i++)
+			{
+				contexts.emplace_back(new AsyncContext(pool));
+			}
+
+			for (auto& context : contexts)
+			{
+				context->call([&numCalls]
+				{
+					std::this_thread::sleep_for(milliseconds(1));
+					numCalls++;
+				});
+			}
+		}
+
+		REQUIRE(numCalls == 16);
+		REQUIRE(ThreadPool::getShared() == ThreadPool::getShared());
+		REQUIRE(ThreadPool::getShared()->getNumThreads() >=
+				ThreadPool::cMinSharedThreads);
+		// blocking I/O doesn't share the pool with other tasks
+		REQUIRE(ThreadPool::getSharedIo() != ThreadPool::getShared());
+		REQUIRE(ThreadPool::getSharedIo()->getNumThreads() ==
+				ThreadPool::cSharedIoThreads);
+	}
+
+	SECTION("Check error in call")
+	{
+		int value = 0;
+
+		{
+			AsyncContext context;
+
+			context.call([] { throw std::runtime_error("Error"); });
+			context.call([&value] { value = 1; });
+		}
+
+		REQUIRE(value == 1);
+	}
+}
+
+TEST_CASE("PollFd", "[utils]")
+{
+	Pipe pipe;
+	PollFd pollFd(pipe.getFd(), POLLIN);
+
+	SECTION("Check timeout")
+	{
+		auto start = steady_clock::now();
+
+		REQUIRE(pollFd.poll(microseconds(10000)) == PollFd::Result::TIMEOUT);
+		REQUIRE(steady_clock::now() - start >= milliseconds(10));
+	}
+
+	SECTION("Check ready")
+	{
+		pipe.write();
+
+		REQUIRE(pollFd.poll(microseconds(10000)) == PollFd::Result::READY);
+		REQUIRE(pollFd.poll());
+
+		pipe.read();
+	}
+
+	SECTION("Check stop")
+	{
+		std::thread thread([&pollFd]
+				{ std::this_thread::sleep_for(milliseconds(10));
+				  pollFd.stop(); });
+
+		REQUIRE_FALSE(pollFd.poll());
+
+		thread.join();
+
+		pollFd.stop();
+
+		REQUIRE(pollFd.poll(microseconds(-1)) == PollFd::Result::STOPPED);
+		REQUIRE(pollFd.poll(microseconds(0)) == PollFd::Result::TIMEOUT);
+	}
+}
+
+TEST_CASE("ThreadConfig", "[utils]")
+{
+	SECTION("Check apply")
+	{
+		ThreadConfig config;
+
+		REQUIRE_FALSE(config.isSet());
+
+		config.name = "test-thread-config";
+		config.cpus = { 0 };
+		config.policy = SCHED_BATCH;
+		config.nice = 5;
+
+		REQUIRE(config.isSet());
+
+		char name[16] = {};
+		cpu_set_t cpuSet;
+		int policy = -1;
+		int nice = 0;
+
+		auto thread = config.createThread([&] {
+			pthread_getname_np(pthread_self(), name, sizeof(name));
+			pthread_getaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+			policy = sched_getscheduler(0);
+			nice = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+		});
+
+		thread.join();
+
+		// the name is truncated to 15 characters
+		REQUIRE(string(name) == "test-thread-con");
+		REQUIRE(CPU_COUNT(&cpuSet) == 1);
+		REQUIRE(CPU_ISSET(0, &cpuSet));
+		REQUIRE(policy == SCHED_BATCH);
+		REQUIRE(nice == 5);
+	}
+
+	SECTION("Check error")
+	{
+		ThreadConfig config;
+		bool called = false;
+
+		config.cpus = { CPU_SETSIZE };
+
+		REQUIRE_THROWS(config.createThread([&called] { called = true; }));
+		REQUIRE_FALSE(called);
+
+		REQUIRE_THROWS(ThreadPool(2, { config }));
+	}
+
+	SECTION("Check thread pool")
+	{
+		ThreadConfig config;
+
+		config.name = "test-pool";
+
+		ThreadPool pool(2, { config });
+		std::atomic_bool named(false);
+		std::atomic_bool done(false);
+
+		pool.call([&] {
+			char name[16] = {};
+
+			pthread_getname_np(pthread_self(), name, sizeof(name));
+
+			named = string(name) == "test-pool";
+			done = true;
+		});
+
+		auto start = steady_clock::now();
+
+		while (!done && steady_clock::now() - start < milliseconds(1000))
+		{
+			std::this_thread::sleep_for(milliseconds(1));
+		}
+
+		REQUIRE(named);
+	}
+}
+
+TEST_CASE("ThreadPool", "[utils]")
+{
+	SECTION("Check work stealing")
+	{
+		ThreadPool pool(2);
+		atomic_int numCalls(0);
+		std::atomic_bool stolen(false);
+		std::atomic_bool done(false);
+
+		pool.call([&]
+		{
+			auto id = std::this_thread::get_id();
+
+			// tasks of the worker go to its own queue
+			for (int i = 0; i < 10; i++)
+			{
+				pool.call([&numCalls, &stolen, id]
+				{
+					if (std::this_thread::get_id() != id)
+					{
+						stolen = true;
+					}
+
+					numCalls++;
+				});
+			}
+
+			// only the other worker can run them while this one waits
+			auto start = steady_clock::now();
+
+			while (numCalls != 10 &&
+				   steady_clock::now() - start < milliseconds(1000))
+			{
+				std::this_thread::sleep_for(milliseconds(1));
+			}
+
+			done = true;
+		});
+
+		auto start = steady_clock::now();
+
+		while (!done && steady_clock::now() - start < milliseconds(2000))
+		{
+			std::this_thread::sleep_for(milliseconds(1));
+		}
+
+		REQUIRE(done);
+		REQUIRE(numCalls == 10);
+		REQUIRE(stolen);
+	}
+
+	SECTION("Check pending tasks")
+	{
+		atomic_int numCalls(0);
+
+		{
+			ThreadPool pool(2);
+
+			for (int i = 0; i < 1000; i++)
+			{
+				pool.call([&numCalls] { numCalls++; });
+			}
+		}
+
+		// destructor waits for queued tasks
+		REQUIRE(numCalls == 1000);
+	}
+}
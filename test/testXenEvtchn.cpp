@@ -24,7 +24,10 @@
 
 #include <catch.hpp>
 
+#include <poll.h>
+
 #include "mocks/XenEvtchnMock.hpp"
+#include "EventLoop.hpp"
 #include "XenEvtchn.hpp"
 
 using std::chrono::milliseconds;
@@ -33,7 +36,11 @@ using std::exception;
 using std::mutex;
 using std::unique_lock;
 
+using XenBackend::EventLoop;
+using XenBackend::EventLoopException;
+using XenBackend::EventLoopPtr;
 using XenBackend::XenEvtchn;
+using XenBackend::XenEvtchnNotifyScope;
 
 static mutex gMutex;
 static condition_variable gCondVar;
@@ -90,6 +97,87 @@ TEST_CASE("XenEvtchn", "[xenevtchn]")
 		REQUIRE(gNumErrors == 0);
 	}
 
+	SECTION("Check notify coalescing")
+	{
+		int numNotifications = 0;
+
+		mock->setNotifyCbk([&numNotifications] { numNotifications++; });
+
+		XenEvtchn otherChannel(3, 25, nullptr);
+
+		auto otherMock = XenEvtchnMock::getLastInstance();
+		int numOtherNotifications = 0;
+
+		otherMock->setNotifyCbk([&numOtherNotifications]
+								{ numOtherNotifications++; });
+
+		{
+			XenEvtchnNotifyScope scope;
+
+			REQUIRE(XenEvtchnNotifyScope::isActive());
+
+			eventChannel.notify();
+			eventChannel.notify();
+			otherChannel.notify();
+
+			{
+				XenEvtchnNotifyScope nestedScope;
+
+				eventChannel.notify();
+			}
+
+			REQUIRE(numNotifications == 0);
+			REQUIRE(numOtherNotifications == 0);
+		}
+
+		// one notification per event channel
+		REQUIRE_FALSE(XenEvtchnNotifyScope::isActive());
+		REQUIRE(numNotifications == 1);
+		REQUIRE(numOtherNotifications == 1);
+
+		eventChannel.notify();
+
+		REQUIRE(numNotifications == 2);
+
+		mock->setNotifyCbk(nullptr);
+	}
+
+	SECTION("Check shared callbacks")
+	{
+		REQUIRE_THROWS_AS(eventChannel.addCallback([] {}),
+						  XenBackend::XenEvtchnException);
+
+		eventChannel.stop();
+
+		int numCalls = 0;
+
+		auto id = eventChannel.addCallback([&numCalls] { numCalls++; });
+
+		eventChannel.start();
+
+		gEventChannelCbk = false;
+
+		mock->signalPort(eventChannel.getPort());
+
+		waitForCbk();
+
+		eventChannel.stop();
+
+		// both callbacks are called on one notification
+		REQUIRE(gEventChannelCbk);
+		REQUIRE(numCalls == 1);
+
+		eventChannel.removeCallback(id);
+
+		eventChannel.start();
+
+		mock->signalPort(eventChannel.getPort());
+
+		waitForCbk();
+
+		REQUIRE(numCalls == 1);
+	}
+
 	SECTION("Check second start")
 	{
 		REQUIRE_THROWS(eventChannel.start());
@@ -121,6 +209,44 @@ TEST_CASE("XenEvtchn", "[xenevtchn]")
 	}
 }
 
+TEST_CASE("XenEvtchnEventLoop", "[xenevtchn]")
+{
+	XenEvtchnMock::setErrorMode(false);
+
+	EventLoopPtr eventLoop(new EventLoop(1));
+
+	XenEvtchn eventChannel(3, 24, eventChannelCbk, errorHandling);
+
+	auto mock = XenEvtchnMock::getLastInstance();
+
+	eventChannel.setEventLoop(eventLoop);
+
+	SECTION("Check failed start")
+	{
+		// the fd is taken already
+		eventLoop->addFd(mock->getFd(), POLLIN, [] {});
+
+		REQUIRE_THROWS_AS(eventChannel.start(), EventLoopException);
+		REQUIRE_FALSE(eventChannel.isStarted());
+
+		eventLoop->removeFd(mock->getFd());
+
+		eventChannel.start();
+
+		REQUIRE(eventChannel.isStarted());
+
+		gEventChannelCbk = false;
+
+		mock->signalPort(eventChannel.getPort());
+
+		waitForCbk();
+
+		REQUIRE(gEventChannelCbk);
+	}
+
+	eventChannel.stop();
+}
+
 TEST_CASE("XenEvtchnError", "[xenevtchn]")
 {
 	XenEvtchnMock::setErrorMode(true);
@@ -18,12 +18,23 @@
  * Copyright (C) 2016 EPAM Systems Inc.
  */
 
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
 #include <catch.hpp>
 
 #include "mocks/XenGnttabMock.hpp"
 #include "XenGnttab.hpp"
 
+using XenBackend::XenGnttab;
 using XenBackend::XenGnttabBuffer;
+using XenBackend::XenGnttabBufferPtr;
+using XenBackend::XenGnttabCache;
+using XenBackend::XenGnttabDirBuffer;
+using XenBackend::XenGnttabSgList;
+using XenBackend::XenGnttabUnmapQueue;
 
 TEST_CASE("XenGnttab", "[xengnttab]")
 {
@@ -50,6 +61,240 @@ TEST_CASE("XenGnttab", "[xengnttab]")
 		REQUIRE(xenBuffer.size() == mock->getMapBufferSize(xenBuffer.get()));
 	}
 
+	SECTION("Check protection")
+	{
+		XenGnttabBuffer xenBuffer(3, 14, PROT_READ);
+
+		REQUIRE(XenGnttabMock::getLastInstance()->getLastProt() == PROT_READ);
+	}
+
+	SECTION("Check page accounting")
+	{
+		grant_ref_t refs[2] = { 1, 2 };
+
+		XenGnttab::setPageLimit(7, 3);
+
+		{
+			XenGnttabBuffer buffer1(7, refs, 2);
+
+			REQUIRE(XenGnttab::getNumMappedPages(7) == 2);
+
+			REQUIRE_THROWS_AS(XenGnttabBuffer(7, refs, 2),
+							  XenBackend::XenGnttabException);
+
+			XenGnttabBuffer buffer2(7, 3);
+
+			REQUIRE(XenGnttab::getNumMappedPages(7) == 3);
+		}
+
+		REQUIRE(XenGnttab::getNumMappedPages(7) == 0);
+
+		XenGnttab::setPageLimit(7, 0);
+		XenGnttab::setDefaultPageLimit(1);
+
+		REQUIRE_THROWS(XenGnttabBuffer(7, refs, 2));
+
+		XenGnttab::setDefaultPageLimit(0);
+
+		XenGnttabBuffer buffer(7, refs, 2);
+
+		REQUIRE(XenGnttab::getNumMappedPages(7) == 2);
+	}
+
+	SECTION("Check shards")
+	{
+		XenGnttab::setNumShards(2);
+
+		XenGnttabBuffer buffer1(2, 14);
+		auto mock1 = XenGnttabMock::getLastInstance();
+
+		XenGnttabBuffer buffer2(3, 14);
+		auto mock2 = XenGnttabMock::getLastInstance();
+
+		XenGnttabBuffer buffer3(4, 14);
+
+		REQUIRE(mock1 != mock2);
+		REQUIRE(XenGnttabMock::getLastInstance() == mock1);
+		REQUIRE(XenGnttab::getForDomain(5) == XenGnttab::getForDomain(3));
+
+		XenGnttab::setNumShards(0);
+
+		REQUIRE(XenGnttab::getForDomain(5) != XenGnttab::getForDomain(3));
+
+		auto gnttab = XenGnttab::getForDomain(5);
+
+		XenGnttab::releaseDomain(5);
+
+		REQUIRE(XenGnttab::getForDomain(5) != gnttab);
+
+		XenGnttab::setNumShards(1);
+
+		REQUIRE(XenGnttab::getForDomain(3).get() == &XenGnttab::getInstance());
+	}
+
+	SECTION("Check deferred unmap")
+	{
+		auto& unmapQueue = XenGnttabUnmapQueue::getInstance();
+
+		unmapQueue.setEnabled(true);
+
+		REQUIRE(unmapQueue.isEnabled());
+
+		size_t numMapped = 0;
+
+		{
+			XenGnttabBuffer buffer1(3, 14);
+			XenGnttabBuffer buffer2(3, 15);
+
+			numMapped = XenGnttabMock::getLastInstance()->checkMapBuffers();
+		}
+
+		unmapQueue.flush();
+
+		REQUIRE(unmapQueue.getNumPending() == 0);
+		REQUIRE(XenGnttabMock::getLastInstance()->checkMapBuffers() ==
+				numMapped - 2);
+
+		{
+			XenGnttabBuffer buffer(3, 14);
+		}
+
+		// disabling unmaps pending buffers
+		unmapQueue.setEnabled(false);
+
+		REQUIRE(unmapQueue.getNumPending() == 0);
+		REQUIRE(XenGnttabMock::getLastInstance()->checkMapBuffers() ==
+				numMapped - 2);
+	}
+
+	SECTION("Check page directory")
+	{
+		// make sure the last instance is the default one
+		XenGnttabBuffer buffer(3, 14);
+
+		auto mock = XenGnttabMock::getLastInstance();
+
+		size_t numPages = XenGnttabDirBuffer::cNumRefsPerPage + 10;
+
+		auto dir1 = reinterpret_cast<XenGnttabDirBuffer::Directory*>(
+				mock->getGrantPage(3, 100));
+		auto dir2 = reinterpret_cast<XenGnttabDirBuffer::Directory*>(
+				mock->getGrantPage(3, 101));
+
+		dir1->nextRef = 101;
+		dir2->nextRef = 0;
+
+		for (size_t i = 0; i < numPages; i++)
+		{
+			if (i < XenGnttabDirBuffer::cNumRefsPerPage)
+			{
+				dir1->refs[i] = 1000 + i;
+			}
+			else
+			{
+				dir2->refs[i - XenGnttabDirBuffer::cNumRefsPerPage] = 1000 + i;
+			}
+		}
+
+		XenGnttabDirBuffer dirBuffer(3, 100, numPages);
+
+		REQUIRE(dirBuffer.size() == numPages * XC_PAGE_SIZE);
+		REQUIRE(mock->getMapBufferSize(dirBuffer.get()) == dirBuffer.size());
+		REQUIRE(dirBuffer.getRefs().size() == numPages);
+		REQUIRE(dirBuffer.getRefs().back() == 1000 + numPages - 1);
+
+		REQUIRE_THROWS_AS(XenGnttabDirBuffer(3, 100, 3 * numPages),
+						  XenBackend::XenGnttabException);
+	}
+
+	SECTION("Check scatter-gather list")
+	{
+		grant_ref_t refs[3] = { 1, 2, 3 };
+
+		XenGnttabBuffer xenBuffer(3, refs, 3);
+
+		auto data = static_cast<uint8_t*>(xenBuffer.get());
+
+		for (size_t i = 0; i < xenBuffer.size(); i++)
+		{
+			data[i] = i % 251;
+		}
+
+		XenGnttabSgList sgList;
+
+		// adjacent segments are merged
+		sgList.addSegment(xenBuffer, 0, 3584, 512);
+		sgList.addSegment(xenBuffer, 1, 0, 100);
+		sgList.addSegment(xenBuffer, 2, 10, 20);
+
+		REQUIRE(sgList.getIoVecCount() == 2);
+		REQUIRE(sgList.size() == 632);
+
+		REQUIRE_THROWS(sgList.addSegment(xenBuffer, 0, 4000, 100));
+		REQUIRE_THROWS(sgList.addSegment(xenBuffer, 3, 0, 100));
+		REQUIRE_THROWS(sgList.addRange(xenBuffer, 3 * XC_PAGE_SIZE - 10, 20));
+
+		int fds[2];
+
+		REQUIRE(pipe(fds) == 0);
+
+		REQUIRE(writev(fds[1], sgList.getIoVec(), sgList.getIoVecCount()) ==
+				static_cast<ssize_t>(sgList.size()));
+
+		std::vector<uint8_t> result(sgList.size());
+
+		REQUIRE(read(fds[0], result.data(), result.size()) ==
+				static_cast<ssize_t>(result.size()));
+
+		REQUIRE(memcmp(result.data(), &data[3584], 612) == 0);
+		REQUIRE(memcmp(&result[612], &data[2 * XC_PAGE_SIZE + 10], 20) == 0);
+
+		close(fds[0]);
+		close(fds[1]);
+
+		sgList.clear();
+
+		REQUIRE(sgList.getIoVecCount() == 0);
+	}
+
+	SECTION("Check grant copy")
+	{
+		auto& gnttab = XenGnttab::getInstance();
+
+		const char data[] = "grant copy";
+		char result[sizeof(data)] = {};
+
+		std::vector<xengnttab_grant_copy_segment_t> segments;
+
+		segments.push_back(XenGnttab::copyToRef(3, 14, 100, data,
+												sizeof(data)));
+
+		gnttab.copy(segments);
+
+		auto mock = XenGnttabMock::getLastInstance();
+
+		REQUIRE(memcmp(mock->getGrantPage(3, 14) + 100, data,
+					   sizeof(data)) == 0);
+
+		segments.clear();
+
+		segments.push_back(XenGnttab::copyFromRef(3, 14, 100, result, 5));
+		segments.push_back(XenGnttab::copyFromRef(3, 14, 105, &result[5],
+												  sizeof(data) - 5));
+
+		gnttab.copy(segments);
+
+		REQUIRE(memcmp(result, data, sizeof(data)) == 0);
+
+		segments.clear();
+
+		segments.push_back(XenGnttab::copyToRef(3, 14, XC_PAGE_SIZE - 1,
+												data, sizeof(data)));
+
+		REQUIRE_THROWS_AS(gnttab.copy(segments),
+						  XenBackend::XenGnttabException);
+	}
+
 	SECTION("Check errors")
 	{
 		XenGnttabMock::setErrorMode(true);
@@ -57,3 +302,86 @@ TEST_CASE("XenGnttab", "[xengnttab]")
 		REQUIRE_THROWS(XenGnttabBuffer(3, 14));
 	}
 }
+
+TEST_CASE("XenGnttabCache", "[xengnttab]")
+{
+	XenGnttabMock::setErrorMode(false);
+
+	XenGnttabCache cache(2);
+
+	SECTION("Check reuse")
+	{
+		auto buffer1 = cache.get(3, 14);
+		auto buffer2 = cache.get(3, 14);
+
+		REQUIRE(buffer1 == buffer2);
+		REQUIRE(cache.getNumPages() == 1);
+		REQUIRE(cache.getNumHits() == 1);
+		REQUIRE(cache.getNumMisses() == 1);
+
+		// mapping is kept after the handles are released
+		void* address = buffer1->get();
+
+		buffer1.reset();
+		buffer2.reset();
+
+		REQUIRE(cache.get(3, 14)->get() == address);
+		REQUIRE(cache.getNumHits() == 2);
+	}
+
+	SECTION("Check eviction")
+	{
+		cache.get(3, 1);
+
+		auto mock = XenGnttabMock::getLastInstance();
+		auto numMapped = mock->checkMapBuffers() - 1;
+
+		cache.get(3, 2);
+
+		// ref 1 becomes the most recently used
+		cache.get(3, 1);
+		cache.get(3, 3);
+
+		REQUIRE(cache.getNumPages() == 2);
+		REQUIRE(mock->checkMapBuffers() == numMapped + 2);
+
+		cache.get(3, 1);
+
+		REQUIRE(cache.getNumHits() == 2);
+
+		cache.get(3, 2);
+
+		REQUIRE(cache.getNumMisses() == 4);
+	}
+
+	SECTION("Check budget with buffers in use")
+	{
+		auto buffer1 = cache.get(3, 1);
+		auto buffer2 = cache.get(3, 2);
+		auto buffer3 = cache.get(3, 3);
+
+		REQUIRE(cache.getNumPages() == 2);
+
+		auto mock = XenGnttabMock::getLastInstance();
+		auto numMapped = mock->checkMapBuffers();
+
+		// not cached buffer is unmapped on release
+		buffer3.reset();
+
+		REQUIRE(mock->checkMapBuffers() == numMapped - 1);
+	}
+
+	SECTION("Check remove")
+	{
+		cache.get(3, 1);
+		cache.get(4, 1);
+
+		cache.remove(3);
+
+		REQUIRE(cache.getNumPages() == 1);
+
+		cache.remove(4, 1);
+
+		REQUIRE(cache.getNumPages() == 0);
+	}
+}
@@ -18,20 +18,67 @@
  * Copyright (C) 2016 EPAM Systems Inc.
  */
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+
 #include <catch.hpp>
 
 #include "mocks/XenCtrlMock.hpp"
+#include "mocks/XenStoreMock.hpp"
 #include "XenStat.hpp"
 
+using std::chrono::milliseconds;
+using std::condition_variable;
+using std::mutex;
+using std::set;
+using std::unique_lock;
+using std::vector;
+
+using XenBackend::DomainInfoSnapshot;
+using XenBackend::XenInterface;
 using XenBackend::XenStat;
+using XenBackend::XenStore;
 
-TEST_CASE("XenStat", "[xenctrl]")
+static mutex gMutex;
+static condition_variable gCondVar;
+static set<domid_t> gAddedDoms;
+static set<domid_t> gRemovedDoms;
+
+static void domainAdded(domid_t domId)
 {
-	XenStat xenStat;
+	unique_lock<mutex> lock(gMutex);
+
+	gAddedDoms.insert(domId);
+
+	gCondVar.notify_all();
+}
+
+static void domainRemoved(domid_t domId)
+{
+	unique_lock<mutex> lock(gMutex);
+
+	gRemovedDoms.insert(domId);
 
+	gCondVar.notify_all();
+}
+
+static bool waitForDoms(const set<domid_t>& doms, size_t size)
+{
+	unique_lock<mutex> lock(gMutex);
+
+	return gCondVar.wait_for(lock, milliseconds(1000), [&doms, size]
+							 { return doms.size() >= size; });
+}
+
+TEST_CASE("XenStat", "[xenctrl]")
+{
 	XenCtrlMock::setErrorMode(false);
 
-	auto mock = XenCtrlMock::getLastInstance();
+	XenStat xenStat;
+
+	XenCtrlMock::clearDomInfos();
 
 	xc_domaininfo_t info = {};
 
@@ -46,7 +93,7 @@ TEST_CASE("XenStat", "[xenctrl]")
 			info.flags = XEN_DOMINF_running;
 		}
 
-		mock->addDomInfo(info);
+		XenCtrlMock::addDomInfo(info);
 	}
 
 	SECTION("Check getters")
@@ -74,6 +121,73 @@ TEST_CASE("XenStat", "[xenctrl]")
 
 		REQUIRE_THROWS(xenStat.getExistingDoms());
 	}
+
+	SECTION("Check monitoring")
+	{
+		XenStoreMock::setErrorMode(false);
+
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			gAddedDoms.clear();
+			gRemovedDoms.clear();
+		}
+
+		XenStore xenStore;
+
+		xenStore.start();
+
+		auto mock = XenStoreMock::getLastInstance();
+
+		xenStat.startMonitoring(xenStore, domainAdded, domainRemoved);
+
+		// existing domains are reported on start
+		REQUIRE(waitForDoms(gAddedDoms, 8));
+
+		// cached list is not affected by the domain table till notification
+		info.domain = 9;
+		info.flags = 0;
+
+		XenCtrlMock::addDomInfo(info);
+
+		REQUIRE(xenStat.getExistingDoms().size() == 8);
+
+		mock->writeValue("@introduceDomain", "");
+
+		REQUIRE(waitForDoms(gAddedDoms, 9));
+		REQUIRE(gAddedDoms.count(9) == 1);
+		REQUIRE(xenStat.getExistingDoms().size() == 9);
+
+		XenCtrlMock::clearDomInfos();
+
+		info.domain = 1;
+
+		XenCtrlMock::addDomInfo(info);
+
+		mock->writeValue("@releaseDomain", "");
+
+		REQUIRE(waitForDoms(gRemovedDoms, 8));
+		REQUIRE(gRemovedDoms.count(1) == 0);
+		REQUIRE(xenStat.getExistingDoms().size() == 1);
+
+		xenStat.stopMonitoring();
+
+		// without monitoring the list is read directly
+		info.domain = 2;
+
+		XenCtrlMock::addDomInfo(info);
+
+		REQUIRE(xenStat.getExistingDoms().size() == 2);
+
+		xenStore.stop();
+
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			REQUIRE(gAddedDoms.size() == 9);
+			REQUIRE(gRemovedDoms.size() == 8);
+		}
+	}
 }
 
 TEST_CASE("XenStatError", "[xenctrl]")
@@ -82,3 +196,74 @@ TEST_CASE("XenStatError", "[xenctrl]")
 
 	REQUIRE_THROWS(XenStat());
 }
+
+TEST_CASE("DomainInfoSnapshot", "[xenctrl]")
+{
+	XenCtrlMock::setErrorMode(false);
+
+	XenCtrlMock::clearDomInfos();
+
+	XenInterface xenInterface;
+	DomainInfoSnapshot snapshot;
+
+	xc_domaininfo_t info = {};
+
+	for (domid_t domId = 1; domId <= 100; domId++)
+	{
+		info.domain = domId;
+		info.flags = domId % 2 ? XEN_DOMINF_running : 0;
+
+		XenCtrlMock::addDomInfo(info);
+	}
+
+	REQUIRE(snapshot.refresh(xenInterface));
+	REQUIRE(snapshot.getGeneration() == 1);
+	REQUIRE(snapshot.getInfos().size() == 100);
+
+	SECTION("Check views")
+	{
+		REQUIRE(snapshot.isExisting(50));
+		REQUIRE_FALSE(snapshot.isExisting(101));
+		REQUIRE(snapshot.isRunning(51));
+		REQUIRE_FALSE(snapshot.isRunning(50));
+		REQUIRE(snapshot.find(77)->domain == 77);
+		REQUIRE(snapshot.find(0) == nullptr);
+
+		vector<domid_t> domIds;
+
+		snapshot.getRunningDoms(domIds);
+
+		REQUIRE(domIds.size() == 50);
+
+		snapshot.getExistingDoms(domIds);
+
+		REQUIRE(domIds.size() == 100);
+	}
+
+	SECTION("Check generation")
+	{
+		REQUIRE_FALSE(snapshot.refresh(xenInterface));
+		REQUIRE(snapshot.getGeneration() == 1);
+
+		info.domain = 101;
+		info.flags = 0;
+
+		XenCtrlMock::addDomInfo(info);
+
+		REQUIRE(snapshot.refresh(xenInterface));
+		REQUIRE(snapshot.getGeneration() == 2);
+		REQUIRE(snapshot.isExisting(101));
+	}
+
+	SECTION("Check errors")
+	{
+		XenCtrlMock::setErrorMode(true);
+
+		REQUIRE_THROWS(snapshot.refresh(xenInterface));
+
+		XenCtrlMock::setErrorMode(false);
+
+		REQUIRE(snapshot.getGeneration() == 1);
+		REQUIRE(snapshot.getInfos().size() == 100);
+	}
+}
@@ -21,6 +21,7 @@
 #include <algorithm>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
 
 #include <catch.hpp>
@@ -30,14 +31,18 @@
 
 using std::chrono::milliseconds;
 using std::condition_variable;
+using std::count;
 using std::exception;
 using std::find;
 using std::mutex;
 using std::string;
+using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 
+using XenBackend::ThreadPool;
+using XenBackend::ThreadPoolPtr;
 using XenBackend::XenStore;
 using XenBackend::XenStoreException;
 
@@ -142,6 +147,69 @@ TEST_CASE("XenStore", "[xenstore]")
 		REQUIRE_THROWS(xenStore.readString(path));
 	}
 
+	SECTION("Check batch read")
+	{
+		typedef XenStore::BatchItem Item;
+
+		string path = "/local/domain/3/batch/";
+
+		xenStore.writeInt(path + "int", -45);
+		xenStore.writeUint(path + "uint", 4000000000u);
+		xenStore.writeString(path + "string", "Value");
+		xenStore.writeString(path + "invalid", "12abc");
+
+		vector<Item> items = {
+			Item(path + "int", Item::Type::INT),
+			Item(path + "uint", Item::Type::UINT),
+			Item(path + "string"),
+			Item(path + "missing", Item::Type::INT),
+			Item(path + "invalid", Item::Type::UINT)
+		};
+
+		REQUIRE(xenStore.readBatch(items) == 3);
+
+		REQUIRE(items[0].status == Item::Status::OK);
+		REQUIRE(items[0].intValue == -45);
+		REQUIRE(items[1].status == Item::Status::OK);
+		REQUIRE(items[1].uintValue == 4000000000u);
+		REQUIRE(items[2].status == Item::Status::OK);
+		REQUIRE(items[2].stringValue == "Value");
+		REQUIRE(items[3].status == Item::Status::NOT_FOUND);
+		REQUIRE(items[4].status == Item::Status::INVALID);
+
+		XenStore::Transaction transaction(xenStore);
+
+		transaction.writeString(path + "missing", "7");
+
+		REQUIRE(transaction.readBatch(items) == 4);
+		REQUIRE(items[3].status == Item::Status::OK);
+		REQUIRE(items[3].intValue == 7);
+	}
+
+	SECTION("Check async requests")
+	{
+		string path = "/local/domain/3/async/";
+
+		auto write1 = xenStore.writeStringAsync(path + "entry1", "Value1");
+		auto write2 = xenStore.writeStringAsync(path + "entry2", "Value2");
+
+		// requests are executed in order
+		auto read = xenStore.readStringAsync(path + "entry1");
+		auto dir = xenStore.readDirectoryAsync(path);
+
+		write1.get();
+		write2.get();
+
+		REQUIRE(read.get() == "Value1");
+		REQUIRE(dir.get().size() == 2);
+
+		xenStore.removePathAsync(path + "entry1").get();
+
+		auto missing = xenStore.readStringAsync(path + "entry1");
+
+		REQUIRE_THROWS_AS(missing.get(), XenStoreException);
+	}
+
 	SECTION("Check exist/remove")
 	{
 		string path = "/local/domain/3/exist";
@@ -184,6 +252,191 @@ TEST_CASE("XenStore", "[xenstore]")
 		REQUIRE(result.size() == 0);
 	}
 
+	SECTION("Check transaction")
+	{
+		string path = "/local/domain/3/transaction/";
+
+		xenStore.writeString(path + "removed", "Removed");
+
+		{
+			XenStore::Transaction transaction(xenStore);
+
+			transaction.writeInt(path + "int", -12);
+			transaction.writeUint(path + "uint", 34);
+			transaction.writeString(path + "string", "Value");
+			transaction.removePath(path + "removed");
+
+			REQUIRE(transaction.readInt(path + "int") == -12);
+			REQUIRE(transaction.readUint(path + "uint") == 34);
+			REQUIRE(transaction.readString(path + "string") == "Value");
+			REQUIRE_FALSE(transaction.checkIfExist(path + "removed"));
+
+			// changes are not visible outside the transaction till commit
+			REQUIRE_FALSE(xenStore.checkIfExist(path + "int"));
+			REQUIRE(xenStore.checkIfExist(path + "removed"));
+
+			REQUIRE(transaction.commit());
+
+			REQUIRE_THROWS_AS(transaction.writeInt(path + "int", 0),
+							  XenStoreException);
+		}
+
+		REQUIRE(xenStore.readInt(path + "int") == -12);
+		REQUIRE(xenStore.readUint(path + "uint") == 34);
+		REQUIRE(xenStore.readString(path + "string") == "Value");
+		REQUIRE_FALSE(xenStore.checkIfExist(path + "removed"));
+	}
+
+	SECTION("Check transaction abort")
+	{
+		string path = "/local/domain/3/transaction/aborted";
+
+		{
+			XenStore::Transaction transaction(xenStore);
+
+			transaction.writeInt(path, 1);
+		}
+
+		REQUIRE_FALSE(xenStore.checkIfExist(path));
+	}
+
+	SECTION("Check transaction retry")
+	{
+		string path = "/local/domain/3/transaction/retry";
+		int numCalls = 0;
+
+		mock->setNumConflicts(2);
+
+		xenStore.runTransaction([&path, &numCalls]
+								(XenStore::Transaction& transaction)
+								{
+									numCalls++;
+									transaction.writeInt(path, numCalls);
+								});
+
+		REQUIRE(numCalls == 3);
+		REQUIRE(mock->getNumCommits() == 1);
+		REQUIRE(xenStore.readInt(path) == 3);
+
+		mock->setNumConflicts(XenStore::cMaxTransactionAttempts);
+
+		REQUIRE_THROWS_AS(xenStore.runTransaction(
+						  [&path](XenStore::Transaction& transaction)
+						  { transaction.writeInt(path, 0); }),
+						  XenStoreException);
+
+		REQUIRE(xenStore.readInt(path) == 3);
+	}
+
+	SECTION("Check transaction error")
+	{
+		XenStoreMock::setErrorMode(true);
+
+		REQUIRE_THROWS_AS(XenStore::Transaction(xenStore), XenStoreException);
+	}
+
+	SECTION("Check read cache")
+	{
+		string path = "/local/domain/3/cache";
+		int numEvents = 0;
+
+		auto waitForEvents = [&numEvents](int num)
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			return gCondVar.wait_for(lock, milliseconds(1000), [&numEvents, num]
+									 { return numEvents >= num; });
+		};
+
+		xenStore.setCacheEnabled(true);
+
+		xenStore.writeString(path, "1");
+
+		xenStore.setWatch(path, [&numEvents](const string& path)
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			numEvents++;
+
+			gCondVar.notify_all();
+		});
+
+		REQUIRE(waitForEvents(1));
+
+		auto numReads = mock->getNumReads();
+
+		REQUIRE(xenStore.checkIfExist(path));
+		REQUIRE(xenStore.readInt(path) == 1);
+		REQUIRE(xenStore.readInt(path) == 1);
+
+		REQUIRE(mock->getNumReads() == numReads + 1);
+		REQUIRE(xenStore.getNumCacheHits() == 2);
+
+		// changed by other XS client
+		mock->writeValue(path, "2");
+
+		REQUIRE(waitForEvents(2));
+
+		REQUIRE(xenStore.readInt(path) == 2);
+
+		// children of the changed entry are invalidated as well
+		string childPath = path + "/child";
+
+		mock->writeValue(childPath, "4");
+
+		REQUIRE(waitForEvents(3));
+
+		REQUIRE(xenStore.readInt(childPath) == 4);
+
+		numReads = mock->getNumReads();
+
+		REQUIRE(xenStore.readInt(childPath) == 4);
+		REQUIRE(mock->getNumReads() == numReads);
+
+		mock->writeValue(path, "2");
+
+		REQUIRE(waitForEvents(4));
+
+		REQUIRE(xenStore.readInt(childPath) == 4);
+		REQUIRE(mock->getNumReads() == numReads + 1);
+
+		xenStore.removePath(childPath);
+
+		// changed by this instance
+		xenStore.writeString(path, "3");
+
+		REQUIRE(xenStore.readInt(path) == 3);
+
+		xenStore.removePath(path);
+
+		REQUIRE_FALSE(xenStore.checkIfExist(path));
+
+		// not watched entries are not cached
+		string otherPath = "/local/domain/3/nocache";
+
+		xenStore.writeString(otherPath, "Value");
+
+		numReads = mock->getNumReads();
+
+		xenStore.readString(otherPath);
+		xenStore.readString(otherPath);
+
+		REQUIRE(mock->getNumReads() == numReads + 2);
+
+		xenStore.clearWatch(path);
+	}
+
+	SECTION("Check domain path memoization")
+	{
+		mock->setDomainPath(4, "/local/domain/4");
+
+		REQUIRE(xenStore.getDomainPath(4) == "/local/domain/4");
+
+		mock->setDomainPath(4, "/changed/domain/4");
+
+		REQUIRE(xenStore.getDomainPath(4) == "/local/domain/4");
+	}
+
 	SECTION("Check watches")
 	{
 		string path = "/local/domain/3/watch1";
@@ -213,6 +466,134 @@ TEST_CASE("XenStore", "[xenstore]")
 		xenStore.clearWatch(path);
 	}
 
+	SECTION("Check recursive watches")
+	{
+		string path = "/local/domain/3/backend";
+		vector<string> parentPathes, childPathes;
+
+		auto waitForPath = [](vector<string>& pathes, const string& path,
+							  int num)
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			return gCondVar.wait_for(lock, milliseconds(1000),
+									 [&pathes, &path, num]
+				{ return count(pathes.begin(), pathes.end(), path) >= num; });
+		};
+
+		auto addPath = [](vector<string>& pathes, const string& path)
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			pathes.push_back(path);
+
+			gCondVar.notify_all();
+		};
+
+		xenStore.setWatch(path, [&parentPathes, &addPath](const string& path)
+						  { addPath(parentPathes, path); });
+
+		xenStore.setWatch(path + "/vif/0",
+						  [&childPathes, &addPath](const string& path)
+						  { addPath(childPathes, path); });
+
+		REQUIRE(waitForPath(parentPathes, path, 1));
+		REQUIRE(waitForPath(childPathes, path + "/vif/0", 1));
+
+		// child entry is routed to the parent watch
+		mock->writeValue(path + "/vbd/1/state", "1");
+
+		REQUIRE(waitForPath(parentPathes, path + "/vbd/1/state", 1));
+
+		// both watches are triggered, each gets its own event
+		mock->writeValue(path + "/vif/0/state", "1");
+
+		REQUIRE(waitForPath(parentPathes, path + "/vif/0/state", 1));
+		REQUIRE(waitForPath(childPathes, path + "/vif/0/state", 1));
+
+		xenStore.clearWatch(path);
+
+		mock->writeValue(path + "/vbd/1/state", "2");
+		mock->writeValue(path + "/vif/0/state", "2");
+
+		REQUIRE(waitForPath(childPathes, path + "/vif/0/state", 2));
+
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			REQUIRE(count(parentPathes.begin(), parentPathes.end(),
+						  path + "/vbd/1/state") == 1);
+			REQUIRE(count(childPathes.begin(), childPathes.end(),
+						  path + "/vif/0/state") == 2);
+		}
+
+		xenStore.clearWatches();
+	}
+
+	SECTION("Check watch groups")
+	{
+		string path = "/local/domain/3/group";
+		int numEvents1 = 0, numEvents2 = 0, numGroupErrors = 0;
+
+		auto waitFor = [](int& value, int num)
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			return gCondVar.wait_for(lock, milliseconds(1000), [&value, num]
+									 { return value >= num; });
+		};
+
+		auto increment = [](int& value)
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			value++;
+
+			gCondVar.notify_all();
+		};
+
+		XenStore::WatchGroup group1(xenStore,
+									[&numGroupErrors, &increment]
+									(const exception& e)
+									{ increment(numGroupErrors); });
+
+		unique_ptr<XenStore::WatchGroup> group2(
+				new XenStore::WatchGroup(xenStore));
+
+		group1.setWatch(path, [&numEvents1, &increment](const string& path)
+		{
+			increment(numEvents1);
+
+			if (numEvents1 > 1)
+			{
+				throw XenStoreException("Error");
+			}
+		});
+
+		group2->setWatch(path, [&numEvents2, &increment](const string& path)
+						 { increment(numEvents2); });
+
+		REQUIRE(waitFor(numEvents1, 1));
+		REQUIRE(waitFor(numEvents2, 1));
+
+		// both groups get the event, the error goes to the group callback
+		mock->writeValue(path, "1");
+
+		REQUIRE(waitFor(numEvents1, 2));
+		REQUIRE(waitFor(numEvents2, 2));
+		REQUIRE(waitFor(numGroupErrors, 1));
+
+		// removing one group doesn't affect another one
+		group2.reset();
+
+		mock->writeValue(path, "2");
+
+		REQUIRE(waitFor(numEvents1, 3));
+		REQUIRE(numEvents2 == 2);
+
+		group1.clearWatches();
+	}
+
 	SECTION("Check watches error")
 	{
 		XenStoreMock::setErrorMode(true);
@@ -229,6 +610,90 @@ TEST_CASE("XenStore", "[xenstore]")
 	}
 }
 
+TEST_CASE("XenStoreExecutor", "[xenstore]")
+{
+	XenStoreMock::setErrorMode(false);
+
+	XenStore xenStore(errorHandling);
+
+	auto mock = XenStoreMock::getLastInstance();
+
+	xenStore.setExecutor(ThreadPoolPtr(new ThreadPool(4)));
+
+	xenStore.start();
+
+	REQUIRE_THROWS_AS(xenStore.setExecutor(nullptr), XenStoreException);
+
+	string path = "/local/domain/3/executor";
+	vector<string> slowPathes, fastPathes;
+	bool release = false;
+
+	auto waitFor = [](std::function<bool()> predicate)
+	{
+		unique_lock<mutex> lock(gMutex);
+
+		return gCondVar.wait_for(lock, milliseconds(1000), predicate);
+	};
+
+	XenStore::WatchGroup slowGroup(xenStore), fastGroup(xenStore);
+
+	slowGroup.setWatch(path + "/slow", [&](const string& path)
+	{
+		unique_lock<mutex> lock(gMutex);
+
+		slowPathes.push_back(path);
+
+		gCondVar.notify_all();
+
+		gCondVar.wait_for(lock, milliseconds(1000), [&release]
+						  { return release; });
+	});
+
+	fastGroup.setWatch(path + "/fast", [&](const string& path)
+	{
+		unique_lock<mutex> lock(gMutex);
+
+		fastPathes.push_back(path);
+
+		gCondVar.notify_all();
+	});
+
+	// the slow callback blocks its group only
+	REQUIRE(waitFor([&slowPathes] { return slowPathes.size() == 1; }));
+
+	for (int i = 0; i < 10; i++)
+	{
+		mock->writeValue(path + "/fast/" + to_string(i), "Value");
+		mock->writeValue(path + "/slow/" + to_string(i), "Value");
+	}
+
+	REQUIRE(waitFor([&fastPathes] { return fastPathes.size() == 11; }));
+
+	{
+		unique_lock<mutex> lock(gMutex);
+
+		REQUIRE(slowPathes.size() == 1);
+
+		release = true;
+
+		gCondVar.notify_all();
+	}
+
+	REQUIRE(waitFor([&slowPathes] { return slowPathes.size() == 11; }));
+
+	// callbacks of one group are called in order
+	for (int i = 0; i < 10; i++)
+	{
+		REQUIRE(fastPathes[i + 1] == path + "/fast/" + to_string(i));
+		REQUIRE(slowPathes[i + 1] == path + "/slow/" + to_string(i));
+	}
+
+	slowGroup.clearWatches();
+	fastGroup.clearWatches();
+
+	xenStore.stop();
+}
+
 TEST_CASE("XenStoreError", "[xenstore]")
 {
 	XenStoreMock::setErrorMode(true);